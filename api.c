@@ -0,0 +1,427 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Runtime control API: JSON-RPC over HTTP on a loopback port.
+ *
+ * Restarting minerd to change its thread count, kernel or pool drops all
+ * in-flight work and pays the startup stagger again.  Instead:
+ *
+ *   stats			hashrates, shares and per-thread state
+ *   threads [N]		run N of the started miner threads
+ *   algo [NAME, THREAD]	swap the scan kernel, of one or all threads
+ *   pool [URL, USERPASS]	move to a pool, adding it if new, and make
+ *				it the preferred one
+ *   pause, resume		park or unpark every miner thread
+ *
+ * e.g.  curl -H 'Authorization: Bearer TOKEN' \
+ *	     -d '{"method":"threads","params":[2],"id":1}' 127.0.0.1:PORT
+ *
+ * Loopback is no barrier to other local users, so every method but
+ * stats needs the --api-token as a bearer token; without one, the API
+ * is read-only.  The -c config file keeps the token out of ps.
+ *
+ * Threads are never created or destroyed here: -t sets how many exist,
+ * and "threads" parks or unparks them, so growing back costs nothing.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "compat.h"
+#include "miner.h"
+
+#define RPC_PARSE_ERROR		-32700
+#define RPC_METHOD_NOT_FOUND	-32601
+#define RPC_INVALID_PARAMS	-32602
+#define RPC_INTERNAL_ERROR	-32603
+#define RPC_UNAUTHORIZED	-32001
+
+static int api_threads;			/* miner threads started */
+static int api_active;			/* of which the API lets run */
+static bool api_paused;
+static char *api_token;			/* NULL: read-only */
+static pthread_mutex_t api_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct api_error {
+	int		code;
+	const char	*message;
+};
+
+static json_t *rates(int thr_id)
+{
+	json_t *arr = json_array();
+
+	json_array_append_new(arr, json_real(stats_rate(thr_id, STATS_1M)));
+	json_array_append_new(arr, json_real(stats_rate(thr_id, STATS_5M)));
+	json_array_append_new(arr, json_real(stats_rate(thr_id, STATS_15M)));
+	return arr;
+}
+
+static json_t *pool_list(void)
+{
+	json_t *arr = json_array();
+	int i, n;
+
+	pthread_mutex_lock(&pool_lock);
+	n = n_pools;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < n; i++) {
+		struct pool *pool = &pools[i];
+		double uptime = pool_uptime(pool);
+		json_t *p = json_object();
+
+		pthread_mutex_lock(&pool_lock);
+		json_object_set_new(p, "id", json_integer(pool->id));
+		json_object_set_new(p, "url", json_string(pool->url));
+		json_object_set_new(p, "active", pool == cur_pool ?
+				    json_true() : json_false());
+		json_object_set_new(p, "alive", pool->alive ?
+				    json_true() : json_false());
+		json_object_set_new(p, "uptime", json_real(uptime));
+		json_object_set_new(p, "rtt", json_real(pool->rtt));
+		json_object_set_new(p, "requests",
+				    json_integer(pool->requests));
+		json_object_set_new(p, "failures",
+				    json_integer(pool->failures));
+		json_object_set_new(p, "weight", json_integer(pool->weight));
+		json_object_set_new(p, "getworks", json_integer(pool->picks));
+		json_object_set_new(p, "accepted", json_integer(pool->accepted));
+		json_object_set_new(p, "rejected", json_integer(pool->rejected));
+		json_object_set_new(p, "stale", json_integer(pool->stale));
+		pthread_mutex_unlock(&pool_lock);
+		json_array_append_new(arr, p);
+	}
+
+	return arr;
+}
+
+/* Percentiles of each traced stage, in seconds */
+static json_t *latency(void)
+{
+	json_t *res = json_object();
+	int i;
+
+	for (i = 0; i < TRACE_STAGES; i++) {
+		struct hdr_histogram *h = &trace_hist[i];
+		json_t *s = json_object();
+
+		json_object_set_new(s, "count",
+				    json_integer(stats_read(&h->count)));
+		json_object_set_new(s, "p50",
+				    json_real(hdr_percentile(h, 0.5) / 1e6));
+		json_object_set_new(s, "p90",
+				    json_real(hdr_percentile(h, 0.9) / 1e6));
+		json_object_set_new(s, "p99",
+				    json_real(hdr_percentile(h, 0.99) / 1e6));
+		json_object_set_new(s, "max",
+				    json_real(stats_read(&h->max_usecs) / 1e6));
+		json_object_set_new(res, trace_stage_names[i], s);
+	}
+
+	return res;
+}
+
+static json_t *api_stats(json_t *params, struct api_error *err)
+{
+	json_t *res, *threads;
+	int i;
+
+	threads = json_array();
+	for (i = 0; i < api_threads; i++) {
+		json_t *t = json_object();
+
+		json_object_set_new(t, "id", json_integer(i));
+		json_object_set_new(t, "cpu", json_integer(thr_info[i].cpu));
+		json_object_set_new(t, "class", json_integer(thr_info[i].cls));
+		json_object_set_new(t, "algo",
+				    json_string(algo_name(thr_info[i].algo)));
+		json_object_set_new(t, "batch",
+				    json_integer(scan_tune[thr_info[i].algo].batch));
+		json_object_set_new(t, "poll",
+				    json_integer(scan_poll(i, thr_info[i].algo)));
+		json_object_set_new(t, "parked",
+				    json_integer(thr_info[i].park_mask));
+		json_object_set_new(t, "hashrate", rates(i));
+		json_object_set_new(t, "duty", json_real(stats_duty(i)));
+		if (perf_mode) {
+			json_object_set_new(t, "cycles_per_hash",
+					    json_real(perf_cycles_per_hash(i)));
+			json_object_set_new(t, "ipc", json_real(perf_ipc(i)));
+		}
+		json_array_append_new(threads, t);
+	}
+
+	res = json_object();
+	json_object_set_new(res, "hashrate", rates(-1));
+	json_object_set_new(res, "accepted",
+			    json_integer(stats_read(&share_stats.accepted)));
+	json_object_set_new(res, "rejected",
+			    json_integer(stats_read(&share_stats.rejected)));
+	json_object_set_new(res, "stale",
+			    json_integer(stats_read(&share_stats.stale)));
+	json_object_set_new(res, "duty", json_real(stats_duty(-1)));
+	pthread_mutex_lock(&api_lock);
+	json_object_set_new(res, "paused",
+			    api_paused ? json_true() : json_false());
+	json_object_set_new(res, "active", json_integer(api_active));
+	pthread_mutex_unlock(&api_lock);
+	json_object_set_new(res, "threads", threads);
+	json_object_set_new(res, "pools", pool_list());
+	json_object_set_new(res, "latency", latency());
+
+	return res;
+}
+
+static json_t *api_set_threads(json_t *params, struct api_error *err)
+{
+	json_t *n = json_array_get(params, 0);
+	int i, want;
+
+	if (n) {
+		want = json_is_integer(n) ? json_integer_value(n) : 0;
+		if (want < 1 || want > api_threads) {
+			err->code = RPC_INVALID_PARAMS;
+			err->message = "thread count out of range";
+			return NULL;
+		}
+
+		pthread_mutex_lock(&api_lock);
+		if (want != api_active) {
+			api_active = want;
+			for (i = 0; i < api_threads; i++)
+				thread_park(i, PARK_USER, i >= want);
+			applog(LOG_INFO, "API: running %d of %d miner threads",
+			       want, api_threads);
+		}
+		pthread_mutex_unlock(&api_lock);
+	}
+
+	return json_integer(api_active);
+}
+
+static json_t *api_set_algo(json_t *params, struct api_error *err)
+{
+	const char *name = json_string_value(json_array_get(params, 0));
+	json_t *thr = json_array_get(params, 1);
+	int algo, first = 0, last = api_threads - 1, i;
+
+	algo = name ? algo_parse(name) : -1;
+	if (algo < 0) {
+		err->code = RPC_INVALID_PARAMS;
+		err->message = "unknown or unsupported algo";
+		return NULL;
+	}
+	if (algo_is_scrypt(algo) != opt_scrypt) {
+		err->code = RPC_INVALID_PARAMS;
+		err->message = "cannot switch between sha256 and scrypt";
+		return NULL;
+	}
+	if (thr) {
+		first = last = json_is_integer(thr) ? json_integer_value(thr) : -1;
+		if (first < 0 || first >= api_threads) {
+			err->code = RPC_INVALID_PARAMS;
+			err->message = "no such thread";
+			return NULL;
+		}
+	}
+
+	/* picked up by each thread at its next scan */
+	for (i = first; i <= last; i++)
+		thr_info[i].algo = algo;
+
+	if (thr)
+		applog(LOG_INFO, "API: thread %d switching to '%s'", first, name);
+	else
+		applog(LOG_INFO, "API: all threads switching to '%s'", name);
+	return json_true();
+}
+
+static json_t *api_set_pool(json_t *params, struct api_error *err)
+{
+	const char *url = json_string_value(json_array_get(params, 0));
+	const char *userpass = json_string_value(json_array_get(params, 1));
+	struct pool *pool;
+
+	if (!url || !strstr(url, "://") || (userpass && !strchr(userpass, ':'))) {
+		err->code = RPC_INVALID_PARAMS;
+		err->message = "expected [url, user:pass]";
+		return NULL;
+	}
+
+	pool = pool_find(url);
+	if (!pool) {
+		if (!userpass) {
+			err->code = RPC_INVALID_PARAMS;
+			err->message = "new pool needs user:pass";
+			return NULL;
+		}
+		pool = pool_add(url, userpass);
+		if (!pool) {
+			err->code = RPC_INTERNAL_ERROR;
+			err->message = "too many pools";
+			return NULL;
+		}
+		userpass = NULL;	/* already in place */
+		/* started with one pool, there was nothing to probe */
+		if (n_pools > 1 && !pool_probe_start(opt_pool_probe)) {
+			err->code = RPC_INTERNAL_ERROR;
+			err->message = "pool probe thread unavailable";
+			return NULL;
+		}
+	}
+	pool_prefer(pool);
+
+	if (!pool_switch(pool, userpass, true)) {
+		err->code = RPC_INTERNAL_ERROR;
+		err->message = "workio thread unavailable";
+		return NULL;
+	}
+
+	return json_true();
+}
+
+static json_t *api_pause(bool pause)
+{
+	int i;
+
+	pthread_mutex_lock(&api_lock);
+	if (pause != api_paused) {
+		api_paused = pause;
+		for (i = 0; i < api_threads; i++)
+			thread_park(i, PARK_PAUSED, pause);
+		applog(LOG_INFO, "API: mining %s", pause ? "paused" : "resumed");
+	}
+	pthread_mutex_unlock(&api_lock);
+
+	return json_true();
+}
+
+static json_t *api_dispatch(const char *method, json_t *params,
+			    struct api_error *err)
+{
+	if (!strcmp(method, "stats"))
+		return api_stats(params, err);
+	if (!strcmp(method, "threads"))
+		return api_set_threads(params, err);
+	if (!strcmp(method, "algo"))
+		return api_set_algo(params, err);
+	if (!strcmp(method, "pool"))
+		return api_set_pool(params, err);
+	if (!strcmp(method, "pause"))
+		return api_pause(true);
+	if (!strcmp(method, "resume"))
+		return api_pause(false);
+
+	err->code = RPC_METHOD_NOT_FOUND;
+	err->message = "method not found";
+	return NULL;
+}
+
+/* Does 'req' carry the API token?  Compared in constant time. */
+static bool api_authorized(const struct http_request *req)
+{
+	char buf[256];
+	const char *auth;
+	size_t i, len;
+	unsigned char diff = 0;
+
+	if (!api_token)
+		return false;
+	auth = http_header(req, "Authorization", buf, sizeof(buf));
+	if (!auth || strncasecmp(auth, "Bearer ", 7))
+		return false;
+	auth += 7;
+
+	len = strlen(api_token);
+	if (strlen(auth) != len)
+		return false;
+	for (i = 0; i < len; i++)
+		diff |= auth[i] ^ api_token[i];
+	return !diff;
+}
+
+static void api_handler(int fd, struct http_request *req, void *arg)
+{
+	struct api_error err = { 0, NULL };
+	json_t *val, *res = NULL, *reply, *id = NULL;
+	json_error_t jerr;
+	const char *method;
+	char *s;
+
+	if (strcmp(req->method, "POST")) {
+		static const char *msg = "POST a JSON-RPC request\n";
+
+		http_respond(fd, 405, "text/plain", "Allow: POST\r\n",
+			     msg, strlen(msg));
+		return;
+	}
+
+	val = JSON_LOADS(req->body, &jerr);
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method) {
+		err.code = RPC_PARSE_ERROR;
+		err.message = "invalid JSON-RPC request";
+	} else {
+		json_t *params = json_object_get(val, "params");
+
+		if (params && !json_is_array(params))
+			params = NULL;
+		id = json_object_get(val, "id");
+		if (strcmp(method, "stats") && !api_authorized(req)) {
+			err.code = RPC_UNAUTHORIZED;
+			err.message = api_token ? "bad or missing API token" :
+				      "read-only: start with --api-token";
+		} else
+			res = api_dispatch(method, params, &err);
+	}
+
+	reply = json_object();
+	if (err.code) {
+		json_t *e = json_object();
+
+		json_object_set_new(e, "code", json_integer(err.code));
+		json_object_set_new(e, "message", json_string(err.message));
+		json_object_set_new(reply, "result", json_null());
+		json_object_set_new(reply, "error", e);
+	} else {
+		json_object_set_new(reply, "result", res);
+		json_object_set_new(reply, "error", json_null());
+	}
+	json_object_set(reply, "id", id ? id : json_null());
+
+	s = json_dumps(reply, JSON_COMPACT);
+	if (s)
+		http_respond(fd, 200, "application/json", NULL, s, strlen(s));
+	else
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+
+	free(s);
+	json_decref(reply);
+	if (val)
+		json_decref(val);
+}
+
+bool api_start(int port, int n_threads, const char *token)
+{
+	api_threads = api_active = n_threads;
+	if (token && *token)
+		api_token = strdup(token);
+
+	if (!http_server_start("127.0.0.1", port, api_handler, NULL))
+		return false;
+
+	applog(LOG_INFO, "Control API listening on 127.0.0.1:%d%s", port,
+	       api_token ? "" : " (read-only, no --api-token)");
+	return true;
+}
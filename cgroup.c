@@ -0,0 +1,318 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * cgroup v1/v2 CPU quota and cpuset detection.
+ *
+ * Containers commonly cap CPU time with a CFS quota (cpu.max on v2,
+ * cpu.cfs_quota_us/cpu.cfs_period_us on v1) while still exposing every
+ * host cpu through sysconf().  Running one thread per visible cpu then
+ * gets the whole group throttled each period.  We locate our own cgroup
+ * through /proc/self/cgroup and /proc/self/mountinfo, and report how many
+ * cpus' worth of time we may actually use.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "miner.h"
+
+#ifdef __linux
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+static int cg_version;			/* 0 = none found, 1 or 2 */
+static char cg_cpu_dir[PATH_MAX];	/* holds the cpu quota files */
+static char cg_cpu_root[PATH_MAX];	/* mount point; stop walking here */
+static char cg_cpuset_dir[PATH_MAX];
+
+/* does comma-separated 'list' contain 'word'? */
+static bool list_has(const char *list, const char *word)
+{
+	size_t len = strlen(word);
+
+	while (list && *list) {
+		if (!strncmp(list, word, len) &&
+		    (list[len] == ',' || list[len] == 0))
+			return true;
+		list = strchr(list, ',');
+		if (list)
+			list++;
+	}
+	return false;
+}
+
+/* Find this process' cgroup path for 'controller' (NULL = v2 unified) */
+static bool self_cgroup(const char *controller, char *path, size_t len)
+{
+	char line[PATH_MAX + 128];
+	bool found = false;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), f)) {
+		char *ctl, *p;
+
+		ctl = strchr(line, ':');
+		if (!ctl)
+			continue;
+		ctl++;
+		p = strchr(ctl, ':');
+		if (!p)
+			continue;
+		*p++ = 0;
+		p[strcspn(p, "\n")] = 0;
+
+		if (controller ? list_has(ctl, controller) : !*ctl) {
+			snprintf(path, len, "%s", p);
+			found = true;
+		}
+	}
+
+	fclose(f);
+	return found;
+}
+
+/* Find the mount of a cgroup hierarchy; returns mount point and root */
+static bool cgroup_mount(const char *controller, char *mnt, char *root)
+{
+	char line[2 * PATH_MAX + 256];
+	bool found = false;
+	FILE *f;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), f)) {
+		char m_root[PATH_MAX], m_point[PATH_MAX];
+		char fstype[64], superopts[512];
+		char *sep;
+
+		if (sscanf(line, "%*s %*s %*s %4095s %4095s",
+			   m_root, m_point) != 2)
+			continue;
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(sep + 3, "%63s %*s %511s",
+				   fstype, superopts) != 2)
+			continue;
+
+		if (controller) {
+			if (strcmp(fstype, "cgroup") ||
+			    !list_has(superopts, controller))
+				continue;
+		} else if (strcmp(fstype, "cgroup2"))
+			continue;
+
+		strcpy(mnt, m_point);
+		strcpy(root, m_root);
+		found = true;
+	}
+
+	fclose(f);
+	return found;
+}
+
+/* Resolve the directory of our cgroup for 'controller' */
+static bool cgroup_dir(const char *controller, char *dir, char *mnt)
+{
+	char path[PATH_MAX], root[PATH_MAX];
+	const char *rel;
+	size_t rlen;
+
+	if (!self_cgroup(controller, path, sizeof(path)) ||
+	    !cgroup_mount(controller, mnt, root))
+		return false;
+
+	/* inside a container the mount root is usually our own cgroup */
+	rel = path;
+	rlen = strlen(root);
+	if (strcmp(root, "/") && !strncmp(path, root, rlen))
+		rel = path + rlen;
+	if (!strcmp(rel, "/"))
+		rel = "";
+
+	snprintf(dir, PATH_MAX, "%s%s", mnt, rel);
+	return true;
+}
+
+static bool read_line(const char *dir, const char *file, char *buf, size_t len)
+{
+	char path[PATH_MAX + 64];
+	FILE *f;
+	bool rc;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	rc = fgets(buf, len, f) != NULL;
+	fclose(f);
+
+	return rc;
+}
+
+/* quota of one directory, in cpus; 0 if unlimited or unreadable */
+static double dir_quota(const char *dir)
+{
+	char buf[128];
+	long quota, period;
+
+	if (cg_version == 2) {
+		if (!read_line(dir, "cpu.max", buf, sizeof(buf)) ||
+		    !strncmp(buf, "max", 3) ||
+		    sscanf(buf, "%ld %ld", &quota, &period) != 2)
+			return 0.0;
+	} else {
+		if (!read_line(dir, "cpu.cfs_quota_us", buf, sizeof(buf)) ||
+		    sscanf(buf, "%ld", &quota) != 1 || quota <= 0)
+			return 0.0;
+		if (!read_line(dir, "cpu.cfs_period_us", buf, sizeof(buf)) ||
+		    sscanf(buf, "%ld", &period) != 1)
+			return 0.0;
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0.0;
+	return (double) quota / period;
+}
+
+/* Effective quota, in cpus: the tightest limit between our cgroup and
+ * the hierarchy root, since parents cap their children.  0 = unlimited.
+ */
+double cgroup_cpu_quota(void)
+{
+	char dir[PATH_MAX];
+	double best = 0.0;
+	size_t rlen = strlen(cg_cpu_root);
+
+	if (!cg_version)
+		return 0.0;
+
+	strcpy(dir, cg_cpu_dir);
+	while (1) {
+		double q = dir_quota(dir);
+		char *slash;
+
+		if (q > 0.0 && (best == 0.0 || q < best))
+			best = q;
+
+		slash = strrchr(dir, '/');
+		if (!slash || (size_t)(slash - dir) < rlen ||
+		    strlen(dir) <= rlen)
+			break;
+		*slash = 0;
+	}
+
+	return best;
+}
+
+/* Number of cpus in our effective cpuset; 0 if unknown */
+int cgroup_cpuset_cpus(void)
+{
+	static int cpus[MAX_CPUS];
+	char buf[4096];
+	int n;
+
+	if (!cg_cpuset_dir[0])
+		return 0;
+
+	if (!read_line(cg_cpuset_dir, cg_version == 2 ?
+		       "cpuset.cpus.effective" : "cpuset.effective_cpus",
+		       buf, sizeof(buf)) &&
+	    !read_line(cg_cpuset_dir, "cpuset.cpus", buf, sizeof(buf)))
+		return 0;
+
+	n = cpulist_parse(buf, cpus, MAX_CPUS);
+	return n < 0 ? 0 : n;
+}
+
+/* On hybrid v1/v2 hosts the unified hierarchy may lack the cpu controller */
+static bool v2_has_cpu(const char *dir)
+{
+	char buf[512], *tok, *save;
+
+	if (!read_line(dir, "cgroup.controllers", buf, sizeof(buf)))
+		return false;
+	for (tok = strtok_r(buf, " \n", &save); tok;
+	     tok = strtok_r(NULL, " \n", &save))
+		if (!strcmp(tok, "cpu"))
+			return true;
+	return false;
+}
+
+bool cgroup_init(void)
+{
+	char mnt[PATH_MAX];
+
+	if (cgroup_dir(NULL, cg_cpu_dir, cg_cpu_root) &&
+	    v2_has_cpu(cg_cpu_dir)) {
+		cg_version = 2;
+		strcpy(cg_cpuset_dir, cg_cpu_dir);
+	} else if (cgroup_dir("cpu", cg_cpu_dir, cg_cpu_root)) {
+		cg_version = 1;
+		if (!cgroup_dir("cpuset", cg_cpuset_dir, mnt))
+			cg_cpuset_dir[0] = 0;
+	} else
+		return false;
+
+	applog(LOG_INFO, "cgroup v%d: %s, quota %.2f cpus, cpuset %d cpus",
+	       cg_version, cg_cpu_dir, cgroup_cpu_quota(),
+	       cgroup_cpuset_cpus());
+	return true;
+}
+
+#else /* !__linux */
+
+bool cgroup_init(void)
+{
+	return false;
+}
+
+double cgroup_cpu_quota(void)
+{
+	return 0.0;
+}
+
+int cgroup_cpuset_cpus(void)
+{
+	return 0;
+}
+
+#endif /* __linux */
+
+/* How many miner threads the cgroup lets us run without being throttled,
+ * or 0 when there is no limit.  A fractional quota is rounded down: a
+ * thread that can only get half a cpu per period stalls the others.
+ */
+int cgroup_cpu_limit(void)
+{
+	double quota = cgroup_cpu_quota();
+	int cpuset = cgroup_cpuset_cpus();
+	int limit = 0;
+
+	if (quota > 0.0) {
+		limit = (int) quota;
+		if (limit < 1)
+			limit = 1;
+	}
+	if (cpuset > 0 && (!limit || cpuset < limit))
+		limit = cpuset;
+
+	return limit;
+}
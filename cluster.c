@@ -0,0 +1,1078 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Cluster mode: one coordinator minerd owns the upstream pools, worker
+ * minerds on other hosts mine for it.
+ *
+ * Workers connect over TCP or a UNIX socket and are leased ranges of
+ * work: a lease is one upstream getwork plus a run of ntime offsets,
+ * each offset being one unit of work for one miner thread scan (our scan
+ * kernels always start from nonce zero, so the nonce space itself cannot
+ * be split).  Lease size follows the rate at which each worker reports
+ * consuming units, so a lease lasts about CL_LEASE_SECS; the unused part
+ * of a dead worker's lease is handed to the next one asking.  A new block
+ * is pushed to every worker at once.
+ *
+ * Messages are a 4 byte header, type and big-endian payload length,
+ * followed by a big-endian payload:
+ *
+ *   HELLO	w->c	u16 version, u16 threads
+ *   STATUS	w->c	u8 want lease, u32 lease, u32 used, u64 hash/sec,
+ *			u32 units/minute
+ *   LEASE	c->w	u32 lease, u32 block, u32 count, midstate, data,
+ *			hash1, target
+ *   SHARE	w->c	u32 lease, data
+ *   RESULT	c->w	u32 lease, u8 share_results (CL_DROPPED: not relayed)
+ *   RESTART	c->w	u32 block: new block, drop all leases
+ *
+ * A lease granted just before a block change may arrive after the
+ * RESTART; its block number, behind the RESTART's, tells the worker to
+ * drop it.
+ *
+ * Anyone who can connect can take leases and relay shares, so given only
+ * a port the coordinator listens on loopback; name a host to open it to
+ * a trusted network.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "compat.h"
+#include "miner.h"
+
+struct cluster_stats cluster_stats;
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CL_PROTO	1
+#define CL_MAX_MSG	512
+#define CL_LEASE_SECS	30	/* how long a lease should last */
+#define CL_MAX_LEASE	256	/* units */
+#define CL_MAX_ROLL	60	/* ntime offsets per upstream getwork */
+#define CL_MAX_AGE	60	/* seconds before refreshing upstream work */
+#define CL_JOBS		32
+#define CL_LEASES	1024
+#define CL_FREE		256
+#define CL_STATUS_SECS	5
+#define CL_RETRY_SECS	5
+#define CL_SEND_SECS	5	/* a worker not reading for this long is dropped */
+#define CL_SHARES_PER_UNIT 4	/* more per lease than a worker could find */
+#define CL_DROPPED	255
+
+enum cl_msgs {
+	CL_HELLO	= 1,
+	CL_STATUS,
+	CL_LEASE,
+	CL_SHARE,
+	CL_RESULT,
+	CL_RESTART,
+};
+
+struct cl_job {
+	struct work	work;
+	unsigned long	seq;		/* fetch number, 0 = empty */
+	unsigned long	gen;		/* cl_gen when fetched */
+};
+
+struct cl_worker;
+
+struct cl_lease {
+	uint32_t	id;		/* 0 = empty */
+	unsigned long	job_seq;
+	uint32_t	off, count;	/* ntime offsets off..off+count-1 */
+	uint32_t	used;		/* as last reported */
+	uint32_t	gen;		/* block it is for */
+	struct cl_worker *owner;
+	uint64_t	*seen;		/* shares relayed: offset << 32 | nonce */
+	uint32_t	n_seen;
+};
+
+struct cl_range {
+	unsigned long	job_seq;
+	uint32_t	off, count;
+};
+
+struct cl_worker {
+	int		fd;
+	int		id;
+	int		threads;
+	double		rate;		/* reported hash/sec */
+	double		units;		/* reported work units/sec */
+	pthread_mutex_t	wlock;		/* serializes writes to fd */
+	int		refs;		/* under cl_lock; fd closed at 0 */
+	struct cl_worker *next;
+};
+
+/* byte order helpers */
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return ((uint64_t) get32(p) << 32) | get32(p + 4);
+}
+
+/* framing */
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+
+	while (len) {
+		ssize_t n = recv(fd, p, len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Read one message into buf (CL_MAX_MSG bytes); returns its type, or -1 */
+static int cl_recv(int fd, unsigned char *buf, size_t *len)
+{
+	unsigned char hdr[4];
+
+	if (!read_full(fd, hdr, sizeof(hdr)))
+		return -1;
+	*len = get16(hdr + 2);
+	if (*len > CL_MAX_MSG || !read_full(fd, buf, *len))
+		return -1;
+	return hdr[0];
+}
+
+/* Caller serializes writes to fd */
+static bool cl_send(int fd, int type, const unsigned char *payload,
+		    size_t len)
+{
+	unsigned char msg[4 + CL_MAX_MSG];
+
+	msg[0] = type;
+	msg[1] = 0;
+	put16(msg + 2, len);
+	if (len)
+		memcpy(msg + 4, payload, len);
+	return write_full(fd, msg, 4 + len);
+}
+
+/* ADDR is [host:]port, or a UNIX socket path starting with '/' */
+static bool cl_parse_addr(const char *addr, char *host, size_t hostlen,
+			  int *port)
+{
+	const char *colon = strrchr(addr, ':');
+
+	if (*addr == '/')
+		return true;
+
+	*host = 0;
+	if (colon) {
+		size_t n = colon - addr;
+
+		if (n >= hostlen)
+			return false;
+		memcpy(host, addr, n);
+		host[n] = 0;
+		addr = colon + 1;
+	}
+	*port = atoi(addr);
+	return *port > 0 && *port < 65536;
+}
+
+static int cl_unix_socket(const char *path, struct sockaddr_un *sun)
+{
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		applog(LOG_ERR, "cluster: socket path too long: %s", path);
+		return -1;
+	}
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+
+	return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static int cl_connect(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256], service[16];
+	int fd = -1, port, one = 1;
+
+	if (!cl_parse_addr(addr, host, sizeof(host), &port))
+		return -1;
+
+	if (*addr == '/') {
+		struct sockaddr_un sun;
+
+		fd = cl_unix_socket(addr, &sun);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &sun,
+				       sizeof(sun))) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(*host ? host : NULL, service, &hints, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+ * Coordinator
+ */
+
+static struct thr_info cl_thr;		/* our queue for get_work() */
+
+/* as in proxy.c, cl_lock is never held across a call into the workio
+ * thread, which calls cluster_restart(); fetches are serialized by
+ * cl_fetch_lock instead
+ */
+static pthread_mutex_t cl_fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cl_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long cl_gen;		/* bumped on each new block */
+static struct cl_job cl_jobs[CL_JOBS];
+static unsigned long cl_job_seq;	/* current job */
+static time_t cl_fetched;
+static uint32_t cl_next_off;		/* next unleased ntime offset */
+static struct cl_lease cl_leases[CL_LEASES];
+static uint32_t cl_lease_seq;
+static struct cl_range cl_free[CL_FREE];	/* reclaimed, to lease first */
+static int cl_n_free;
+static struct cl_worker *cl_workers;
+static int cl_n_workers, cl_worker_seq;
+
+/* Caller holds cl_lock */
+static struct cl_job *job_get(unsigned long seq)
+{
+	struct cl_job *job = &cl_jobs[seq % CL_JOBS];
+
+	return seq && job->seq == seq ? job : NULL;
+}
+
+/* Caller holds cl_lock */
+static bool job_usable(void)
+{
+	struct cl_job *job = job_get(cl_job_seq);
+
+	return job && job->gen == cl_gen && cl_next_off < CL_MAX_ROLL &&
+	       time(NULL) - cl_fetched < CL_MAX_AGE;
+}
+
+/* Units that keep worker 'w' busy for CL_LEASE_SECS */
+static uint32_t lease_size(const struct cl_worker *w)
+{
+	double units = w->units * CL_LEASE_SECS;
+
+	if (units <= 0.0)
+		units = w->threads;	/* nothing reported yet */
+	if (units < 1.0)
+		units = 1.0;
+	if (units > CL_MAX_LEASE)
+		units = CL_MAX_LEASE;
+	return units;
+}
+
+/* Lease work to 'w', preferring ranges reclaimed from dead workers */
+static bool cl_grant(struct cl_worker *w, struct cl_lease *lease,
+		     struct work *work)
+{
+	uint32_t want = lease_size(w);
+	struct cl_job *job = NULL;
+	struct cl_range r;
+	bool reclaimed = false;
+
+	pthread_mutex_lock(&cl_fetch_lock);
+	pthread_mutex_lock(&cl_lock);
+
+	while (cl_n_free && !job) {
+		r = cl_free[--cl_n_free];
+		job = job_get(r.job_seq);
+		if (job && job->gen != cl_gen)
+			job = NULL;
+	}
+	if (job) {
+		reclaimed = true;
+		if (r.count > want) {
+			/* hand back the rest */
+			cl_free[cl_n_free].job_seq = r.job_seq;
+			cl_free[cl_n_free].off = r.off + want;
+			cl_free[cl_n_free].count = r.count - want;
+			cl_n_free++;
+			r.count = want;
+		}
+	} else {
+		if (!job_usable()) {
+			unsigned long gen = cl_gen;
+			struct work fresh;
+
+			pthread_mutex_unlock(&cl_lock);
+			if (!get_work(&cl_thr, &fresh)) {
+				pthread_mutex_unlock(&cl_fetch_lock);
+				return false;
+			}
+			pthread_mutex_lock(&cl_lock);
+
+			/* a block arriving meanwhile makes the next
+			 * grant fetch again
+			 */
+			cl_job_seq++;
+			job = &cl_jobs[cl_job_seq % CL_JOBS];
+			job->work = fresh;
+			job->seq = cl_job_seq;
+			job->gen = gen;
+			cl_fetched = time(NULL);
+			cl_next_off = 0;
+		}
+		job = job_get(cl_job_seq);
+		r.job_seq = cl_job_seq;
+		r.off = cl_next_off;
+		r.count = CL_MAX_ROLL - cl_next_off;
+		if (r.count > want)
+			r.count = want;
+		cl_next_off += r.count;
+	}
+
+	if (!++cl_lease_seq)
+		cl_lease_seq++;		/* 0 means none */
+	lease->id = cl_lease_seq;
+	lease->job_seq = r.job_seq;
+	lease->off = r.off;
+	lease->count = r.count;
+	lease->used = 0;
+	lease->gen = job->gen;
+	lease->owner = w;
+	lease->seen = NULL;
+	lease->n_seen = 0;
+	free(cl_leases[lease->id % CL_LEASES].seen);
+	cl_leases[lease->id % CL_LEASES] = *lease;
+
+	*work = job->work;
+	work_set_ntime(work, work_ntime(work) + r.off);
+
+	pthread_mutex_unlock(&cl_lock);
+	pthread_mutex_unlock(&cl_fetch_lock);
+
+	stats_add(&cluster_stats.leases, 1);
+	stats_add(&cluster_stats.units, r.count);
+	if (reclaimed)
+		stats_add(&cluster_stats.reclaimed, 1);
+	return true;
+}
+
+static bool cl_send_lease(struct cl_worker *w)
+{
+	unsigned char buf[12 + 32 + 128 + 64 + 32], *p = buf;
+	struct cl_lease lease;
+	struct work work;
+	bool ok;
+
+	if (!cl_grant(w, &lease, &work))
+		return false;
+
+	put32(p, lease.id);
+	put32(p + 4, lease.gen);
+	put32(p + 8, lease.count);
+	p += 12;
+	memcpy(p, work.midstate, sizeof(work.midstate));
+	p += sizeof(work.midstate);
+	memcpy(p, work.data, sizeof(work.data));
+	p += sizeof(work.data);
+	memcpy(p, work.hash1, sizeof(work.hash1));
+	p += sizeof(work.hash1);
+	memcpy(p, work.target, sizeof(work.target));
+
+	pthread_mutex_lock(&w->wlock);
+	ok = cl_send(w->fd, CL_LEASE, buf, sizeof(buf));
+	pthread_mutex_unlock(&w->wlock);
+	return ok;
+}
+
+/* Caller holds cl_lock; NULL if the share in 'msg' is one to relay,
+ * else why not.  Only the lease's ntime offsets and nonce are taken from
+ * the worker, and each share is relayed once.
+ */
+static const char *cl_check_share(struct cl_worker *w, const unsigned char *msg,
+				  struct work *work)
+{
+	struct cl_lease *lease = &cl_leases[get32(msg) % CL_LEASES];
+	struct cl_job *job;
+	struct work share;
+	uint32_t off, nonce, i;
+	uint64_t key, *seen;
+
+	if (lease->id != get32(msg) || lease->owner != w ||
+	    !(job = job_get(lease->job_seq)))
+		return "for an unknown lease";
+	if (lease->gen != (uint32_t) cl_gen)
+		return "for an old block";
+
+	memcpy(share.data, msg + 4, sizeof(share.data));
+	off = work_ntime(&share) - work_ntime(&job->work);
+	if (memcmp(job->work.data, share.data, 68) ||
+	    memcmp(job->work.data + 72, share.data + 72, 4) ||
+	    off - lease->off >= lease->count)
+		return "outside its lease";
+
+	memcpy(&nonce, share.data + 76, 4);
+	key = (uint64_t) off << 32 | nonce;
+	for (i = 0; i < lease->n_seen; i++)
+		if (lease->seen[i] == key)
+			return "repeated";
+	if (lease->n_seen >= lease->count * CL_SHARES_PER_UNIT)
+		return "beyond what its lease could yield";
+	seen = realloc(lease->seen, (lease->n_seen + 1) * sizeof(*seen));
+	if (!seen)
+		return "without memory to remember it";
+	lease->seen = seen;
+	lease->seen[lease->n_seen++] = key;
+
+	*work = job->work;
+	memcpy(work->data + 68, share.data + 68, 4);	/* ntime */
+	memcpy(work->data + 76, share.data + 76, 4);	/* nonce */
+	return NULL;
+}
+
+static bool cl_relay_share(struct cl_worker *w, const unsigned char *msg)
+{
+	uint32_t id = get32(msg);
+	enum share_results result;
+	unsigned char reply[5];
+	const char *why;
+	struct work work;
+	int res = CL_DROPPED;
+	bool ok;
+
+	pthread_mutex_lock(&cl_lock);
+	why = cl_check_share(w, msg, &work);
+	pthread_mutex_unlock(&cl_lock);
+
+	if (why)
+		applog(LOG_INFO, "cluster: worker %d share %s, lease %u, "
+		       "dropped", w->id, why, id);
+	else if (submit_work_sync(&work, &result))
+		res = result;
+
+	put32(reply, id);
+	reply[4] = res;
+	pthread_mutex_lock(&w->wlock);
+	ok = cl_send(w->fd, CL_RESULT, reply, sizeof(reply));
+	pthread_mutex_unlock(&w->wlock);
+	return ok;
+}
+
+/* Drop a reference taken under cl_lock; the last one closes the fd */
+static void cl_put_worker(struct cl_worker *w)
+{
+	bool last;
+
+	pthread_mutex_lock(&cl_lock);
+	last = !--w->refs;
+	pthread_mutex_unlock(&cl_lock);
+	if (!last)
+		return;
+
+	close(w->fd);
+	pthread_mutex_destroy(&w->wlock);
+	free(w);
+}
+
+/* Worker gone: unlink it and reclaim what it had not started */
+static void cl_drop_worker(struct cl_worker *w)
+{
+	struct cl_worker **pw;
+	int i;
+
+	pthread_mutex_lock(&cl_lock);
+	for (pw = &cl_workers; *pw; pw = &(*pw)->next)
+		if (*pw == w) {
+			*pw = w->next;
+			break;
+		}
+	cl_n_workers--;
+
+	for (i = 0; i < CL_LEASES; i++) {
+		struct cl_lease *lease = &cl_leases[i];
+		struct cl_job *job;
+
+		if (lease->owner != w)
+			continue;
+		lease->owner = NULL;
+		job = job_get(lease->job_seq);
+		if (!job || job->gen != cl_gen || lease->used >= lease->count ||
+		    cl_n_free == CL_FREE)
+			continue;
+		cl_free[cl_n_free].job_seq = lease->job_seq;
+		cl_free[cl_n_free].off = lease->off + lease->used;
+		cl_free[cl_n_free].count = lease->count - lease->used;
+		cl_n_free++;
+	}
+	pthread_mutex_unlock(&cl_lock);
+
+	applog(LOG_INFO, "cluster: worker %d disconnected", w->id);
+	cl_put_worker(w);
+}
+
+static void *cl_worker_thread(void *userdata)
+{
+	struct cl_worker *w = userdata;
+	unsigned char msg[CL_MAX_MSG];
+	size_t len;
+	int type;
+
+	while ((type = cl_recv(w->fd, msg, &len)) >= 0) {
+		switch (type) {
+		case CL_HELLO:
+			if (len < 4 || get16(msg) != CL_PROTO) {
+				applog(LOG_ERR, "cluster: worker %d speaks "
+				       "another protocol", w->id);
+				goto out;
+			}
+			w->threads = get16(msg + 2);
+			applog(LOG_INFO, "cluster: worker %d joined, %d threads",
+			       w->id, w->threads);
+			break;
+
+		case CL_STATUS: {
+			struct cl_lease *lease;
+			uint32_t id;
+
+			if (len < 21)
+				goto out;
+			id = get32(msg + 1);
+			pthread_mutex_lock(&cl_lock);
+			w->rate = get64(msg + 9);
+			w->units = get32(msg + 17) / 60.0;
+			lease = &cl_leases[id % CL_LEASES];
+			if (lease->id == id && lease->owner == w)
+				lease->used = get32(msg + 5);
+			pthread_mutex_unlock(&cl_lock);
+
+			if (msg[0] && !cl_send_lease(w))
+				goto out;
+			break;
+		}
+
+		case CL_SHARE:
+			if (len < 4 + 128 || !cl_relay_share(w, msg))
+				goto out;
+			break;
+
+		default:
+			applog(LOG_ERR, "cluster: worker %d sent unknown "
+			       "message %d", w->id, type);
+			goto out;
+		}
+	}
+
+out:
+	cl_drop_worker(w);
+	return NULL;
+}
+
+static void *cl_accept_thread(void *userdata)
+{
+	int lfd = (intptr_t) userdata;
+
+	while (1) {
+		struct cl_worker *w;
+		pthread_attr_t attr;
+		pthread_t pth;
+		struct timeval tv = { CL_SEND_SECS, 0 };
+		int fd, one = 1;
+
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			applog(LOG_ERR, "cluster: accept failed: %s",
+			       strerror(errno));
+			sleep(1);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		/* a worker that stops reading must not wedge our writers */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		w = calloc(1, sizeof(*w));
+		if (!w) {
+			close(fd);
+			continue;
+		}
+		w->fd = fd;
+		w->refs = 1;		/* its thread's */
+		pthread_mutex_init(&w->wlock, NULL);
+
+		pthread_mutex_lock(&cl_lock);
+		w->id = cl_worker_seq++;
+		w->next = cl_workers;
+		cl_workers = w;
+		cl_n_workers++;
+		pthread_mutex_unlock(&cl_lock);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&pth, &attr, cl_worker_thread, w))
+			cl_drop_worker(w);
+		pthread_attr_destroy(&attr);
+	}
+
+	return NULL;
+}
+
+/* New block: leases out there are stale; tell every worker now.
+ * Called on the workio thread, so the sends happen outside cl_lock, and
+ * a worker that cannot take the message within CL_SEND_SECS is cut off.
+ */
+void cluster_restart(void)
+{
+	struct cl_worker *w, **list;
+	unsigned char gen[4];
+	int i, n = 0;
+	bool ok;
+
+	pthread_mutex_lock(&cl_lock);
+	cl_gen++;
+	cl_n_free = 0;
+	put32(gen, cl_gen);
+	list = malloc((cl_n_workers + 1) * sizeof(*list));
+	for (w = cl_workers; w && list; w = w->next) {
+		w->refs++;
+		list[n++] = w;
+	}
+	pthread_mutex_unlock(&cl_lock);
+
+	for (i = 0; i < n; i++) {
+		w = list[i];
+		pthread_mutex_lock(&w->wlock);
+		ok = cl_send(w->fd, CL_RESTART, gen, sizeof(gen));
+		pthread_mutex_unlock(&w->wlock);
+		if (!ok) {
+			applog(LOG_ERR, "cluster: worker %d not reading, "
+			       "dropped", w->id);
+			/* its thread sees the end of the stream */
+			shutdown(w->fd, SHUT_RDWR);
+		}
+		cl_put_worker(w);
+	}
+	free(list);
+}
+
+int cluster_workers(void)
+{
+	int n;
+
+	pthread_mutex_lock(&cl_lock);
+	n = cl_n_workers;
+	pthread_mutex_unlock(&cl_lock);
+	return n;
+}
+
+bool cluster_listen(const char *addr)
+{
+	char host[256];
+	pthread_t pth;
+	int fd, port;
+
+	if (!cl_parse_addr(addr, host, sizeof(host), &port)) {
+		applog(LOG_ERR, "cluster: bad address %s", addr);
+		return false;
+	}
+
+	if (*addr == '/') {
+		struct sockaddr_un sun;
+
+		fd = cl_unix_socket(addr, &sun);
+		unlink(addr);
+		if (fd >= 0 && (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) ||
+				listen(fd, 128))) {
+			applog(LOG_ERR, "cluster: listen on %s failed: %s",
+			       addr, strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+	} else
+		fd = http_listen(*host ? host : "127.0.0.1", port);
+	if (fd < 0)
+		return false;
+
+	cl_thr.id = -1;
+	cl_thr.cpu = -1;
+	cl_thr.q = tq_new();
+	if (!cl_thr.q ||
+	    pthread_create(&pth, NULL, cl_accept_thread, (void *)(intptr_t) fd)) {
+		applog(LOG_ERR, "cluster thread create failed");
+		close(fd);
+		return false;
+	}
+
+	applog(LOG_INFO, "cluster coordinator listening on %s", addr);
+	return true;
+}
+
+/*
+ * Worker
+ */
+
+struct cj_lease {
+	struct work	work;		/* at the lease's first offset */
+	uint32_t	id;
+	uint32_t	count, next;	/* units, handed out so far */
+};
+
+static const char *cj_addr;
+static int cj_threads;
+static int cj_fd = -1;
+static pthread_mutex_t cj_wlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cj_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cj_cond = PTHREAD_COND_INITIALIZER;
+static struct cj_lease cj_leases[2];	/* current, and the next one */
+static int cj_n_leases;
+static bool cj_wanted;			/* lease requested, not arrived */
+static uint32_t cj_gen;			/* coordinator's block number */
+static uint32_t cj_units;		/* handed out, ever */
+
+/* Caller holds cj_lock */
+static bool cj_send(int type, const unsigned char *payload, size_t len)
+{
+	bool ok;
+
+	if (cj_fd < 0)
+		return false;
+	pthread_mutex_lock(&cj_wlock);
+	ok = cl_send(cj_fd, type, payload, len);
+	pthread_mutex_unlock(&cj_wlock);
+	return ok;
+}
+
+/* Report progress, optionally asking for a lease; caller holds cj_lock */
+static void cj_status(bool want, uint32_t units_per_min)
+{
+	unsigned char buf[21];
+
+	buf[0] = want;
+	put32(buf + 1, cj_n_leases ? cj_leases[0].id : 0);
+	put32(buf + 5, cj_n_leases ? cj_leases[0].next : 0);
+	put64(buf + 9, stats_rate(-1, STATS_1M));
+	put32(buf + 17, units_per_min);
+	if (cj_send(CL_STATUS, buf, sizeof(buf)) && want)
+		cj_wanted = true;
+}
+
+/* Caller holds cj_lock */
+static int cj_remaining(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < cj_n_leases; i++)
+		n += cj_leases[i].count - cj_leases[i].next;
+	return n;
+}
+
+bool cluster_get_work(struct work *work)
+{
+	struct cj_lease *l;
+
+	pthread_mutex_lock(&cj_lock);
+	while (1) {
+		while (cj_n_leases &&
+		       cj_leases[0].next == cj_leases[0].count) {
+			cj_leases[0] = cj_leases[1];
+			cj_n_leases--;
+		}
+		if (cj_n_leases)
+			break;
+		if (!cj_wanted)
+			cj_status(true, 0);
+		pthread_cond_wait(&cj_cond, &cj_lock);
+	}
+
+	l = &cj_leases[0];
+	*work = l->work;
+	work_set_ntime(work, work_ntime(work) + l->next++);
+	work->lease = l->id;
+	cj_units++;
+
+	/* ask ahead, so threads do not wait on the round trip */
+	if (!cj_wanted && cj_n_leases < 2 && cj_remaining() < cj_threads)
+		cj_status(true, 0);
+	pthread_mutex_unlock(&cj_lock);
+
+	return true;
+}
+
+bool cluster_submit(const struct work *work)
+{
+	unsigned char buf[4 + 128];
+	bool ok;
+
+	put32(buf, work->lease);
+	memcpy(buf + 4, work->data, sizeof(work->data));
+
+	pthread_mutex_lock(&cj_lock);
+	ok = cj_send(CL_SHARE, buf, sizeof(buf));
+	pthread_mutex_unlock(&cj_lock);
+
+	if (!ok)
+		applog(LOG_ERR, "cluster: coordinator unreachable, share lost");
+	return true;
+}
+
+static void cj_result(const unsigned char *msg)
+{
+	int res = msg[4];
+
+	if (res == CL_DROPPED) {
+		applog(LOG_INFO, "PROOF OF WORK RESULT: dropped by coordinator");
+		return;
+	}
+
+	applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
+	       res == SHARE_ACCEPTED ? "true (yay!!!)" : "false (booooo)");
+	stats_share(res);
+}
+
+static void cj_lease_add(const unsigned char *msg)
+{
+	struct cj_lease *l;
+	const unsigned char *p = msg + 12;
+	uint32_t gen = get32(msg + 4);
+
+	pthread_mutex_lock(&cj_lock);
+	cj_wanted = false;
+	if ((int32_t)(gen - cj_gen) > 0) {
+		cj_gen = gen;		/* a block we missed the RESTART of */
+		cj_n_leases = 0;
+	}
+	if (gen == cj_gen && cj_n_leases < 2) {
+		l = &cj_leases[cj_n_leases++];
+		memset(l, 0, sizeof(*l));
+		l->id = get32(msg);
+		l->count = get32(msg + 8);
+		memcpy(l->work.midstate, p, sizeof(l->work.midstate));
+		p += sizeof(l->work.midstate);
+		memcpy(l->work.data, p, sizeof(l->work.data));
+		p += sizeof(l->work.data);
+		memcpy(l->work.hash1, p, sizeof(l->work.hash1));
+		p += sizeof(l->work.hash1);
+		memcpy(l->work.target, p, sizeof(l->work.target));
+		pthread_cond_broadcast(&cj_cond);
+	} else if (gen != cj_gen && !cj_n_leases)
+		cj_status(true, 0);	/* stale; ask again */
+	pthread_mutex_unlock(&cj_lock);
+}
+
+static void *cj_thread(void *userdata)
+{
+	unsigned char msg[CL_MAX_MSG], hello[4];
+	size_t len;
+	int fd, type;
+
+	put16(hello, CL_PROTO);
+	put16(hello + 2, cj_threads);
+
+	while (1) {
+		fd = cl_connect(cj_addr);
+		if (fd < 0) {
+			applog(LOG_ERR, "cluster: cannot reach coordinator %s, "
+			       "retry after %d seconds", cj_addr, CL_RETRY_SECS);
+			sleep(CL_RETRY_SECS);
+			continue;
+		}
+		applog(LOG_INFO, "cluster: joined coordinator %s", cj_addr);
+
+		pthread_mutex_lock(&cj_lock);
+		cj_fd = fd;
+		cj_wanted = false;
+		cj_gen = 0;
+		cj_send(CL_HELLO, hello, sizeof(hello));
+		cj_status(true, 0);
+		pthread_mutex_unlock(&cj_lock);
+
+		while ((type = cl_recv(fd, msg, &len)) >= 0) {
+			if (type == CL_LEASE && len >= 12 + 32 + 128 + 64 + 32)
+				cj_lease_add(msg);
+			else if (type == CL_RESULT && len >= 5)
+				cj_result(msg);
+			else if (type == CL_RESTART && len >= 4) {
+				pthread_mutex_lock(&cj_lock);
+				cj_gen = get32(msg);
+				cj_n_leases = 0;
+				pthread_mutex_unlock(&cj_lock);
+				applog(LOG_INFO, "cluster: coordinator "
+				       "detected new block");
+				restart_threads();
+			}
+		}
+
+		/* the coordinator reclaims our leases; start over */
+		applog(LOG_ERR, "cluster: lost coordinator %s", cj_addr);
+		pthread_mutex_lock(&cj_lock);
+		pthread_mutex_lock(&cj_wlock);
+		close(cj_fd);
+		cj_fd = -1;
+		pthread_mutex_unlock(&cj_wlock);
+		cj_n_leases = 0;
+		pthread_mutex_unlock(&cj_lock);
+		restart_threads();
+		sleep(CL_RETRY_SECS);
+	}
+
+	return NULL;
+}
+
+static void *cj_status_thread(void *userdata)
+{
+	uint32_t last = 0;
+
+	while (1) {
+		sleep(CL_STATUS_SECS);
+
+		pthread_mutex_lock(&cj_lock);
+		cj_status(false, (cj_units - last) * 60 / CL_STATUS_SECS);
+		last = cj_units;
+		pthread_mutex_unlock(&cj_lock);
+	}
+
+	return NULL;
+}
+
+bool cluster_join(const char *addr, int n_threads)
+{
+	char host[256];
+	pthread_t pth;
+	int port;
+
+	if (!cl_parse_addr(addr, host, sizeof(host), &port)) {
+		applog(LOG_ERR, "cluster: bad address %s", addr);
+		return false;
+	}
+
+	cj_addr = addr;
+	cj_threads = n_threads;
+	if (pthread_create(&pth, NULL, cj_thread, NULL) ||
+	    pthread_create(&pth, NULL, cj_status_thread, NULL)) {
+		applog(LOG_ERR, "cluster thread create failed");
+		return false;
+	}
+
+	return true;
+}
+
+#else /* WIN32 */
+
+void cluster_restart(void)
+{
+}
+
+int cluster_workers(void)
+{
+	return 0;
+}
+
+bool cluster_listen(const char *addr)
+{
+	applog(LOG_ERR, "cluster mode not supported on this platform");
+	return false;
+}
+
+bool cluster_join(const char *addr, int n_threads)
+{
+	applog(LOG_ERR, "cluster mode not supported on this platform");
+	return false;
+}
+
+bool cluster_get_work(struct work *work)
+{
+	return false;
+}
+
+bool cluster_submit(const struct work *work)
+{
+	return false;
+}
+
+#endif /* WIN32 */
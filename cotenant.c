@@ -0,0 +1,290 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Co-tenancy controller: yield cpus to foreground load.
+ *
+ * SCHED_IDLE and nice 19 keep miner threads off cpus that other tasks
+ * want, but a miner on the SMT sibling of a busy core, or sharing its
+ * caches, still slows that core down.  This controller samples CPU
+ * pressure (PSI, /proc/pressure/cpu, or the run queue length from
+ * /proc/loadavg on kernels without PSI) and parks miner threads one at a
+ * time while pressure is above the threshold, unparking them again once
+ * it has dropped well below.  Optionally, threads whose SMT sibling is
+ * busy with non-miner work are parked as well.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define COTENANT_INTERVAL	2	/* seconds between samples */
+
+static int ct_threads;
+static double ct_threshold;		/* percent of time stalled */
+static bool ct_smt;
+
+static bool have_psi = true;
+static unsigned long long psi_last;
+static struct timeval psi_tv;
+
+/* per-cpu busy accounting, for SMT sibling parking */
+static unsigned long long *cpu_busy_last, *cpu_total_last;
+static bool *cpu_busy;
+
+/* CPU pressure over the last interval, in percent; <0 on failure */
+static double psi_sample(void)
+{
+	unsigned long long total;
+	struct timeval now, diff;
+	char line[256];
+	double pct = -1.0;
+	FILE *f;
+
+	f = fopen("/proc/pressure/cpu", "r");
+	if (!f)
+		return -1.0;
+	while (fgets(line, sizeof(line), f)) {
+		char *p;
+
+		if (strncmp(line, "some ", 5))
+			continue;
+		p = strstr(line, "total=");
+		if (!p || sscanf(p + 6, "%llu", &total) != 1)
+			break;
+
+		gettimeofday(&now, NULL);
+		if (psi_tv.tv_sec) {
+			double usecs;
+
+			timeval_subtract(&diff, &now, &psi_tv);
+			usecs = diff.tv_sec * 1e6 + diff.tv_usec;
+			if (usecs > 0)
+				pct = 100.0 * (total - psi_last) / usecs;
+		} else
+			pct = 0.0;
+		psi_last = total;
+		psi_tv = now;
+		break;
+	}
+	fclose(f);
+
+	return pct;
+}
+
+/* Fallback: share of cpus with a non-miner task waiting to run */
+static double loadavg_sample(int running_miners)
+{
+	int runnable, total, ncpus = topo_num_cpus();
+	double excess;
+	FILE *f;
+
+	f = fopen("/proc/loadavg", "r");
+	if (!f)
+		return -1.0;
+	if (fscanf(f, "%*s %*s %*s %d/%d", &runnable, &total) != 2) {
+		fclose(f);
+		return -1.0;
+	}
+	fclose(f);
+
+	/* runnable includes ourselves and the running miner threads */
+	excess = (runnable - 1) - ncpus;
+	if (excess <= 0 || ncpus <= 0)
+		return 0.0;
+	if (excess > running_miners)
+		excess = running_miners;
+	return 100.0 * excess / ncpus;
+}
+
+/* Mark cpus that are busy with something other than our miners */
+static void sample_cpu_busy(void)
+{
+	char line[512];
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long v[8] = { }, total = 0, busy;
+		int cpu;
+
+		/* the "cpu " line is the sum over all cpus */
+		if (!strncmp(line, "cpu ", 4))
+			continue;
+		if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &cpu, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+			   &v[6], &v[7]) < 5)
+			continue;
+		if (cpu < 0 || cpu >= MAX_CPUS)
+			continue;
+
+		for (i = 0; i < 8; i++)
+			total += v[i];
+		/* miners run niced, so exclude the nice column */
+		busy = total - v[1] - v[3] - v[4];
+
+		cpu_busy[cpu] = (total - cpu_total_last[cpu]) &&
+			2 * (busy - cpu_busy_last[cpu]) >
+			    (total - cpu_total_last[cpu]);
+		cpu_busy_last[cpu] = busy;
+		cpu_total_last[cpu] = total;
+	}
+
+	fclose(f);
+}
+
+/* Is any other cpu of thread 'thr''s core busy with foreground work? */
+static bool sibling_busy(const struct thr_info *thr)
+{
+	int cpu, core;
+
+	if (thr->cpu < 0)
+		return false;
+	core = topo_cpu_core(thr->cpu);
+	for (cpu = 0; cpu < MAX_CPUS; cpu++)
+		if (cpu != thr->cpu && cpu_busy[cpu] &&
+		    topo_cpu_core(cpu) == core)
+			return true;
+	return false;
+}
+
+static void *cotenant_thread(void *userdata)
+{
+	double pressure_at_park = 0.0;
+	int i;
+
+	while (1) {
+		double pressure, forgone = 0.0;
+		int running = 0, n_parked = 0, park = -1, unpark = -1;
+		bool changed = false;
+
+		sleep(COTENANT_INTERVAL);
+
+		/* threads parked for other reasons are not ours to manage;
+		 * park from the highest thread id down, unpark in reverse
+		 */
+		for (i = 0; i < ct_threads; i++) {
+			unsigned int mask = thr_info[i].park_mask;
+
+			if (mask & PARK_QUOTA)
+				continue;
+			if (mask & PARK_COTENANT) {
+				if (unpark < 0)
+					unpark = i;
+				n_parked++;
+			} else if (!mask) {
+				/* parking an already parked thread frees
+				 * no cpu
+				 */
+				park = i;
+				running++;
+			}
+		}
+
+		pressure = have_psi ? psi_sample() : -1.0;
+		if (pressure < 0.0) {
+			have_psi = false;
+			pressure = loadavg_sample(running);
+		}
+		if (pressure < 0.0)
+			continue;
+
+		if (pressure > ct_threshold && running > 1 && park >= 0) {
+			if (!n_parked)
+				pressure_at_park = pressure;
+			thread_park(park, PARK_COTENANT, true);
+			changed = true;
+		} else if (pressure < ct_threshold / 2 && unpark >= 0) {
+			thread_park(unpark, PARK_COTENANT, false);
+			changed = true;
+		}
+
+		if (ct_smt) {
+			sample_cpu_busy();
+			for (i = 0; i < ct_threads; i++) {
+				bool busy = sibling_busy(&thr_info[i]);
+				bool was = thr_info[i].park_mask & PARK_SMT;
+
+				if (busy != was) {
+					thread_park(i, PARK_SMT, busy);
+					changed = true;
+				}
+			}
+		}
+
+		if (!changed)
+			continue;
+
+		/* a parked thread's last hashmeter rate is what we gave up */
+		n_parked = 0;
+		for (i = 0; i < ct_threads; i++) {
+			unsigned int mask = thr_info[i].park_mask;
+
+			if ((mask & (PARK_COTENANT | PARK_SMT)) &&
+			    !(mask & PARK_QUOTA)) {
+				n_parked++;
+				forgone += thr_info[i].khashes;
+			}
+		}
+
+		applog(LOG_INFO, "cotenant: cpu pressure %.1f%% (threshold "
+		       "%.1f%%, %s), %d of %d threads parked, "
+		       "%.2f khash/sec given up, pressure %+.1f points "
+		       "since parking began",
+		       pressure, ct_threshold, have_psi ? "psi" : "loadavg",
+		       n_parked, ct_threads, forgone,
+		       n_parked ? pressure - pressure_at_park : 0.0);
+	}
+
+	return NULL;
+}
+
+bool cotenant_start(int n_threads, double threshold, bool smt)
+{
+	pthread_t pth;
+
+	ct_threads = n_threads;
+	ct_threshold = threshold;
+	ct_smt = smt;
+
+	cpu_busy_last = calloc(MAX_CPUS, sizeof(*cpu_busy_last));
+	cpu_total_last = calloc(MAX_CPUS, sizeof(*cpu_total_last));
+	cpu_busy = calloc(MAX_CPUS, sizeof(*cpu_busy));
+	if (!cpu_busy_last || !cpu_total_last || !cpu_busy)
+		return false;
+
+	if (psi_sample() < 0.0) {
+		have_psi = false;
+		applog(LOG_INFO, "cotenant: /proc/pressure/cpu unavailable, "
+		       "using loadavg");
+	}
+	if (ct_smt)
+		sample_cpu_busy();
+
+	if (pthread_create(&pth, NULL, cotenant_thread, NULL)) {
+		applog(LOG_ERR, "cotenant thread create failed");
+		return false;
+	}
+
+	applog(LOG_INFO, "cotenant: keeping cpu pressure under %.1f%%%s",
+	       threshold, smt ? ", parking threads beside busy SMT siblings" :
+	       "");
+	return true;
+}
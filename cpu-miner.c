@@ -54,8 +54,11 @@ static inline void affine_to_cpu(int id, int cpu)
 
 	CPU_ZERO(&set);
 	CPU_SET(cpu, &set);
-	sched_setaffinity(0, sizeof(&set), &set);
-	applog(LOG_INFO, "Binding thread %d to cpu %d", id, cpu);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		applog(LOG_WARNING, "Binding thread %d to cpu %d failed",
+		       id, cpu);
+	else
+		applog(LOG_INFO, "Binding thread %d to cpu %d", id, cpu);
 }
 #else
 static inline void drop_policy(void)
@@ -70,27 +73,26 @@ static inline void affine_to_cpu(int id, int cpu)
 enum workio_commands {
 	WC_GET_WORK,
 	WC_SUBMIT_WORK,
+	WC_SWITCH_POOL,
 };
 
 struct workio_cmd {
 	enum workio_commands	cmd;
 	struct thr_info		*thr;
+	struct thread_q		*reply;	/* WC_SUBMIT_WORK: wants the result */
 	union {
 		struct work	*work;
+		struct {
+			struct pool *pool;
+			char	*userpass;	/* new credentials, or NULL */
+			bool	restart;	/* drop work from the old pool */
+		} pool;
 	} u;
 };
 
-enum sha256_algos {
-	ALGO_C,			/* plain C */
-	ALGO_4WAY,		/* parallel SSE2 */
-	ALGO_VIA,		/* VIA padlock */
-	ALGO_CRYPTOPP,		/* Crypto++ (C) */
-	ALGO_CRYPTOPP_ASM32,	/* Crypto++ 32-bit assembly */
-	ALGO_SSE2_64,		/* SSE2 for x86_64 */
-};
-
 static const char *algo_names[] = {
 	[ALGO_C]		= "c",
+	[ALGO_C_ILP]		= "c_ilp",
 #ifdef WANT_SSE2_4WAY
 	[ALGO_4WAY]		= "4way",
 #endif
@@ -104,6 +106,14 @@ static const char *algo_names[] = {
 #ifdef WANT_X8664_SSE2
 	[ALGO_SSE2_64]		= "sse2_64",
 #endif
+#ifdef WANT_SHA256_VEC
+	[ALGO_VEC4]		= "vec4",
+	[ALGO_VEC8]		= "vec8",
+	[ALGO_VEC16]		= "vec16",
+#endif
+#ifdef WANT_SCRYPT
+	[ALGO_SCRYPT]		= "scrypt",
+#endif
 };
 
 bool opt_debug = false;
@@ -111,27 +121,68 @@ bool opt_protocol = false;
 bool want_longpoll = true;
 bool have_longpoll = false;
 bool use_syslog = false;
-static bool opt_quiet = false;
+bool opt_quiet = false;
+bool opt_scrypt = false;
+static bool opt_benchmark = false;
+static bool opt_tune = false;
+static bool opt_perf = false;
+static int opt_smt_algo = -1;
+#define MAX_CLASSES 8
+static int opt_class_algo[MAX_CLASSES];
+static int opt_n_class_algo;
 static int opt_retries = 10;
 static int opt_fail_pause = 30;
 int opt_scantime = 5;
+int opt_timeout = 10;
+int opt_pool_probe = 15;
 static json_t *opt_config;
 static const bool opt_time = true;
 #ifdef WANT_X8664_SSE2
 static enum sha256_algos opt_algo = ALGO_SSE2_64;
+#elif defined(WANT_SHA256_VEC)
+static enum sha256_algos opt_algo = ALGO_VEC4;
 #else
 static enum sha256_algos opt_algo = ALGO_C;
 #endif
 static int opt_n_threads;
-static int num_processors;
-static char *rpc_url;
-static char *rpc_userpass;
-static char *rpc_user, *rpc_pass;
+static bool auto_threads;
+static int opt_cgroup_recheck = 30;
+static double opt_cotenant;
+static bool opt_cotenant_smt;
+static int opt_stats_interval = 60;
+static int opt_metrics_port;
+static int opt_api_port;
+static char *opt_api_token;
+static int opt_proxy_port;
+static char *opt_proxy_bind;
+static int opt_proxy_roll = 30;
+static char *opt_cluster_listen;
+static char *opt_cluster_join;
+static char *opt_share_journal;
+static char *opt_record;
+static char *opt_trace;
+static char *opt_work_file;
+static char *opt_work_out;
+static char *opt_aux_url;
+static char *opt_aux_userpass;
+static char *opt_coinbase_script;
+static enum cpu_policies opt_cpu_policy = CPU_POLICY_AUTO;
+static bool cli_cpu_policy_given;
+static char *opt_cpu_list;
+struct pool *cur_pool;		/* written by the workio thread only */
+static volatile unsigned long pool_gen;	/* bumped on each pool switch */
 struct thr_info *thr_info;
 static int work_thr_id;
 int longpoll_thr_id;
 struct work_restart *work_restart = NULL;
+static volatile unsigned long work_gen;	/* bumped on each new block */
+/* gettimeofday() usecs when work_gen was last bumped; a single word,
+ * as every miner thread reads it
+ */
+static volatile uint64_t restart_usecs;
 pthread_mutex_t time_lock;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
 
 
 struct option_help {
@@ -143,13 +194,35 @@ static struct option_help options_help[] = {
 	{ "help",
 	  "(-h) Display this help text" },
 
+	{ "cgroup-recheck N",
+	  "Seconds between re-reading the cgroup cpu quota, to follow\n"
+	  "\truntime changes (default: 30; 0 disables)" },
+
+	{ "class-algo LIST",
+	  "On hybrid CPUs, the kernel for each core class, fastest\n"
+	  "\tclass first, e.g. vec8,c_ilp; an empty entry means -a\n"
+	  "\t(default: -a for all)" },
+
+	{ "cluster-join ADDR",
+	  "Mine for the cluster coordinator at ADDR ([HOST:]PORT, or a\n"
+	  "\tUNIX socket path) instead of a pool" },
+
+	{ "cluster-listen ADDR",
+	  "Coordinate worker minerds connecting on ADDR ([HOST:]PORT,\n"
+	  "\tor a UNIX socket path), leasing them work from our pools;\n"
+	  "\twithout a HOST, on loopback only (default: off)" },
+
 	{ "config FILE",
 	  "(-c FILE) JSON-format configuration file (default: none)\n"
 	  "See example-cfg.json for an example configuration." },
 
 	{ "algo XXX",
 	  "(-a XXX) Specify sha256 implementation:\n"
-	  "\tc\t\tLinux kernel sha256, implemented in C (default)"
+	  "\tc\t\tLinux kernel sha256, implemented in C"
+#ifndef WANT_SHA256_VEC
+	  " (default)"
+#endif
+	  "\n\tc_ilp\t\tthe same, several nonces interleaved"
 #ifdef WANT_SSE2_4WAY
 	  "\n\t4way\t\ttcatm's 4-way SSE2 implementation"
 #endif
@@ -162,21 +235,132 @@ static struct option_help options_help[] = {
 #endif
 #ifdef WANT_X8664_SSE2
 	  "\n\tsse2_64\t\tSSE2 implementation for x86_64 machines"
+#endif
+#ifdef WANT_SHA256_VEC
+	  "\n\tvec4\t\tportable vector implementation, 4 lanes"
+#ifndef WANT_X8664_SSE2
+	  " (default)"
+#endif
+	  "\n\tvec8\t\tportable vector implementation, 8 lanes"
+	  "\n\tvec16\t\tportable vector implementation, 16 lanes"
+#endif
+#ifdef WANT_SCRYPT
+	  "\n\tscrypt\t\tscrypt(1024, 1, 1) proof of work instead, as for\n"
+	  "\t\t\tLitecoin; cannot be switched at runtime"
 #endif
 	  },
 
+	{ "api-port N",
+	  "Accept JSON-RPC control commands on http://127.0.0.1:N/\n"
+	  "\t(stats, threads, algo, pool, pause, resume; default: off)" },
+
+	{ "api-token TOKEN",
+	  "Bearer token the control API requires for all but stats;\n"
+	  "\twithout one it is read-only.  Set it in the -c config\n"
+	  "\tfile to keep it out of ps (default: none)" },
+
+	{ "aux-url URL",
+	  "Merged mining: commit to blocks of the aux chain at URL\n"
+	  "\t(getauxblock) in coinbases we build from the pool's block\n"
+	  "\ttemplates (getblocktemplate), and submit solutions to each\n"
+	  "\tchain whose target they meet (default: off)" },
+
+	{ "aux-userpass USERNAME:PASSWORD",
+	  "Credentials for --aux-url (default: none)" },
+
+	{ "benchmark",
+	  "Run offline benchmark on dummy work; no pool is contacted" },
+
+	{ "cotenant PCT",
+	  "Park miner threads while CPU pressure (PSI, or loadavg if\n"
+	  "\tunavailable) exceeds PCT percent (default: off)" },
+
+	{ "cotenant-smt",
+	  "With --cotenant, also park threads whose SMT sibling is busy\n"
+	  "\twith other work" },
+
+	{ "coinbase-script HEX",
+	  "With --aux-url, the output script our coinbases pay to" },
+
+	{ "cpu-affinity LIST",
+	  "Bind miner threads, in order, to the cpus in LIST (e.g. 0-3,8);\n"
+	  "\tnot with --cpu-policy" },
+
+	{ "cpu-policy POLICY",
+	  "Miner thread placement policy (default: auto):\n"
+	  "\tauto\t\tbind only if threads are a multiple of cpus\n"
+	  "\tnone\t\tnever bind threads\n"
+	  "\tcompact\t\tfill SMT siblings, then cores, then NUMA nodes\n"
+	  "\tspread\t\tone thread per core, alternating NUMA nodes\n"
+	  "\tcore\t\tone thread per physical core" },
+
 	{ "quiet",
 	  "(-q) Disable per-thread hashmeter output (default: off)" },
 
 	{ "debug",
 	  "(-D) Enable debug output (default: off)" },
 
+	{ "log-format FORMAT",
+	  "Log lines as text or json, one object per line\n"
+	  "\t(default: text)" },
+
+	{ "log-rate N",
+	  "Most messages per second from any one place in the code;\n"
+	  "\tthe rest are dropped and counted (default: 100; 0: no limit)" },
+
+	{ "metrics-port N",
+	  "Serve Prometheus metrics on http://127.0.0.1:N/metrics\n"
+	  "\t(default: off)" },
+
 	{ "no-longpoll",
 	  "Disable X-Long-Polling support (default: enabled)" },
 
+	{ "perf",
+	  "Count cycles, instructions, branch and L1d misses around\n"
+	  "\teach scan, reporting cycles/hash and IPC per thread and\n"
+	  "\tkernel; TSC cycles where perf events are unavailable\n"
+	  "\t(default: off)" },
+
+	{ "pool-balance POLICY",
+	  "How to spread work over several pools:\n"
+	  "\tfailover\tall from the preferred live pool (default)\n"
+	  "\tweighted\tin proportion to --pool-weight\n"
+	  "\trtt\t\tfavour pools with a short round trip\n"
+	  "\tstale\t\tfavour pools with few stale shares" },
+
+	{ "pool-probe N",
+	  "With several pools, seconds between health probes of each\n"
+	  "\t(default: 15)" },
+
+	{ "pool-weight N",
+	  "Weight of the preceding --url under --pool-balance weighted\n"
+	  "\t(default: 1)" },
+
+	{ "proxy-port N",
+	  "Serve getwork to other miners on port N, handing out work\n"
+	  "\tfrom our pools and relaying their shares (default: off)" },
+
+	{ "proxy-bind ADDR",
+	  "Address for --proxy-port to listen on, e.g. 0.0.0.0 for all\n"
+	  "\tinterfaces; anyone who can connect mines on our account\n"
+	  "\t(default: 127.0.0.1)" },
+
+	{ "proxy-roll N",
+	  "Work units handed out per upstream getwork, by rolling the\n"
+	  "\theader time (default: 30; 1 disables rolling)" },
+
 	{ "protocol-dump",
 	  "(-P) Verbose dump of protocol-level activities (default: off)" },
 
+	{ "record FILE",
+	  "Record every RPC exchange with its timing to FILE, for\n"
+	  "\tlater playback by rpc-replay (default: off)" },
+
+	{ "restart-budget N",
+	  "Microseconds a miner thread may take to notice a new block;\n"
+	  "\tthe kernels check that often, going by their hash rate\n"
+	  "\t(default: 1000; 0: after every pass)" },
+
 	{ "retries N",
 	  "(-r N) Number of times to retry, if JSON-RPC call fails\n"
 	  "\t(default: 10; use -1 for \"never\")" },
@@ -194,12 +378,50 @@ static struct option_help options_help[] = {
 	  "Use system log for output messages (default: standard error)" },
 #endif
 
+	{ "share-journal FILE",
+	  "Journal found shares in FILE before submitting them, and\n"
+	  "\tresubmit those a pool outage or restart kept from it\n"
+	  "\t(default: off)" },
+
+	{ "smt-algo XXX",
+	  "Kernel for the second miner thread on each physical core,\n"
+	  "\tkept on cores where a startup benchmark finds the mix\n"
+	  "\tfaster than -a alone, e.g. c_ilp beside a vector kernel\n"
+	  "\t(default: off)" },
+
+	{ "stats-interval N",
+	  "Seconds between total hashrate and share reports; per-scan\n"
+	  "\tthread output is then only shown with --debug\n"
+	  "\t(default: 60; 0 disables)" },
+
 	{ "threads N",
-	  "(-t N) Number of miner threads (default: 1)" },
+	  "(-t N) Number of miner threads (default: one per usable cpu)" },
+
+	{ "timeout N",
+	  "Seconds before a getwork or share submission is abandoned\n"
+	  "\tand the next pool tried (default: 10)" },
+
+	{ "trace FILE",
+	  "Write each RPC phase, queue wait, get_work, scan and share\n"
+	  "\tto FILE as Chrome trace-event JSON (default: off)" },
+
+	{ "tune",
+	  "Time the kernel's batch sizes on dummy work at startup and\n"
+	  "\tmine with the fastest (default: off)" },
+
+	{ "work-file FILE",
+	  "Scan the headers in FILE (\"-\": standard input) instead of\n"
+	  "\tasking a pool: hex lines of an 80 or 128 byte header and\n"
+	  "\toptional target, or a binary batch; exits when done" },
+
+	{ "work-out FILE",
+	  "Where --work-file writes solutions (default: standard output)" },
 
 	{ "url URL",
 	  "URL for bitcoin JSON-RPC server "
-	  "(default: " DEF_RPC_URL ")" },
+	  "(default: " DEF_RPC_URL ")\n"
+	  "\tRepeat for backup pools, most preferred first; credentials\n"
+	  "\toptions apply to the URL they follow" },
 
 	{ "userpass USERNAME:PASSWORD",
 	  "Username:Password pair for bitcoin JSON-RPC server "
@@ -216,35 +438,83 @@ static struct option_help options_help[] = {
 
 static struct option options[] = {
 	{ "algo", 1, NULL, 'a' },
+	{ "api-port", 1, NULL, 1013 },
+	{ "api-token", 1, NULL, 1038 },
+	{ "aux-url", 1, NULL, 1029 },
+	{ "aux-userpass", 1, NULL, 1030 },
+	{ "benchmark", 0, NULL, 1005 },
+	{ "cgroup-recheck", 1, NULL, 1008 },
+	{ "cluster-join", 1, NULL, 1022 },
+	{ "class-algo", 1, NULL, 1035 },
+	{ "cluster-listen", 1, NULL, 1021 },
+	{ "coinbase-script", 1, NULL, 1031 },
 	{ "config", 1, NULL, 'c' },
+	{ "cotenant", 1, NULL, 1009 },
+	{ "cotenant-smt", 0, NULL, 1010 },
+	{ "cpu-affinity", 1, NULL, 1006 },
+	{ "cpu-policy", 1, NULL, 1007 },
 	{ "debug", 0, NULL, 'D' },
 	{ "help", 0, NULL, 'h' },
+	{ "log-format", 1, NULL, 1027 },
+	{ "log-rate", 1, NULL, 1028 },
+	{ "metrics-port", 1, NULL, 1012 },
 	{ "no-longpoll", 0, NULL, 1003 },
 	{ "pass", 1, NULL, 'p' },
+	{ "perf", 0, NULL, 1037 },
+	{ "pool-balance", 1, NULL, 1016 },
+	{ "pool-probe", 1, NULL, 1014 },
+	{ "pool-weight", 1, NULL, 1017 },
 	{ "protocol-dump", 0, NULL, 'P' },
+	{ "proxy-bind", 1, NULL, 1019 },
+	{ "proxy-port", 1, NULL, 1018 },
+	{ "proxy-roll", 1, NULL, 1020 },
 	{ "quiet", 0, NULL, 'q' },
+	{ "record", 1, NULL, 1024 },
+	{ "restart-budget", 1, NULL, 1033 },
 	{ "threads", 1, NULL, 't' },
+	{ "timeout", 1, NULL, 1015 },
+	{ "trace", 1, NULL, 1036 },
+	{ "tune", 0, NULL, 1032 },
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "scantime", 1, NULL, 's' },
+	{ "share-journal", 1, NULL, 1023 },
+	{ "smt-algo", 1, NULL, 1034 },
+	{ "stats-interval", 1, NULL, 1011 },
 #ifdef HAVE_SYSLOG_H
 	{ "syslog", 0, NULL, 1004 },
 #endif
 	{ "url", 1, NULL, 1001 },
 	{ "user", 1, NULL, 'u' },
 	{ "userpass", 1, NULL, 1002 },
+	{ "work-file", 1, NULL, 1025 },
+	{ "work-out", 1, NULL, 1026 },
 
 	{ }
 };
 
-struct work {
-	unsigned char	data[128];
-	unsigned char	hash1[64];
-	unsigned char	midstate[32];
-	unsigned char	target[32];
+int algo_parse(const char *name)
+{
+	int i;
 
-	unsigned char	hash[32];
-};
+	for (i = 0; i < ARRAY_SIZE(algo_names); i++)
+		if (algo_names[i] && !strcmp(name, algo_names[i]))
+			return i;
+	return -1;
+}
+
+/* scrypt mines different chains: a thread cannot switch to or from it */
+bool algo_is_scrypt(int algo)
+{
+	return algo == ALGO_SCRYPT;
+}
+
+const char *algo_name(int algo)
+{
+	if (algo < 0 || algo >= ARRAY_SIZE(algo_names) || !algo_names[algo])
+		return "unknown";
+	return algo_names[algo];
+}
 
 static bool jobj_binary(const json_t *obj, const char *key,
 			void *buf, size_t buflen)
@@ -299,12 +569,37 @@ err_out:
 	return false;
 }
 
-static bool submit_upstream_work(CURL *curl, const struct work *work)
+/* Follow a pool's X-Switch-To; workio thread only */
+static void workio_redirect(struct pool *pool, const char *switch_to)
+{
+	if (!pool_redirect(pool, switch_to) || pool != cur_pool)
+		return;
+
+	/* re-arm long polling on the new host */
+	pthread_mutex_lock(&pool_lock);
+	pool_gen++;
+	have_longpoll = false;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static bool submit_upstream_work(CURL *curl, const struct work *work,
+				 enum share_results *result_out)
 {
 	char *hexstr = NULL;
 	json_t *val, *res;
-	char s[345];
+	char s[345], *switch_to;
 	bool rc = false;
+	struct timeval tv_start;
+	struct pool *pool = work->pool;
+	enum share_results result;
+	bool accepted;
+
+	/* merged mining: to the chain or chains it solves a block for */
+	if (merged_mining) {
+		if (!merged_submit(curl, work, &accepted))
+			goto out;
+		goto verdict;
+	}
 
 	/* build hex string */
 	hexstr = bin2hex(work->data, sizeof(work->data));
@@ -322,7 +617,15 @@ static bool submit_upstream_work(CURL *curl, const struct work *work)
 		applog(LOG_DEBUG, "DBG: sending RPC call: %s", s);
 
 	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, rpc_url, rpc_userpass, s, false, false);
+	gettimeofday(&tv_start, NULL);
+	val = json_rpc_call(curl, pool->url, pool->userpass, s, false, false,
+			    &switch_to);
+	hist_observe(&rpc_latency[RPC_SUBMIT], usecs_since(&tv_start));
+	pool_result(pool, val != NULL, usecs_since(&tv_start));
+	if (switch_to) {
+		workio_redirect(pool, switch_to);
+		free(switch_to);
+	}
 	if (unlikely(!val)) {
 		applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
 		goto out;
@@ -332,9 +635,20 @@ static bool submit_upstream_work(CURL *curl, const struct work *work)
 
 	applog(LOG_INFO, "PROOF OF WORK RESULT: %s",
 	       json_is_true(res) ? "true (yay!!!)" : "false (booooo)");
-
+	accepted = json_is_true(res);
 	json_decref(val);
 
+verdict:
+	if (accepted)
+		result = SHARE_ACCEPTED;
+	else if (work->gen != work_gen)
+		result = SHARE_STALE;
+	else
+		result = SHARE_REJECTED;
+	stats_share(result);
+	pool_share(pool, result);
+	*result_out = result;
+
 	rc = true;
 
 out:
@@ -345,16 +659,41 @@ out:
 static const char *rpc_req =
 	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
 
-static bool get_upstream_work(CURL *curl, struct work *work)
+static bool get_upstream_work(CURL *curl, struct work *work,
+			      struct pool *pool)
 {
+	char *switch_to;
 	json_t *val;
 	bool rc;
+	struct timeval tv_start;
 
-	val = json_rpc_call(curl, rpc_url, rpc_userpass, rpc_req,
-			    want_longpoll, false);
+	/* merged mining: from the pool's block template */
+	if (merged_mining) {
+		bool new_block;
+
+		rc = merged_get_work(curl, work, pool, &new_block);
+		if (new_block) {
+			applog(LOG_INFO, "merged mining: new block");
+			restart_threads();
+			work->gen = work_gen;
+		}
+		return rc;
+	}
+
+	gettimeofday(&tv_start, NULL);
+	val = json_rpc_call(curl, pool->url, pool->userpass, rpc_req,
+			    want_longpoll, false, &switch_to);
+	hist_observe(&rpc_latency[RPC_GETWORK], usecs_since(&tv_start));
+	pool_result(pool, val != NULL, usecs_since(&tv_start));
+	if (switch_to) {
+		workio_redirect(pool, switch_to);
+		free(switch_to);
+	}
 	if (!val)
 		return false;
 
+	work->pool = pool;
+
 	rc = work_decode(json_object_get(val, "result"), work);
 
 	json_decref(val);
@@ -371,6 +710,9 @@ static void workio_cmd_free(struct workio_cmd *wc)
 	case WC_SUBMIT_WORK:
 		free(wc->u.work);
 		break;
+	case WC_SWITCH_POOL:
+		free(wc->u.pool.userpass);
+		break;
 	default: /* do nothing */
 		break;
 	}
@@ -379,17 +721,61 @@ static void workio_cmd_free(struct workio_cmd *wc)
 	free(wc);
 }
 
+/* Make 'pool' the one we fetch work from; workio thread only */
+static void workio_use_pool(struct pool *pool, bool restart)
+{
+	if (pool == cur_pool)
+		return;
+
+	pthread_mutex_lock(&pool_lock);
+	cur_pool = pool;
+	pool_gen++;
+	have_longpoll = false;	/* pick up the new pool's X-Long-Polling */
+	pthread_mutex_unlock(&pool_lock);
+
+	applog(LOG_INFO, "Switched to pool %d (%s)", pool->id, pool->url);
+
+	/* work from a failed pool cannot be submitted anywhere; work from
+	 * a healthy one still goes back to it, so it may run out
+	 */
+	if (restart)
+		restart_threads();
+}
+
 static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
 {
 	struct work *ret_work;
-	int failures = 0;
+	int failures = 0, tried = 1;
 
 	ret_work = calloc(1, sizeof(*ret_work));
 	if (!ret_work)
 		return false;
 
 	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(curl, ret_work)) {
+	ret_work->gen = work_gen;
+	while (1) {
+		struct pool *pool, *next;
+
+		pool = pool_policy == POOL_FAILOVER ? cur_pool : pool_pick();
+		if (get_upstream_work(curl, ret_work, pool))
+			break;
+
+		/* fail over to the next pool at once, no pause; when
+		 * balancing, the failed pool is simply not picked again,
+		 * but long polling must move off it
+		 */
+		if (tried < n_pools) {
+			tried++;
+			next = pool_next(pool);
+			if (next && pool == cur_pool) {
+				workio_use_pool(next, true);
+				ret_work->gen = work_gen;
+			}
+			if (next)
+				continue;
+		}
+		tried = 1;
+
 		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
 			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
 			free(ret_work);
@@ -402,6 +788,8 @@ static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
 		sleep(opt_fail_pause);
 	}
 
+	journal_block(ret_work);
+
 	/* send work to requesting thread */
 	if (!tq_push(wc->thr->q, ret_work))
 		free(ret_work);
@@ -409,12 +797,61 @@ static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
 	return true;
 }
 
+static void workio_reply(struct workio_cmd *wc, enum share_results result)
+{
+	enum share_results *res;
+
+	if (!wc->reply)
+		return;
+
+	res = malloc(sizeof(*res));
+	if (!res)
+		return;
+	*res = result;
+	if (!tq_push(wc->reply, res))
+		free(res);
+}
+
 static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
 {
-	int failures = 0;
+	enum share_results result;
+	int failures = 0, slot;
+	uint64_t found = wc->u.work->found_us, start = trace_now();
+
+	/* replayed from the journal, a share has no life to trace */
+	if (found)
+		trace_observe(TRACE_SHARE_QUEUE, start - found);
+
+	/* on disk before it goes out; replays are already there */
+	slot = wc->u.work->journal;
+	if (!slot)
+		slot = journal_add(wc->u.work);
+	if (slot < 0) {
+		applog(LOG_INFO, "duplicate share suppressed");
+		workio_reply(wc, SHARE_REJECTED);
+		return true;
+	}
 
 	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(curl, wc->u.work)) {
+	while (!submit_upstream_work(curl, wc->u.work, &result)) {
+		/* journaled, it is resubmitted when the pool is back */
+		if (slot) {
+			applog(LOG_ERR, "share journaled for resubmission");
+			journal_done(slot, false);
+			workio_reply(wc, SHARE_REJECTED);
+			return true;
+		}
+
+		/* a share is only good at the pool it came from; don't hold
+		 * up work for everyone else waiting for a dead one
+		 */
+		if (n_pools > 1 && !wc->u.work->pool->alive) {
+			applog(LOG_ERR, "pool %d down, share discarded",
+			       wc->u.work->pool->id);
+			workio_reply(wc, SHARE_REJECTED);
+			return true;
+		}
+
 		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
 			applog(LOG_ERR, "...terminating workio thread");
 			return false;
@@ -426,6 +863,55 @@ static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
 		sleep(opt_fail_pause);
 	}
 
+	journal_done(slot, true);
+	if (found) {
+		trace_span(TRACE_SHARE_SUBMIT, start, trace_now(), NULL);
+		trace_share(found, result);
+	}
+	workio_reply(wc, result);
+	return true;
+}
+
+static bool workio_switch_pool(struct workio_cmd *wc)
+{
+	struct pool *pool = wc->u.pool.pool;
+	char *old_userpass = NULL;
+
+	if (wc->u.pool.userpass) {
+		pthread_mutex_lock(&pool_lock);
+		old_userpass = pool->userpass;
+		pool->userpass = wc->u.pool.userpass;
+		wc->u.pool.userpass = NULL;
+		pthread_mutex_unlock(&pool_lock);
+		free(old_userpass);
+	}
+
+	workio_use_pool(pool, wc->u.pool.restart);
+	return true;
+}
+
+/* Ask the workio thread to move to 'pool' between requests, optionally
+ * replacing its credentials ('userpass' may be NULL).
+ */
+bool pool_switch(struct pool *pool, const char *userpass, bool restart)
+{
+	struct workio_cmd *wc;
+
+	wc = calloc(1, sizeof(*wc));
+	if (!wc)
+		return false;
+
+	wc->cmd = WC_SWITCH_POOL;
+	wc->u.pool.pool = pool;
+	wc->u.pool.restart = restart;
+	if (userpass)
+		wc->u.pool.userpass = strdup(userpass);
+	if ((userpass && !wc->u.pool.userpass) ||
+	    !tq_push(thr_info[work_thr_id].q, wc)) {
+		workio_cmd_free(wc);
+		return false;
+	}
+
 	return true;
 }
 
@@ -440,6 +926,7 @@ static void *workio_thread(void *userdata)
 		applog(LOG_ERR, "CURL initialization failed");
 		return NULL;
 	}
+	trace_thread("workio");
 
 	while (ok) {
 		struct workio_cmd *wc;
@@ -459,6 +946,9 @@ static void *workio_thread(void *userdata)
 		case WC_SUBMIT_WORK:
 			ok = workio_submit_work(wc, curl);
 			break;
+		case WC_SWITCH_POOL:
+			ok = workio_switch_pool(wc);
+			break;
 
 		default:		/* should never happen */
 			ok = false;
@@ -478,21 +968,69 @@ static void hashmeter(int thr_id, const struct timeval *diff,
 		      unsigned long hashes_done)
 {
 	double khashes, secs;
+	char perf[160];
 
 	khashes = hashes_done / 1000.0;
 	secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
 
-	if (!opt_quiet)
+	thr_info[thr_id].khashes = khashes / secs;
+
+	/* the stats reporter summarizes; keep per-scan lines for debug */
+	if (opt_quiet || (opt_stats_interval && !opt_debug))
+		return;
+
+	if (opt_benchmark && thr_info[thr_id].cpu >= 0)
+		applog(LOG_INFO, "thread %d (cpu %d): %lu hashes, %.2f khash/sec",
+		       thr_id, thr_info[thr_id].cpu, hashes_done,
+		       khashes / secs);
+	else
 		applog(LOG_INFO, "thread %d: %lu hashes, %.2f khash/sec",
 		       thr_id, hashes_done,
 		       khashes / secs);
+
+	if (perf_scan_summary(thr_id, perf, sizeof(perf)))
+		applog(LOG_INFO, "thread %d: %s", thr_id, perf);
 }
 
-static bool get_work(struct thr_info *thr, struct work *work)
+/* Dummy work for --benchmark: an all-zero header, correctly padded */
+void benchmark_work(struct work *work)
+{
+	uint32_t *data32 = (uint32_t *) work->data;
+	uint32_t *hash1_32 = (uint32_t *) work->hash1;
+
+	memset(work, 0, sizeof(*work));
+	memcpy(work->midstate, sha256_init_state, sizeof(work->midstate));
+	data32[20] = 0x80000000;
+	data32[31] = 0x00000280;
+	hash1_32[8] = 0x80000000;
+	hash1_32[15] = 0x00000100;
+}
+
+bool get_work(struct thr_info *thr, struct work *work)
 {
 	struct workio_cmd *wc;
 	struct work *work_heap;
 
+	if (opt_benchmark) {
+		benchmark_work(work);
+		return true;
+	}
+
+	if (opt_work_file) {
+		if (!workfile_get_work(thr->id, work))
+			return false;
+		work->gen = work_gen;
+		return true;
+	}
+
+	/* cluster worker: the coordinator leases us work instead */
+	if (opt_cluster_join) {
+		if (!cluster_get_work(work))
+			return false;
+		work->gen = work_gen;
+		return true;
+	}
+
 	/* fill out work request message */
 	wc = calloc(1, sizeof(*wc));
 	if (!wc)
@@ -523,6 +1061,15 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
 
+	if (opt_work_file)
+		return workfile_submit(work_in);
+	if (opt_cluster_join)
+		return cluster_submit(work_in);
+
+	/* no chain wants a hash above both targets */
+	if (merged_mining && !merged_check(work_in))
+		return true;
+
 	/* fill out work request message */
 	wc = calloc(1, sizeof(*wc));
 	if (!wc)
@@ -547,11 +1094,184 @@ err_out:
 	return false;
 }
 
+/* Submit a share and wait for the pool's verdict */
+bool submit_work_sync(const struct work *work_in, enum share_results *result)
+{
+	struct workio_cmd *wc;
+	enum share_results *res;
+	struct thread_q *reply;
+
+	reply = tq_new();
+	if (!reply)
+		return false;
+
+	wc = calloc(1, sizeof(*wc));
+	if (!wc)
+		goto err_out;
+
+	wc->u.work = malloc(sizeof(*work_in));
+	if (!wc->u.work)
+		goto err_out;
+
+	wc->cmd = WC_SUBMIT_WORK;
+	wc->reply = reply;
+	memcpy(wc->u.work, work_in, sizeof(*work_in));
+
+	if (!tq_push(thr_info[work_thr_id].q, wc))
+		goto err_out;
+
+	res = tq_pop(reply, NULL);
+	tq_free(reply);
+	if (!res)
+		return false;
+	*result = *res;
+	free(res);
+	return true;
+
+err_out:
+	workio_cmd_free(wc);
+	tq_free(reply);
+	return false;
+}
+
+/* Park or unpark a miner thread for 'reason'.  A thread runs only while
+ * no reason holds it; parking cuts its current scan short, except for a
+ * header from a work file, which could not be picked up again part way.
+ */
+void thread_park(int thr_id, unsigned int reason, bool park)
+{
+	struct thr_info *thr = &thr_info[thr_id];
+
+	pthread_mutex_lock(&park_lock);
+	if (park)
+		thr->park_mask |= reason;
+	else
+		thr->park_mask &= ~reason;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+
+	if (park && !opt_work_file)
+		work_restart[thr_id].restart = 1;
+}
+
+static void wait_unparked(struct thr_info *thr)
+{
+	if (likely(!thr->park_mask))
+		return;
+
+	pthread_mutex_lock(&park_lock);
+	while (thr->park_mask)
+		pthread_cond_wait(&park_cond, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+}
+
+/* Scan nonces of 'work' with kernel 'algo', up to about max_nonce:
+ * 1 if a proof-of-work hash was found, 0 if not, -1 for no such kernel
+ */
+int scan_work(int algo, int thr_id, struct work *work, void *scratchbuf,
+	      uint32_t max_nonce, unsigned long *hashes_done)
+{
+	bool rc;
+
+	switch (algo) {
+	case ALGO_C:
+		rc = scanhash_c(thr_id, work->midstate, work->data + 64,
+			        work->hash, work->target,
+				max_nonce, hashes_done);
+		break;
+
+	case ALGO_C_ILP:
+		rc = scanhash_c_ilp(thr_id, work->midstate, work->data + 64,
+				    work->hash, work->target,
+				    max_nonce, hashes_done);
+		break;
+
+#ifdef WANT_X8664_SSE2
+	case ALGO_SSE2_64: {
+		unsigned int rc5 =
+		        scanhash_sse2_64(thr_id, work->midstate, work->data + 64,
+					 work->hash1, work->hash,
+					 work->target,
+				         max_nonce, hashes_done);
+		rc = (rc5 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_SSE2_4WAY
+	case ALGO_4WAY: {
+		unsigned int rc4 =
+			ScanHash_4WaySSE2(thr_id, work->midstate, work->data + 64,
+					  work->hash1, work->hash,
+					  work->target,
+					  max_nonce, hashes_done);
+		rc = (rc4 == -1) ? false : true;
+		}
+		break;
+#endif
+
+#ifdef WANT_VIA_PADLOCK
+	case ALGO_VIA:
+		rc = scanhash_via(thr_id, work->data, work->target,
+				  max_nonce, hashes_done);
+		break;
+#endif
+	case ALGO_CRYPTOPP:
+		rc = scanhash_cryptopp(thr_id, work->midstate, work->data + 64,
+			        work->hash, work->target,
+				max_nonce, hashes_done);
+		break;
+
+#ifdef WANT_CRYPTOPP_ASM32
+	case ALGO_CRYPTOPP_ASM32:
+		rc = scanhash_asm32(thr_id, work->midstate, work->data + 64,
+			        work->hash, work->target,
+				max_nonce, hashes_done);
+		break;
+#endif
+
+#ifdef WANT_SHA256_VEC
+	case ALGO_VEC4:
+		rc = scanhash_vec4(thr_id, work->midstate, work->data + 64,
+				   work->hash, work->target,
+				   max_nonce, hashes_done);
+		break;
+	case ALGO_VEC8:
+		rc = scanhash_vec8(thr_id, work->midstate, work->data + 64,
+				   work->hash, work->target,
+				   max_nonce, hashes_done);
+		break;
+	case ALGO_VEC16:
+		rc = scanhash_vec16(thr_id, work->midstate, work->data + 64,
+				    work->hash, work->target,
+				    max_nonce, hashes_done);
+		break;
+#endif
+
+#ifdef WANT_SCRYPT
+	case ALGO_SCRYPT:
+		rc = scanhash_scrypt(thr_id, work->data, scratchbuf,
+				     work->hash, work->target,
+				     max_nonce, hashes_done);
+		break;
+#endif
+
+	default:
+		return -1;
+	}
+
+	return rc ? 1 : 0;
+}
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
 	int thr_id = mythr->id;
 	uint32_t max_nonce = 0xffffff;
+	unsigned long seen_gen = work_gen;
+	struct work *work;
+	void *scratchbuf = NULL;
+	char trace_args[64];
 
 	/* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
 	 * and if that fails, then SCHED_BATCH. No need for this to be an
@@ -559,187 +1279,295 @@ static void *miner_thread(void *userdata)
 	setpriority(PRIO_PROCESS, 0, 19);
 	drop_policy();
 
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (!(opt_n_threads % num_processors))
-		affine_to_cpu(mythr->id, mythr->id % num_processors);
+	if (mythr->cpu >= 0)
+		affine_to_cpu(mythr->id, mythr->cpu);
+	perf_thread_start(thr_id);
+
+	/* allocate after binding, so the work copy lands on our node */
+	work = topo_alloc_local(sizeof(*work));
+	if (!work) {
+		applog(LOG_ERR, "thread %d work allocation failed", thr_id);
+		goto out;
+	}
+	if (opt_scrypt) {
+		/* a thousand times slower than sha256d */
+		max_nonce = 0xffff;
+		scratchbuf = topo_alloc_huge(scrypt_scratch_size());
+		if (!scratchbuf) {
+			applog(LOG_ERR, "thread %d scrypt scratchpad allocation "
+			       "failed", thr_id);
+			goto out;
+		}
+	}
+	/* on hybrid CPUs, sized to our core class */
+	if (mythr->max_nonce)
+		max_nonce = mythr->max_nonce;
+
+	snprintf(trace_args, sizeof(trace_args), "miner %d", thr_id);
+	trace_thread(trace_args);
 
 	while (1) {
-		struct work work __attribute__((aligned(128)));
 		unsigned long hashes_done;
 		struct timeval tv_start, tv_end, diff;
-		uint64_t max64;
-		bool rc;
+		uint64_t max64, usecs, trace_start;
+		int algo, found;
+
+		/* a thread waking from park did not take part in any restart */
+		if (unlikely(mythr->park_mask)) {
+			wait_unparked(mythr);
+			seen_gen = work_gen;
+		}
 
 		/* obtain new work from internal workio thread */
-		if (unlikely(!get_work(mythr, &work))) {
-			applog(LOG_ERR, "work retrieval failed, exiting "
-				"mining thread %d", mythr->id);
+		gettimeofday(&tv_start, NULL);
+		trace_start = trace_now();
+		if (unlikely(!get_work(mythr, work))) {
+			/* the normal end of a work file */
+			if (!opt_work_file)
+				applog(LOG_ERR, "work retrieval failed, exiting "
+					"mining thread %d", mythr->id);
 			goto out;
 		}
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		stats_add(&thr_stats[thr_id].wait_usecs,
+			  diff.tv_sec * 1000000ULL + diff.tv_usec);
+		trace_span(TRACE_GET_WORK, trace_start, trace_now(), NULL);
 
 		hashes_done = 0;
 		gettimeofday(&tv_start, NULL);
-
-		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
-		case ALGO_C:
-			rc = scanhash_c(thr_id, work.midstate, work.data + 64,
-				        work.hash, work.target,
-					max_nonce, &hashes_done);
-			break;
-
-#ifdef WANT_X8664_SSE2
-		case ALGO_SSE2_64: {
-			unsigned int rc5 =
-			        scanhash_sse2_64(thr_id, work.midstate, work.data + 64,
-						 work.hash1, work.hash,
-						 work.target,
-					         max_nonce, &hashes_done);
-			rc = (rc5 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_SSE2_4WAY
-		case ALGO_4WAY: {
-			unsigned int rc4 =
-				ScanHash_4WaySSE2(thr_id, work.midstate, work.data + 64,
-						  work.hash1, work.hash,
-						  work.target,
-						  max_nonce, &hashes_done);
-			rc = (rc4 == -1) ? false : true;
-			}
-			break;
-#endif
-
-#ifdef WANT_VIA_PADLOCK
-		case ALGO_VIA:
-			rc = scanhash_via(thr_id, work.data, work.target,
-					  max_nonce, &hashes_done);
-			break;
-#endif
-		case ALGO_CRYPTOPP:
-			rc = scanhash_cryptopp(thr_id, work.midstate, work.data + 64,
-				        work.hash, work.target,
-					max_nonce, &hashes_done);
-			break;
-
-#ifdef WANT_CRYPTOPP_ASM32
-		case ALGO_CRYPTOPP_ASM32:
-			rc = scanhash_asm32(thr_id, work.midstate, work.data + 64,
-				        work.hash, work.target,
-					max_nonce, &hashes_done);
-			break;
-#endif
-
-		default:
-			/* should never happen */
-			goto out;
+		trace_start = trace_now();
+
+		/* first scan of a new block: how long did the switch take? */
+		if (unlikely(work->gen != seen_gen)) {
+			uint64_t now = tv_start.tv_sec * 1000000ULL +
+				       tv_start.tv_usec;
+			uint64_t at = stats_read(&restart_usecs);
+
+			seen_gen = work->gen;
+			usecs = now > at ? now - at : 0;
+			hist_observe(&restart_latency, usecs);
+			trace_observe(TRACE_RESTART, usecs);
 		}
 
+		/* a header from a file gets the whole nonce range, as the
+		 * kernels cannot pick up where a scan left off
+		 */
+		if (opt_work_file)
+			max_nonce = 0xfffffffa;
+
+		/* scan nonces for a proof-of-work hash; the kernel may be
+		 * swapped at runtime, taking effect here
+		 */
+		algo = mythr->algo;
+		perf_scan_begin(thr_id);
+		found = scan_work(algo, thr_id, work, scratchbuf, max_nonce,
+				  &hashes_done);
+		perf_scan_end(thr_id, algo, hashes_done);
+		if (unlikely(found < 0))
+			goto out;	/* should never happen */
+
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
 		timeval_subtract(&diff, &tv_end, &tv_start);
+		if (trace_active)
+			snprintf(trace_args, sizeof(trace_args),
+				 "{\"algo\":\"%s\",\"hashes\":%lu}",
+				 algo_names[algo], hashes_done);
+		trace_span(TRACE_SCAN, trace_start, trace_now(),
+			   trace_active ? trace_args : NULL);
 
 		hashmeter(thr_id, &diff, hashes_done);
-
-		/* adjust max_nonce to meet target scan time */
-		if (diff.tv_usec > 500000)
-			diff.tv_sec++;
-		if (diff.tv_sec > 0) {
-			max64 =
-			   ((uint64_t)hashes_done * opt_scantime) / diff.tv_sec;
+		stats_add(&thr_stats[thr_id].hashes, hashes_done);
+		stats_add(&thr_stats[thr_id].scan_usecs,
+			  diff.tv_sec * 1000000ULL + diff.tv_usec);
+
+		/* space restart checks to this rate */
+		tune_observe(thr_id, algo, hashes_done,
+			     diff.tv_sec * 1000000ULL + diff.tv_usec);
+
+		/* adjust max_nonce to meet target scan time; use usec
+		 * resolution, so a scan cut short by a restart or park does
+		 * not collapse the estimate
+		 */
+		usecs = diff.tv_sec * 1000000ULL + diff.tv_usec;
+		if (usecs > 0) {
+			max64 = ((uint64_t)hashes_done * opt_scantime *
+				 1000000ULL) / usecs;
 			if (max64 > 0xfffffffaULL)
 				max64 = 0xfffffffaULL;
+			if (max64 < (opt_scrypt ? 0x100ULL : 0x10000ULL))
+				max64 = opt_scrypt ? 0x100ULL : 0x10000ULL;
 			max_nonce = max64;
 		}
 
 		/* if nonce found, submit work */
-		if (rc && !submit_work(mythr, &work))
+		if (found)
+			work->found_us = trace_now();
+		if (found && !opt_benchmark && !submit_work(mythr, work))
 			break;
 	}
 
 out:
+	if (scratchbuf)
+		topo_free_huge(scratchbuf, scrypt_scratch_size());
+	topo_free_local(work, sizeof(*work));
 	tq_freeze(mythr->q);
 
 	return NULL;
 }
 
-static void restart_threads(void)
+/* Run only as many threads as the cgroup quota and cpuset allow */
+static void cgroup_apply(int limit, bool log)
 {
+	int i, active;
+
+	active = (limit > 0 && limit < opt_n_threads) ? limit : opt_n_threads;
+	for (i = 0; i < opt_n_threads; i++)
+		thread_park(i, PARK_QUOTA, i >= active);
+
+	if (log)
+		applog(LOG_INFO, "cgroup limit %d cpus: running %d of %d "
+		       "miner threads", limit, active, opt_n_threads);
+}
+
+static void *cgroup_thread(void *userdata)
+{
+	int limit = cgroup_cpu_limit();
+
+	while (1) {
+		int new_limit;
+
+		sleep(opt_cgroup_recheck);
+
+		new_limit = cgroup_cpu_limit();
+		if (new_limit != limit) {
+			limit = new_limit;
+			cgroup_apply(limit, true);
+		}
+	}
+
+	return NULL;
+}
+
+void restart_threads(void)
+{
+	struct timeval tv;
 	int i;
 
+	gettimeofday(&tv, NULL);
+	__sync_lock_test_and_set(&restart_usecs,
+				 tv.tv_sec * 1000000ULL + tv.tv_usec);
+	trace_instant("new block");
+	work_gen++;
 	for (i = 0; i < opt_n_threads; i++)
 		work_restart[i].restart = 1;
+
+	proxy_restart();
+	cluster_restart();
 }
 
-static void *longpoll_thread(void *userdata)
+/* Long-poll URL from an X-Long-Polling value; caller holds pool_lock */
+static char *longpoll_url(const char *hdr_path)
 {
-	struct thr_info *mythr = userdata;
-	CURL *curl = NULL;
-	char *copy_start, *hdr_path, *lp_url = NULL;
+	const char *copy_start, *rpc_url = cur_pool->url;
 	bool need_slash = false;
-	int failures = 0;
-
-	hdr_path = tq_pop(mythr->q, NULL);
-	if (!hdr_path)
-		goto out;
+	char *lp_url;
 
 	/* full URL */
-	if (strstr(hdr_path, "://")) {
-		lp_url = hdr_path;
-		hdr_path = NULL;
-	}
-	
+	if (strstr(hdr_path, "://"))
+		return strdup(hdr_path);
+
 	/* absolute path, on current server */
-	else {
-		copy_start = (*hdr_path == '/') ? (hdr_path + 1) : hdr_path;
-		if (rpc_url[strlen(rpc_url) - 1] != '/')
-			need_slash = true;
+	copy_start = (*hdr_path == '/') ? (hdr_path + 1) : hdr_path;
+	if (rpc_url[strlen(rpc_url) - 1] != '/')
+		need_slash = true;
 
-		lp_url = malloc(strlen(rpc_url) + strlen(copy_start) + 2);
-		if (!lp_url)
-			goto out;
+	lp_url = malloc(strlen(rpc_url) + strlen(copy_start) + 2);
+	if (!lp_url)
+		return NULL;
 
-		sprintf(lp_url, "%s%s%s", rpc_url, need_slash ? "/" : "", copy_start);
-	}
+	sprintf(lp_url, "%s%s%s", rpc_url, need_slash ? "/" : "", copy_start);
+	return lp_url;
+}
 
-	applog(LOG_INFO, "Long-polling activated for %s", lp_url);
+static void *longpoll_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	CURL *curl = NULL;
+	char *hdr_path, *lp_url = NULL, *userpass = NULL;
+	int failures = 0;
 
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
 		applog(LOG_ERR, "CURL initialization failed");
 		goto out;
 	}
+	trace_thread("longpoll");
+
+	/* a pool switch sends us back here, for the new pool's header */
+	while ((hdr_path = tq_pop(mythr->q, NULL)) != NULL) {
+		unsigned long lp_pool;
+
+		pthread_mutex_lock(&pool_lock);
+		lp_pool = pool_gen;
+		lp_url = longpoll_url(hdr_path);
+		userpass = strdup(cur_pool->userpass);
+		pthread_mutex_unlock(&pool_lock);
+		free(hdr_path);
+		if (!lp_url || !userpass)
+			goto out;
 
-	while (1) {
-		json_t *val;
-
-		val = json_rpc_call(curl, lp_url, rpc_userpass, rpc_req,
-				    false, true);
-		if (likely(val)) {
-			failures = 0;
-			json_decref(val);
+		applog(LOG_INFO, "Long-polling activated for %s", lp_url);
+
+		while (lp_pool == pool_gen) {
+			struct timeval tv_start;
+			json_t *val;
+
+			gettimeofday(&tv_start, NULL);
+			val = json_rpc_call(curl, lp_url, userpass, rpc_req,
+					    false, true, NULL);
+			hist_observe(&rpc_latency[RPC_LONGPOLL],
+				     usecs_since(&tv_start));
+			if (lp_pool != pool_gen) {
+				/* the old pool's news is no concern of ours */
+				if (val)
+					json_decref(val);
+				break;
+			}
+			if (likely(val)) {
+				failures = 0;
+				json_decref(val);
 
-			applog(LOG_INFO, "LONGPOLL detected new block");
-			restart_threads();
-		} else {
-			if (failures++ < 10) {
-				sleep(30);
-				applog(LOG_ERR,
-					"longpoll failed, sleeping for 30s");
+				applog(LOG_INFO, "LONGPOLL detected new block");
+				restart_threads();
 			} else {
-				applog(LOG_ERR,
-					"longpoll failed, ending thread");
-				goto out;
+				if (failures++ < 10) {
+					int secs;
+
+					applog(LOG_ERR,
+						"longpoll failed, sleeping for 30s");
+					/* unless the pool fails over meanwhile */
+					for (secs = 0; secs < 30 &&
+					     lp_pool == pool_gen; secs++)
+						sleep(1);
+				} else {
+					applog(LOG_ERR,
+						"longpoll failed, ending thread");
+					goto out;
+				}
 			}
 		}
+
+		free(lp_url);
+		free(userpass);
+		lp_url = userpass = NULL;
+		failures = 0;
 	}
 
 out:
-	free(hdr_path);
 	free(lp_url);
+	free(userpass);
 	tq_freeze(mythr->q);
 	if (curl)
 		curl_easy_cleanup(curl);
@@ -763,21 +1591,28 @@ static void show_usage(void)
 	exit(1);
 }
 
+static bool cli_url_given;
+
+/* Credentials on the command line apply to the latest --url */
+static struct pool *cli_pool(void)
+{
+	if (!n_pools && !pool_add(DEF_RPC_URL, NULL))
+		exit(1);
+	return &pools[n_pools - 1];
+}
+
 static void parse_arg (int key, char *arg)
 {
+	struct pool *pool;
 	int v, i;
 
 	switch(key) {
 	case 'a':
-		for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
-			if (algo_names[i] &&
-			    !strcmp(arg, algo_names[i])) {
-				opt_algo = i;
-				break;
-			}
-		}
-		if (i == ARRAY_SIZE(algo_names))
+		i = algo_parse(arg);
+		if (i < 0)
 			show_usage();
+		opt_algo = i;
+		opt_scrypt = algo_is_scrypt(i);
 		break;
 	case 'c': {
 		json_error_t err;
@@ -801,8 +1636,9 @@ static void parse_arg (int key, char *arg)
 		opt_debug = true;
 		break;
 	case 'p':
-		free(rpc_pass);
-		rpc_pass = strdup(arg);
+		pool = cli_pool();
+		free(pool->pass);
+		pool->pass = strdup(arg);
 		break;
 	case 'P':
 		opt_protocol = true;
@@ -836,23 +1672,57 @@ static void parse_arg (int key, char *arg)
 		opt_n_threads = v;
 		break;
 	case 'u':
-		free(rpc_user);
-		rpc_user = strdup(arg);
+		pool = cli_pool();
+		free(pool->user);
+		pool->user = strdup(arg);
 		break;
 	case 1001:			/* --url */
 		if (strncmp(arg, "http://", 7) &&
 		    strncmp(arg, "https://", 8))
 			show_usage();
 
-		free(rpc_url);
-		rpc_url = strdup(arg);
+		/* the first --url replaces the default */
+		if (n_pools == 1 && !cli_url_given) {
+			free(pools[0].url);
+			pools[0].url = strdup(arg);
+		} else if (!pool_add(arg, NULL))
+			show_usage();
+		cli_url_given = true;
 		break;
 	case 1002:			/* --userpass */
 		if (!strchr(arg, ':'))
 			show_usage();
 
-		free(rpc_userpass);
-		rpc_userpass = strdup(arg);
+		pool = cli_pool();
+		free(pool->userpass);
+		pool->userpass = strdup(arg);
+		break;
+	case 1014:			/* --pool-probe */
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_pool_probe = v;
+		break;
+	case 1016:			/* --pool-balance */
+		i = pool_policy_parse(arg);
+		if (i < 0)
+			show_usage();
+		pool_policy = i;
+		break;
+	case 1017:			/* --pool-weight */
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage();
+
+		cli_pool()->weight = v;
+		break;
+	case 1015:			/* --timeout */
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_timeout = v;
 		break;
 	case 1003:
 		want_longpoll = false;
@@ -860,18 +1730,238 @@ static void parse_arg (int key, char *arg)
 	case 1004:
 		use_syslog = true;
 		break;
+	case 1005:
+		opt_benchmark = true;
+		want_longpoll = false;
+		break;
+	case 1006: {			/* --cpu-affinity */
+		int cpus[MAX_CPUS];
+
+		if (cpulist_parse(arg, cpus, MAX_CPUS) <= 0) {
+			applog(LOG_ERR, "Invalid cpu list '%s'", arg);
+			show_usage();
+		}
+		if (cli_cpu_policy_given) {
+			applog(LOG_ERR, "--cpu-affinity and --cpu-policy "
+			       "cannot be combined");
+			exit(1);
+		}
+		free(opt_cpu_list);
+		opt_cpu_list = strdup(arg);
+		opt_cpu_policy = CPU_POLICY_LIST;
+		break;
+	}
+	case 1008:			/* --cgroup-recheck */
+		v = atoi(arg);
+		if (v < 0 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_cgroup_recheck = v;
+		break;
+	case 1011:			/* --stats-interval */
+		v = atoi(arg);
+		if (v < 0 || v > 9999)	/* sanity check */
+			show_usage();
+
+		opt_stats_interval = v;
+		break;
+	case 1013:			/* --api-port */
+		v = atoi(arg);
+		if (v < 1 || v > 65535)	/* sanity check */
+			show_usage();
+
+		opt_api_port = v;
+		break;
+	case 1018:			/* --proxy-port */
+		v = atoi(arg);
+		if (v < 1 || v > 65535)	/* sanity check */
+			show_usage();
+
+		opt_proxy_port = v;
+		break;
+	case 1019:			/* --proxy-bind */
+		free(opt_proxy_bind);
+		opt_proxy_bind = strdup(arg);
+		break;
+	case 1020:			/* --proxy-roll */
+		v = atoi(arg);
+		if (v < 1 || v > 7200)	/* sanity check */
+			show_usage();
+
+		opt_proxy_roll = v;
+		break;
+	case 1021:			/* --cluster-listen */
+		free(opt_cluster_listen);
+		opt_cluster_listen = strdup(arg);
+		break;
+	case 1022:			/* --cluster-join */
+		free(opt_cluster_join);
+		opt_cluster_join = strdup(arg);
+		want_longpoll = false;	/* the coordinator pushes blocks */
+		break;
+	case 1023:			/* --share-journal */
+		free(opt_share_journal);
+		opt_share_journal = strdup(arg);
+		break;
+	case 1024:			/* --record */
+		free(opt_record);
+		opt_record = strdup(arg);
+		break;
+	case 1025:			/* --work-file */
+		free(opt_work_file);
+		opt_work_file = strdup(arg);
+		want_longpoll = false;
+		break;
+	case 1026:			/* --work-out */
+		free(opt_work_out);
+		opt_work_out = strdup(arg);
+		break;
+	case 1027:			/* --log-format */
+		i = log_format_parse(arg);
+		if (i < 0)
+			show_usage();
+		log_format = i;
+		break;
+	case 1028:			/* --log-rate */
+		v = atoi(arg);
+		if (v < 0 || v > 1000000)	/* sanity check */
+			show_usage();
+
+		log_rate = v;
+		break;
+	case 1029:			/* --aux-url */
+		free(opt_aux_url);
+		opt_aux_url = strdup(arg);
+		want_longpoll = false;
+		break;
+	case 1030:			/* --aux-userpass */
+		free(opt_aux_userpass);
+		opt_aux_userpass = strdup(arg);
+		break;
+	case 1031:			/* --coinbase-script */
+		free(opt_coinbase_script);
+		opt_coinbase_script = strdup(arg);
+		break;
+	case 1032:			/* --tune */
+		opt_tune = true;
+		break;
+	case 1033:			/* --restart-budget */
+		v = atoi(arg);
+		if (v < 0 || v > 10000000)	/* sanity check */
+			show_usage();
+
+		restart_budget = v;
+		break;
+	case 1035: {			/* --class-algo */
+		const char *p = arg;
+		char name[32];
+
+		opt_n_class_algo = 0;
+		do {
+			size_t len = strcspn(p, ",");
+
+			if (opt_n_class_algo == MAX_CLASSES ||
+			    len >= sizeof(name))
+				show_usage();
+			memcpy(name, p, len);
+			name[len] = 0;
+			i = len ? algo_parse(name) : -1;
+			if (len && i < 0)
+				show_usage();
+			opt_class_algo[opt_n_class_algo++] = i;
+			p += len;
+		} while (*p++);
+		break;
+	}
+	case 1034:			/* --smt-algo */
+		i = algo_parse(arg);
+		if (i < 0)
+			show_usage();
+		opt_smt_algo = i;
+		break;
+	case 1036:			/* --trace */
+		free(opt_trace);
+		opt_trace = strdup(arg);
+		break;
+	case 1037:			/* --perf */
+		opt_perf = true;
+		break;
+	case 1038:			/* --api-token */
+		free(opt_api_token);
+		opt_api_token = strdup(arg);
+		break;
+	case 1012:			/* --metrics-port */
+		v = atoi(arg);
+		if (v < 1 || v > 65535)	/* sanity check */
+			show_usage();
+
+		opt_metrics_port = v;
+		break;
+	case 1009: {			/* --cotenant */
+		double d = atof(arg);
+		if (d <= 0.0 || d > 100.0)	/* sanity check */
+			show_usage();
+
+		opt_cotenant = d;
+		break;
+	}
+	case 1010:
+		opt_cotenant_smt = true;
+		break;
+	case 1007:			/* --cpu-policy */
+		v = cpu_policy_parse(arg);
+		if (v < 0 || v == CPU_POLICY_LIST)
+			show_usage();
+		if (opt_cpu_policy == CPU_POLICY_LIST) {
+			applog(LOG_ERR, "--cpu-affinity and --cpu-policy "
+			       "cannot be combined");
+			exit(1);
+		}
+		opt_cpu_policy = v;
+		cli_cpu_policy_given = true;
+		break;
 	default:
 		show_usage();
 	}
+}
 
-#ifdef WIN32
-	if (!opt_n_threads)
-		opt_n_threads = 1;
-#else
-	num_processors = sysconf(_SC_NPROCESSORS_ONLN);
-	if (!opt_n_threads)
-		opt_n_threads = num_processors;
-#endif /* !WIN32 */
+/* "pools": [ { "url": ..., "user": ..., "pass": ... }, ... ] */
+static void parse_config_pools(json_t *arr)
+{
+	static const struct {
+		const char	*name;
+		int		key;
+	} keys[] = {
+		{ "url", 1001 },	/* first: starts a new pool */
+		{ "userpass", 1002 },
+		{ "user", 'u' },
+		{ "pass", 'p' },
+		{ "weight", 1017 },
+	};
+	int i, k;
+
+	for (i = 0; i < json_array_size(arr); i++) {
+		json_t *obj = json_array_get(arr, i);
+
+		if (!json_is_string(json_object_get(obj, "url"))) {
+			applog(LOG_ERR, "JSON pool %d has no url", i);
+			continue;
+		}
+		for (k = 0; k < ARRAY_SIZE(keys); k++) {
+			json_t *v = json_object_get(obj, keys[k].name);
+			char s[512];
+
+			if (json_is_integer(v))
+				snprintf(s, sizeof(s), "%d",
+					 (int) json_integer_value(v));
+			else if (json_is_string(v))
+				snprintf(s, sizeof(s), "%s",
+					 json_string_value(v));
+			else
+				continue;
+			parse_arg(keys[k].key, s);
+		}
+	}
 }
 
 static void parse_config(void)
@@ -882,6 +1972,10 @@ static void parse_config(void)
 	if (!json_is_object(opt_config))
 		return;
 
+	val = json_object_get(opt_config, "pools");
+	if (json_is_array(val))
+		parse_config_pools(val);
+
 	for (i = 0; i < ARRAY_SIZE(options); i++) {
 		if (!options[i].name)
 			break;
@@ -924,24 +2018,56 @@ static void parse_cmdline(int argc, char *argv[])
 int main (int argc, char *argv[])
 {
 	struct thr_info *thr;
-	int i;
-
-	rpc_url = strdup(DEF_RPC_URL);
+	pthread_t cg_thread;
+	int i, cg_limit = 0, smt_paired = 0;
 
 	/* parse command line */
 	parse_cmdline(argc, argv);
 
-	if (!rpc_userpass) {
-		if (!rpc_user || !rpc_pass) {
-			applog(LOG_ERR, "No login credentials supplied");
+	if (!topo_init(opt_cpu_policy, opt_cpu_list))
+		return 1;
+	if (!opt_n_threads) {
+		opt_n_threads = topo_default_threads();
+		auto_threads = cgroup_init();
+		if (auto_threads)
+			cg_limit = cgroup_cpu_limit();
+	}
+
+	cli_pool();
+	if (opt_work_file &&
+	    (opt_benchmark || opt_proxy_port || opt_cluster_listen ||
+	     opt_cluster_join)) {
+		applog(LOG_ERR, "--work-file cannot be combined with "
+		       "--benchmark, --proxy-port or --cluster-*");
+		return 1;
+	}
+
+	if (opt_aux_url &&
+	    (opt_benchmark || opt_work_file || opt_cluster_join || opt_scrypt)) {
+		applog(LOG_ERR, "--aux-url cannot be combined with "
+		       "--benchmark, --work-file, --cluster-join or scrypt");
+		return 1;
+	}
+
+	if (opt_smt_algo >= 0 && (opt_scrypt || algo_is_scrypt(opt_smt_algo))) {
+		applog(LOG_ERR, "--smt-algo cannot be combined with scrypt");
+		return 1;
+	}
+
+	for (i = 0; i < opt_n_class_algo; i++) {
+		if (opt_class_algo[i] >= 0 &&
+		    algo_is_scrypt(opt_class_algo[i]) != opt_scrypt) {
+			applog(LOG_ERR, "--class-algo cannot mix scrypt and "
+			       "SHA256 kernels");
 			return 1;
 		}
-		rpc_userpass = malloc(strlen(rpc_user) + strlen(rpc_pass) + 2);
-		if (!rpc_userpass)
-			return 1;
-		sprintf(rpc_userpass, "%s:%s", rpc_user, rpc_pass);
 	}
 
+	if (!pool_finalize(!opt_benchmark && !opt_cluster_join &&
+			   !opt_work_file))
+		return 1;
+	cur_pool = &pools[0];
+
 	pthread_mutex_init(&time_lock, NULL);
 
 #ifdef HAVE_SYSLOG_H
@@ -949,6 +2075,10 @@ int main (int argc, char *argv[])
 		openlog("cpuminer", LOG_PID, LOG_USER);
 #endif
 
+	/* from here on, logging never blocks the caller */
+	if (!log_start())
+		return 1;
+
 	work_restart = calloc(opt_n_threads, sizeof(*work_restart));
 	if (!work_restart)
 		return 1;
@@ -957,6 +2087,25 @@ int main (int argc, char *argv[])
 	if (!thr_info)
 		return 1;
 
+	if (!stats_init(opt_n_threads) || !stats_start(opt_stats_interval))
+		return 1;
+
+	if (opt_trace && !trace_open(opt_trace))
+		return 1;
+
+	if (opt_perf && !perf_init(opt_n_threads))
+		return 1;
+
+	if (opt_tune && !tune_batch(opt_algo))
+		return 1;
+
+	if (opt_record && !opt_benchmark && !record_open(opt_record))
+		return 1;
+
+	if (opt_aux_url &&
+	    !merged_init(opt_aux_url, opt_aux_userpass, opt_coinbase_script))
+		return 1;
+
 	/* init workio thread info */
 	work_thr_id = opt_n_threads;
 	thr = &thr_info[work_thr_id];
@@ -988,27 +2137,110 @@ int main (int argc, char *argv[])
 	} else
 		longpoll_thr_id = -1;
 
-	/* start mining threads */
+	if (n_pools > 1 && !opt_benchmark && !opt_cluster_join &&
+	    !opt_work_file) {
+		for (i = 0; i < n_pools; i++)
+			applog(LOG_INFO, "pool %d: %s", i, pools[i].url);
+		applog(LOG_INFO, "pool balance policy: %s",
+		       pool_policy_name(pool_policy));
+		if (!pool_probe_start(opt_pool_probe))
+			return 1;
+	}
+
+	if (opt_work_file &&
+	    !workfile_open(opt_work_file, opt_work_out, opt_n_threads))
+		return 1;
+
+	if (opt_share_journal && !opt_benchmark && !opt_cluster_join &&
+	    !opt_work_file && !journal_open(opt_share_journal))
+		return 1;
+
+	topo_log(opt_n_threads);
+
 	for (i = 0; i < opt_n_threads; i++) {
 		thr = &thr_info[i];
 
 		thr->id = i;
+		thr->cpu = topo_thread_cpu(i, opt_n_threads);
+		thr->cls = thr->cpu >= 0 ? topo_cpu_class(thr->cpu) : 0;
+		thr->algo = opt_algo;
+		if (thr->cls < opt_n_class_algo &&
+		    opt_class_algo[thr->cls] >= 0)
+			thr->algo = opt_class_algo[thr->cls];
+	}
+
+	if (!tune_classes(opt_n_threads, opt_scantime))
+		return 1;
+
+	/* before the threads start, so it has the cpus to itself */
+	if (opt_smt_algo >= 0) {
+		smt_paired = tune_smt(opt_n_threads, opt_smt_algo);
+		if (smt_paired < 0)
+			return 1;
+	}
+
+	/* start mining threads */
+	for (i = 0; i < opt_n_threads; i++) {
+		thr = &thr_info[i];
+
 		thr->q = tq_new();
 		if (!thr->q)
 			return 1;
+		if (auto_threads && cg_limit > 0 && i >= cg_limit)
+			thr->park_mask = PARK_QUOTA;
 
 		if (unlikely(pthread_create(&thr->pth, NULL, miner_thread, thr))) {
 			applog(LOG_ERR, "thread %d create failed", i);
 			return 1;
 		}
 
-		sleep(1);	/* don't pound RPC server all at once */
+		if (!opt_benchmark && !opt_work_file && !thr->park_mask)
+			sleep(1);	/* don't pound RPC server all at once */
+	}
+
+	/* follow cgroup quota changes, if we sized ourselves from it */
+	if (auto_threads) {
+		cgroup_apply(cg_limit, cg_limit > 0);
+		if (opt_cgroup_recheck &&
+		    pthread_create(&cg_thread, NULL, cgroup_thread, NULL))
+			applog(LOG_ERR, "cgroup thread create failed");
 	}
 
+	if (opt_metrics_port &&
+	    !metrics_start(opt_metrics_port, opt_n_threads,
+			   thr_info[work_thr_id].q))
+		return 1;
+
+	if (opt_api_port &&
+	    !api_start(opt_api_port, opt_n_threads, opt_api_token))
+		return 1;
+
+	if (opt_proxy_port &&
+	    !proxy_start(opt_proxy_bind, opt_proxy_port, opt_proxy_roll))
+		return 1;
+
+	if (opt_cluster_listen && !cluster_listen(opt_cluster_listen))
+		return 1;
+
+	if (opt_cluster_join && !cluster_join(opt_cluster_join, opt_n_threads))
+		return 1;
+
+	if (opt_cotenant > 0.0 &&
+	    !cotenant_start(opt_n_threads, opt_cotenant, opt_cotenant_smt))
+		return 1;
+
 	applog(LOG_INFO, "%d miner threads started, "
-		"using SHA256 '%s' algorithm.",
-		opt_n_threads,
+		"using %s '%s' algorithm.",
+		opt_n_threads, opt_scrypt ? "scrypt" : "SHA256",
 		algo_names[opt_algo]);
+	if (smt_paired > 0)
+		applog(LOG_INFO, "%d threads on SMT siblings use '%s' instead",
+		       smt_paired, algo_names[opt_smt_algo]);
+
+	if (opt_work_file) {
+		workfile_wait();
+		return 0;
+	}
 
 	/* main loop - simply wait for workio thread to exit */
 	pthread_join(thr_info[work_thr_id].pth, NULL);
@@ -0,0 +1,391 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Minimal embedded HTTP/1.1 server.
+ *
+ * Just enough HTTP for local telemetry and getwork-style JSON-RPC: one
+ * thread per connection, keep-alive, Content-Length bodies only (no
+ * chunked requests).  Handlers are called with the parsed request and
+ * write their reply with http_respond().  Connections are capped per
+ * server, and one that sends nothing for HTTP_IDLE_SECS is closed.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include "compat.h"
+#include "miner.h"
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HTTP_MAX_HEADER	(64 * 1024)
+#define HTTP_MAX_BODY	(4 * 1024 * 1024)
+#define HTTP_MAX_CONNS	256	/* per server */
+#define HTTP_IDLE_SECS	60
+
+struct http_server {
+	int		fd;
+	http_handler_t	handler;
+	void		*arg;
+	volatile int	n_conns;
+};
+
+struct http_conn {
+	struct http_server *srv;
+	int		fd;
+	char		*buf;		/* unconsumed input */
+	size_t		len, cap;
+};
+
+static bool conn_fill(struct http_conn *c)
+{
+	ssize_t n;
+
+	if (c->len + 4096 > c->cap) {
+		size_t cap = c->cap ? c->cap * 2 : 8192;
+		char *p = realloc(c->buf, cap + 1);
+
+		if (!p)
+			return false;
+		c->buf = p;
+		c->cap = cap;
+	}
+
+	do {
+		n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return false;
+
+	c->len += n;
+	c->buf[c->len] = 0;
+	return true;
+}
+
+static void conn_consume(struct http_conn *c, size_t n)
+{
+	memmove(c->buf, c->buf + n, c->len - n);
+	c->len -= n;
+	c->buf[c->len] = 0;
+}
+
+/* Look up header 'name' in a request; returns 'buf' or NULL */
+const char *http_header(const struct http_request *req, const char *name,
+			char *buf, size_t buflen)
+{
+	size_t nlen = strlen(name);
+	const char *p = req->headers;
+
+	while (p && *p) {
+		const char *eol = strstr(p, "\r\n");
+		size_t llen = eol ? (size_t)(eol - p) : strlen(p);
+
+		if (llen > nlen && p[nlen] == ':' && !strncasecmp(p, name, nlen)) {
+			const char *v = p + nlen + 1;
+			size_t vlen;
+
+			while (*v == ' ' || *v == '\t')
+				v++;
+			vlen = llen - (v - p);
+			if (vlen >= buflen)
+				vlen = buflen - 1;
+			memcpy(buf, v, vlen);
+			buf[vlen] = 0;
+			return buf;
+		}
+		p = eol ? eol + 2 : NULL;
+	}
+
+	return NULL;
+}
+
+static bool read_request(struct http_conn *c, struct http_request *req)
+{
+	char *hdr_end, *line_end, tmp[64];
+	size_t hdr_len, body_len = 0;
+
+	memset(req, 0, sizeof(*req));
+
+	while (!(hdr_end = c->buf ? strstr(c->buf, "\r\n\r\n") : NULL)) {
+		if (c->len > HTTP_MAX_HEADER || !conn_fill(c))
+			return false;
+	}
+	hdr_len = hdr_end - c->buf + 4;
+
+	line_end = strstr(c->buf, "\r\n");
+	if (sscanf(c->buf, "%15s %255s", req->method, req->path) != 2)
+		return false;
+
+	req->headers = strndup(line_end + 2, hdr_end - line_end);
+	if (!req->headers)
+		return false;
+
+	if (http_header(req, "Content-Length", tmp, sizeof(tmp)))
+		body_len = strtoul(tmp, NULL, 10);
+	if (body_len > HTTP_MAX_BODY)
+		return false;
+
+	/* HTTP/1.0 closes unless asked not to; only the request line says */
+	req->keepalive = !memmem(c->buf, line_end - c->buf, "HTTP/1.0", 8);
+	if (http_header(req, "Connection", tmp, sizeof(tmp)))
+		req->keepalive = !strcasecmp(tmp, "keep-alive") ||
+			(req->keepalive && strcasecmp(tmp, "close"));
+
+	while (c->len < hdr_len + body_len)
+		if (!conn_fill(c))
+			return false;
+
+	req->body = malloc(body_len + 1);
+	if (!req->body)
+		return false;
+	memcpy(req->body, c->buf + hdr_len, body_len);
+	req->body[body_len] = 0;
+	req->body_len = body_len;
+
+	conn_consume(c, hdr_len + body_len);
+	return true;
+}
+
+static void free_request(struct http_request *req)
+{
+	free(req->headers);
+	free(req->body);
+	req->headers = req->body = NULL;
+}
+
+static bool write_all(int fd, const char *p, size_t len)
+{
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static const char *status_text(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default:  return "Unknown";
+	}
+}
+
+/* Send a complete response; 'extra' holds additional header lines, each
+ * terminated by \r\n, or is NULL.
+ */
+bool http_respond(int fd, int status, const char *content_type,
+		  const char *extra, const char *body, size_t len)
+{
+	char hdr[1024];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof(hdr),
+			"HTTP/1.1 %d %s\r\n"
+			"Server: %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %lu\r\n"
+			"%s\r\n",
+			status, status_text(status), PACKAGE_STRING,
+			content_type, (unsigned long) len, extra ? extra : "");
+	if (hlen < 0 || hlen >= sizeof(hdr))
+		return false;
+
+	return write_all(fd, hdr, hlen) && write_all(fd, body, len);
+}
+
+static void *conn_thread(void *userdata)
+{
+	struct http_conn *c = userdata;
+	struct http_request req;
+
+	while (read_request(c, &req)) {
+		bool keepalive = req.keepalive;
+
+		c->srv->handler(c->fd, &req, c->srv->arg);
+		free_request(&req);
+		if (!keepalive)
+			break;
+	}
+	free_request(&req);
+
+	close(c->fd);
+	__sync_sub_and_fetch(&c->srv->n_conns, 1);
+	free(c->buf);
+	free(c);
+	return NULL;
+}
+
+static void *accept_thread(void *userdata)
+{
+	struct http_server *srv = userdata;
+
+	while (1) {
+		struct timeval tv = { HTTP_IDLE_SECS, 0 };
+		struct http_conn *c;
+		pthread_attr_t attr;
+		pthread_t pth;
+		int fd, one = 1;
+
+		fd = accept(srv->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			applog(LOG_ERR, "HTTP accept failed: %s", strerror(errno));
+			sleep(1);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		if (__sync_add_and_fetch(&srv->n_conns, 1) > HTTP_MAX_CONNS) {
+			http_respond(fd, 503, "text/plain", NULL, "", 0);
+			close(fd);
+			__sync_sub_and_fetch(&srv->n_conns, 1);
+			continue;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			__sync_sub_and_fetch(&srv->n_conns, 1);
+			continue;
+		}
+		c->srv = srv;
+		c->fd = fd;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&pth, &attr, conn_thread, c)) {
+			close(fd);
+			__sync_sub_and_fetch(&srv->n_conns, 1);
+			free(c);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	return NULL;
+}
+
+/* Listen on host:port (host NULL = all interfaces); returns fd or -1 */
+int http_listen(const char *host, int port)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (getaddrinfo(host, service, &hints, &res)) {
+		applog(LOG_ERR, "HTTP listen: cannot resolve %s", host);
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 128))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		applog(LOG_ERR, "HTTP listen on %s:%d failed: %s",
+		       host ? host : "*", port, strerror(errno));
+	return fd;
+}
+
+bool http_server_start(const char *host, int port, http_handler_t handler,
+		       void *arg)
+{
+	struct http_server *srv;
+	pthread_t pth;
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return false;
+
+	srv->fd = http_listen(host, port);
+	if (srv->fd < 0) {
+		free(srv);
+		return false;
+	}
+	srv->handler = handler;
+	srv->arg = arg;
+
+	if (pthread_create(&pth, NULL, accept_thread, srv)) {
+		applog(LOG_ERR, "HTTP server thread create failed");
+		close(srv->fd);
+		free(srv);
+		return false;
+	}
+
+	return true;
+}
+
+#else /* WIN32 */
+
+const char *http_header(const struct http_request *req, const char *name,
+			char *buf, size_t buflen)
+{
+	return NULL;
+}
+
+bool http_respond(int fd, int status, const char *content_type,
+		  const char *extra, const char *body, size_t len)
+{
+	return false;
+}
+
+int http_listen(const char *host, int port)
+{
+	return -1;
+}
+
+bool http_server_start(const char *host, int port, http_handler_t handler,
+		       void *arg)
+{
+	applog(LOG_ERR, "HTTP server not supported on this platform");
+	return false;
+}
+
+#endif /* WIN32 */
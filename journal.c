@@ -0,0 +1,352 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Share journal: found shares survive pool outages and restarts.
+ *
+ * Every share is written to an mmap'ed file before it is submitted, and
+ * marked once the pool has answered.  A share that could not be
+ * delivered is left to a replayer thread, which resubmits it once its
+ * pool answers again, or purges it once a new block makes it worthless.
+ * Headers already in the journal are never submitted twice, across
+ * restarts too.
+ *
+ * The file is a header slot followed by a ring of fixed-size records,
+ * written in sequence; a record is valid once its magic is set, which is
+ * written last, and records never straddle a page.  Records name their
+ * pool by its id, which a redirect leaves alone, and are found by header
+ * through an in-memory hash index.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "compat.h"
+#include "miner.h"
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define JOURNAL_VERSION	2
+#define JOURNAL_RECS	4096	/* ring size, not counting the header */
+#define JOURNAL_HASH	8192	/* index buckets */
+#define JOURNAL_REPLAY	10	/* seconds between replayer passes */
+#define JREC_MAGIC	0x4a524543	/* "JREC" */
+
+enum jrec_states {
+	JREC_PENDING,		/* being submitted */
+	JREC_FAILED,		/* not delivered; the replayer's */
+	JREC_DONE,		/* the pool answered */
+	JREC_STALE,		/* purged: its block is gone */
+};
+
+struct jhdr {
+	char		magic[8];	/* "MINERJNL" */
+	uint32_t	version;
+	uint32_t	rec_size;
+	uint32_t	n_recs;
+};
+
+struct jrec {
+	volatile uint32_t magic;	/* JREC_MAGIC once complete */
+	volatile uint32_t state;
+	uint64_t	seq;
+	uint64_t	when;		/* time found */
+	uint64_t	pool;		/* its pool's id */
+	uint64_t	header;		/* hash of the 80 byte header */
+	unsigned char	data[128];
+	unsigned char	padding[256 - 40 - 128];
+};
+
+static struct jrec *j_recs;		/* [0] holds the header */
+static size_t j_len;
+static uint64_t j_seq;			/* next record */
+static unsigned char j_prevhash[32];	/* of the newest work */
+static unsigned long j_gen;		/* and its work_gen */
+static bool j_have_block;
+static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* guarded by j_lock: valid records chained by header hash */
+static int j_bucket[JOURNAL_HASH];	/* first slot, 0 = none */
+static int j_chain[JOURNAL_RECS + 1];	/* next slot in the bucket */
+
+/* FNV-1a */
+static uint64_t fnv64(const void *p, size_t len)
+{
+	const unsigned char *s = p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void jindex_add(int slot)
+{
+	int b = j_recs[slot].header % JOURNAL_HASH;
+
+	j_chain[slot] = j_bucket[b];
+	j_bucket[b] = slot;
+}
+
+static void jindex_del(int slot)
+{
+	int *p = &j_bucket[j_recs[slot].header % JOURNAL_HASH];
+
+	while (*p && *p != slot)
+		p = &j_chain[*p];
+	if (*p)
+		*p = j_chain[slot];
+}
+
+static void jrec_sync(struct jrec *rec, int flags)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t addr = (uintptr_t) rec & ~(uintptr_t)(page - 1);
+
+	msync((void *) addr, page, flags);
+}
+
+/* Journal 'work' before submitting it; returns its slot, or -1 if the
+ * same header was journaled before.  0: no journal.
+ */
+int journal_add(const struct work *work)
+{
+	uint64_t header = fnv64(work->data, 80);
+	struct jrec *rec;
+	int i, slot;
+
+	if (!j_recs)
+		return 0;
+
+	pthread_mutex_lock(&j_lock);
+	for (i = j_bucket[header % JOURNAL_HASH]; i; i = j_chain[i])
+		if (j_recs[i].header == header &&
+		    !memcmp(j_recs[i].data, work->data, 80)) {
+			pthread_mutex_unlock(&j_lock);
+			return -1;
+		}
+
+	slot = 1 + j_seq % JOURNAL_RECS;
+	rec = &j_recs[slot];
+	if (rec->magic == JREC_MAGIC) {
+		if (rec->state == JREC_FAILED || rec->state == JREC_PENDING)
+			applog(LOG_WARNING, "share journal full, undelivered "
+			       "share dropped");
+		jindex_del(slot);
+	}
+
+	rec->magic = 0;
+	__sync_synchronize();
+	rec->state = JREC_PENDING;
+	rec->seq = j_seq++;
+	rec->when = time(NULL);
+	rec->pool = work->pool->id;
+	rec->header = header;
+	memcpy(rec->data, work->data, sizeof(rec->data));
+	__sync_synchronize();
+	rec->magic = JREC_MAGIC;
+	jindex_add(slot);
+	pthread_mutex_unlock(&j_lock);
+
+	/* the point of it all: on disk before the pool sees it */
+	jrec_sync(rec, MS_SYNC);
+	return slot;
+}
+
+/* The pool answered (delivered) or could not be reached */
+void journal_done(int slot, bool delivered)
+{
+	if (slot <= 0 || !j_recs)
+		return;
+
+	j_recs[slot].state = delivered ? JREC_DONE : JREC_FAILED;
+	jrec_sync(&j_recs[slot], MS_ASYNC);
+}
+
+/* Note the block fresh work is for; older shares are worthless */
+void journal_block(const struct work *work)
+{
+	if (!j_recs)
+		return;
+
+	pthread_mutex_lock(&j_lock);
+	memcpy(j_prevhash, work->data + 4, sizeof(j_prevhash));
+	j_gen = work->gen;
+	j_have_block = true;
+	pthread_mutex_unlock(&j_lock);
+}
+
+static struct pool *pool_by_id(uint64_t id)
+{
+	struct pool *found = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (id < n_pools)
+		found = &pools[id];
+	pthread_mutex_unlock(&pool_lock);
+
+	return found;
+}
+
+/* One pass: purge what went stale, resubmit what can be delivered */
+static void journal_replay(void)
+{
+	int i;
+
+	for (i = 1; i <= JOURNAL_RECS; i++) {
+		struct jrec *rec = &j_recs[i];
+		enum share_results result;
+		struct work work;
+		bool current;
+
+		if (rec->magic != JREC_MAGIC || rec->state != JREC_FAILED)
+			continue;
+
+		memset(&work, 0, sizeof(work));
+		pthread_mutex_lock(&j_lock);
+		if (!j_have_block) {
+			pthread_mutex_unlock(&j_lock);
+			return;		/* nothing to judge by yet */
+		}
+		current = !memcmp(rec->data + 4, j_prevhash, sizeof(j_prevhash));
+		work.gen = j_gen;
+		pthread_mutex_unlock(&j_lock);
+
+		work.pool = pool_by_id(rec->pool);
+		if (!current || !work.pool) {
+			rec->state = JREC_STALE;
+			jrec_sync(rec, MS_ASYNC);
+			applog(LOG_INFO, "share journal: purged %s share, found "
+			       "%lds ago", current ? "orphaned" : "stale",
+			       (long)(time(NULL) - rec->when));
+			continue;
+		}
+		if (!work.pool->alive)
+			continue;
+
+		memcpy(work.data, rec->data, sizeof(work.data));
+		work.journal = i;
+		rec->state = JREC_PENDING;
+		applog(LOG_INFO, "share journal: resubmitting share to pool %d",
+		       work.pool->id);
+		if (!submit_work_sync(&work, &result))
+			rec->state = JREC_FAILED;
+	}
+}
+
+static void *journal_thread(void *userdata)
+{
+	while (1) {
+		sleep(JOURNAL_REPLAY);
+		journal_replay();
+	}
+
+	return NULL;
+}
+
+bool journal_open(const char *path)
+{
+	struct jhdr *hdr;
+	pthread_t pth;
+	int fd, i, failed = 0;
+
+	j_len = (JOURNAL_RECS + 1) * sizeof(struct jrec);
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || ftruncate(fd, j_len)) {
+		applog(LOG_ERR, "share journal %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	j_recs = mmap(NULL, j_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (j_recs == MAP_FAILED) {
+		applog(LOG_ERR, "share journal %s: %s", path, strerror(errno));
+		j_recs = NULL;
+		return false;
+	}
+
+	hdr = (struct jhdr *) &j_recs[0];
+	if (memcmp(hdr->magic, "MINERJNL", 8)) {
+		memset(j_recs, 0, j_len);
+		memcpy(hdr->magic, "MINERJNL", 8);
+		hdr->version = JOURNAL_VERSION;
+		hdr->rec_size = sizeof(struct jrec);
+		hdr->n_recs = JOURNAL_RECS;
+		msync(j_recs, j_len, MS_SYNC);
+	} else if (hdr->version != JOURNAL_VERSION ||
+		   hdr->rec_size != sizeof(struct jrec) ||
+		   hdr->n_recs != JOURNAL_RECS) {
+		applog(LOG_ERR, "share journal %s: incompatible format", path);
+		munmap(j_recs, j_len);
+		j_recs = NULL;
+		return false;
+	}
+
+	/* shares in flight when we stopped were never answered */
+	for (i = 1; i <= JOURNAL_RECS; i++) {
+		struct jrec *rec = &j_recs[i];
+
+		if (rec->magic != JREC_MAGIC)
+			continue;
+		if (rec->seq >= j_seq)
+			j_seq = rec->seq + 1;
+		if (rec->state == JREC_PENDING)
+			rec->state = JREC_FAILED;
+		if (rec->state == JREC_FAILED)
+			failed++;
+		jindex_add(i);
+	}
+
+	if (pthread_create(&pth, NULL, journal_thread, NULL)) {
+		applog(LOG_ERR, "share journal thread create failed");
+		return false;
+	}
+
+	applog(LOG_INFO, "share journal %s: %d shares awaiting resubmission",
+	       path, failed);
+	return true;
+}
+
+#else /* WIN32 */
+
+int journal_add(const struct work *work)
+{
+	return 0;
+}
+
+void journal_done(int slot, bool delivered)
+{
+}
+
+void journal_block(const struct work *work)
+{
+}
+
+bool journal_open(const char *path)
+{
+	applog(LOG_ERR, "share journal not supported on this platform");
+	return false;
+}
+
+#endif /* WIN32 */
@@ -0,0 +1,298 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Asynchronous logging.
+ *
+ * Once log_start() has run, applog() never blocks: the caller formats
+ * its message into a slot of a bounded lock-free ring (Vyukov's MPMC
+ * queue, used here with a single consumer) and returns.  A writer thread
+ * drains the ring, adds the timestamp text and writes the lines out, as
+ * text or JSON, to stderr or syslog.  When the ring is full, messages are
+ * dropped and counted rather than waited for.
+ *
+ * Arguments are formatted by the caller, into the slot, because they may
+ * not outlive the call; the rest -- localtime, stdio locking, the
+ * write() -- happens on the writer thread.
+ *
+ * Each call site (format string) may log at most --log-rate messages a
+ * second; the excess is dropped, and counted when the site next logs.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define LOG_RING	1024	/* slots; a power of two */
+#define LOG_LINE	512	/* longest message kept */
+#define LOG_SITES	64	/* call sites tracked for rate limiting */
+#define LOG_POLL_MS	20	/* writer sleep when the ring is empty */
+
+struct log_slot {
+	volatile unsigned long	seq;
+	int			prio;
+	struct timeval		tv;
+	char			msg[LOG_LINE];
+};
+
+struct log_site {
+	const char		*fmt;
+	time_t			sec;
+	unsigned int		n;		/* messages this second */
+	unsigned long		dropped;	/* this second */
+};
+
+enum log_formats log_format = LOG_FORMAT_TEXT;
+int log_rate = 100;
+
+static struct log_slot *log_ring;
+static volatile unsigned long log_head;	/* next slot to fill */
+static volatile unsigned long log_tail;	/* next slot to write */
+static volatile uint64_t log_dropped;	/* ring full */
+static volatile bool log_async;
+static struct log_site log_sites[LOG_SITES];
+
+static const char *prio_name(int prio)
+{
+	switch (prio) {
+	case LOG_ERR:		return "error";
+	case LOG_WARNING:	return "warning";
+	case LOG_DEBUG:		return "debug";
+	default:		return "info";
+	}
+}
+
+static void log_line(int prio, const struct timeval *tv, const char *msg)
+{
+	struct tm tm, *tm_p;
+	const char *p;
+
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		syslog(prio, "%s", msg);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&time_lock);
+	tm_p = localtime(&tv->tv_sec);
+	memcpy(&tm, tm_p, sizeof(tm));
+	pthread_mutex_unlock(&time_lock);
+
+	if (log_format == LOG_FORMAT_TEXT) {
+		fprintf(stderr, "[%d-%02d-%02d %02d:%02d:%02d] %s\n",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec, msg);
+		return;
+	}
+
+	fprintf(stderr, "{\"time\":\"%d-%02d-%02dT%02d:%02d:%02d.%03ld\","
+		"\"ts\":%ld.%06ld,\"level\":\"%s\",\"msg\":\"",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec, (long) tv->tv_usec / 1000,
+		(long) tv->tv_sec, (long) tv->tv_usec,
+		prio_name(prio));
+	for (p = msg; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(stderr, "\\%c", *p);
+		else if (*p == '\n')
+			fputs("\\n", stderr);
+		else if ((unsigned char) *p < 0x20)
+			fprintf(stderr, "\\u%04x", *p);
+		else
+			fputc(*p, stderr);
+	}
+	fputs("\"}\n", stderr);
+}
+
+/* Claim a slot; NULL if the ring is full */
+static struct log_slot *ring_claim(unsigned long *pos_out)
+{
+	unsigned long pos = log_head;
+
+	while (1) {
+		struct log_slot *slot = &log_ring[pos & (LOG_RING - 1)];
+		long dif = (long)(slot->seq - pos);
+
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&log_head, pos, pos + 1)) {
+				*pos_out = pos;
+				return slot;
+			}
+		} else if (dif < 0)
+			return NULL;
+		pos = log_head;
+	}
+}
+
+static void ring_put(int prio, const struct timeval *tv, const char *fmt,
+		     va_list ap)
+{
+	struct log_slot *slot;
+	unsigned long pos;
+
+	slot = ring_claim(&pos);
+	if (!slot) {
+		stats_add(&log_dropped, 1);
+		return;
+	}
+	slot->prio = prio;
+	slot->tv = *tv;
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	__sync_synchronize();
+	slot->seq = pos + 1;		/* publish */
+}
+
+static void ring_printf(int prio, const struct timeval *tv,
+			const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ring_put(prio, tv, fmt, ap);
+	va_end(ap);
+}
+
+/* Write out what is in the ring; writer thread only, or at exit */
+static bool ring_drain(void)
+{
+	static uint64_t reported;
+	bool any = false;
+
+	while (1) {
+		struct log_slot *slot = &log_ring[log_tail & (LOG_RING - 1)];
+
+		if (slot->seq != log_tail + 1)
+			break;
+		__sync_synchronize();
+		log_line(slot->prio, &slot->tv, slot->msg);
+		slot->seq = log_tail + LOG_RING;
+		log_tail++;
+		any = true;
+	}
+
+	if (log_dropped != reported) {
+		char msg[64];
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		snprintf(msg, sizeof(msg), "log ring full, %llu messages lost",
+			 (unsigned long long)(log_dropped - reported));
+		log_line(LOG_WARNING, &tv, msg);
+		reported = log_dropped;
+		any = true;
+	}
+
+	if (any)
+		fflush(stderr);
+	return any;
+}
+
+static void *log_thread(void *userdata)
+{
+	while (1)
+		if (!ring_drain())
+			usleep(LOG_POLL_MS * 1000);
+
+	return NULL;
+}
+
+/* false: over the rate for its call site.  Approximate: racing callers
+ * may let a few extra through, which beats taking a lock.
+ */
+static bool rate_ok(const char *fmt, const struct timeval *tv)
+{
+	struct log_site *site;
+	unsigned long dropped;
+
+	if (log_rate <= 0)
+		return true;
+
+	site = &log_sites[((uintptr_t) fmt >> 3) % LOG_SITES];
+	if (site->fmt != fmt || site->sec != tv->tv_sec) {
+		dropped = site->fmt == fmt ? site->dropped : 0;
+		site->fmt = fmt;
+		site->sec = tv->tv_sec;
+		site->n = 0;
+		site->dropped = 0;
+		if (dropped)
+			ring_printf(LOG_INFO, tv, "%lu more \"%.40s\" "
+				    "messages suppressed", dropped, fmt);
+	}
+	if (site->n++ < (unsigned int) log_rate)
+		return true;
+	site->dropped++;
+	return false;
+}
+
+void applog(int prio, const char *fmt, ...)
+{
+	struct timeval tv;
+	va_list ap;
+
+	gettimeofday(&tv, NULL);
+
+	va_start(ap, fmt);
+	if (!log_async) {
+		char msg[LOG_LINE];
+
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		log_line(prio, &tv, msg);
+	} else if (rate_ok(fmt, &tv))
+		ring_put(prio, &tv, fmt, ap);
+	va_end(ap);
+}
+
+/* Give the writer up to a second to catch up, so last words are seen */
+static void log_flush(void)
+{
+	int i;
+
+	for (i = 0; i < 1000 && log_tail != log_head; i++)
+		usleep(1000);
+}
+
+int log_format_parse(const char *name)
+{
+	if (!strcmp(name, "text"))
+		return LOG_FORMAT_TEXT;
+	if (!strcmp(name, "json"))
+		return LOG_FORMAT_JSON;
+	return -1;
+}
+
+bool log_start(void)
+{
+	pthread_t pth;
+	unsigned long i;
+
+	log_ring = calloc(LOG_RING, sizeof(*log_ring));
+	if (!log_ring)
+		return false;
+	for (i = 0; i < LOG_RING; i++)
+		log_ring[i].seq = i;
+
+	if (pthread_create(&pth, NULL, log_thread, NULL)) {
+		applog(LOG_ERR, "log thread create failed");
+		return false;
+	}
+
+	atexit(log_flush);
+	log_async = true;
+	return true;
+}
@@ -0,0 +1,690 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Merged mining: one SHA-256d search serving a parent chain and an
+ * auxiliary chain.
+ *
+ * Work is built here instead of fetched.  The pool is the parent's node,
+ * asked for a block template (getblocktemplate); we write its coinbase,
+ * paying --coinbase-script, and commit in it to the aux chain's block
+ * hash from --aux-url (getauxblock) in the usual merged mining form:
+ * fabe6d6d, the hash, a one-leaf chain merkle tree.  An extranonce in the
+ * coinbase makes every work unit distinct.  Work targets the easier of
+ * the two chains' targets.
+ *
+ * A solution is hashed again and goes to whichever chains' targets it
+ * meets: to the parent as a whole block (submitblock), to the aux chain
+ * as proof of work (getauxblock HASH AUXPOW): the coinbase, its merkle
+ * branch and the parent header.
+ *
+ * Templates are polled, at most every MERGED_REFRESH seconds, as work is
+ * asked for; a new parent tip or aux block restarts the miner threads.
+ * Recent work is remembered by merkle root, so that a solution finds its
+ * coinbase again.  All of this runs on the workio thread, but for
+ * merged_check().
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define MERGED_REFRESH	5	/* seconds a template is mined */
+#define MERGED_TMPLS	8	/* templates kept for late solutions */
+#define MERGED_JOBS	1024	/* work units remembered */
+#define SCRIPT_MAX	128	/* longest payout script */
+#define WITNESS_MAX	38	/* OP_RETURN, push of a BIP 141 commitment */
+/* height, aux commitment, extranonce and tag */
+#define SIGSCRIPT_MAX	(9 + 45 + 9)
+/* version, input, outputs (value, script) and lock time */
+#define COINBASE_MAX	(4 + 1 + 36 + 1 + SIGSCRIPT_MAX + 4 + \
+			 1 + 8 + 3 + SCRIPT_MAX + 8 + 1 + WITNESS_MAX + 4)
+
+/* a parent block template, shared by the work built from it */
+struct merged_tmpl {
+	int		refs;
+	unsigned long	seq;
+	struct pool	*pool;
+	json_t		*gbt;		/* for the transactions */
+	time_t		fetched;
+
+	unsigned char	prevhash[32];
+	unsigned char	target[32];	/* little-endian */
+	uint32_t	version, bits, curtime;
+	int64_t		height;
+	uint64_t	value;
+	unsigned char	*witness;	/* commitment script, or NULL */
+	size_t		witness_len;
+
+	int		n_branch;	/* coinbase merkle branch */
+	unsigned char	(*branch)[32];
+};
+
+struct merged_aux {
+	unsigned char	hash[32];	/* as committed: getauxblock's order */
+	unsigned char	target[32];	/* little-endian */
+};
+
+/* a work unit handed out */
+struct merged_job {
+	struct merged_tmpl *tmpl;
+	bool		has_aux;
+	struct merged_aux aux;
+	unsigned char	merkle[32];
+	unsigned char	coinbase[COINBASE_MAX];	/* without witness */
+	size_t		coinbase_len;
+};
+
+bool merged_mining;
+const char merged_gbt_req[] =
+	"{\"method\": \"getblocktemplate\", "
+	"\"params\": [{\"rules\": [\"segwit\"]}], \"id\":0}\r\n";
+
+static char *aux_url, *aux_userpass;
+static unsigned char payout[SCRIPT_MAX];
+static size_t payout_len;
+static uint32_t merged_tag;		/* in every coinbase of ours */
+static uint32_t extranonce;
+
+static struct merged_tmpl *cur_tmpl;
+static unsigned long n_tmpls;
+static struct merged_aux cur_aux;
+static bool have_aux;
+static struct merged_job jobs[MERGED_JOBS];
+static unsigned long n_jobs;
+
+static unsigned char *put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+static unsigned char *put_le64(unsigned char *p, uint64_t v)
+{
+	p = put_le32(p, v);
+	return put_le32(p, v >> 32);
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	if (v < 0xfd) {
+		*p++ = v;
+		return p;
+	}
+	if (v <= 0xffff) {
+		*p++ = 0xfd;
+		*p++ = v;
+		*p++ = v >> 8;
+		return p;
+	}
+	*p++ = 0xfe;
+	return put_le32(p, v);
+}
+
+static uint32_t be32dec(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void be32enc(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* A hash or target in the RPC's display order, reversed into ours */
+static bool hex2bin_rev(unsigned char *p, const char *hex, size_t len)
+{
+	size_t i;
+
+	if (!hex || !hex2bin(p, hex, len))
+		return false;
+	for (i = 0; i < len / 2; i++) {
+		unsigned char c = p[i];
+
+		p[i] = p[len - 1 - i];
+		p[len - 1 - i] = c;
+	}
+	return true;
+}
+
+/* hash <= target, the hash as sha256d_data() leaves it */
+static bool hash_meets(const unsigned char *hash, const unsigned char *target)
+{
+	const uint32_t *hash32 = (const uint32_t *) hash;
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		uint32_t h = swab32(hash32[i]);
+		uint32_t t = target[4 * i] | (target[4 * i + 1] << 8) |
+			     (target[4 * i + 2] << 16) |
+			     ((uint32_t) target[4 * i + 3] << 24);
+
+		if (h != t)
+			return h < t;
+	}
+	return true;
+}
+
+/* sha256d(a || b), the merkle tree node over 'a' and 'b' */
+static void merkle_node(unsigned char *out, const unsigned char *a,
+			const unsigned char *b)
+{
+	unsigned char pair[64];
+
+	memcpy(pair, a, 32);
+	memcpy(pair + 32, b, 32);
+	sha256d(out, pair, sizeof(pair));
+}
+
+static void tmpl_put(struct merged_tmpl *t)
+{
+	if (!t || --t->refs)
+		return;
+	json_decref(t->gbt);
+	free(t->witness);
+	free(t->branch);
+	free(t);
+}
+
+/* The coinbase's merkle branch: it is leaf 0, the template's txids follow */
+static bool tmpl_branch(struct merged_tmpl *t, const json_t *txs)
+{
+	size_t n = json_array_size(txs) + 1, i, j;
+	unsigned char (*level)[32];
+
+	level = calloc(n, sizeof(*level));
+	t->branch = calloc(32, sizeof(*t->branch));
+	if (!level || !t->branch) {
+		free(level);
+		return false;
+	}
+	for (i = 1; i < n; i++) {
+		const char *txid = json_string_value(
+			json_object_get(json_array_get(txs, i - 1), "txid"));
+
+		/* pre-segwit nodes only give "hash", which is the txid */
+		if (!txid)
+			txid = json_string_value(json_object_get(
+				json_array_get(txs, i - 1), "hash"));
+		if (!hex2bin_rev(level[i], txid, 32)) {
+			free(level);
+			return false;
+		}
+	}
+
+	/* the coinbase side of each level is unknown, and not needed */
+	for (; n > 1; n = (n + 1) / 2) {
+		memcpy(t->branch[t->n_branch++], level[1], 32);
+		for (i = 1; 2 * i < n; i++) {
+			j = 2 * i + 1 < n ? 2 * i + 1 : 2 * i;
+			merkle_node(level[i], level[2 * i], level[j]);
+		}
+	}
+
+	free(level);
+	return true;
+}
+
+static struct merged_tmpl *tmpl_fetch(CURL *curl, struct pool *pool)
+{
+	struct merged_tmpl *t;
+	struct timeval tv_start;
+	const char *bits, *wc;
+	json_t *val, *res;
+
+	gettimeofday(&tv_start, NULL);
+	val = json_rpc_call(curl, pool->url, pool->userpass, merged_gbt_req,
+			    false, false, NULL);
+	hist_observe(&rpc_latency[RPC_GETWORK], usecs_since(&tv_start));
+	pool_result(pool, val != NULL, usecs_since(&tv_start));
+	if (!val)
+		return NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		json_decref(val);
+		return NULL;
+	}
+	res = json_object_get(val, "result");
+	t->refs = 1;
+	t->seq = n_tmpls++;
+	t->pool = pool;
+	t->gbt = json_incref(res);
+	t->fetched = time(NULL);
+	json_decref(val);
+
+	bits = json_string_value(json_object_get(res, "bits"));
+	wc = json_string_value(json_object_get(res, "default_witness_commitment"));
+	if (!bits ||
+	    !hex2bin_rev(t->prevhash, json_string_value(
+			json_object_get(res, "previousblockhash")), 32) ||
+	    !hex2bin_rev(t->target, json_string_value(
+			json_object_get(res, "target")), 32) ||
+	    !json_is_array(json_object_get(res, "transactions")))
+		goto err_out;
+	t->version = json_integer_value(json_object_get(res, "version"));
+	t->bits = strtoul(bits, NULL, 16);
+	t->curtime = json_integer_value(json_object_get(res, "curtime"));
+	t->height = json_integer_value(json_object_get(res, "height"));
+	t->value = json_integer_value(json_object_get(res, "coinbasevalue"));
+
+	if (wc) {
+		t->witness_len = strlen(wc) / 2;
+		t->witness = malloc(t->witness_len);
+		if (t->witness_len > WITNESS_MAX || !t->witness ||
+		    !hex2bin(t->witness, wc, t->witness_len))
+			goto err_out;
+	}
+
+	if (!tmpl_branch(t, json_object_get(res, "transactions")))
+		goto err_out;
+	return t;
+
+err_out:
+	applog(LOG_ERR, "pool %d: bad block template", pool->id);
+	tmpl_put(t);
+	return NULL;
+}
+
+static bool aux_fetch(CURL *curl, struct merged_aux *aux)
+{
+	static const char *req =
+		"{\"method\": \"getauxblock\", \"params\": [], \"id\":0}\r\n";
+	const char *target;
+	json_t *val, *res;
+	bool rc;
+
+	val = json_rpc_call(curl, aux_url, aux_userpass, req, false, false,
+			    NULL);
+	if (!val)
+		return false;
+
+	/* "_target" is little-endian already, "target" for display */
+	res = json_object_get(val, "result");
+	target = json_string_value(json_object_get(res, "_target"));
+	rc = hex2bin(aux->hash, json_string_value(json_object_get(res, "hash")),
+		     32) &&
+	     (target ? hex2bin(aux->target, target, 32) :
+		       hex2bin_rev(aux->target, json_string_value(
+				json_object_get(res, "target")), 32));
+	if (!rc)
+		applog(LOG_ERR, "aux chain: bad getauxblock reply");
+
+	json_decref(val);
+	return rc;
+}
+
+/* The coinbase, without witness; returns its length */
+static size_t coinbase_build(unsigned char *cb, const struct merged_tmpl *t,
+			     const struct merged_aux *aux, uint32_t en)
+{
+	unsigned char script[SIGSCRIPT_MAX], *s = script, *p = cb;
+	int64_t h = t->height;
+	int n = 0;
+
+	/* BIP 34 height, pushed as a script number */
+	if (h >= 1 && h <= 16)
+		*s++ = 0x50 + h;
+	else {
+		for (; h; h >>= 8)
+			s[1 + n++] = h & 0xff;
+		if (n && (s[n] & 0x80))
+			s[1 + n++] = 0;
+		*s = n;
+		s += 1 + n;
+	}
+	if (aux) {
+		*s++ = 44;
+		memcpy(s, "\xfa\xbe\x6d\x6d", 4);
+		memcpy(s + 4, aux->hash, 32);
+		put_le32(s + 36, 1);		/* chain merkle tree size */
+		put_le32(s + 40, 0);		/* and nonce */
+		s += 44;
+	}
+	*s++ = 8;
+	s = put_le32(s, en);
+	s = put_le32(s, merged_tag);
+
+	p = put_le32(p, 1);			/* version */
+	*p++ = 1;
+	memset(p, 0, 32);			/* no previous output */
+	p = put_le32(p + 32, 0xffffffff);
+	p = put_varint(p, s - script);
+	memcpy(p, script, s - script);
+	p = put_le32(p + (s - script), 0xffffffff);	/* sequence */
+
+	*p++ = t->witness ? 2 : 1;
+	p = put_le64(p, t->value);
+	p = put_varint(p, payout_len);
+	memcpy(p, payout, payout_len);
+	p += payout_len;
+	if (t->witness) {
+		p = put_le64(p, 0);
+		p = put_varint(p, t->witness_len);
+		memcpy(p, t->witness, t->witness_len);
+		p += t->witness_len;
+	}
+	p = put_le32(p, 0);			/* lock time */
+
+	return p - cb;
+}
+
+/* Drop work from templates too old to be worth a solution */
+static void jobs_expire(void)
+{
+	int i;
+
+	for (i = 0; i < MERGED_JOBS; i++)
+		if (jobs[i].tmpl &&
+		    jobs[i].tmpl->seq + MERGED_TMPLS <= cur_tmpl->seq) {
+			tmpl_put(jobs[i].tmpl);
+			jobs[i].tmpl = NULL;
+		}
+}
+
+/* Refresh the parent template and aux block; false if the parent fails */
+static bool merged_refresh(CURL *curl, struct pool *pool, bool *new_block)
+{
+	struct merged_tmpl *t;
+	struct merged_aux aux;
+
+	t = tmpl_fetch(curl, pool);
+	if (!t)
+		return false;
+	if (cur_tmpl && memcmp(cur_tmpl->prevhash, t->prevhash, 32))
+		*new_block = true;
+	tmpl_put(cur_tmpl);
+	cur_tmpl = t;
+	jobs_expire();
+
+	/* without the aux chain, the parent is still worth mining */
+	if (aux_fetch(curl, &aux)) {
+		if (have_aux && memcmp(cur_aux.hash, aux.hash, 32))
+			*new_block = true;
+		cur_aux = aux;
+		have_aux = true;
+	} else if (have_aux) {
+		applog(LOG_ERR, "aux chain unavailable, mining the parent "
+		       "alone");
+		have_aux = false;
+	}
+
+	return true;
+}
+
+/* Next work unit from 'pool'; *new_block if either chain moved on */
+bool merged_get_work(CURL *curl, struct work *work, struct pool *pool,
+		     bool *new_block)
+{
+	uint32_t *data32 = (uint32_t *) work->data;
+	uint32_t *hash1_32 = (uint32_t *) work->hash1;
+	unsigned char header[80];
+	const unsigned char *target;
+	struct merged_job *job;
+	time_t now = time(NULL);
+	int i;
+
+	*new_block = false;
+	if ((!cur_tmpl || cur_tmpl->pool != pool ||
+	     now - cur_tmpl->fetched >= MERGED_REFRESH) &&
+	    !merged_refresh(curl, pool, new_block))
+		return false;
+
+	job = &jobs[n_jobs++ % MERGED_JOBS];
+	tmpl_put(job->tmpl);
+	job->tmpl = cur_tmpl;
+	cur_tmpl->refs++;
+	job->has_aux = have_aux;
+	job->aux = cur_aux;
+	job->coinbase_len = coinbase_build(job->coinbase, cur_tmpl,
+					   have_aux ? &cur_aux : NULL,
+					   extranonce++);
+	sha256d(job->merkle, job->coinbase, job->coinbase_len);
+	for (i = 0; i < cur_tmpl->n_branch; i++)
+		merkle_node(job->merkle, job->merkle, cur_tmpl->branch[i]);
+
+	put_le32(header, cur_tmpl->version);
+	memcpy(header + 4, cur_tmpl->prevhash, 32);
+	memcpy(header + 36, job->merkle, 32);
+	put_le32(header + 68, cur_tmpl->curtime + (now - cur_tmpl->fetched));
+	put_le32(header + 72, cur_tmpl->bits);
+	put_le32(header + 76, 0);
+
+	/* the easier target: 'hash_meets' sorts out which chain */
+	target = cur_tmpl->target;
+	if (have_aux)
+		for (i = 31; i >= 0; i--)
+			if (cur_aux.target[i] != target[i]) {
+				if (cur_aux.target[i] > target[i])
+					target = cur_aux.target;
+				break;
+			}
+
+	memset(work->data, 0, sizeof(work->data));
+	memset(work->hash1, 0, sizeof(work->hash1));
+	memset(work->hash, 0, sizeof(work->hash));
+	for (i = 0; i < 20; i++)
+		data32[i] = be32dec(header + 4 * i);
+	data32[20] = 0x80000000;
+	data32[31] = 0x00000280;
+	memcpy(work->target, target, sizeof(work->target));
+	sha256_midstate(work->midstate, work->data);
+	hash1_32[8] = 0x80000000;
+	hash1_32[15] = 0x00000100;
+	work->pool = pool;
+
+	return true;
+}
+
+/* Does the solution meet the work's target?  Any miner thread */
+bool merged_check(const struct work *work)
+{
+	unsigned char hash[32];
+
+	sha256d_data(hash, work->data);
+	return hash_meets(hash, work->target);
+}
+
+static char *hex_append(char *s, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		s += sprintf(s, "%02x", p[i]);
+	return s;
+}
+
+static const char *tx_data(const json_t *txs, size_t i)
+{
+	const char *data = json_string_value(
+		json_object_get(json_array_get(txs, i), "data"));
+
+	return data ? data : "";
+}
+
+/* The whole block to the parent; -1: no answer, else accepted or not */
+static int submit_block(CURL *curl, const struct merged_job *job,
+			const unsigned char *header)
+{
+	static const unsigned char wit[] = { 0x01, 0x20 };	/* one 32 byte item */
+	const struct merged_tmpl *t = job->tmpl;
+	json_t *txs = json_object_get(t->gbt, "transactions"), *val, *res;
+	unsigned char buf[16], zero[32] = { };
+	size_t len, n = json_array_size(txs), i;
+	struct timeval tv_start;
+	char *req, *s;
+	int rc;
+
+	len = 2 * (80 + 9 + COINBASE_MAX + 2 + 34) + 64;
+	for (i = 0; i < n; i++)
+		len += strlen(tx_data(txs, i));
+	req = malloc(len);
+	if (!req)
+		return -1;
+
+	s = req + sprintf(req, "{\"method\": \"submitblock\", \"params\": [\"");
+	s = hex_append(s, header, 80);
+	s = hex_append(s, buf, put_varint(buf, n + 1) - buf);
+	if (t->witness) {
+		/* marker and flag, then the witness reserved value */
+		s = hex_append(s, job->coinbase, 4);
+		s = hex_append(s, (const unsigned char *) "\x00\x01", 2);
+		s = hex_append(s, job->coinbase + 4, job->coinbase_len - 8);
+		s = hex_append(s, wit, sizeof(wit));
+		s = hex_append(s, zero, sizeof(zero));
+		s = hex_append(s, job->coinbase + job->coinbase_len - 4, 4);
+	} else
+		s = hex_append(s, job->coinbase, job->coinbase_len);
+	for (i = 0; i < n; i++)
+		s += sprintf(s, "%s", tx_data(txs, i));
+	strcpy(s, "\"], \"id\":1}\r\n");
+
+	gettimeofday(&tv_start, NULL);
+	val = json_rpc_call_null(curl, t->pool->url, t->pool->userpass, req);
+	hist_observe(&rpc_latency[RPC_SUBMIT], usecs_since(&tv_start));
+	pool_result(t->pool, val != NULL, usecs_since(&tv_start));
+	free(req);
+	if (!val)
+		return -1;
+
+	/* null, or why not */
+	res = json_object_get(val, "result");
+	rc = json_is_null(res);
+	if (rc)
+		applog(LOG_INFO, "PARENT BLOCK RESULT: accepted (yay!!!)");
+	else
+		applog(LOG_INFO, "PARENT BLOCK RESULT: rejected (%s)",
+		       json_is_string(res) ? json_string_value(res) : "?");
+	json_decref(val);
+	return rc;
+}
+
+/* Proof of work to the aux chain; as submit_block() */
+static int submit_aux(CURL *curl, const struct merged_job *job,
+		      const unsigned char *header, const unsigned char *digest)
+{
+	const struct merged_tmpl *t = job->tmpl;
+	unsigned char buf[16];
+	char req[2 * (COINBASE_MAX + 40 + 32 * 32 + 96) + 128], *s;
+	json_t *val;
+	int i, rc;
+
+	s = req + sprintf(req, "{\"method\": \"getauxblock\", \"params\": [\"");
+	s = hex_append(s, job->aux.hash, 32);
+	s += sprintf(s, "\", \"");
+	s = hex_append(s, job->coinbase, job->coinbase_len);
+	s = hex_append(s, digest, 32);		/* parent block hash */
+	s = hex_append(s, buf, put_varint(buf, t->n_branch) - buf);
+	for (i = 0; i < t->n_branch; i++)
+		s = hex_append(s, t->branch[i], 32);
+	s = hex_append(s, buf, put_le32(buf, 0) - buf);	/* coinbase index */
+	s = hex_append(s, buf, put_varint(buf, 0) - buf);	/* chain branch */
+	s = hex_append(s, buf, put_le32(buf, 0) - buf);
+	s = hex_append(s, header, 80);
+	strcpy(s, "\"], \"id\":1}\r\n");
+
+	val = json_rpc_call(curl, aux_url, aux_userpass, req, false, false,
+			    NULL);
+	if (!val)
+		return -1;
+
+	rc = json_is_true(json_object_get(val, "result"));
+	applog(LOG_INFO, "AUX BLOCK RESULT: %s",
+	       rc ? "accepted (yay!!!)" : "rejected (booooo)");
+	json_decref(val);
+	return rc;
+}
+
+/* Submit a solution to whichever chains it solves a block for.  False if
+ * a chain did not answer; *accepted if one took it.
+ */
+bool merged_submit(CURL *curl, const struct work *work, bool *accepted)
+{
+	const uint32_t *data32 = (const uint32_t *) work->data;
+	unsigned char header[80], hash[32], digest[32];
+	const uint32_t *hash32 = (const uint32_t *) hash;
+	const struct merged_job *job = NULL;
+	bool parent, aux, rc = true;
+	int i, r;
+
+	*accepted = false;
+	for (i = 0; i < 20; i++)
+		be32enc(header + 4 * i, data32[i]);
+	for (i = 0; i < MERGED_JOBS && !job; i++)
+		if (jobs[i].tmpl && !memcmp(jobs[i].merkle, header + 36, 32))
+			job = &jobs[i];
+	if (!job) {
+		applog(LOG_INFO, "solution for forgotten work dropped");
+		return true;
+	}
+
+	sha256d_data(hash, work->data);
+	parent = hash_meets(hash, job->tmpl->target);
+	aux = job->has_aux && hash_meets(hash, job->aux.target);
+	if (!parent && !aux) {
+		applog(LOG_INFO, "solution meets neither chain's target");
+		return true;
+	}
+
+	for (i = 0; i < 8; i++)
+		be32enc(digest + 4 * i, hash32[i]);
+
+	if (parent) {
+		r = submit_block(curl, job, header);
+		rc = r >= 0;
+		*accepted |= r > 0;
+	}
+	if (aux) {
+		r = submit_aux(curl, job, header, digest);
+		rc = rc && r >= 0;
+		*accepted |= r > 0;
+	}
+	return rc;
+}
+
+/* 'script' is the payout scriptPubKey, in hex */
+bool merged_init(const char *url, const char *userpass, const char *script)
+{
+	struct timeval tv;
+
+	payout_len = script ? strlen(script) / 2 : 0;
+	if (!payout_len || payout_len > SCRIPT_MAX ||
+	    strlen(script) != 2 * payout_len ||
+	    !hex2bin(payout, script, payout_len)) {
+		applog(LOG_ERR, "merged mining needs --coinbase-script, a "
+		       "payout script of up to %d bytes in hex", SCRIPT_MAX);
+		return false;
+	}
+
+	aux_url = strdup(url);
+	aux_userpass = userpass ? strdup(userpass) : NULL;
+	if (!aux_url || (userpass && !aux_userpass))
+		return false;
+
+	/* distinct coinbases from every run */
+	gettimeofday(&tv, NULL);
+	merged_tag = tv.tv_sec ^ (tv.tv_usec << 12) ^ getpid();
+
+	merged_mining = true;
+	applog(LOG_INFO, "merged mining with aux chain %s", aux_url);
+	return true;
+}
@@ -0,0 +1,334 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Prometheus/OpenMetrics text exposition on a local HTTP port.
+ *
+ * Everything exported here is read from counters the rest of the miner
+ * already maintains (thr_stats, share_stats, the histograms in stats.c),
+ * so scraping costs the miner threads nothing.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include "compat.h"
+#include "miner.h"
+
+struct mbuf {
+	char	*buf;
+	size_t	len, cap;
+	bool	failed;		/* out of memory: render nothing */
+};
+
+static int m_threads;
+static struct thread_q *m_workq;
+
+static void mb_printf(struct mbuf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int n;
+
+	while (!mb->failed) {
+		va_start(ap, fmt);
+		n = vsnprintf(mb->buf + mb->len, mb->cap - mb->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (mb->len + n < mb->cap) {
+			mb->len += n;
+			return;
+		}
+
+		buf = realloc(mb->buf, (mb->cap + n) * 2);
+		if (!buf) {
+			mb->failed = true;
+			return;
+		}
+		mb->buf = buf;
+		mb->cap = (mb->cap + n) * 2;
+	}
+}
+
+static void put_histogram(struct mbuf *mb, const char *name,
+			  const char *labels, struct histogram *h)
+{
+	uint64_t cum = 0;
+	char braced[96] = "";
+	int i;
+
+	if (*labels)
+		snprintf(braced, sizeof(braced), "{%s}", labels);
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		cum += stats_read(&h->bucket[i]);
+		mb_printf(mb, "%s_bucket{%s%sle=\"%g\"} %llu\n", name,
+			  labels, *labels ? "," : "", hist_bounds[i],
+			  (unsigned long long) cum);
+	}
+	cum += stats_read(&h->bucket[HIST_BUCKETS]);
+	mb_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name,
+		  labels, *labels ? "," : "", (unsigned long long) cum);
+	mb_printf(mb, "%s_sum%s %.6f\n", name, braced,
+		  stats_read(&h->sum_usecs) / 1e6);
+	mb_printf(mb, "%s_count%s %llu\n", name, braced,
+		  (unsigned long long) stats_read(&h->count));
+}
+
+/* The stage histograms, as a summary: their buckets are too many and
+ * too fine to expose one by one
+ */
+static void put_stages(struct mbuf *mb)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const char *name = "minerd_stage_duration_seconds";
+	int i, q;
+
+	mb_printf(mb, "# HELP %s Time spent in each stage of getting work "
+		  "and submitting shares.\n# TYPE %s summary\n", name, name);
+	for (i = 0; i < TRACE_STAGES; i++) {
+		struct hdr_histogram *h = &trace_hist[i];
+
+		for (q = 0; q < ARRAY_SIZE(quantiles); q++)
+			mb_printf(mb, "%s{stage=\"%s\",quantile=\"%g\"} "
+				  "%.6f\n", name, trace_stage_names[i],
+				  quantiles[q],
+				  hdr_percentile(h, quantiles[q]) / 1e6);
+		mb_printf(mb, "%s_sum{stage=\"%s\"} %.6f\n", name,
+			  trace_stage_names[i], stats_read(&h->sum_usecs) / 1e6);
+		mb_printf(mb, "%s_count{stage=\"%s\"} %llu\n", name,
+			  trace_stage_names[i],
+			  (unsigned long long) stats_read(&h->count));
+	}
+}
+
+static void put_pools(struct mbuf *mb)
+{
+	int i, n;
+
+	pthread_mutex_lock(&pool_lock);
+	n = n_pools;
+	pthread_mutex_unlock(&pool_lock);
+
+	mb_printf(mb, "# HELP minerd_pool_up Whether the pool answered its "
+		  "last request.\n# TYPE minerd_pool_up gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf(mb, "minerd_pool_up{pool=\"%d\"} %d\n", i,
+			  pools[i].alive);
+
+	mb_printf(mb, "# HELP minerd_pool_active Whether work is fetched from "
+		  "the pool.\n# TYPE minerd_pool_active gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf(mb, "minerd_pool_active{pool=\"%d\"} %d\n", i,
+			  &pools[i] == cur_pool);
+
+	mb_printf(mb, "# HELP minerd_pool_uptime_ratio Fraction of time the "
+		  "pool has been answering.\n"
+		  "# TYPE minerd_pool_uptime_ratio gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf(mb, "minerd_pool_uptime_ratio{pool=\"%d\"} %.4f\n",
+			  i, pool_uptime(&pools[i]));
+
+	mb_printf(mb, "# HELP minerd_pool_rtt_seconds Smoothed request round "
+		  "trip.\n# TYPE minerd_pool_rtt_seconds gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf(mb, "minerd_pool_rtt_seconds{pool=\"%d\"} %.6f\n",
+			  i, pools[i].rtt);
+
+	mb_printf(mb, "# HELP minerd_pool_requests_total Requests to the pool, "
+		  "by result.\n# TYPE minerd_pool_requests_total counter\n");
+	for (i = 0; i < n; i++) {
+		mb_printf(mb, "minerd_pool_requests_total{pool=\"%d\","
+			  "result=\"ok\"} %llu\n", i, (unsigned long long)
+			  (pools[i].requests - pools[i].failures));
+		mb_printf(mb, "minerd_pool_requests_total{pool=\"%d\","
+			  "result=\"failed\"} %llu\n", i,
+			  (unsigned long long) pools[i].failures);
+	}
+
+	mb_printf(mb, "# HELP minerd_pool_shares_total Shares submitted to "
+		  "the pool, by result.\n"
+		  "# TYPE minerd_pool_shares_total counter\n");
+	for (i = 0; i < n; i++) {
+		mb_printf(mb, "minerd_pool_shares_total{pool=\"%d\","
+			  "result=\"accepted\"} %llu\n", i,
+			  (unsigned long long) pools[i].accepted);
+		mb_printf(mb, "minerd_pool_shares_total{pool=\"%d\","
+			  "result=\"rejected\"} %llu\n", i,
+			  (unsigned long long) pools[i].rejected);
+		mb_printf(mb, "minerd_pool_shares_total{pool=\"%d\","
+			  "result=\"stale\"} %llu\n", i,
+			  (unsigned long long) pools[i].stale);
+	}
+}
+
+static void build_metrics(struct mbuf *mb)
+{
+	static const char *rpc_names[RPC_KINDS] = {
+		[RPC_GETWORK]	= "getwork",
+		[RPC_SUBMIT]	= "submit",
+		[RPC_LONGPOLL]	= "longpoll",
+	};
+	char labels[64];
+	int i;
+
+	mb_printf(mb, "# HELP minerd_info Active algorithm and scan kernel.\n"
+		  "# TYPE minerd_info gauge\n"
+		  "minerd_info{version=\"%s\",algo=\"%s\",kernel=\"%s\"} 1\n",
+		  VERSION, opt_scrypt ? "scrypt" : "sha256d",
+		  algo_name(thr_info[0].algo));
+
+	/* kernels can be swapped per thread at runtime */
+	mb_printf(mb, "# HELP minerd_thread_info Cpu binding and scan kernel "
+		  "of each miner thread.\n# TYPE minerd_thread_info gauge\n");
+	for (i = 0; i < m_threads; i++)
+		mb_printf(mb, "minerd_thread_info{thread=\"%d\",cpu=\"%d\","
+			  "kernel=\"%s\"} 1\n", i, thr_info[i].cpu,
+			  algo_name(thr_info[i].algo));
+
+	/* per thread only: sum() gives the total */
+	mb_printf(mb, "# HELP minerd_hashrate Hash rate, 1 minute average, "
+		  "in hashes per second.\n# TYPE minerd_hashrate gauge\n");
+	for (i = 0; i < m_threads; i++)
+		mb_printf(mb, "minerd_hashrate{thread=\"%d\"} %.0f\n",
+			  i, stats_rate(i, STATS_1M));
+
+	mb_printf(mb, "# HELP minerd_hashes_total Hashes computed.\n"
+		  "# TYPE minerd_hashes_total counter\n");
+	for (i = 0; i < m_threads; i++)
+		mb_printf(mb, "minerd_hashes_total{thread=\"%d\"} %llu\n", i,
+			  (unsigned long long) stats_read(&thr_stats[i].hashes));
+
+	mb_printf(mb, "# HELP minerd_duty_cycle Fraction of time spent "
+		  "hashing rather than waiting for work.\n"
+		  "# TYPE minerd_duty_cycle gauge\n");
+	for (i = 0; i < m_threads; i++)
+		mb_printf(mb, "minerd_duty_cycle{thread=\"%d\"} %.4f\n",
+			  i, stats_duty(i));
+
+	mb_printf(mb, "# HELP minerd_shares_total Shares submitted, by "
+		  "result.\n# TYPE minerd_shares_total counter\n");
+	mb_printf(mb, "minerd_shares_total{result=\"accepted\"} %llu\n",
+		  (unsigned long long) stats_read(&share_stats.accepted));
+	mb_printf(mb, "minerd_shares_total{result=\"rejected\"} %llu\n",
+		  (unsigned long long) stats_read(&share_stats.rejected));
+	mb_printf(mb, "minerd_shares_total{result=\"stale\"} %llu\n",
+		  (unsigned long long) stats_read(&share_stats.stale));
+
+	mb_printf(mb, "# HELP minerd_rpc_duration_seconds JSON-RPC call "
+		  "latency.\n# TYPE minerd_rpc_duration_seconds histogram\n");
+	for (i = 0; i < RPC_KINDS; i++) {
+		snprintf(labels, sizeof(labels), "call=\"%s\"", rpc_names[i]);
+		put_histogram(mb, "minerd_rpc_duration_seconds", labels,
+			      &rpc_latency[i]);
+	}
+
+	mb_printf(mb, "# HELP minerd_restart_duration_seconds Time from a "
+		  "new block to a miner thread scanning new work.\n"
+		  "# TYPE minerd_restart_duration_seconds histogram\n");
+	put_histogram(mb, "minerd_restart_duration_seconds", "",
+		      &restart_latency);
+
+	put_stages(mb);
+	put_pools(mb);
+
+	if (proxy_running()) {
+		mb_printf(mb, "# HELP minerd_proxy_getworks_total Work handed "
+			  "to downstream miners, and of that fetched upstream.\n"
+			  "# TYPE minerd_proxy_getworks_total counter\n");
+		mb_printf(mb, "minerd_proxy_getworks_total{source=\"served\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.getworks));
+		mb_printf(mb, "minerd_proxy_getworks_total{source=\"upstream\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.upstream));
+
+		mb_printf(mb, "# HELP minerd_proxy_shares_total Downstream "
+			  "shares, by result.\n"
+			  "# TYPE minerd_proxy_shares_total counter\n");
+		mb_printf(mb, "minerd_proxy_shares_total{result=\"accepted\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.accepted));
+		mb_printf(mb, "minerd_proxy_shares_total{result=\"rejected\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.rejected));
+		mb_printf(mb, "minerd_proxy_shares_total{result=\"stale\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.stale));
+		mb_printf(mb, "minerd_proxy_shares_total{result=\"duplicate\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.duplicate));
+		mb_printf(mb, "minerd_proxy_shares_total{result=\"unknown\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&proxy_stats.unknown));
+	}
+
+	if (cluster_stats.leases || cluster_workers()) {
+		mb_printf(mb, "# HELP minerd_cluster_workers Worker minerds "
+			  "connected.\n# TYPE minerd_cluster_workers gauge\n"
+			  "minerd_cluster_workers %d\n", cluster_workers());
+		mb_printf(mb, "# HELP minerd_cluster_leases_total Work leases "
+			  "granted, by origin.\n"
+			  "# TYPE minerd_cluster_leases_total counter\n");
+		mb_printf(mb, "minerd_cluster_leases_total{origin=\"fresh\"} "
+			  "%llu\n", (unsigned long long)
+			  (stats_read(&cluster_stats.leases) -
+			   stats_read(&cluster_stats.reclaimed)));
+		mb_printf(mb, "minerd_cluster_leases_total{origin=\"reclaimed\"} "
+			  "%llu\n", (unsigned long long)
+			  stats_read(&cluster_stats.reclaimed));
+		mb_printf(mb, "# HELP minerd_cluster_units_total Work units "
+			  "(ntime offsets) leased.\n"
+			  "# TYPE minerd_cluster_units_total counter\n"
+			  "minerd_cluster_units_total %llu\n", (unsigned long long)
+			  stats_read(&cluster_stats.units));
+	}
+
+	mb_printf(mb, "# HELP minerd_workio_queue_depth Requests queued for "
+		  "the work I/O thread.\n"
+		  "# TYPE minerd_workio_queue_depth gauge\n"
+		  "minerd_workio_queue_depth %d\n", tq_depth(m_workq));
+}
+
+static void metrics_handler(int fd, struct http_request *req, void *arg)
+{
+	struct mbuf mb = { };
+	static const char *nf = "not found\n";
+
+	if (strcmp(req->path, "/metrics")) {
+		http_respond(fd, 404, "text/plain", NULL, nf, strlen(nf));
+		return;
+	}
+
+	build_metrics(&mb);
+	if (mb.failed)
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+	else
+		http_respond(fd, 200, "text/plain; version=0.0.4", NULL,
+			     mb.buf ? mb.buf : "", mb.len);
+	free(mb.buf);
+}
+
+bool metrics_start(int port, int n_threads, struct thread_q *workq)
+{
+	m_threads = n_threads;
+	m_workq = workq;
+
+	if (!http_server_start("127.0.0.1", port, metrics_handler, NULL))
+		return false;
+
+	applog(LOG_INFO, "Metrics available at http://127.0.0.1:%d/metrics",
+	       port);
+	return true;
+}
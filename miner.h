@@ -17,6 +17,12 @@
 #include <jansson.h>
 #include <curl/curl.h>
 
+#if JANSSON_MAJOR_VERSION >= 2
+#define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
+#else
+#define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
+#endif
+
 #ifdef STDC_HEADERS
 # include <stdlib.h>
 # include <stddef.h>
@@ -52,10 +58,16 @@ void *alloca (size_t);
 #define WANT_VIA_PADLOCK 1
 #endif
 
-#if defined(__x86_64__) && defined(__SSE2__) && defined(HAS_YASM)
+#if defined(__x86_64__) && defined(__SSE2__)
 #define WANT_X8664_SSE2 1
 #endif
 
+/* vector extensions with subscripting and scalar operands */
+#if defined(__clang__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)
+#define WANT_SHA256_VEC 1
+#define WANT_SCRYPT 1
+#endif
+
 #if ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3))
 #define WANT_BUILTIN_BSWAP
 #else
@@ -108,6 +120,8 @@ enum {
 #define WANT_CRYPTOPP_ASM32
 #endif
 
+#define MAX_CPUS 1024
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #endif
@@ -116,6 +130,22 @@ struct thr_info {
 	int		id;
 	pthread_t	pth;
 	struct thread_q	*q;
+	int		cpu;		/* bound cpu, or -1 */
+	volatile unsigned int park_mask; /* PARK_xxx reasons, 0 = running */
+	double		khashes;	/* last hashmeter rate, khash/sec */
+	volatile int	algo;		/* scan kernel, swappable at runtime */
+	int		cls;		/* core class of cpu, 0 the fastest */
+	uint32_t	max_nonce;	/* first scan's, or 0 for the default */
+	unsigned int	poll;		/* nonces between restart checks */
+	int		poll_algo;	/* the kernel poll was measured on */
+};
+
+enum park_reasons {
+	PARK_QUOTA		= (1 << 0),	/* over cgroup cpu quota */
+	PARK_COTENANT		= (1 << 1),	/* cpu pressure too high */
+	PARK_SMT		= (1 << 2),	/* SMT sibling busy */
+	PARK_PAUSED		= (1 << 3),	/* paused through the API */
+	PARK_USER		= (1 << 4),	/* above the API thread count */
 };
 
 static inline uint32_t swab32(uint32_t v)
@@ -143,13 +173,38 @@ static inline void swap256(void *dest_p, const void *src_p)
 }
 
 extern bool opt_debug;
+extern bool opt_quiet;
+extern bool opt_scrypt;
 extern bool opt_protocol;
 extern const uint32_t sha256_init_state[];
+extern void sha256_midstate(unsigned char *midstate,
+			    const unsigned char *data);
+extern void sha256d_data(unsigned char *hash, const unsigned char *data);
+extern void sha256d(unsigned char *hash, const unsigned char *data,
+		    size_t len);
+extern void sha256_block(uint32_t *state, const uint32_t *block);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
-			     const char *rpc_req, bool, bool);
+			     const char *rpc_req, bool, bool, char **switch_to);
+extern json_t *json_rpc_call_null(CURL *curl, const char *url,
+				  const char *userpass, const char *rpc_req);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
+enum sha256_algos {
+	ALGO_C,			/* plain C */
+	ALGO_4WAY,		/* parallel SSE2 */
+	ALGO_VIA,		/* VIA padlock */
+	ALGO_CRYPTOPP,		/* Crypto++ (C) */
+	ALGO_CRYPTOPP_ASM32,	/* Crypto++ 32-bit assembly */
+	ALGO_SSE2_64,		/* SSE2 for x86_64 */
+	ALGO_VEC4,		/* portable vectors, 4 lanes */
+	ALGO_VEC8,		/* portable vectors, 8 lanes */
+	ALGO_VEC16,		/* portable vectors, 16 lanes */
+	ALGO_C_ILP,		/* plain C, interleaved nonces */
+	ALGO_SCRYPT,		/* scrypt, not sha256 */
+	ALGO_MAX,
+};
+
 extern unsigned int ScanHash_4WaySSE2(int, const unsigned char *pmidstate,
 	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
@@ -167,6 +222,10 @@ extern bool scanhash_via(int, unsigned char *data_inout,
 extern bool scanhash_c(int, const unsigned char *midstate, unsigned char *data,
 	      unsigned char *hash, const unsigned char *target,
 	      uint32_t max_nonce, unsigned long *hashes_done);
+extern bool scanhash_c_ilp(int, const unsigned char *midstate,
+	unsigned char *data, unsigned char *hash,
+	const unsigned char *target,
+	uint32_t max_nonce, unsigned long *hashes_done);
 extern bool scanhash_cryptopp(int, const unsigned char *midstate,unsigned char *data,
 	      unsigned char *hash, const unsigned char *target,
 	      uint32_t max_nonce, unsigned long *hashes_done);
@@ -178,13 +237,141 @@ extern int scanhash_sse2_64(int, const unsigned char *pmidstate, unsigned char *
 	unsigned char *phash1, unsigned char *phash,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *nHashesDone);
+extern bool scanhash_vec4(int, const unsigned char *midstate,
+	unsigned char *data, unsigned char *hash,
+	const unsigned char *target,
+	uint32_t max_nonce, unsigned long *hashes_done);
+extern bool scanhash_vec8(int, const unsigned char *midstate,
+	unsigned char *data, unsigned char *hash,
+	const unsigned char *target,
+	uint32_t max_nonce, unsigned long *hashes_done);
+extern bool scanhash_vec16(int, const unsigned char *midstate,
+	unsigned char *data, unsigned char *hash,
+	const unsigned char *target,
+	uint32_t max_nonce, unsigned long *hashes_done);
+extern size_t scrypt_scratch_size(void);
+extern bool scrypt_data(unsigned char *hash, const unsigned char *data);
+extern bool scanhash_scrypt(int, unsigned char *data, void *scratchbuf,
+	unsigned char *hash, const unsigned char *target,
+	uint32_t max_nonce, unsigned long *hashes_done);
+
+enum stats_windows {
+	STATS_1M,
+	STATS_5M,
+	STATS_15M,
+	STATS_WINDOWS,
+};
+
+enum share_results {
+	SHARE_ACCEPTED,
+	SHARE_REJECTED,
+	SHARE_STALE,		/* block changed before submission */
+};
+
+/* per-thread counters, written only by their miner thread */
+struct thr_stats {
+	volatile uint64_t	hashes;
+	volatile uint64_t	scan_usecs;	/* time in scanhash */
+	volatile uint64_t	wait_usecs;	/* time in get_work */
+	char			padding[128 - 3 * sizeof(uint64_t)];
+};
+
+struct share_stats {
+	volatile uint64_t	accepted;
+	volatile uint64_t	rejected;
+	volatile uint64_t	stale;
+};
+
+static inline void stats_add(volatile uint64_t *ctr, uint64_t v)
+{
+	__sync_fetch_and_add(ctr, v);
+}
+
+/* untorn read, even on 32-bit hosts */
+static inline uint64_t stats_read(volatile uint64_t *ctr)
+{
+	return __sync_fetch_and_add(ctr, 0);
+}
+
+#define HIST_BUCKETS 18
+
+struct histogram {
+	volatile uint64_t	count;
+	volatile uint64_t	sum_usecs;
+	volatile uint64_t	bucket[HIST_BUCKETS + 1];	/* last: +Inf */
+};
+
+enum rpc_kinds {
+	RPC_GETWORK,
+	RPC_SUBMIT,
+	RPC_LONGPOLL,
+	RPC_KINDS,
+};
+
+extern const double hist_bounds[HIST_BUCKETS];
+extern struct histogram rpc_latency[RPC_KINDS];
+extern struct histogram restart_latency;
+extern void hist_observe(struct histogram *h, uint64_t usecs);
+
+/* HDR-style: 2^HDR_SUB_BITS linear buckets per power of two of usecs */
+#define HDR_SUB_BITS 4
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS 40
+#define HDR_BUCKETS ((HDR_MAX_BITS - HDR_SUB_BITS + 1) * HDR_SUB)
+
+struct hdr_histogram {
+	volatile uint64_t	count;
+	volatile uint64_t	sum_usecs;
+	volatile uint64_t	max_usecs;
+	volatile uint64_t	bucket[HDR_BUCKETS];
+};
+
+enum trace_stages {
+	TRACE_RPC_CONNECT,	/* json_rpc_call: until connected */
+	TRACE_RPC_SEND,		/* until the request is sent */
+	TRACE_RPC_WAIT,		/* until the first byte of the reply */
+	TRACE_RPC_RECV,		/* until the last byte */
+	TRACE_RPC_PARSE,	/* decoding the reply */
+	TRACE_QUEUE,		/* waiting in a thread_q */
+	TRACE_GET_WORK,		/* miner thread blocked in get_work */
+	TRACE_SCAN,		/* one scanhash call */
+	TRACE_RESTART,		/* new block until the thread notices */
+	TRACE_SHARE_QUEUE,	/* share found until workio picks it up */
+	TRACE_SHARE_SUBMIT,	/* submission until the pool's verdict */
+	TRACE_SHARE_TOTAL,	/* share found until its verdict */
+	TRACE_STAGES,
+};
+
+extern bool trace_active;
+extern struct hdr_histogram trace_hist[TRACE_STAGES];
+extern const char *trace_stage_names[TRACE_STAGES];
+extern uint64_t trace_now(void);
+extern uint64_t hdr_percentile(struct hdr_histogram *h, double q);
+extern bool trace_open(const char *path);
+extern void trace_observe(enum trace_stages stage, uint64_t usecs);
+extern void trace_span(enum trace_stages stage, uint64_t start, uint64_t end,
+		       const char *args);
+extern void trace_share(uint64_t found, enum share_results result);
+extern void trace_instant(const char *name);
+extern void trace_thread(const char *name);
+
+extern struct thr_stats *thr_stats;
+extern struct share_stats share_stats;
+extern bool stats_init(int n_threads);
+extern bool stats_start(int interval);
+extern void stats_share(enum share_results result);
+extern double stats_rate(int thr_id, enum stats_windows window);
+extern double stats_duty(int thr_id);
 
 extern int
 timeval_subtract (struct timeval *result, struct timeval *x, struct timeval *y);
+extern uint64_t usecs_since(const struct timeval *start);
 
 extern bool fulltest(const unsigned char *hash, const unsigned char *target);
 
 extern int opt_scantime;
+extern int opt_pool_probe;
+extern int opt_timeout;
 extern bool want_longpoll;
 extern bool have_longpoll;
 struct thread_q;
@@ -200,12 +387,320 @@ extern struct thr_info *thr_info;
 extern int longpoll_thr_id;
 extern struct work_restart *work_restart;
 
+/* Per-kernel scan parameters, indexed by algo */
+struct scan_tune {
+	unsigned int	batch;		/* nonces per pass, where it varies */
+};
+
+extern struct scan_tune scan_tune[ALGO_MAX];
+extern int restart_budget;
+extern void tune_observe(int thr_id, int algo, unsigned long hashes,
+			 uint64_t usecs);
+extern bool tune_batch(int algo);
+extern int tune_smt(int n_threads, int smt_algo);
+extern bool tune_classes(int n_threads, int scantime);
+
+/* Nonces between restart checks for thread 'thr_id' scanning with
+ * 'algo'; 0, every pass, until a scan with it has measured the rate
+ */
+static inline unsigned int scan_poll(int thr_id, int algo)
+{
+	return thr_info[thr_id].poll_algo == algo ? thr_info[thr_id].poll : 0;
+}
+
+/* For the end of a kernel pass, having scanned 'n' nonces: true if a
+ * restart is due.  The flag is read only once 'n' reaches '*poll_at'.
+ */
+static inline bool scan_restart(int thr_id, uint32_t n, uint32_t *poll_at,
+				unsigned int poll)
+{
+	if (likely(n < *poll_at))
+		return false;
+	*poll_at = n + poll;
+	return work_restart[thr_id].restart;
+}
+
+enum perf_counters {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,	/* L1 data cache read misses */
+	PERF_COUNTERS,
+};
+
+enum perf_modes {
+	PERF_MODE_OFF,
+	PERF_MODE_EVENTS,	/* perf_event_open counters */
+	PERF_MODE_TSC,		/* time stamp counter as cycles */
+};
+
+/* counter totals over scans, and the hashes they took */
+struct perf_totals {
+	volatile uint64_t	hashes;
+	volatile uint64_t	count[PERF_COUNTERS];
+};
+
+extern int perf_mode;
+extern bool perf_init(int n_threads);
+extern void perf_thread_start(int thr_id);
+extern void perf_scan_begin(int thr_id);
+extern void perf_scan_end(int thr_id, int algo, unsigned long hashes);
+extern bool perf_scan_summary(int thr_id, char *buf, size_t len);
+extern double perf_cycles_per_hash(int thr_id);
+extern double perf_ipc(int thr_id);
+extern void perf_log(void);
+
+enum cpu_policies {
+	CPU_POLICY_AUTO,	/* pin only if threads divide cpus evenly */
+	CPU_POLICY_NONE,	/* never pin */
+	CPU_POLICY_COMPACT,	/* fill SMT siblings, then cores, then nodes */
+	CPU_POLICY_SPREAD,	/* one per core, round-robin across nodes */
+	CPU_POLICY_CORE,	/* one thread per physical core */
+	CPU_POLICY_LIST,	/* explicit --cpu-affinity list */
+};
+
+extern int cpu_policy_parse(const char *name);
+extern const char *cpu_policy_name(enum cpu_policies policy);
+extern int cpulist_parse(const char *s, int *cpus, int max);
+extern bool topo_init(enum cpu_policies policy, const char *cpu_list);
+extern int topo_num_cpus(void);
+extern int topo_num_cores(void);
+extern int topo_default_threads(void);
+extern int topo_thread_cpu(int thr_id, int n_threads);
+extern void topo_log(int n_threads);
+extern int topo_cpu_core(int cpu);
+extern int topo_num_classes(void);
+extern int topo_cpu_class(int cpu);
+extern void *topo_alloc_local(size_t len);
+extern void topo_free_local(void *p, size_t len);
+extern void *topo_alloc_huge(size_t len);
+extern void topo_free_huge(void *p, size_t len);
+
+extern bool cgroup_init(void);
+extern double cgroup_cpu_quota(void);
+extern int cgroup_cpuset_cpus(void);
+extern int cgroup_cpu_limit(void);
+
+extern bool cotenant_start(int n_threads, double threshold, bool smt);
+
+extern void thread_park(int thr_id, unsigned int reason, bool park);
+extern int algo_parse(const char *name);
+extern bool algo_is_scrypt(int algo);
+extern const char *algo_name(int algo);
+
 extern void applog(int prio, const char *fmt, ...);
+
+enum log_formats {
+	LOG_FORMAT_TEXT,
+	LOG_FORMAT_JSON,	/* one object per line */
+};
+
+extern enum log_formats log_format;
+extern int log_rate;
+extern int log_format_parse(const char *name);
+extern bool log_start(void);
 extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern int tq_depth(struct thread_q *tq);
+
+struct http_request {
+	char		method[16];
+	char		path[256];
+	char		*headers;	/* raw header lines */
+	char		*body;		/* nul terminated */
+	size_t		body_len;
+	bool		keepalive;
+};
+
+typedef void (*http_handler_t)(int fd, struct http_request *req, void *arg);
+
+extern int http_listen(const char *host, int port);
+extern bool http_server_start(const char *host, int port,
+			      http_handler_t handler, void *arg);
+extern bool http_respond(int fd, int status, const char *content_type,
+			 const char *extra, const char *body, size_t len);
+extern const char *http_header(const struct http_request *req,
+			       const char *name, char *buf, size_t buflen);
+
+extern bool metrics_start(int port, int n_threads, struct thread_q *workq);
+
+extern bool api_start(int port, int n_threads, const char *token);
+
+#define MAX_POOLS 16
+
+struct pool {
+	int		id;		/* position on the command line */
+	int		prio;		/* lower is preferred */
+	char		*url;
+	char		*user, *pass;
+	char		*userpass;
+	int		weight;		/* for --pool-balance weighted */
+
+	bool		alive;		/* last request or probe succeeded */
+	int		ok_streak;	/* successes since the last failure */
+	double		rtt;		/* smoothed round trip, seconds */
+	uint64_t	requests;
+	uint64_t	failures;
+	time_t		since;		/* 'alive' last changed */
+	uint64_t	up_secs, down_secs;	/* before 'since' */
+
+	uint64_t	accepted, rejected, stale;
+	uint64_t	picks;		/* getworks sent here by balancing */
+	double		credit;		/* weighted round robin state */
+};
+
+enum pool_policies {
+	POOL_FAILOVER,		/* all work from the preferred live pool */
+	POOL_WEIGHTED,		/* in proportion to --pool-weight */
+	POOL_RTT,		/* in inverse proportion to round trip */
+	POOL_STALE,		/* in inverse proportion to stale rate */
+};
+
+extern struct pool pools[MAX_POOLS];
+extern int n_pools;
+extern struct pool *cur_pool;
+extern pthread_mutex_t pool_lock;
+extern enum pool_policies pool_policy;
+extern int pool_policy_parse(const char *name);
+extern const char *pool_policy_name(enum pool_policies policy);
+extern void pool_share(struct pool *pool, enum share_results result);
+extern struct pool *pool_pick(void);
+extern struct pool *pool_add(const char *url, const char *userpass);
+extern struct pool *pool_find(const char *url);
+extern bool pool_finalize(bool need_creds);
+extern void pool_result(struct pool *pool, bool ok, uint64_t usecs);
+extern double pool_uptime(struct pool *pool);
+extern struct pool *pool_next(struct pool *cur);
+extern bool pool_redirect(struct pool *pool, const char *switch_to);
+extern void pool_prefer(struct pool *pool);
+extern bool pool_probe_start(int interval);
+extern void pool_log(void);
+extern bool pool_switch(struct pool *pool, const char *userpass,
+			bool restart);
+
+struct work {
+	unsigned char	data[128];
+	unsigned char	hash1[64];
+	unsigned char	midstate[32];
+	unsigned char	target[32];
+
+	unsigned char	hash[32];
+
+	unsigned long	gen;		/* work_gen when fetched */
+	struct pool	*pool;		/* where it came from */
+	uint32_t	lease;		/* cluster lease it came from */
+	uint32_t	record;		/* --work-file record it came from */
+	int		journal;	/* share journal slot, 0 = none yet */
+	uint64_t	found_us;	/* trace_now() when found, 0 = not */
+};
+
+/* Header time, stored big-endian in getwork data; rolling it gives new
+ * work with the same midstate
+ */
+static inline uint32_t work_ntime(const struct work *work)
+{
+	const unsigned char *p = work->data + 68;
+
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	       ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void work_set_ntime(struct work *work, uint32_t ntime)
+{
+	unsigned char *p = work->data + 68;
+
+	p[0] = ntime >> 24;
+	p[1] = ntime >> 16;
+	p[2] = ntime >> 8;
+	p[3] = ntime;
+}
+
+extern bool journal_open(const char *path);
+extern int journal_add(const struct work *work);
+extern void journal_done(int slot, bool delivered);
+extern void journal_block(const struct work *work);
+
+extern bool merged_mining;
+extern const char merged_gbt_req[];
+extern bool merged_init(const char *url, const char *userpass,
+			const char *script);
+extern bool merged_get_work(CURL *curl, struct work *work, struct pool *pool,
+			    bool *new_block);
+extern bool merged_check(const struct work *work);
+extern bool merged_submit(CURL *curl, const struct work *work,
+			  bool *accepted);
+
+extern bool workfile_open(const char *in, const char *out, int n_threads);
+extern bool workfile_get_work(int thr_id, struct work *work);
+extern bool workfile_submit(const struct work *work);
+extern void workfile_wait(void);
+
+extern bool get_work(struct thr_info *thr, struct work *work);
+extern void benchmark_work(struct work *work);
+extern int scan_work(int algo, int thr_id, struct work *work,
+		     void *scratchbuf, uint32_t max_nonce,
+		     unsigned long *hashes_done);
+extern bool submit_work_sync(const struct work *work,
+			     enum share_results *result);
+
+struct proxy_stats {
+	volatile uint64_t	getworks;	/* work handed downstream */
+	volatile uint64_t	upstream;	/* of which fetched upstream */
+	volatile uint64_t	accepted, rejected, stale;
+	volatile uint64_t	duplicate;	/* dropped, already relayed */
+	volatile uint64_t	unknown;	/* dropped, not our work */
+};
+
+extern struct proxy_stats proxy_stats;
+extern bool proxy_start(const char *host, int port, int roll);
+extern void proxy_restart(void);
+extern bool proxy_running(void);
+
+struct cluster_stats {
+	volatile uint64_t	leases;		/* granted to workers */
+	volatile uint64_t	reclaimed;	/* of which from dead workers */
+	volatile uint64_t	units;		/* work units leased */
+};
+
+extern struct cluster_stats cluster_stats;
+extern bool cluster_listen(const char *addr);
+extern bool cluster_join(const char *addr, int n_threads);
+extern bool cluster_get_work(struct work *work);
+extern bool cluster_submit(const struct work *work);
+extern void cluster_restart(void);
+extern int cluster_workers(void);
+extern void restart_threads(void);
+
+/* --record file: a header, then one entry per RPC exchange, each followed
+ * by its long poll path, request and response; host byte order
+ */
+#define RECORD_MAGIC	"MINERREC"
+#define RECORD_VERSION	1
+#define RECORD_ORDER	0x01020304
+
+struct record_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	order;		/* RECORD_ORDER as written */
+};
+
+struct record_ent {
+	uint64_t	t_usecs;	/* request sent, since recording began */
+	uint32_t	dur_usecs;	/* until the response was complete */
+	uint32_t	req_len;
+	uint32_t	resp_len;
+	uint16_t	lp_len;		/* X-Long-Polling path, if any */
+	uint8_t		kind;		/* enum rpc_kinds */
+	uint8_t		ok;		/* 0: the request failed */
+};
+
+extern bool record_open(const char *path);
+extern bool record_enabled(void);
+extern void record_rpc(const struct timeval *start, bool longpoll,
+		       const char *req, const char *resp, const char *lp_path);
 
 #endif /* __MINER_H__ */
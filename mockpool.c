@@ -0,0 +1,1057 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * mock-pool: a getwork server for testing minerd without bitcoind.
+ *
+ * Hands out valid, distinct work for a made-up block chain that moves on
+ * every -B seconds, and checks each share by hashing its header again,
+ * with a SHA-256 of its own rather than one of minerd's kernels.  Shares
+ * are accepted, or rejected as stale (for an earlier block), duplicate,
+ * unknown (not our work) or above target.  Latency and failures can be
+ * injected, long polling and JSON-RPC batches are supported, and the
+ * counts are logged periodically, which is enough to load a single box
+ * with a hundred miner threads and watch the stale and reject rates.
+ *
+ * Work identifies itself: the merkle root carries a serial number and a
+ * tag picked at startup, so shares are matched without searching.
+ *
+ * For merged mining it also plays a node of either chain.  As the parent,
+ * it serves block templates (getblocktemplate) with a few made-up
+ * transactions, and checks submitted blocks (submitblock): the header
+ * hash, the transactions, the merkle root.  As the aux chain, it serves
+ * a block hash to commit to (getauxblock) and checks the proof of work
+ * submitted for it: the commitment in the coinbase, the coinbase's
+ * merkle branch to the parent header, and that header's hash.  A block
+ * found, by either route, moves the chain on.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define MOCK_WORKS	65536	/* work remembered for share checking */
+#define MOCK_SEEN	16384	/* shares remembered for duplicates */
+#define MOCK_TXS	64	/* most transactions in a template */
+#define MOCK_TX_LEN	256	/* longest made-up transaction */
+
+enum mock_results {
+	MOCK_ACCEPTED,
+	MOCK_STALE,
+	MOCK_DUPLICATE,
+	MOCK_UNKNOWN,
+	MOCK_HIGH_HASH,
+	MOCK_INVALID,
+	MOCK_RESULTS,
+};
+
+static const char *result_names[MOCK_RESULTS] = {
+	[MOCK_ACCEPTED]		= "accepted",
+	[MOCK_STALE]		= "stale",
+	[MOCK_DUPLICATE]	= "duplicate",
+	[MOCK_UNKNOWN]		= "unknown-work",
+	[MOCK_HIGH_HASH]	= "high-hash",
+	[MOCK_INVALID]		= "invalid",
+};
+
+struct mock_work {
+	uint64_t	serial;
+	unsigned long	block;
+};
+
+struct mock_tx {
+	unsigned char	data[MOCK_TX_LEN];
+	size_t		len;
+	unsigned char	txid[32];
+};
+
+static int zero_bits = 32;		/* share target */
+static int latency_ms;
+static double error_rate;
+static bool longpoll = true;
+static int block_secs = 60;
+static bool debug;
+static int n_txs = 3;
+
+static unsigned char target[32];	/* little endian, as in getwork */
+static uint64_t tag;			/* in every merkle root of ours */
+
+/* the state below is guarded by mock_lock */
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t block_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long block;		/* height of the chain tip */
+static uint32_t prevhash[8];
+static uint64_t n_works;
+static struct mock_work works[MOCK_WORKS];
+static uint64_t seen[MOCK_SEEN];
+static unsigned long n_seen;
+static uint64_t rng_state;
+static struct mock_tx txs[MOCK_TXS];	/* in the next block */
+static unsigned char aux_hash[32];	/* aux block to commit to */
+
+static struct {
+	volatile uint64_t getworks, templates, longpolls, errors;
+	volatile uint64_t shares[MOCK_RESULTS];
+} counts;
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/* One SHA-256 block, given as sixteen big-endian words */
+static void sha256_compress(uint32_t *state, const uint32_t *block)
+{
+	uint32_t W[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = block[i];
+	for (i = 16; i < 64; i++)
+		W[i] = (ROR(W[i-2], 17) ^ ROR(W[i-2], 19) ^ (W[i-2] >> 10)) +
+		       W[i-7] +
+		       (ROR(W[i-15], 7) ^ ROR(W[i-15], 18) ^ (W[i-15] >> 3)) +
+		       W[i-16];
+
+	memcpy(s, state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + K[i] + W[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += s[i];
+}
+
+/* SHA-256d of an 80 byte header held as big-endian words, with the
+ * padding of the first hash already in words 20..31
+ */
+static void sha256d_header(uint32_t *hash, const uint32_t *header)
+{
+	uint32_t state[8], block[16];
+	int i;
+
+	memcpy(state, H0, sizeof(state));
+	sha256_compress(state, header);
+	sha256_compress(state, header + 16);
+
+	memcpy(block, state, sizeof(state));
+	block[8] = 0x80000000;
+	for (i = 9; i < 15; i++)
+		block[i] = 0;
+	block[15] = 256;
+	memcpy(hash, H0, sizeof(H0));
+	sha256_compress(hash, block);
+}
+
+/* SHA-256d of a byte string, as transactions and merkle nodes are hashed;
+ * the digest in byte order
+ */
+static void sha256d_bytes(unsigned char *digest, const unsigned char *p,
+			  size_t len)
+{
+	uint32_t state[8], block[16];
+	size_t i, n = (len + 9 + 63) / 64 * 64;
+	int k;
+
+	memcpy(state, H0, sizeof(state));
+	memset(block, 0, sizeof(block));
+	for (i = 0; i < n; i++) {
+		unsigned int c = i < len ? p[i] : i == len ? 0x80 : 0;
+
+		if (i >= n - 8)
+			c = ((uint64_t) len * 8) >> (8 * (n - 1 - i)) & 0xff;
+		block[i % 64 / 4] |= c << (24 - 8 * (i % 4));
+		if (i % 64 == 63) {
+			sha256_compress(state, block);
+			memset(block, 0, sizeof(block));
+		}
+	}
+
+	memcpy(block, state, sizeof(state));
+	block[8] = 0x80000000;
+	for (k = 9; k < 15; k++)
+		block[k] = 0;
+	block[15] = 256;
+	memcpy(state, H0, sizeof(H0));
+	sha256_compress(state, block);
+	for (k = 0; k < 32; k++)
+		digest[k] = state[k / 4] >> (24 - 8 * (k % 4));
+}
+
+static void le32enc(unsigned char *p, uint32_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static uint32_t le32dec(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static json_t *hex_string(const unsigned char *p, size_t len)
+{
+	char s[2 * MOCK_TX_LEN + 1];
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(s + 2 * i, "%02x", p[i]);
+	s[2 * len] = 0;
+	return json_string(s);
+}
+
+/* A hash or target for display: reversed */
+static json_t *hex_string_rev(const unsigned char *p, size_t len)
+{
+	unsigned char buf[32];
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = p[len - 1 - i];
+	return hex_string(buf, len);
+}
+
+/* getwork byte order: every header word little endian */
+static json_t *words_hex(const uint32_t *words, int n)
+{
+	unsigned char buf[128];
+	int i;
+
+	for (i = 0; i < n; i++)
+		le32enc(buf + 4 * i, words[i]);
+	return hex_string(buf, 4 * n);
+}
+
+static bool hex_decode(unsigned char *p, const char *hex, size_t len)
+{
+	unsigned int v;
+
+	if (strlen(hex) < 2 * len)
+		return false;
+	while (len--) {
+		if (!isxdigit(hex[0]) || !isxdigit(hex[1]) ||
+		    sscanf(hex, "%2x", &v) != 1)
+			return false;
+		*p++ = v;
+		hex += 2;
+	}
+	return true;
+}
+
+/* xorshift64*; caller holds mock_lock */
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* Caller holds mock_lock */
+static void new_block(void)
+{
+	int i;
+
+	block++;
+	for (i = 0; i < 8; i++)
+		prevhash[i] = rng();
+	n_seen = 0;
+
+	for (i = 0; i < n_txs; i++) {
+		struct mock_tx *tx = &txs[i];
+		size_t k;
+
+		tx->len = 60 + rng() % (MOCK_TX_LEN - 60);
+		for (k = 0; k < tx->len; k++)
+			tx->data[k] = rng();
+		sha256d_bytes(tx->txid, tx->data, tx->len);
+	}
+	for (i = 0; i < 32; i++)
+		aux_hash[i] = rng();
+	pthread_cond_broadcast(&block_cond);
+}
+
+static json_t *make_work(void)
+{
+	uint32_t data[32], midstate[8], hash1[16];
+	struct mock_work *w;
+	json_t *res;
+	int i;
+
+	memset(data, 0, sizeof(data));
+
+	pthread_mutex_lock(&mock_lock);
+	w = &works[n_works % MOCK_WORKS];
+	w->serial = n_works++;
+	w->block = block;
+	data[0] = 1;				/* version */
+	memcpy(data + 1, prevhash, sizeof(prevhash));
+	data[9] = w->serial >> 32;		/* merkle root */
+	data[10] = w->serial;
+	data[11] = tag >> 32;
+	data[12] = tag;
+	for (i = 13; i < 17; i++)
+		data[i] = rng();
+	pthread_mutex_unlock(&mock_lock);
+
+	data[17] = time(NULL);			/* ntime */
+	data[18] = 0x1d00ffff;			/* nbits */
+	data[20] = 0x80000000;			/* SHA-256 padding */
+	data[31] = 80 * 8;
+
+	memcpy(midstate, H0, sizeof(midstate));
+	sha256_compress(midstate, data);
+
+	memset(hash1, 0, sizeof(hash1));
+	hash1[8] = 0x80000000;
+	hash1[15] = 256;
+
+	res = json_object();
+	json_object_set_new(res, "midstate", words_hex(midstate, 8));
+	json_object_set_new(res, "data", words_hex(data, 32));
+	json_object_set_new(res, "hash1", words_hex(hash1, 16));
+	json_object_set_new(res, "target", hex_string(target, sizeof(target)));
+
+	stats_add(&counts.getworks, 1);
+	return res;
+}
+
+static enum mock_results check_share(const unsigned char *buf)
+{
+	uint32_t header[32], hash[8];
+	unsigned char digest[32];
+	enum mock_results result;
+	uint64_t serial, id;
+	int i, n;
+
+	for (i = 0; i < 32; i++)
+		header[i] = le32dec(buf + 4 * i);
+	serial = ((uint64_t) header[9] << 32) | header[10];
+	if ((((uint64_t) header[11] << 32) | header[12]) != tag)
+		return MOCK_UNKNOWN;
+
+	/* hash the header as the chain would, not as getwork has it */
+	header[20] = 0x80000000;
+	for (i = 21; i < 31; i++)
+		header[i] = 0;
+	header[31] = 80 * 8;
+	sha256d_header(hash, header);
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = hash[i] >> 24;
+		digest[4 * i + 1] = hash[i] >> 16;
+		digest[4 * i + 2] = hash[i] >> 8;
+		digest[4 * i + 3] = hash[i];
+	}
+	for (i = 31; i >= 0 && digest[i] == target[i]; i--)
+		;
+	if (i >= 0 && digest[i] > target[i])
+		return MOCK_HIGH_HASH;
+	memcpy(&id, digest, sizeof(id));
+
+	pthread_mutex_lock(&mock_lock);
+	if (serial >= n_works || works[serial % MOCK_WORKS].serial != serial)
+		result = MOCK_UNKNOWN;
+	else if (works[serial % MOCK_WORKS].block != block)
+		result = MOCK_STALE;
+	else {
+		result = MOCK_ACCEPTED;
+		n = n_seen < MOCK_SEEN ? n_seen : MOCK_SEEN;
+		for (i = 0; i < n; i++)
+			if (seen[i] == id) {
+				result = MOCK_DUPLICATE;
+				break;
+			}
+		if (result == MOCK_ACCEPTED)
+			seen[n_seen++ % MOCK_SEEN] = id;
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return result;
+}
+
+static json_t *submit(const char *hexdata, const char **why)
+{
+	unsigned char buf[128];
+	enum mock_results result;
+
+	if (!hex_decode(buf, hexdata, sizeof(buf))) {
+		*why = "malformed share";
+		return NULL;
+	}
+
+	result = check_share(buf);
+	stats_add(&counts.shares[result], 1);
+	applog(LOG_DEBUG, "share %s", result_names[result]);
+
+	return result == MOCK_ACCEPTED ? json_true() : json_false();
+}
+
+/* Caller holds mock_lock */
+static void prevhash_bytes(unsigned char *p)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		p[i] = prevhash[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static json_t *make_template(void)
+{
+	unsigned char prev[32];
+	json_t *res, *arr;
+	int i;
+
+	res = json_object();
+	arr = json_array();
+
+	pthread_mutex_lock(&mock_lock);
+	prevhash_bytes(prev);
+	json_object_set_new(res, "previousblockhash",
+			    hex_string_rev(prev, 32));
+	json_object_set_new(res, "height", json_integer(block));
+	for (i = 0; i < n_txs; i++) {
+		json_t *tx = json_object();
+
+		json_object_set_new(tx, "data",
+				    hex_string(txs[i].data, txs[i].len));
+		json_object_set_new(tx, "txid", hex_string_rev(txs[i].txid, 32));
+		json_object_set_new(tx, "hash", hex_string_rev(txs[i].txid, 32));
+		json_array_append_new(arr, tx);
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	json_object_set_new(res, "version", json_integer(0x20000000));
+	json_object_set_new(res, "transactions", arr);
+	json_object_set_new(res, "coinbasevalue", json_integer(625000000));
+	json_object_set_new(res, "target", hex_string_rev(target, 32));
+	json_object_set_new(res, "curtime", json_integer(time(NULL)));
+	json_object_set_new(res, "bits", json_string("1d00ffff"));
+
+	stats_add(&counts.templates, 1);
+	return res;
+}
+
+static bool varint(const unsigned char **p, const unsigned char *end,
+		   uint64_t *v)
+{
+	const unsigned char *q = *p;
+	int n, k;
+
+	if (q >= end)
+		return false;
+	n = *q == 0xff ? 8 : *q == 0xfe ? 4 : *q == 0xfd ? 2 : 0;
+	if (end - q < 1 + n)
+		return false;
+	if (!n)
+		*v = *q;
+	else
+		for (*v = 0, k = n; k; k--)
+			*v = (*v << 8) | q[k];
+	*p = q + 1 + n;
+	return true;
+}
+
+/* Skip a varint-sized field; false if it overruns */
+static bool skip_field(const unsigned char **p, const unsigned char *end,
+		       uint64_t scale)
+{
+	uint64_t n;
+
+	if (!varint(p, end, &n) || n > (uint64_t)(end - *p) / scale)
+		return false;
+	*p += n * scale;
+	return true;
+}
+
+/* Parse a transaction at *p, with or without witness: its txid, and the
+ * script of its first input
+ */
+static bool tx_parse(const unsigned char **p, const unsigned char *end,
+		     unsigned char *txid, const unsigned char **script,
+		     size_t *script_len)
+{
+	const unsigned char *q = *p, *ins, *outs_end;
+	unsigned char *strip;
+	uint64_t n_in, n_out, i;
+	bool witness;
+	size_t len;
+
+	if (end - q < 10)
+		return false;
+	witness = q[4] == 0 && q[5] == 1;
+	ins = q + (witness ? 6 : 4);
+	q = ins;
+	if (!varint(&q, end, &n_in) || !n_in)
+		return false;
+	for (i = 0; i < n_in; i++) {
+		if (end - q < 36)
+			return false;
+		q += 36;
+		if (i == 0) {
+			const unsigned char *s = q;
+			uint64_t n;
+
+			if (!varint(&s, end, &n) || n > (uint64_t)(end - s))
+				return false;
+			*script = s;
+			*script_len = n;
+		}
+		if (!skip_field(&q, end, 1) || end - q < 4)
+			return false;
+		q += 4;
+	}
+	if (!varint(&q, end, &n_out))
+		return false;
+	for (i = 0; i < n_out; i++) {
+		if (end - q < 8)
+			return false;
+		q += 8;
+		if (!skip_field(&q, end, 1))
+			return false;
+	}
+	outs_end = q;
+	if (witness)
+		for (i = 0; i < n_in; i++) {
+			uint64_t items, k;
+
+			if (!varint(&q, end, &items))
+				return false;
+			for (k = 0; k < items; k++)
+				if (!skip_field(&q, end, 1))
+					return false;
+		}
+	if (end - q < 4)
+		return false;
+
+	/* the txid leaves the witness out */
+	len = 4 + (outs_end - ins) + 4;
+	strip = malloc(len);
+	if (!strip)
+		return false;
+	memcpy(strip, *p, 4);
+	memcpy(strip + 4, ins, outs_end - ins);
+	memcpy(strip + len - 4, q, 4);
+	sha256d_bytes(txid, strip, len);
+	free(strip);
+
+	*p = q + 4;
+	return true;
+}
+
+/* Header hash against our target; 'h' is the 80 byte header */
+static bool header_ok(const unsigned char *h, unsigned char *digest)
+{
+	int i;
+
+	sha256d_bytes(digest, h, 80);
+	for (i = 31; i >= 0 && digest[i] == target[i]; i--)
+		;
+	return i < 0 || digest[i] < target[i];
+}
+
+static unsigned char *hex_alloc(const char *hex, size_t *len)
+{
+	unsigned char *buf;
+
+	*len = strlen(hex) / 2;
+	buf = malloc(*len + 1);
+	if (buf && (strlen(hex) % 2 || !hex_decode(buf, hex, *len))) {
+		free(buf);
+		buf = NULL;
+	}
+	return buf;
+}
+
+static enum mock_results check_block(const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf + 80, *end = buf + len, *script;
+	unsigned char prev[32], digest[32], root[32], pair[64];
+	enum mock_results result = MOCK_ACCEPTED;
+	size_t script_len;
+	uint64_t n;
+	int i;
+
+	if (len < 81 || !varint(&p, end, &n) || n < 1 ||
+	    !tx_parse(&p, end, root, &script, &script_len))
+		return MOCK_INVALID;
+	if (!header_ok(buf, digest))
+		return MOCK_HIGH_HASH;
+
+	pthread_mutex_lock(&mock_lock);
+	prevhash_bytes(prev);
+	if (memcmp(buf + 4, prev, 32))
+		result = MOCK_STALE;
+	else if (n != 1 + n_txs)
+		result = MOCK_INVALID;
+	for (i = 0; i < n_txs && result == MOCK_ACCEPTED; i++) {
+		if ((size_t)(end - p) < txs[i].len ||
+		    memcmp(p, txs[i].data, txs[i].len))
+			result = MOCK_INVALID;
+		p += txs[i].len;
+	}
+
+	/* the merkle root over the coinbase and our transactions */
+	if (result == MOCK_ACCEPTED) {
+		unsigned char level[MOCK_TXS + 1][32];
+		int count = n_txs + 1, k;
+
+		memcpy(level[0], root, 32);
+		for (i = 0; i < n_txs; i++)
+			memcpy(level[i + 1], txs[i].txid, 32);
+		for (; count > 1; count = (count + 1) / 2)
+			for (k = 0; 2 * k < count; k++) {
+				memcpy(pair, level[2 * k], 32);
+				memcpy(pair + 32, level[2 * k + 1 < count ?
+							2 * k + 1 : 2 * k], 32);
+				sha256d_bytes(level[k], pair, 64);
+			}
+		if (p != end || memcmp(level[0], buf + 36, 32))
+			result = MOCK_INVALID;
+	}
+	if (result == MOCK_ACCEPTED) {
+		applog(LOG_INFO, "block %lu found", block);
+		new_block();
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return result;
+}
+
+/* submitblock: null if accepted, else why not */
+static json_t *submit_block(const char *hex, const char **why)
+{
+	enum mock_results result;
+	unsigned char *buf;
+	size_t len;
+
+	buf = hex ? hex_alloc(hex, &len) : NULL;
+	if (!buf) {
+		*why = "malformed block";
+		return NULL;
+	}
+	result = check_block(buf, len);
+	free(buf);
+
+	stats_add(&counts.shares[result], 1);
+	applog(LOG_DEBUG, "block %s", result_names[result]);
+	return result == MOCK_ACCEPTED ? json_null() :
+	       json_string(result_names[result]);
+}
+
+static json_t *make_aux(void)
+{
+	unsigned char t[32];
+	json_t *res = json_object();
+	int i;
+
+	pthread_mutex_lock(&mock_lock);
+	json_object_set_new(res, "hash", hex_string(aux_hash, 32));
+	json_object_set_new(res, "height", json_integer(block));
+	pthread_mutex_unlock(&mock_lock);
+
+	for (i = 0; i < 32; i++)
+		t[i] = target[31 - i];
+	json_object_set_new(res, "chainid", json_integer(1));
+	json_object_set_new(res, "_target", hex_string(target, 32));
+	json_object_set_new(res, "target", hex_string(t, 32));
+
+	stats_add(&counts.templates, 1);
+	return res;
+}
+
+static enum mock_results check_aux(const unsigned char *hash,
+				   const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = buf + len, *script, *header;
+	unsigned char root[32], digest[32], pair[64];
+	enum mock_results result = MOCK_ACCEPTED;
+	size_t script_len, k;
+	uint64_t n, i;
+
+	/* the coinbase and the parent block hash */
+	if (!tx_parse(&p, end, root, &script, &script_len) || end - p < 32)
+		return MOCK_INVALID;
+	p += 32;
+
+	/* the coinbase branch, with index 0, to the parent's merkle root */
+	if (!varint(&p, end, &n) || n > (uint64_t)(end - p) / 32)
+		return MOCK_INVALID;
+	for (i = 0; i < n; i++, p += 32) {
+		memcpy(pair, root, 32);
+		memcpy(pair + 32, p, 32);
+		sha256d_bytes(root, pair, 64);
+	}
+	if (end - p < 4)
+		return MOCK_INVALID;
+	p += 4;
+
+	/* we are the only aux chain: an empty chain branch */
+	if (!varint(&p, end, &n) || n || end - p != 4 + 80)
+		return MOCK_INVALID;
+	header = p + 4;
+	if (memcmp(root, header + 36, 32))
+		return MOCK_INVALID;
+
+	/* our block's hash, committed to in the merged mining form */
+	for (k = 0; k + 36 <= script_len; k++)
+		if (!memcmp(script + k, "\xfa\xbe\x6d\x6d", 4) &&
+		    !memcmp(script + k + 4, hash, 32))
+			break;
+	if (k + 36 > script_len)
+		return MOCK_INVALID;
+	if (!header_ok(header, digest))
+		return MOCK_HIGH_HASH;
+
+	pthread_mutex_lock(&mock_lock);
+	if (memcmp(hash, aux_hash, 32))
+		result = MOCK_STALE;
+	else {
+		applog(LOG_INFO, "aux block %lu found", block);
+		new_block();
+	}
+	pthread_mutex_unlock(&mock_lock);
+
+	return result;
+}
+
+/* getauxblock HASH AUXPOW */
+static json_t *submit_aux(const char *hash_hex, const char *hex,
+			  const char **why)
+{
+	enum mock_results result;
+	unsigned char hash[32], *buf;
+	size_t len;
+
+	buf = hex ? hex_alloc(hex, &len) : NULL;
+	if (!buf || strlen(hash_hex) != 64 || !hex_decode(hash, hash_hex, 32)) {
+		free(buf);
+		*why = "malformed aux proof of work";
+		return NULL;
+	}
+	result = check_aux(hash, buf, len);
+	free(buf);
+
+	stats_add(&counts.shares[result], 1);
+	applog(LOG_DEBUG, "aux block %s", result_names[result]);
+	return result == MOCK_ACCEPTED ? json_true() : json_false();
+}
+
+static json_t *longpoll_wait(void)
+{
+	unsigned long seen_block;
+
+	stats_add(&counts.longpolls, 1);
+
+	pthread_mutex_lock(&mock_lock);
+	seen_block = block;
+	while (seen_block == block)
+		pthread_cond_wait(&block_cond, &mock_lock);
+	pthread_mutex_unlock(&mock_lock);
+
+	return make_work();
+}
+
+/* One JSON-RPC call, alone or from a batch */
+static json_t *rpc_call(json_t *req, bool lp)
+{
+	json_t *reply, *res = NULL, *id, *params;
+	const char *method, *data, *errmsg = NULL;
+
+	method = json_string_value(json_object_get(req, "method"));
+	params = json_object_get(req, "params");
+	data = json_string_value(json_array_get(params, 0));
+	id = json_object_get(req, "id");
+
+	if (!method)
+		errmsg = "no method";
+	else if (!strcmp(method, "getblocktemplate"))
+		res = make_template();
+	else if (!strcmp(method, "submitblock"))
+		res = submit_block(data, &errmsg);
+	else if (!strcmp(method, "getauxblock"))
+		res = data ? submit_aux(data, json_string_value(
+						json_array_get(params, 1)),
+					&errmsg) :
+			     make_aux();
+	else if (strcmp(method, "getwork"))
+		errmsg = "method not supported";
+	else if (data)
+		res = submit(data, &errmsg);
+	else
+		res = lp ? longpoll_wait() : make_work();
+
+	reply = json_object();
+	if (res) {
+		json_object_set_new(reply, "result", res);
+		json_object_set_new(reply, "error", json_null());
+	} else {
+		json_t *e = json_object();
+
+		json_object_set_new(e, "code", json_integer(-1));
+		json_object_set_new(e, "message", json_string(errmsg));
+		json_object_set_new(reply, "result", json_null());
+		json_object_set_new(reply, "error", e);
+	}
+	json_object_set(reply, "id", id ? id : json_null());
+
+	return reply;
+}
+
+static void mock_handler(int fd, struct http_request *req, void *arg)
+{
+	static const char *lp_header = "X-Long-Polling: /LP\r\n";
+	bool lp = !strncmp(req->path, "/LP", 3);
+	json_t *val, *reply;
+	json_error_t err;
+	unsigned int i;
+	char *s;
+
+	if (strcmp(req->method, "POST")) {
+		static const char *msg = "POST a getwork request\n";
+
+		http_respond(fd, 405, "text/plain", "Allow: POST\r\n",
+			     msg, strlen(msg));
+		return;
+	}
+
+	if (error_rate > 0 && drand48() < error_rate) {
+		stats_add(&counts.errors, 1);
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+		return;
+	}
+
+	val = JSON_LOADS(req->body, &err);
+	if (!val) {
+		http_respond(fd, 400, "text/plain", NULL, "", 0);
+		return;
+	}
+	if (json_is_array(val)) {
+		reply = json_array();
+		for (i = 0; i < json_array_size(val); i++)
+			json_array_append_new(reply,
+				rpc_call(json_array_get(val, i), lp));
+	} else
+		reply = rpc_call(val, lp);
+	json_decref(val);
+
+	if (latency_ms)
+		usleep(latency_ms * 1000);
+
+	s = json_dumps(reply, JSON_COMPACT);
+	if (s)
+		http_respond(fd, 200, "application/json",
+			     longpoll ? lp_header : NULL, s, strlen(s));
+	else
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+	free(s);
+	json_decref(reply);
+}
+
+void applog(int prio, const char *fmt, ...)
+{
+	va_list ap;
+	struct tm tm;
+	time_t now;
+
+	if (prio == LOG_DEBUG && !debug)
+		return;
+
+	time(&now);
+	localtime_r(&now, &tm);
+	fprintf(stderr, "[%d-%02d-%02d %02d:%02d:%02d] ",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: mock-pool [OPTIONS] PORT\n"
+		"Serve getwork for a made-up block chain and check shares;\n"
+		"or block templates, or aux blocks, and check blocks.\n\n"
+		"  -b ADDR   address to listen on (default: 127.0.0.1)\n"
+		"  -z BITS   leading zero bits a share or block needs,\n"
+		"            32 to 255 (default: 32)\n"
+		"  -l MS     delay every response by MS milliseconds\n"
+		"  -e RATE   fail this fraction of requests with HTTP 500\n"
+		"  -B SECS   seconds between new blocks (default: 60;\n"
+		"            0 never)\n"
+		"  -x N      transactions in a block template (default: 3)\n"
+		"  -n        no long polling\n"
+		"  -i SECS   seconds between reports (default: 10)\n"
+		"  -D        log every share\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *bind_addr = "127.0.0.1";
+	int c, i, port, interval = 10;
+	struct timeval tv;
+	time_t next_block, next_report;
+	char *end;
+
+	while ((c = getopt(argc, argv, "b:z:l:e:B:x:ni:Dh")) != -1) {
+		switch (c) {
+		case 'b':
+			bind_addr = optarg;
+			break;
+		case 'z':
+			zero_bits = atoi(optarg);
+			/* minerd only checks hashes with the top word clear */
+			if (zero_bits >= 1 && zero_bits < 32) {
+				fprintf(stderr, "mock-pool: -z below 32 would "
+					"not change the share rate; minerd's "
+					"kernels only report hashes with 32 "
+					"leading zero bits\n");
+				exit(1);
+			}
+			if (zero_bits < 32 || zero_bits > 255)
+				usage();
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			if (latency_ms < 0)
+				usage();
+			break;
+		case 'e':
+			error_rate = strtod(optarg, &end);
+			if (*end || error_rate < 0 || error_rate > 1)
+				usage();
+			break;
+		case 'B':
+			block_secs = atoi(optarg);
+			if (block_secs < 0)
+				usage();
+			break;
+		case 'x':
+			n_txs = atoi(optarg);
+			if (n_txs < 0 || n_txs > MOCK_TXS)
+				usage();
+			break;
+		case 'n':
+			longpoll = false;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval < 1)
+				usage();
+			break;
+		case 'D':
+			debug = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	port = atoi(argv[optind]);
+	if (port < 1 || port > 65535)
+		usage();
+
+	/* the top zero_bits bits clear, all others set */
+	memset(target, 0xff, sizeof(target));
+	for (i = 0; i < zero_bits; i++)
+		target[31 - i / 8] &= ~(0x80 >> (i % 8));
+
+	gettimeofday(&tv, NULL);
+	rng_state = ((uint64_t) tv.tv_sec << 20) ^ tv.tv_usec ^ getpid();
+	srand48(rng_state);
+	pthread_mutex_lock(&mock_lock);
+	tag = ((uint64_t) rng() << 32) | rng();
+	new_block();
+	pthread_mutex_unlock(&mock_lock);
+
+	if (!http_server_start(bind_addr, port, mock_handler, NULL))
+		return 1;
+	applog(LOG_INFO, "mock pool on %s:%d: %d bit target, new block "
+	       "every %ds, %dms latency, %g error rate%s", bind_addr, port,
+	       zero_bits, block_secs, latency_ms, error_rate,
+	       longpoll ? ", long polling" : "");
+
+	next_block = time(NULL) + block_secs;
+	next_report = time(NULL) + interval;
+	while (1) {
+		uint64_t total = 0;
+		time_t now;
+
+		sleep(1);
+		now = time(NULL);
+
+		if (block_secs && now >= next_block) {
+			pthread_mutex_lock(&mock_lock);
+			new_block();
+			applog(LOG_INFO, "block %lu", block);
+			pthread_mutex_unlock(&mock_lock);
+			next_block = now + block_secs;
+		}
+		if (now < next_report)
+			continue;
+		next_report = now + interval;
+
+		for (i = 0; i < MOCK_RESULTS; i++)
+			total += counts.shares[i];
+		applog(LOG_INFO, "%llu getworks, %llu templates, %llu long "
+		       "polls, %llu errors; %llu shares: %llu accepted, "
+		       "%llu stale, %llu duplicate, %llu unknown, %llu high-hash, "
+		       "%llu invalid",
+		       (unsigned long long) counts.getworks,
+		       (unsigned long long) counts.templates,
+		       (unsigned long long) counts.longpolls,
+		       (unsigned long long) counts.errors,
+		       (unsigned long long) total,
+		       (unsigned long long) counts.shares[MOCK_ACCEPTED],
+		       (unsigned long long) counts.shares[MOCK_STALE],
+		       (unsigned long long) counts.shares[MOCK_DUPLICATE],
+		       (unsigned long long) counts.shares[MOCK_UNKNOWN],
+		       (unsigned long long) counts.shares[MOCK_HIGH_HASH],
+		       (unsigned long long) counts.shares[MOCK_INVALID]);
+	}
+	return 0;
+}
@@ -0,0 +1,415 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Hardware performance counters around each scan (--perf).
+ *
+ * A hash rate alone cannot tell a kernel that is front-end bound from
+ * one waiting on a busy port or on memory.  Each miner thread opens a
+ * perf_event group on itself, counting cycles, instructions, branch
+ * misses and L1 data cache read misses in user space only, and reads it
+ * before and after every scanhash call.  The deltas are summed per
+ * thread and per kernel, and reported as cycles per hash and
+ * instructions per cycle, with the misses per hash.
+ *
+ * Where perf events are not available (not Linux, perf_event_paranoid,
+ * a container without the syscall), the time stamp counter stands in
+ * for cycles.  It ticks at a fixed rate whether or not the thread runs,
+ * so it only gives cycles per hash, and then only of a thread that has
+ * its cpu to itself.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "compat.h"
+#include "miner.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_TSC 1
+#endif
+
+struct perf_thread {
+	int			fd;		/* group leader, -1 = none */
+	uint64_t		start[PERF_COUNTERS];
+	uint64_t		enabled, running;
+	uint64_t		last_hashes;	/* the last scan's */
+	uint64_t		last[PERF_COUNTERS];
+	struct perf_totals	tot;
+	char			padding[64];
+};
+
+/* totals at the last perf_log, for its deltas */
+struct perf_snap {
+	uint64_t		hashes;
+	uint64_t		count[PERF_COUNTERS];
+};
+
+int perf_mode;
+
+static int pf_threads;
+static struct perf_thread *pf_thr;
+static struct perf_snap *pf_snap;	/* threads, then algos */
+static bool pf_have[PERF_COUNTERS];
+static struct perf_totals perf_algo[ALGO_MAX];
+
+static const char *counter_names[PERF_COUNTERS] = {
+	[PERF_CYCLES]		= "cycles",
+	[PERF_INSTRUCTIONS]	= "instructions",
+	[PERF_BRANCH_MISSES]	= "branch misses",
+	[PERF_L1D_MISSES]	= "L1d misses",
+};
+
+#ifdef HAVE_TSC
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} counter_events[PERF_COUNTERS] = {
+	[PERF_CYCLES]		= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS]	= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_BRANCH_MISSES]	= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_BRANCH_MISSES },
+	[PERF_L1D_MISSES]	= { PERF_TYPE_HW_CACHE,
+				    PERF_COUNT_HW_CACHE_L1D |
+				    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static int counter_open(int counter, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter_events[counter].type;
+	attr.config = counter_events[counter].config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP |
+			   PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* the calling thread, on whatever cpu it runs */
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* A group of the counters in pf_have on the calling thread; its
+ * leader's fd, or -1.  The members' fds stay open with the leader.
+ */
+static int group_open(void)
+{
+	int i, fd[PERF_COUNTERS];
+
+	fd[PERF_CYCLES] = counter_open(PERF_CYCLES, -1);
+	if (fd[PERF_CYCLES] < 0)
+		return -1;
+	for (i = PERF_CYCLES + 1; i < PERF_COUNTERS; i++) {
+		fd[i] = pf_have[i] ? counter_open(i, fd[PERF_CYCLES]) : -1;
+		if (pf_have[i] && fd[i] < 0) {
+			while (i-- > 0)
+				if (fd[i] >= 0)
+					close(fd[i]);
+			return -1;
+		}
+	}
+	return fd[PERF_CYCLES];
+}
+
+/* The group's counts, scaled for the time it was multiplexed out */
+static bool group_read(struct perf_thread *pt, uint64_t *count,
+		       uint64_t *enabled, uint64_t *running)
+{
+	uint64_t buf[3 + PERF_COUNTERS];
+	int i, n = 0;
+
+	if (read(pt->fd, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(*buf)))
+		return false;
+
+	*enabled = buf[1];
+	*running = buf[2];
+	for (i = 0; i < PERF_COUNTERS; i++)
+		count[i] = pf_have[i] ? buf[3 + n++] : 0;
+	return true;
+}
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+/* Which counters this kernel and cpu have, tried on the calling thread */
+static bool probe_events(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	int i, fd;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		fd = counter_open(i, -1);
+		pf_have[i] = fd >= 0;
+		if (fd >= 0)
+			close(fd);
+		else if (i == PERF_CYCLES) {
+			applog(LOG_INFO, "perf events unavailable: %s",
+			       strerror(errno));
+			return false;
+		}
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool perf_init(int n_threads)
+{
+	char names[96] = "";
+	int i;
+
+	if (probe_events()) {
+		perf_mode = PERF_MODE_EVENTS;
+		for (i = 0; i < PERF_COUNTERS; i++)
+			if (pf_have[i])
+				sprintf(names + strlen(names), "%s%s",
+					*names ? ", " : "", counter_names[i]);
+		applog(LOG_INFO, "hardware counters: %s", names);
+	} else {
+#ifdef HAVE_TSC
+		perf_mode = PERF_MODE_TSC;
+		pf_have[PERF_CYCLES] = true;
+		applog(LOG_INFO, "hardware counters: TSC cycles only");
+#else
+		applog(LOG_ERR, "--perf: no cycle counter on this system");
+		return false;
+#endif
+	}
+
+	pf_threads = n_threads;
+	pf_thr = calloc(n_threads, sizeof(*pf_thr));
+	pf_snap = calloc(n_threads + ALGO_MAX, sizeof(*pf_snap));
+	if (!pf_thr || !pf_snap) {
+		perf_mode = PERF_MODE_OFF;
+		return false;
+	}
+	for (i = 0; i < n_threads; i++)
+		pf_thr[i].fd = -1;
+
+	return true;
+}
+
+/* For each miner thread, once, before its first scan */
+void perf_thread_start(int thr_id)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	struct perf_thread *pt;
+
+	if (perf_mode != PERF_MODE_EVENTS)
+		return;
+
+	pt = &pf_thr[thr_id];
+	pt->fd = group_open();
+	if (pt->fd < 0)
+		applog(LOG_ERR, "thread %d: perf events: %s", thr_id,
+		       strerror(errno));
+#endif
+}
+
+void perf_scan_begin(int thr_id)
+{
+	struct perf_thread *pt;
+
+	if (!perf_mode)
+		return;
+
+	pt = &pf_thr[thr_id];
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	if (perf_mode == PERF_MODE_EVENTS) {
+		if (pt->fd >= 0 &&
+		    !group_read(pt, pt->start, &pt->enabled, &pt->running)) {
+			close(pt->fd);
+			pt->fd = -1;
+		}
+		return;
+	}
+#endif
+#ifdef HAVE_TSC
+	pt->start[PERF_CYCLES] = rdtsc();
+#endif
+}
+
+void perf_scan_end(int thr_id, int algo, unsigned long hashes)
+{
+	uint64_t count[PERF_COUNTERS] = { };
+	struct perf_thread *pt;
+	int i;
+
+	if (!perf_mode)
+		return;
+
+	pt = &pf_thr[thr_id];
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	if (perf_mode == PERF_MODE_EVENTS) {
+		uint64_t enabled, running;
+		double scale;
+
+		if (pt->fd < 0 || !group_read(pt, count, &enabled, &running))
+			return;
+		running -= pt->running;
+		enabled -= pt->enabled;
+		if (!running)
+			return;
+		scale = (double) enabled / running;
+		for (i = 0; i < PERF_COUNTERS; i++)
+			count[i] = (count[i] - pt->start[i]) * scale;
+	}
+#endif
+#ifdef HAVE_TSC
+	if (perf_mode == PERF_MODE_TSC)
+		count[PERF_CYCLES] = rdtsc() - pt->start[PERF_CYCLES];
+#endif
+
+	pt->last_hashes = hashes;
+	memcpy(pt->last, count, sizeof(count));
+	stats_add(&pt->tot.hashes, hashes);
+	stats_add(&perf_algo[algo].hashes, hashes);
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		stats_add(&pt->tot.count[i], count[i]);
+		stats_add(&perf_algo[algo].count[i], count[i]);
+	}
+}
+
+/* "N cycles/hash, IPC N, ..." for 'count' over 'hashes' */
+static void perf_format(char *buf, size_t len, uint64_t hashes,
+			const uint64_t *count)
+{
+	int n;
+
+	if (perf_mode == PERF_MODE_TSC) {
+		snprintf(buf, len, "%.1f TSC cycles/hash",
+			 (double) count[PERF_CYCLES] / hashes);
+		return;
+	}
+
+	n = snprintf(buf, len, "%.1f cycles/hash, IPC %.2f",
+		     (double) count[PERF_CYCLES] / hashes,
+		     count[PERF_CYCLES] ? (double) count[PERF_INSTRUCTIONS] /
+					  count[PERF_CYCLES] : 0.0);
+	if (pf_have[PERF_BRANCH_MISSES] && (size_t) n < len)
+		n += snprintf(buf + n, len - n, ", %.3f branch misses/hash",
+			      (double) count[PERF_BRANCH_MISSES] / hashes);
+	if (pf_have[PERF_L1D_MISSES] && (size_t) n < len)
+		snprintf(buf + n, len - n, ", %.3f L1d misses/hash",
+			 (double) count[PERF_L1D_MISSES] / hashes);
+}
+
+/* The calling miner thread's last scan, formatted; false if none */
+bool perf_scan_summary(int thr_id, char *buf, size_t len)
+{
+	struct perf_thread *pt;
+
+	if (!perf_mode)
+		return false;
+
+	pt = &pf_thr[thr_id];
+	if (!pt->last_hashes)
+		return false;
+	perf_format(buf, len, pt->last_hashes, pt->last);
+	return true;
+}
+
+/* Cycles per hash and IPC of a miner thread since startup; 0 if unknown */
+double perf_cycles_per_hash(int thr_id)
+{
+	uint64_t hashes;
+
+	if (!perf_mode)
+		return 0.0;
+
+	hashes = stats_read(&pf_thr[thr_id].tot.hashes);
+	if (!hashes)
+		return 0.0;
+	return (double) stats_read(&pf_thr[thr_id].tot.count[PERF_CYCLES]) /
+	       hashes;
+}
+
+double perf_ipc(int thr_id)
+{
+	uint64_t cycles;
+
+	if (perf_mode != PERF_MODE_EVENTS)
+		return 0.0;
+
+	cycles = stats_read(&pf_thr[thr_id].tot.count[PERF_CYCLES]);
+	if (!cycles)
+		return 0.0;
+	return (double) stats_read(&pf_thr[thr_id].tot.count[PERF_INSTRUCTIONS]) /
+	       cycles;
+}
+
+/* Since the last call, into 'snap': false if nothing was hashed */
+static bool perf_delta(struct perf_totals *tot, struct perf_snap *snap,
+		       uint64_t *hashes, uint64_t *count)
+{
+	uint64_t now;
+	int i;
+
+	now = stats_read(&tot->hashes);
+	*hashes = now - snap->hashes;
+	snap->hashes = now;
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		now = stats_read(&tot->count[i]);
+		count[i] = now - snap->count[i];
+		snap->count[i] = now;
+	}
+	return *hashes != 0;
+}
+
+/* For the stats reporter: each thread and kernel over the last interval */
+void perf_log(void)
+{
+	uint64_t hashes, count[PERF_COUNTERS];
+	char buf[160];
+	int i;
+
+	if (!perf_mode)
+		return;
+
+	for (i = 0; i < ALGO_MAX; i++) {
+		if (!perf_delta(&perf_algo[i], &pf_snap[pf_threads + i],
+				&hashes, count))
+			continue;
+		perf_format(buf, sizeof(buf), hashes, count);
+		applog(LOG_INFO, "%s: %s", algo_name(i), buf);
+	}
+
+	for (i = 0; i < pf_threads; i++) {
+		if (!perf_delta(&pf_thr[i].tot, &pf_snap[i], &hashes, count))
+			continue;
+		if (opt_quiet)
+			continue;
+		perf_format(buf, sizeof(buf), hashes, count);
+		applog(LOG_INFO, "thread %d: %s", i, buf);
+	}
+}
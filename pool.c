@@ -0,0 +1,489 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Pool list, health probing and failover.
+ *
+ * Pools are tried in the order given with --url.  The workio thread moves
+ * to the next healthy pool as soon as a request to the active one fails
+ * or times out, without the retry pause.  A probe thread issues a getwork
+ * to every pool each --pool-probe seconds, so the health and round trip
+ * time of the backups are known before they are needed, and moves back
+ * to a preferred pool once it has answered several probes in a row.
+ *
+ * With a --pool-balance policy other than failover, work is drawn from
+ * every live pool at once: each getwork goes to the pool picked by smooth
+ * weighted round robin, so over any stretch of requests each pool gets
+ * work in proportion to its weight.  Weights are the configured ones, or
+ * follow the measured round trip time or stale share rate.
+ *
+ * The workio thread is the only writer of a pool's url and credentials;
+ * it does so under pool_lock, and everyone else copies them under it.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define POOL_FAILBACK_PROBES	3	/* good probes before failing back */
+#define POOL_RTT_WEIGHT		0.2	/* EWMA weight of a new sample */
+
+/* stale rate prior: a pool starts out as if 1 in 50 shares were stale */
+#define POOL_STALE_PRIOR	1.0
+#define POOL_STALE_PRIOR_N	50.0
+
+struct pool pools[MAX_POOLS];
+int n_pools;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+enum pool_policies pool_policy = POOL_FAILOVER;
+
+static const char *pool_policy_names[] = {
+	[POOL_FAILOVER]		= "failover",
+	[POOL_WEIGHTED]		= "weighted",
+	[POOL_RTT]		= "rtt",
+	[POOL_STALE]		= "stale",
+};
+
+static int probe_interval;
+
+static const char *probe_req =
+	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
+
+int pool_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pool_policy_names); i++)
+		if (!strcmp(name, pool_policy_names[i]))
+			return i;
+
+	return -1;
+}
+
+const char *pool_policy_name(enum pool_policies policy)
+{
+	return pool_policy_names[policy];
+}
+
+/* Append a pool; its priority follows command line order.  'userpass'
+ * may be NULL until pool_finalize, but a pool added while mining must
+ * come with it: other threads may pick the pool as soon as it is here.
+ */
+struct pool *pool_add(const char *url, const char *userpass)
+{
+	struct pool *pool;
+
+	pthread_mutex_lock(&pool_lock);
+	if (n_pools >= MAX_POOLS) {
+		pthread_mutex_unlock(&pool_lock);
+		applog(LOG_ERR, "Too many pools, at most %d", MAX_POOLS);
+		return NULL;
+	}
+
+	pool = &pools[n_pools];
+	memset(pool, 0, sizeof(*pool));
+	pool->id = n_pools;
+	pool->prio = n_pools;
+	pool->url = strdup(url);
+	pool->userpass = userpass ? strdup(userpass) : NULL;
+	if (!pool->url || (userpass && !pool->userpass)) {
+		free(pool->url);
+		free(pool->userpass);
+		pthread_mutex_unlock(&pool_lock);
+		return NULL;
+	}
+	pool->weight = 1;
+	pool->alive = true;		/* innocent until proven guilty */
+	pool->since = time(NULL);
+	n_pools++;
+	pthread_mutex_unlock(&pool_lock);
+
+	return pool;
+}
+
+struct pool *pool_find(const char *url)
+{
+	struct pool *pool = NULL;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_pools; i++)
+		if (!strcmp(pools[i].url, url))
+			pool = &pools[i];
+	pthread_mutex_unlock(&pool_lock);
+
+	return pool;
+}
+
+/* Build each pool's user:pass; pools without any inherit the first's */
+bool pool_finalize(bool need_creds)
+{
+	int i;
+
+	for (i = 0; i < n_pools; i++) {
+		struct pool *pool = &pools[i];
+
+		if (pool->userpass)
+			continue;
+		if (pool->user && pool->pass) {
+			pool->userpass = malloc(strlen(pool->user) +
+						strlen(pool->pass) + 2);
+			if (!pool->userpass)
+				return false;
+			sprintf(pool->userpass, "%s:%s", pool->user, pool->pass);
+		} else if (i > 0 && pools[0].userpass)
+			pool->userpass = strdup(pools[0].userpass);
+		else if (need_creds) {
+			applog(LOG_ERR, "No login credentials supplied for %s",
+			       pool->url);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Account the outcome of a request to 'pool'; usecs is its round trip */
+void pool_result(struct pool *pool, bool ok, uint64_t usecs)
+{
+	time_t now = time(NULL);
+	bool changed;
+
+	pthread_mutex_lock(&pool_lock);
+	pool->requests++;
+	if (ok) {
+		double rtt = usecs / 1e6;
+
+		pool->rtt = pool->rtt > 0.0 ?
+			pool->rtt + POOL_RTT_WEIGHT * (rtt - pool->rtt) : rtt;
+		pool->ok_streak++;
+	} else {
+		pool->failures++;
+		pool->ok_streak = 0;
+	}
+
+	changed = ok != pool->alive;
+	if (changed) {
+		if (pool->alive)
+			pool->up_secs += now - pool->since;
+		else
+			pool->down_secs += now - pool->since;
+		pool->alive = ok;
+		pool->since = now;
+	}
+	if (changed && n_pools > 1)
+		applog(ok ? LOG_INFO : LOG_ERR, "pool %d (%s) is %s",
+		       pool->id, pool->url, ok ? "back up" : "down");
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Fraction of time 'pool' has been answering, since startup */
+double pool_uptime(struct pool *pool)
+{
+	time_t now = time(NULL);
+	double up, down;
+
+	pthread_mutex_lock(&pool_lock);
+	up = pool->up_secs;
+	down = pool->down_secs;
+	if (pool->alive)
+		up += now - pool->since;
+	else
+		down += now - pool->since;
+	pthread_mutex_unlock(&pool_lock);
+
+	return up + down > 0 ? up / (up + down) : 1.0;
+}
+
+/* Count a submitted share against the pool it came from */
+void pool_share(struct pool *pool, enum share_results result)
+{
+	pthread_mutex_lock(&pool_lock);
+	switch (result) {
+	case SHARE_ACCEPTED:
+		pool->accepted++;
+		break;
+	case SHARE_REJECTED:
+		pool->rejected++;
+		break;
+	case SHARE_STALE:
+		pool->stale++;
+		break;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Share of work 'pool' should get under the balance policy, relative to
+ * the others; 0 for a pool that is down.  Caller holds pool_lock.
+ */
+static double pool_weight(const struct pool *pool)
+{
+	double shares, rate;
+
+	if (!pool->alive)
+		return 0.0;
+
+	switch (pool_policy) {
+	case POOL_RTT:
+		/* no sample yet: treat as 100ms until probed */
+		return 1.0 / (pool->rtt > 0.0 ? pool->rtt : 0.1);
+	case POOL_STALE:
+		shares = pool->accepted + pool->rejected + pool->stale;
+		rate = (pool->stale + POOL_STALE_PRIOR) /
+		       (shares + POOL_STALE_PRIOR_N);
+		return 1.0 / rate;
+	default:
+		return pool->weight;
+	}
+}
+
+/* Pool for the next getwork under a balance policy, by smooth weighted
+ * round robin: every pool gains its weight, the richest is picked and
+ * pays back the total.  Falls back to the preferred pool when none is
+ * alive.  Workio thread only.
+ */
+struct pool *pool_pick(void)
+{
+	struct pool *best = NULL;
+	double total = 0.0;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_pools; i++) {
+		struct pool *pool = &pools[i];
+		double w = pool_weight(pool);
+
+		if (w <= 0.0)
+			continue;
+		pool->credit += w;
+		total += w;
+		if (!best || pool->credit > best->credit)
+			best = pool;
+	}
+	if (best)
+		best->credit -= total;
+	else
+		for (i = 0; i < n_pools; i++)
+			if (!best || pools[i].prio < best->prio)
+				best = &pools[i];
+	best->picks++;
+	pthread_mutex_unlock(&pool_lock);
+
+	return best;
+}
+
+/* Where to go when 'cur' fails: the preferred live pool, else the
+ * preferred of the ones that failed last time.  NULL if there is none.
+ */
+struct pool *pool_next(struct pool *cur)
+{
+	struct pool *best = NULL;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_pools; i++) {
+		struct pool *pool = &pools[i];
+
+		if (pool == cur)
+			continue;
+		if (!best || (pool->alive && !best->alive) ||
+		    (pool->alive == best->alive && pool->prio < best->prio))
+			best = pool;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return best;
+}
+
+/* Replace a pool's url, as asked by its X-Switch-To header: either a full
+ * URL, or host[:port] on the same scheme and path.  Workio thread only.
+ */
+bool pool_redirect(struct pool *pool, const char *switch_to)
+{
+	const char *host, *path;
+	char *url;
+
+	if (strstr(switch_to, "://"))
+		url = strdup(switch_to);
+	else {
+		host = strstr(pool->url, "://") + 3;
+		path = strchr(host, '/');
+		if (!path)
+			path = "/";
+		url = malloc((host - pool->url) + strlen(switch_to) +
+			     strlen(path) + 1);
+		if (url)
+			sprintf(url, "%.*s%s%s", (int)(host - pool->url),
+				pool->url, switch_to, path);
+	}
+	if (!url || !strcmp(url, pool->url)) {
+		free(url);
+		return false;
+	}
+
+	applog(LOG_INFO, "pool %d redirected from %s to %s", pool->id,
+	       pool->url, url);
+
+	pthread_mutex_lock(&pool_lock);
+	free(pool->url);
+	pool->url = url;
+	pthread_mutex_unlock(&pool_lock);
+	return true;
+}
+
+static void probe_one(CURL *curl, struct pool *pool)
+{
+	struct timeval tv_start;
+	char *url, *userpass;
+	json_t *val;
+
+	pthread_mutex_lock(&pool_lock);
+	url = strdup(pool->url);
+	userpass = pool->userpass ? strdup(pool->userpass) : NULL;
+	pthread_mutex_unlock(&pool_lock);
+	if (!url)
+		goto out;
+
+	gettimeofday(&tv_start, NULL);
+	val = json_rpc_call(curl, url, userpass,
+			    merged_mining ? merged_gbt_req : probe_req,
+			    false, false, NULL);
+	pool_result(pool, val != NULL, usecs_since(&tv_start));
+	if (val)
+		json_decref(val);
+
+out:
+	free(url);
+	free(userpass);
+}
+
+static void *probe_thread(void *userdata)
+{
+	CURL *curl;
+	int i, n;
+
+	curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		return NULL;
+	}
+
+	while (1) {
+		struct pool *cur, *best = NULL;
+
+		sleep(probe_interval);
+
+		pthread_mutex_lock(&pool_lock);
+		n = n_pools;
+		pthread_mutex_unlock(&pool_lock);
+		for (i = 0; i < n; i++)
+			probe_one(curl, &pools[i]);
+
+		/* fail back once a preferred pool has proven itself, or
+		 * leave an active pool that has stopped answering probes
+		 */
+		pthread_mutex_lock(&pool_lock);
+		cur = cur_pool;
+		for (i = 0; i < n_pools; i++) {
+			struct pool *pool = &pools[i];
+
+			if (!pool->alive || (pool != cur &&
+			    pool->ok_streak < POOL_FAILBACK_PROBES))
+				continue;
+			if (!best || pool->prio < best->prio)
+				best = pool;
+		}
+		pthread_mutex_unlock(&pool_lock);
+
+		if (best && best != cur &&
+		    (best->prio < cur->prio || !cur->alive))
+			pool_switch(best, NULL, !cur->alive);
+	}
+
+	return NULL;
+}
+
+/* Once there are several pools; later calls do nothing */
+bool pool_probe_start(int interval)
+{
+	static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+	static bool started;
+	pthread_t pth;
+	bool rc = true;
+
+	pthread_mutex_lock(&start_lock);
+	if (!started) {
+		probe_interval = interval;
+		if (pthread_create(&pth, NULL, probe_thread, NULL)) {
+			applog(LOG_ERR, "pool probe thread create failed");
+			rc = false;
+		} else
+			started = true;
+	}
+	pthread_mutex_unlock(&start_lock);
+
+	return rc;
+}
+
+/* Make 'pool' the most preferred, so failback returns to it */
+void pool_prefer(struct pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < n_pools; i++)
+		if (&pools[i] != pool && pools[i].prio <= pool->prio)
+			pool->prio = pools[i].prio - 1;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_log(void)
+{
+	uint64_t picks = 0;
+	int i, n;
+
+	pthread_mutex_lock(&pool_lock);
+	n = n_pools;
+	for (i = 0; i < n; i++)
+		picks += pools[i].picks;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < n; i++) {
+		struct pool *pool = &pools[i];
+		double uptime = pool_uptime(pool);
+		char *url, work[32] = "";
+
+		pthread_mutex_lock(&pool_lock);
+		url = strdup(pool->url);
+		if (pool_policy != POOL_FAILOVER && picks)
+			snprintf(work, sizeof(work), ", %.0f%% of work",
+				 100.0 * pool->picks / picks);
+		pthread_mutex_unlock(&pool_lock);
+
+		applog(LOG_INFO, "pool %d%s: %s, %s, uptime %.1f%%, "
+		       "rtt %.0f ms, %llu requests, %llu failed, "
+		       "shares %llu/%llu/%llu (a/r/s)%s",
+		       pool->id, pool == cur_pool ? " (active)" : "",
+		       url ? url : "", pool->alive ? "up" : "down",
+		       100.0 * uptime, pool->rtt * 1000.0,
+		       (unsigned long long) pool->requests,
+		       (unsigned long long) pool->failures,
+		       (unsigned long long) pool->accepted,
+		       (unsigned long long) pool->rejected,
+		       (unsigned long long) pool->stale, work);
+		free(url);
+	}
+}
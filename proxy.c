@@ -0,0 +1,340 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * getwork proxy: serve work from our upstream pool to miners on the LAN.
+ *
+ * Downstream miners speak plain getwork to us, including X-Long-Polling
+ * and share submission.  Each upstream getwork is stretched over several
+ * downstream requests by rolling the header ntime, so every miner gets
+ * distinct work while the pool sees one client: a header differing only
+ * in ntime hashes to entirely different values over the same nonce
+ * range, and the midstate (first 64 bytes) stays valid.
+ *
+ * Shares are matched back to the upstream work they came from, so they
+ * are relayed to the right pool, and dropped if seen before.  Upstream
+ * fetches and submissions go through the workio thread, sharing its
+ * failover and balancing with our own miner threads.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define PROXY_JOBS	32	/* upstream work remembered for shares */
+#define PROXY_SEEN	4096	/* shares remembered for duplicates */
+#define PROXY_MAX_AGE	60	/* seconds before refreshing upstream work */
+#define PROXY_LP_WAIT	PROXY_MAX_AGE	/* longest a long poll is held */
+
+#define MATCH_LEN	68	/* version, prev block, merkle root */
+#define HEADER_LEN	80
+
+struct proxy_stats proxy_stats;
+
+static struct thr_info px_thr;		/* our queue for get_work() */
+static int px_roll;
+
+/* fetches are serialized by px_fetch_lock; the state below is guarded
+ * by px_lock, which is never held across a call into the workio thread,
+ * since that thread calls proxy_restart()
+ */
+static pthread_mutex_t px_fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t px_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t px_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long px_gen;		/* bumped on each new block */
+static struct work px_jobs[PROXY_JOBS];
+static unsigned long px_n_jobs;		/* ever fetched */
+static int px_cur;			/* the one being handed out */
+static unsigned long px_job_gen;	/* px_gen when current was fetched */
+static time_t px_fetched;
+static int px_rolled;			/* work handed out from current */
+static uint64_t px_seen[PROXY_SEEN];
+static unsigned long px_n_seen;
+
+/* FNV-1a */
+static uint64_t header_hash(const unsigned char *data)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < HEADER_LEN; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Caller holds px_lock */
+static bool job_usable(void)
+{
+	return px_n_jobs && px_job_gen == px_gen && px_rolled < px_roll &&
+	       time(NULL) - px_fetched < PROXY_MAX_AGE;
+}
+
+/* Next distinct unit of work for a downstream miner */
+static bool proxy_next_work(struct work *work)
+{
+	struct work fresh;
+	unsigned long gen;
+
+	pthread_mutex_lock(&px_fetch_lock);
+
+	pthread_mutex_lock(&px_lock);
+	gen = px_gen;
+	if (!job_usable()) {
+		pthread_mutex_unlock(&px_lock);
+
+		if (!get_work(&px_thr, &fresh)) {
+			pthread_mutex_unlock(&px_fetch_lock);
+			return false;
+		}
+		stats_add(&proxy_stats.upstream, 1);
+
+		/* a block arriving meanwhile makes the next request
+		 * fetch again
+		 */
+		pthread_mutex_lock(&px_lock);
+		px_cur = px_n_jobs++ % PROXY_JOBS;
+		px_jobs[px_cur] = fresh;
+		px_job_gen = gen;
+		px_fetched = time(NULL);
+		px_rolled = 0;
+	}
+
+	*work = px_jobs[px_cur];
+	work_set_ntime(work, work_ntime(work) + px_rolled++);
+	pthread_mutex_unlock(&px_lock);
+
+	pthread_mutex_unlock(&px_fetch_lock);
+
+	stats_add(&proxy_stats.getworks, 1);
+	return true;
+}
+
+/* Find the upstream work a share was built on, and check it is new */
+static bool proxy_match_share(const unsigned char *data, struct work *work,
+			      const char **why)
+{
+	uint64_t h = header_hash(data);
+	int i, n;
+
+	pthread_mutex_lock(&px_lock);
+
+	n = px_n_seen < PROXY_SEEN ? px_n_seen : PROXY_SEEN;
+	for (i = 0; i < n; i++)
+		if (px_seen[i] == h) {
+			pthread_mutex_unlock(&px_lock);
+			stats_add(&proxy_stats.duplicate, 1);
+			*why = "duplicate";
+			return false;
+		}
+
+	n = px_n_jobs < PROXY_JOBS ? px_n_jobs : PROXY_JOBS;
+	for (i = 0; i < n; i++)
+		if (!memcmp(px_jobs[i].data, data, MATCH_LEN))
+			break;
+	if (i == n) {
+		pthread_mutex_unlock(&px_lock);
+		stats_add(&proxy_stats.unknown, 1);
+		*why = "unknown work";
+		return false;
+	}
+
+	*work = px_jobs[i];
+	memcpy(work->data, data, sizeof(work->data));
+	px_seen[px_n_seen++ % PROXY_SEEN] = h;
+
+	pthread_mutex_unlock(&px_lock);
+	return true;
+}
+
+static json_t *work_encode(const struct work *work)
+{
+	json_t *res = json_object();
+	char *s;
+
+	s = bin2hex(work->midstate, sizeof(work->midstate));
+	json_object_set_new(res, "midstate", json_string(s));
+	free(s);
+	s = bin2hex(work->data, sizeof(work->data));
+	json_object_set_new(res, "data", json_string(s));
+	free(s);
+	s = bin2hex(work->hash1, sizeof(work->hash1));
+	json_object_set_new(res, "hash1", json_string(s));
+	free(s);
+	s = bin2hex(work->target, sizeof(work->target));
+	json_object_set_new(res, "target", json_string(s));
+	free(s);
+
+	return res;
+}
+
+static json_t *proxy_getwork(bool longpoll)
+{
+	struct work work;
+
+	/* hold a long poll until the next block, but not forever: a pool
+	 * switch or a lost upstream long poll must not strand it
+	 */
+	if (longpoll) {
+		struct timespec abstime = { time(NULL) + PROXY_LP_WAIT, 0 };
+		unsigned long gen;
+
+		pthread_mutex_lock(&px_lock);
+		gen = px_gen;
+		while (gen == px_gen &&
+		       !pthread_cond_timedwait(&px_cond, &px_lock, &abstime))
+			;
+		pthread_mutex_unlock(&px_lock);
+	}
+
+	if (!proxy_next_work(&work))
+		return NULL;
+	return work_encode(&work);
+}
+
+static json_t *proxy_submit(const char *hexdata)
+{
+	enum share_results result;
+	unsigned char data[128];
+	struct work work;
+	const char *why;
+
+	if (!hex2bin(data, hexdata, sizeof(data)))
+		return NULL;
+
+	if (!proxy_match_share(data, &work, &why)) {
+		applog(LOG_INFO, "proxy: %s share dropped", why);
+		return json_false();
+	}
+
+	if (!submit_work_sync(&work, &result))
+		return NULL;
+
+	switch (result) {
+	case SHARE_ACCEPTED:
+		stats_add(&proxy_stats.accepted, 1);
+		break;
+	case SHARE_REJECTED:
+		stats_add(&proxy_stats.rejected, 1);
+		break;
+	case SHARE_STALE:
+		stats_add(&proxy_stats.stale, 1);
+		break;
+	}
+
+	return result == SHARE_ACCEPTED ? json_true() : json_false();
+}
+
+static void proxy_handler(int fd, struct http_request *req, void *arg)
+{
+	static const char *lp_header = "X-Long-Polling: /LP\r\n";
+	json_t *val, *params, *res = NULL, *reply, *id;
+	const char *method, *submit, *errmsg = NULL;
+	json_error_t jerr;
+	char *s;
+
+	if (strcmp(req->method, "POST")) {
+		static const char *msg = "POST a getwork request\n";
+
+		http_respond(fd, 405, "text/plain", "Allow: POST\r\n",
+			     msg, strlen(msg));
+		return;
+	}
+
+	val = JSON_LOADS(req->body, &jerr);
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	id = json_object_get(val, "id");
+	submit = json_string_value(json_array_get(params, 0));
+
+	if (!method || strcmp(method, "getwork"))
+		errmsg = "only getwork is supported";
+	else if (submit) {
+		res = proxy_submit(submit);
+		if (!res)
+			errmsg = "share submission failed";
+	} else {
+		res = proxy_getwork(!strncmp(req->path, "/LP", 3));
+		if (!res)
+			errmsg = "no work available";
+	}
+
+	reply = json_object();
+	if (errmsg) {
+		json_t *e = json_object();
+
+		json_object_set_new(e, "code", json_integer(-1));
+		json_object_set_new(e, "message", json_string(errmsg));
+		json_object_set_new(reply, "result", json_null());
+		json_object_set_new(reply, "error", e);
+	} else {
+		json_object_set_new(reply, "result", res);
+		json_object_set_new(reply, "error", json_null());
+	}
+	json_object_set(reply, "id", id ? id : json_null());
+
+	s = json_dumps(reply, JSON_COMPACT);
+	if (s)
+		/* without an upstream long poll, a new block is only seen at
+		 * our next getwork: too late to be worth a downstream one
+		 */
+		http_respond(fd, 200, "application/json",
+			     have_longpoll ? lp_header : NULL, s, strlen(s));
+	else
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+
+	free(s);
+	json_decref(reply);
+	if (val)
+		json_decref(val);
+}
+
+/* New block: work handed out so far is stale; wake long polls */
+void proxy_restart(void)
+{
+	pthread_mutex_lock(&px_lock);
+	px_gen++;
+	pthread_cond_broadcast(&px_cond);
+	pthread_mutex_unlock(&px_lock);
+}
+
+bool proxy_running(void)
+{
+	return px_thr.q != NULL;
+}
+
+bool proxy_start(const char *host, int port, int roll)
+{
+	px_roll = roll;
+	px_thr.id = -1;
+	px_thr.cpu = -1;
+	px_thr.q = tq_new();
+	if (!px_thr.q)
+		return false;
+
+	/* anyone who can connect mines on our account */
+	if (!host)
+		host = "127.0.0.1";
+	if (!http_server_start(host, port, proxy_handler, NULL)) {
+		tq_free(px_thr.q);
+		px_thr.q = NULL;
+		return false;
+	}
+
+	applog(LOG_INFO, "getwork proxy listening on %s:%d, %d work units "
+	       "per upstream getwork", host, port, roll);
+	return true;
+}
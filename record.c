@@ -0,0 +1,111 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * RPC session recorder.
+ *
+ * With --record, every JSON-RPC exchange (getwork, submit, long poll) is
+ * appended to a file as it completes: when it started, how long it took,
+ * the request, the raw response and any X-Long-Polling path.  rpc-replay
+ * serves such a file back, at the original or a scaled pace, so the whole
+ * I/O pipeline can be benchmarked offline against the same session.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+static FILE *rec_file;
+static struct timeval rec_start;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool record_open(const char *path)
+{
+	struct record_hdr hdr;
+
+	rec_file = fopen(path, "wb");
+	if (!rec_file) {
+		applog(LOG_ERR, "cannot create record file %s", path);
+		return false;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = RECORD_VERSION;
+	hdr.order = RECORD_ORDER;
+	if (fwrite(&hdr, sizeof(hdr), 1, rec_file) != 1) {
+		applog(LOG_ERR, "cannot write record file %s", path);
+		fclose(rec_file);
+		rec_file = NULL;
+		return false;
+	}
+	gettimeofday(&rec_start, NULL);
+
+	applog(LOG_INFO, "Recording RPC session to %s", path);
+	return true;
+}
+
+bool record_enabled(void)
+{
+	return rec_file != NULL;
+}
+
+static int record_kind(const char *req, bool longpoll)
+{
+	json_error_t err;
+	json_t *val;
+	int kind;
+
+	if (longpoll)
+		return RPC_LONGPOLL;
+
+	val = JSON_LOADS(req, &err);
+	kind = json_array_size(json_object_get(val, "params")) ?
+		RPC_SUBMIT : RPC_GETWORK;
+	if (val)
+		json_decref(val);
+	return kind;
+}
+
+/* One finished exchange; 'resp' is NULL if the request failed */
+void record_rpc(const struct timeval *start, bool longpoll, const char *req,
+		const char *resp, const char *lp_path)
+{
+	struct record_ent ent;
+	struct timeval at = *start, origin = rec_start, since;
+
+	if (!rec_file)
+		return;
+
+	memset(&ent, 0, sizeof(ent));
+	/* timeval_subtract normalizes its operands in place */
+	timeval_subtract(&since, &at, &origin);
+	ent.t_usecs = since.tv_sec * 1000000ULL + since.tv_usec;
+	ent.dur_usecs = usecs_since(start);
+	ent.kind = record_kind(req, longpoll);
+	ent.ok = resp != NULL;
+	ent.req_len = strlen(req);
+	ent.resp_len = resp ? strlen(resp) : 0;
+	ent.lp_len = lp_path ? strlen(lp_path) : 0;
+
+	pthread_mutex_lock(&rec_lock);
+	fwrite(&ent, sizeof(ent), 1, rec_file);
+	fwrite(lp_path ? lp_path : "", 1, ent.lp_len, rec_file);
+	fwrite(req, 1, ent.req_len, rec_file);
+	fwrite(resp ? resp : "", 1, ent.resp_len, rec_file);
+	fflush(rec_file);	/* a session that ends in a crash is the
+				 * most interesting one */
+	pthread_mutex_unlock(&rec_lock);
+}
@@ -0,0 +1,337 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * rpc-replay: serve a session recorded with minerd --record.
+ *
+ * Stands in for the pool: getwork and submit requests are answered with
+ * the recorded responses, in recorded order, each after its recorded
+ * round trip; long polls return at the moment they returned in the
+ * recording, counted from the first request.  -s scales all of it, so a
+ * session can be replayed faster than it happened, or with -s 0 as fast
+ * as possible.  Point minerd (with --metrics-port) at it to measure
+ * restart latency, idle time and share round trips against exactly the
+ * same traffic, run after run.
+ *
+ * The session is over once every recorded getwork and submit has been
+ * answered: long polls still held are dropped, as by a pool restarting,
+ * and rpc-replay exits.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "compat.h"
+#include "miner.h"
+
+struct exchange {
+	struct record_ent ent;
+	const char	*resp;		/* into the file image */
+};
+
+static struct exchange *xchg[RPC_KINDS];
+static int n_xchg[RPC_KINDS];
+static int next_xchg[RPC_KINDS];
+static uint64_t t_first;		/* of the first exchange */
+
+static double scale = 1.0;
+static bool debug;
+
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+static struct timeval epoch;		/* first request arrived */
+static bool started;
+static int busy;			/* requests being answered */
+static bool done;			/* the session is over */
+
+static const char *kind_names[RPC_KINDS] = {
+	[RPC_GETWORK]	= "getwork",
+	[RPC_SUBMIT]	= "submit",
+	[RPC_LONGPOLL]	= "longpoll",
+};
+
+void applog(int prio, const char *fmt, ...)
+{
+	va_list ap;
+	struct tm tm;
+	time_t now;
+
+	if (prio == LOG_DEBUG && !debug)
+		return;
+
+	time(&now);
+	localtime_r(&now, &tm);
+	fprintf(stderr, "[%d-%02d-%02d %02d:%02d:%02d] ",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	char *buf = NULL;
+	long size;
+
+	if (!f)
+		return NULL;
+	if (!fseek(f, 0, SEEK_END) && (size = ftell(f)) >= 0 &&
+	    !fseek(f, 0, SEEK_SET) && (buf = malloc(size + 1)) &&
+	    fread(buf, 1, size, f) == (size_t) size) {
+		*len = size;
+		fclose(f);
+		return buf;
+	}
+	free(buf);
+	fclose(f);
+	return NULL;
+}
+
+/* Index the recording, which is kept in memory for good */
+static bool load(const char *path)
+{
+	struct record_hdr hdr;
+	size_t len, pos;
+	char *buf;
+	int k, n = 0;
+
+	buf = read_file(path, &len);
+	if (!buf) {
+		applog(LOG_ERR, "%s: %s", path, strerror(errno));
+		return false;
+	}
+	if (len < sizeof(hdr))
+		goto bad;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != RECORD_VERSION)
+		goto bad;
+	if (hdr.order != RECORD_ORDER) {
+		applog(LOG_ERR, "%s: recorded on a host of other byte order",
+		       path);
+		return false;
+	}
+
+	for (pos = sizeof(hdr); pos < len; ) {
+		struct exchange *x;
+		struct record_ent ent;
+		char *resp;
+
+		if (len - pos < sizeof(ent))
+			break;		/* cut short by a crash */
+		memcpy(&ent, buf + pos, sizeof(ent));
+		pos += sizeof(ent);
+		if (ent.kind >= RPC_KINDS)
+			goto bad;
+		if (len - pos < (size_t) ent.lp_len + ent.req_len + ent.resp_len)
+			break;
+		resp = buf + pos + ent.lp_len + ent.req_len;
+		pos += ent.lp_len + ent.req_len + ent.resp_len;
+
+		x = realloc(xchg[ent.kind],
+			    (n_xchg[ent.kind] + 1) * sizeof(*x));
+		if (!x)
+			return false;
+		xchg[ent.kind] = x;
+		x += n_xchg[ent.kind]++;
+		x->ent = ent;
+		x->resp = resp;
+
+		/* entries are written as they complete, not as they start */
+		if (!n || ent.t_usecs < t_first)
+			t_first = ent.t_usecs;
+		n++;
+	}
+
+	for (k = 0; k < RPC_KINDS; k++)
+		applog(LOG_INFO, "%s: %d %s exchanges", path, n_xchg[k],
+		       kind_names[k]);
+	return true;
+
+bad:
+	applog(LOG_ERR, "%s: not a minerd recording", path);
+	free(buf);
+	return false;
+}
+
+static void sleep_usecs(uint64_t usecs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_nsec = (usecs % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static int request_kind(const struct http_request *req)
+{
+	json_error_t err;
+	json_t *val;
+	int kind;
+
+	if (!strncmp(req->path, "/LP", 3))
+		return RPC_LONGPOLL;
+
+	val = JSON_LOADS(req->body, &err);
+	kind = json_array_size(json_object_get(val, "params")) ?
+		RPC_SUBMIT : RPC_GETWORK;
+	if (val)
+		json_decref(val);
+	return kind;
+}
+
+static void replay_handler(int fd, struct http_request *req, void *arg)
+{
+	static const char *lp_header = "X-Long-Polling: /LP\r\n";
+	struct exchange *x = NULL;
+	struct timeval now;
+	uint64_t elapsed;
+	int kind, i;
+
+	if (strcmp(req->method, "POST")) {
+		static const char *msg = "POST a getwork request\n";
+
+		http_respond(fd, 405, "text/plain", "Allow: POST\r\n",
+			     msg, strlen(msg));
+		return;
+	}
+
+	kind = request_kind(req);
+
+	pthread_mutex_lock(&replay_lock);
+	if (!started) {
+		gettimeofday(&epoch, NULL);
+		started = true;
+	}
+	i = next_xchg[kind]++;
+	if (n_xchg[kind] && (kind != RPC_LONGPOLL || i < n_xchg[kind]))
+		x = &xchg[kind][i % n_xchg[kind]];
+
+	/* nothing recorded: a long poll is held until the session ends,
+	 * then its connection dropped
+	 */
+	if (!x && kind == RPC_LONGPOLL) {
+		while (!done)
+			pthread_cond_wait(&replay_cond, &replay_lock);
+		pthread_mutex_unlock(&replay_lock);
+		shutdown(fd, SHUT_RDWR);
+		return;
+	}
+	busy++;
+	pthread_mutex_unlock(&replay_lock);
+
+	if (!x) {
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+		goto out;
+	}
+
+	if (kind == RPC_LONGPOLL) {
+		uint64_t due = x->ent.t_usecs + x->ent.dur_usecs - t_first;
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - epoch.tv_sec) * 1000000ULL +
+			  now.tv_usec - epoch.tv_usec;
+		if (scale > 0 && due / scale > elapsed)
+			sleep_usecs(due / scale - elapsed);
+	} else if (scale > 0)
+		sleep_usecs(x->ent.dur_usecs / scale);
+
+	applog(LOG_DEBUG, "%s #%d%s", kind_names[kind], i,
+	       x->ent.ok ? "" : " (failed)");
+
+	if (!x->ent.ok)
+		http_respond(fd, 500, "text/plain", NULL, "", 0);
+	else
+		http_respond(fd, 200, "application/json",
+			     n_xchg[RPC_LONGPOLL] ? lp_header : NULL,
+			     x->resp, x->ent.resp_len);
+
+out:
+	pthread_mutex_lock(&replay_lock);
+	if (!--busy && next_xchg[RPC_GETWORK] >= n_xchg[RPC_GETWORK] &&
+	    next_xchg[RPC_SUBMIT] >= n_xchg[RPC_SUBMIT]) {
+		done = true;
+		pthread_cond_broadcast(&replay_cond);
+	}
+	pthread_mutex_unlock(&replay_lock);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: rpc-replay [-b ADDR] [-s SCALE] [-D] PORT FILE\n"
+		"Serve an RPC session recorded with minerd --record.\n\n"
+		"  -b ADDR   address to listen on (default: 127.0.0.1)\n"
+		"  -s SCALE  speed relative to the recording (default: 1;\n"
+		"            0 answers without delay)\n"
+		"  -D        log every exchange served\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *bind_addr = "127.0.0.1";
+	char *end;
+	int c, port;
+
+	while ((c = getopt(argc, argv, "b:s:Dh")) != -1) {
+		switch (c) {
+		case 'b':
+			bind_addr = optarg;
+			break;
+		case 's':
+			scale = strtod(optarg, &end);
+			if (*end || scale < 0)
+				usage();
+			break;
+		case 'D':
+			debug = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+	port = atoi(argv[optind]);
+	if (port < 1 || port > 65535)
+		usage();
+
+	if (!load(argv[optind + 1]))
+		return 1;
+	if (!http_server_start(bind_addr, port, replay_handler, NULL))
+		return 1;
+	applog(LOG_INFO, "replaying on %s:%d at %gx", bind_addr, port, scale);
+
+	pthread_mutex_lock(&replay_lock);
+	while (!done)
+		pthread_cond_wait(&replay_cond, &replay_lock);
+	pthread_mutex_unlock(&replay_lock);
+
+	/* let held long polls see their connections go */
+	sleep(1);
+	applog(LOG_INFO, "session replayed: %d getwork, %d submit and %d "
+	       "long poll requests", next_xchg[RPC_GETWORK],
+	       next_xchg[RPC_SUBMIT], next_xchg[RPC_LONGPOLL]);
+	return 0;
+}
@@ -0,0 +1,315 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * scrypt(N=1024, r=1, p=1) proof of work, as used by Litecoin and its
+ * offspring: the hash of an 80 byte header is scrypt with the header as
+ * both password and salt, compared as a little-endian number.
+ *
+ * SCRYPT_LANES nonces are hashed together.  PBKDF2-HMAC-SHA256 runs per
+ * nonce on the generic SHA-256 block function; the memory-hard part,
+ * Salsa20/8 over a 128 KiB scratchpad, runs on all lanes at once with
+ * GCC vector extensions, one nonce per vector lane, in whatever the
+ * build targets.  The scratchpads interleave the lanes too, so that
+ * filling them is plain vector stores; only the data-dependent reads
+ * gather a lane at a time.
+ *
+ * The caller supplies the scratchpads (scrypt_scratch_size() bytes),
+ * allocated once per thread.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "miner.h"
+
+#ifdef WANT_SCRYPT
+
+#if defined(__AVX512F__)
+#define SCRYPT_LANES	16
+#elif defined(__AVX2__)
+#define SCRYPT_LANES	8
+#else
+#define SCRYPT_LANES	4
+#endif
+
+#define SCRYPT_N	1024
+
+typedef uint32_t lanes_t __attribute__((vector_size(SCRYPT_LANES * 4)));
+
+static uint32_t le32dec(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+size_t scrypt_scratch_size(void)
+{
+	return (size_t) SCRYPT_N * 32 * sizeof(lanes_t);
+}
+
+/* HMAC-SHA256 keyed with an 80 byte header: inner and outer states.
+ * 'tmid' is the state after the first 64 bytes of the key, which do
+ * not depend on the nonce.
+ */
+static void hmac_init(uint32_t *istate, uint32_t *ostate,
+		      const uint32_t *tmid, const uint32_t *header)
+{
+	uint32_t tstate[8], pad[16];
+	int i;
+
+	/* the key is longer than a block, so it is hashed first */
+	memcpy(tstate, tmid, sizeof(tstate));
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, header + 16, 16);
+	pad[4] = 0x80000000;
+	pad[15] = 80 * 8;
+	sha256_block(tstate, pad);
+
+	for (i = 0; i < 8; i++)
+		pad[i] = tstate[i] ^ 0x36363636;
+	for (; i < 16; i++)
+		pad[i] = 0x36363636;
+	memcpy(istate, sha256_init_state, 32);
+	sha256_block(istate, pad);
+
+	for (i = 0; i < 8; i++)
+		pad[i] = tstate[i] ^ 0x5c5c5c5c;
+	for (; i < 16; i++)
+		pad[i] = 0x5c5c5c5c;
+	memcpy(ostate, sha256_init_state, 32);
+	sha256_block(ostate, pad);
+}
+
+static void hmac_finish(uint32_t *out, const uint32_t *ostate,
+			const uint32_t *ihash)
+{
+	uint32_t pad[16];
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, ihash, 32);
+	pad[8] = 0x80000000;
+	pad[15] = (64 + 32) * 8;
+	memcpy(out, ostate, 32);
+	sha256_block(out, pad);
+}
+
+/* PBKDF2 with the header as its own salt, one iteration: 128 bytes */
+static void pbkdf2_header(uint32_t *out, const uint32_t *istate,
+			  const uint32_t *ostate, const uint32_t *header)
+{
+	uint32_t salted[8], ihash[8], pad[16];
+	int i;
+
+	memcpy(salted, istate, sizeof(salted));
+	sha256_block(salted, header);
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, header + 16, 16);
+	pad[5] = 0x80000000;
+	pad[15] = (64 + 80 + 4) * 8;
+	for (i = 0; i < 4; i++) {
+		pad[4] = i + 1;		/* block index */
+		memcpy(ihash, salted, sizeof(ihash));
+		sha256_block(ihash, pad);
+		hmac_finish(out + 8 * i, ostate, ihash);
+	}
+}
+
+/* PBKDF2 salted with the mixed block B, one iteration: the 32 byte hash */
+static void pbkdf2_final(uint32_t *out, const uint32_t *istate,
+			 const uint32_t *ostate, const uint32_t *B)
+{
+	uint32_t ihash[8], pad[16];
+
+	memcpy(ihash, istate, sizeof(ihash));
+	sha256_block(ihash, B);
+	sha256_block(ihash, B + 16);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 1;
+	pad[1] = 0x80000000;
+	pad[15] = (64 + 128 + 4) * 8;
+	sha256_block(ihash, pad);
+	hmac_finish(out, ostate, ihash);
+}
+
+#define R(a, b)	(((a) << (b)) | ((a) >> (32 - (b))))
+
+/* B = Salsa20/8(B ^ Bx), on every lane */
+static inline void xor_salsa8(lanes_t *B, const lanes_t *Bx)
+{
+	lanes_t x00, x01, x02, x03, x04, x05, x06, x07;
+	lanes_t x08, x09, x10, x11, x12, x13, x14, x15;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		B[i] ^= Bx[i];
+	x00 = B[0];  x01 = B[1];  x02 = B[2];  x03 = B[3];
+	x04 = B[4];  x05 = B[5];  x06 = B[6];  x07 = B[7];
+	x08 = B[8];  x09 = B[9];  x10 = B[10]; x11 = B[11];
+	x12 = B[12]; x13 = B[13]; x14 = B[14]; x15 = B[15];
+
+	for (i = 0; i < 8; i += 2) {
+		/* columns */
+		x04 ^= R(x00 + x12, 7);  x09 ^= R(x05 + x01, 7);
+		x14 ^= R(x10 + x06, 7);  x03 ^= R(x15 + x11, 7);
+		x08 ^= R(x04 + x00, 9);  x13 ^= R(x09 + x05, 9);
+		x02 ^= R(x14 + x10, 9);  x07 ^= R(x03 + x15, 9);
+		x12 ^= R(x08 + x04, 13); x01 ^= R(x13 + x09, 13);
+		x06 ^= R(x02 + x14, 13); x11 ^= R(x07 + x03, 13);
+		x00 ^= R(x12 + x08, 18); x05 ^= R(x01 + x13, 18);
+		x10 ^= R(x06 + x02, 18); x15 ^= R(x11 + x07, 18);
+
+		/* rows */
+		x01 ^= R(x00 + x03, 7);  x06 ^= R(x05 + x04, 7);
+		x11 ^= R(x10 + x09, 7);  x12 ^= R(x15 + x14, 7);
+		x02 ^= R(x01 + x00, 9);  x07 ^= R(x06 + x05, 9);
+		x08 ^= R(x11 + x10, 9);  x13 ^= R(x12 + x15, 9);
+		x03 ^= R(x02 + x01, 13); x04 ^= R(x07 + x06, 13);
+		x09 ^= R(x08 + x11, 13); x14 ^= R(x13 + x12, 13);
+		x00 ^= R(x03 + x02, 18); x05 ^= R(x04 + x07, 18);
+		x10 ^= R(x09 + x08, 18); x15 ^= R(x14 + x13, 18);
+	}
+
+	B[0] += x00;  B[1] += x01;  B[2] += x02;  B[3] += x03;
+	B[4] += x04;  B[5] += x05;  B[6] += x06;  B[7] += x07;
+	B[8] += x08;  B[9] += x09;  B[10] += x10; B[11] += x11;
+	B[12] += x12; B[13] += x13; B[14] += x14; B[15] += x15;
+}
+
+/* ROMix with r = 1 on every lane; V holds SCRYPT_N blocks of 32 */
+static void scrypt_core(lanes_t *X, lanes_t *V)
+{
+	int i, k, l;
+
+	for (i = 0; i < SCRYPT_N; i++) {
+		memcpy(&V[i * 32], X, 32 * sizeof(*X));
+		xor_salsa8(&X[0], &X[16]);
+		xor_salsa8(&X[16], &X[0]);
+	}
+	for (i = 0; i < SCRYPT_N; i++) {
+		for (l = 0; l < SCRYPT_LANES; l++) {
+			const lanes_t *v = &V[(X[16][l] & (SCRYPT_N - 1)) * 32];
+
+			for (k = 0; k < 32; k++)
+				X[k][l] ^= v[k][l];
+		}
+		xor_salsa8(&X[0], &X[16]);
+		xor_salsa8(&X[16], &X[0]);
+	}
+}
+
+/* scrypt of SCRYPT_LANES headers differing only in their nonce */
+static void scrypt_lanes(uint32_t hash[][8], const uint32_t *data32,
+			 const uint32_t *nonces, const uint32_t *tmid,
+			 lanes_t *V)
+{
+	uint32_t istate[SCRYPT_LANES][8], ostate[SCRYPT_LANES][8];
+	uint32_t header[20], T[32];
+	lanes_t X[32];
+	int k, l;
+
+	memcpy(header, data32, sizeof(header));
+	for (l = 0; l < SCRYPT_LANES; l++) {
+		header[19] = nonces[l];
+		hmac_init(istate[l], ostate[l], tmid, header);
+		pbkdf2_header(T, istate[l], ostate[l], header);
+		/* Salsa20 reads little-endian words */
+		for (k = 0; k < 32; k++)
+			X[k][l] = swab32(T[k]);
+	}
+
+	scrypt_core(X, V);
+
+	for (l = 0; l < SCRYPT_LANES; l++) {
+		for (k = 0; k < 32; k++)
+			T[k] = swab32(X[k][l]);
+		pbkdf2_final(hash[l], istate[l], ostate[l], T);
+	}
+}
+
+/* Full scrypt hash of getwork data, for checking a solution; state words
+ * as the SHA-256 kernels leave them.  false if out of memory.
+ */
+bool scrypt_data(unsigned char *hash, const unsigned char *data)
+{
+	const uint32_t *data32 = (const uint32_t *) data;
+	uint32_t tmid[8], nonces[SCRYPT_LANES], out[SCRYPT_LANES][8];
+	lanes_t *V;
+	int l;
+
+	V = malloc(scrypt_scratch_size());
+	if (!V)
+		return false;
+	memcpy(tmid, sha256_init_state, sizeof(tmid));
+	sha256_block(tmid, data32);
+	for (l = 0; l < SCRYPT_LANES; l++)
+		nonces[l] = data32[19];
+	scrypt_lanes(out, data32, nonces, tmid, V);
+	memcpy(hash, out[0], 32);
+	free(V);
+	return true;
+}
+
+/* hash <= target, both as 256 bit little-endian numbers */
+static bool scrypt_test(const uint32_t *hash32, const unsigned char *target)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		uint32_t h = swab32(hash32[i]), t = le32dec(target + 4 * i);
+
+		if (h != t)
+			return h < t;
+	}
+	return true;
+}
+
+bool scanhash_scrypt(int thr_id, unsigned char *data, void *scratchbuf,
+		     unsigned char *hash, const unsigned char *target,
+		     uint32_t max_nonce, unsigned long *hashes_done)
+{
+	uint32_t *data32 = (uint32_t *) data;
+	uint32_t tmid[8], nonces[SCRYPT_LANES], out[SCRYPT_LANES][8];
+	uint32_t n = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_SCRYPT);
+	uint32_t poll_at = poll;
+	int l;
+
+	work_restart[thr_id].restart = 0;
+
+	/* the first block of the HMAC key is the same for every nonce */
+	memcpy(tmid, sha256_init_state, sizeof(tmid));
+	sha256_block(tmid, data32);
+
+	while (1) {
+		for (l = 0; l < SCRYPT_LANES; l++)
+			nonces[l] = n + l + 1;
+		scrypt_lanes(out, data32, nonces, tmid, scratchbuf);
+
+		for (l = 0; l < SCRYPT_LANES; l++) {
+			if (likely(!scrypt_test(out[l], target)))
+				continue;
+			memcpy(hash, out[l], 32);
+			data32[19] = nonces[l];
+			*hashes_done = n + SCRYPT_LANES;
+			return true;
+		}
+
+		n += SCRYPT_LANES;
+		if ((uint64_t) n + SCRYPT_LANES > max_nonce ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
+			*hashes_done = n;
+			return false;
+		}
+	}
+}
+
+#endif /* WANT_SCRYPT */
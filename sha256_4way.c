@@ -16,9 +16,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define NPAR 32
+/* nonces per pass: scan_tune[ALGO_4WAY].batch, a multiple of 4 */
+#define NPAR_MAX 64
 
-static void DoubleBlockSHA256(const void* pin, void* pout, const void* pinit, unsigned int hash[8][NPAR], const void* init2);
+static void DoubleBlockSHA256(const void* pin, void* pout, const void* pinit, unsigned int hash[9][NPAR_MAX], const void* init2, unsigned int npar);
 
 static const unsigned int sha256_consts[] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
@@ -109,20 +110,26 @@ unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
 {
     unsigned int *nNonce_p = (unsigned int*)(pdata + 12);
     unsigned int nonce = 0;
+    unsigned int npar = scan_tune[ALGO_4WAY].batch & ~3;
+    const unsigned int poll = scan_poll(thr_id, ALGO_4WAY);
+    uint32_t poll_at = poll;
+
+    if (npar < 4 || npar > NPAR_MAX)
+        npar = 32;
 
     work_restart[thr_id].restart = 0;
 
     for (;;)
     {
-        unsigned int thash[9][NPAR] __attribute__((aligned(128)));
+        unsigned int thash[9][NPAR_MAX] __attribute__((aligned(128)));
 	int j;
 
-	nonce += NPAR;
+	nonce += npar;
 	*nNonce_p = nonce;
 
-        DoubleBlockSHA256(pdata, phash1, pmidstate, thash, pSHA256InitState);
+        DoubleBlockSHA256(pdata, phash1, pmidstate, thash, pSHA256InitState, npar);
 
-        for (j = 0; j < NPAR; j++)
+        for (j = 0; j < npar; j++)
         {
             if (unlikely(thash[7][j] == 0))
             {
@@ -139,7 +146,8 @@ unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
             }
         }
 
-        if ((nonce >= max_nonce) || work_restart[thr_id].restart)
+        if ((nonce >= max_nonce) ||
+            scan_restart(thr_id, nonce, &poll_at, poll))
         {
             *nHashesDone = nonce;
             return -1;
@@ -148,7 +156,7 @@ unsigned int ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
 }
 
 
-static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR], const void *init)
+static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR_MAX], const void *init, unsigned int npar)
 {
     unsigned int* In = (unsigned int*)pin;
     unsigned int* Pad = (unsigned int*)pad;
@@ -169,7 +177,7 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
 
     preNonce = _mm_add_epi32(_mm_set1_epi32(In[3]), offset);
 
-    for(k = 0; k<NPAR; k+=4) {
+    for(k = 0; k<npar; k+=4) {
         w0 = _mm_set1_epi32(In[0]);
         w1 = _mm_set1_epi32(In[1]);
         w2 = _mm_set1_epi32(In[2]);
@@ -102,6 +102,8 @@ bool scanhash_cryptopp(int thr_id, const unsigned char *midstate,
 	uint32_t *nonce = (uint32_t *)(data + 12);
 	uint32_t n = 0;
 	unsigned long stat_ctr = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_CRYPTOPP);
+	uint32_t poll_at = poll;
 
 	work_restart[thr_id].restart = 0;
 
@@ -121,7 +123,8 @@ bool scanhash_cryptopp(int thr_id, const unsigned char *midstate,
 			return true;
 		}
 
-		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+		if ((n >= max_nonce) ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
 			*hashes_done = stat_ctr;
 			return false;
 		}
@@ -588,6 +591,8 @@ bool scanhash_asm32(int thr_id, const unsigned char *midstate,
 	uint32_t *nonce = (uint32_t *)(data + 12);
 	uint32_t n = 0;
 	unsigned long stat_ctr = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_CRYPTOPP_ASM32);
+	uint32_t poll_at = poll;
 
 	work_restart[thr_id].restart = 0;
 
@@ -607,7 +612,8 @@ bool scanhash_asm32(int thr_id, const unsigned char *midstate,
 			return true;
 		}
 
-		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+		if ((n >= max_nonce) ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
 			*hashes_done = stat_ctr;
 			return false;
 		}
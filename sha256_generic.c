@@ -238,6 +238,71 @@ const uint32_t sha256_init_state[8] = {
 	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
 };
 
+/* One block of message words into 'state' */
+void sha256_block(uint32_t *state, const uint32_t *block)
+{
+	sha256_transform(state, (const u8 *) block);
+}
+
+/* Midstate of getwork data: the state after its first 64 bytes */
+void sha256_midstate(unsigned char *midstate, const unsigned char *data)
+{
+	runhash(midstate, data, sha256_init_state);
+}
+
+/* Full double hash of getwork data, for checking a solution */
+void sha256d_data(unsigned char *hash, const unsigned char *data)
+{
+	uint32_t midstate[8], hash1[16];
+
+	runhash(midstate, data, sha256_init_state);
+	runhash(hash1, data + 64, midstate);
+	memset(hash1 + 8, 0, 32);
+	hash1[8] = 0x80000000;
+	hash1[15] = 0x00000100;
+	runhash(hash, hash1, sha256_init_state);
+}
+
+/* SHA-256d of a byte string, as the block chain hashes transactions and
+ * merkle tree nodes; the digest in byte order
+ */
+void sha256d(unsigned char *hash, const unsigned char *data, size_t len)
+{
+	uint32_t state[8], block[16];
+	unsigned char buf[64];
+	size_t i, b, blocks = (len + 9 + 63) / 64;	/* with 0x80, length */
+	int k;
+
+	memcpy(state, sha256_init_state, sizeof(state));
+	for (b = 0; b < blocks; b++) {
+		for (k = 0; k < 64; k++) {
+			i = 64 * b + k;
+			buf[k] = i < len ? data[i] : i == len ? 0x80 : 0;
+		}
+		if (b == blocks - 1)
+			for (k = 0; k < 8; k++)
+				buf[63 - k] = ((uint64_t) len << 3) >> (8 * k);
+		for (k = 0; k < 16; k++)
+			block[k] = ((uint32_t) buf[4 * k] << 24) |
+				   (buf[4 * k + 1] << 16) |
+				   (buf[4 * k + 2] << 8) | buf[4 * k + 3];
+		sha256_block(state, block);
+	}
+
+	memcpy(block, state, sizeof(state));
+	memset(block + 8, 0, 32);
+	block[8] = 0x80000000;
+	block[15] = 256;
+	memcpy(state, sha256_init_state, sizeof(state));
+	sha256_block(state, block);
+	for (k = 0; k < 8; k++) {
+		hash[4 * k] = state[k] >> 24;
+		hash[4 * k + 1] = state[k] >> 16;
+		hash[4 * k + 2] = state[k] >> 8;
+		hash[4 * k + 3] = state[k];
+	}
+}
+
 /* suspiciously similar to ScanHash* from bitcoin */
 bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 	        unsigned char *hash, const unsigned char *target,
@@ -247,6 +312,8 @@ bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 	uint32_t *nonce = (uint32_t *)(data + 12);
 	uint32_t n = 0;
 	unsigned long stat_ctr = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_C);
+	uint32_t poll_at = poll;
 
 	work_restart[thr_id].restart = 0;
 
@@ -266,7 +333,8 @@ bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 			return true;
 		}
 
-		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+		if ((n >= max_nonce) ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
 			*hashes_done = stat_ctr;
 			return false;
 		}
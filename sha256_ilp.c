@@ -0,0 +1,287 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Interleaved scalar scan kernel, for hosts and builds with no usable
+ * SIMD kernel.  One SHA-256 round is a long serial dependency chain, so
+ * hashing a single nonce at a time leaves most of a superscalar core
+ * idle; this kernel hashes SHA256_STREAMS nonces in lockstep, round by
+ * round, so the out-of-order core always has independent work at hand.
+ *
+ * What does not depend on the nonce is done once per scan: the first
+ * three rounds of the first hash, and the nonce-free parts of round
+ * four and of the first message schedule words.  The second hash runs
+ * 61 of its 64 rounds, which is as far as its last word needs, and is
+ * finished only for candidates.  The rotates are written so that the compiler
+ * emits single instructions.  On x86_64 the kernel is also built for
+ * BMI2, whose RORX rotates without touching flags or its source, and
+ * that build is used where the cpu has it.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "miner.h"
+
+/* Each stream keeps eight words live.  With 16 registers, as on
+ * x86_64, a third stream spills and runs slower than one; the 31 of
+ * aarch64 hold three.  Override with -DSHA256_STREAMS=N.
+ */
+#ifndef SHA256_STREAMS
+#ifdef __aarch64__
+#define SHA256_STREAMS	3
+#else
+#define SHA256_STREAMS	2
+#endif
+#endif
+
+/* FOR_S(m, ...) expands m(j, ...) for each stream j */
+#if SHA256_STREAMS == 2
+#define FOR_S(m, ...)	m(0, __VA_ARGS__) m(1, __VA_ARGS__)
+#elif SHA256_STREAMS == 3
+#define FOR_S(m, ...)	m(0, __VA_ARGS__) m(1, __VA_ARGS__) m(2, __VA_ARGS__)
+#elif SHA256_STREAMS == 4
+#define FOR_S(m, ...)	m(0, __VA_ARGS__) m(1, __VA_ARGS__) m(2, __VA_ARGS__) \
+			m(3, __VA_ARGS__)
+#else
+#error "SHA256_STREAMS must be 2, 3 or 4"
+#endif
+
+/* a BMI2 build of the kernel, picked at runtime */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__BMI2__)
+#define ILP_BMI2
+#endif
+
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+#define Ch(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+#define e0(x)		(ror32(x, 2) ^ ror32(x, 13) ^ ror32(x, 22))
+#define e1(x)		(ror32(x, 6) ^ ror32(x, 11) ^ ror32(x, 25))
+#define s0(x)		(ror32(x, 7) ^ ror32(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ror32(x, 17) ^ ror32(x, 19) ^ ((x) >> 10))
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* One round of stream j; the callers rotate the roles of a..h */
+#define RND_J(j, a, b, c, d, e, f, g, h, W, i)				\
+	t1 = h##j + e1(e##j) + Ch(e##j, f##j, g##j) + K[i] + W[i][j];	\
+	t2 = e0(a##j) + Maj(a##j, b##j, c##j);				\
+	d##j += t1;							\
+	h##j = t1 + t2;
+
+#define RND(a, b, c, d, e, f, g, h, W, i)				\
+	FOR_S(RND_J, a, b, c, d, e, f, g, h, W, i)
+
+#define RND8(W, i)							\
+	RND(a, b, c, d, e, f, g, h, W, i)				\
+	RND(h, a, b, c, d, e, f, g, W, i + 1)				\
+	RND(g, h, a, b, c, d, e, f, W, i + 2)				\
+	RND(f, g, h, a, b, c, d, e, W, i + 3)				\
+	RND(e, f, g, h, a, b, c, d, W, i + 4)				\
+	RND(d, e, f, g, h, a, b, c, W, i + 5)				\
+	RND(c, d, e, f, g, h, a, b, W, i + 6)				\
+	RND(b, c, d, e, f, g, h, a, W, i + 7)
+
+#define DECL_J(j, x)							\
+	uint32_t a##j, b##j, c##j, d##j, e##j, f##j, g##j, h##j;
+
+#define EXPAND_J(j, W, i)						\
+	W[i][j] = s1(W[i-2][j]) + W[i-7][j] + s0(W[i-15][j]) + W[i-16][j];
+
+/* First hash: round 3 from its hoisted part, for nonce n + j + 1 */
+#define FIRST_J(j, x)							\
+	W1[3][j] = n + j + 1;						\
+	W1[18][j] = pre_w18 + s0(W1[3][j]);				\
+	W1[19][j] = pre_w19 + W1[3][j];					\
+	t1 = pre_t1 + W1[3][j];						\
+	a##j = t1 + pre_t2;  b##j = pre[0];  c##j = pre[1];		\
+	d##j = pre[2];  e##j = pre[3] + t1;  f##j = pre[4];		\
+	g##j = pre[5];  h##j = pre[6];
+
+/* Second hash input; after 60 rounds a..h sit in e..d */
+#define SECOND_J(j, x)							\
+	W2[0][j] = e##j + mid32[0];  W2[1][j] = f##j + mid32[1];	\
+	W2[2][j] = g##j + mid32[2];  W2[3][j] = h##j + mid32[3];	\
+	W2[4][j] = a##j + mid32[4];  W2[5][j] = b##j + mid32[5];	\
+	W2[6][j] = c##j + mid32[6];  W2[7][j] = d##j + mid32[7];	\
+	a##j = sha256_init_state[0];  b##j = sha256_init_state[1];	\
+	c##j = sha256_init_state[2];  d##j = sha256_init_state[3];	\
+	e##j = sha256_init_state[4];  f##j = sha256_init_state[5];	\
+	g##j = sha256_init_state[6];  h##j = sha256_init_state[7];
+
+/* After round 60 of the second hash the last word is final: the e of
+ * round 61, in h.  Only candidates are finished.
+ */
+#define CHECK_J(j, x)							\
+	if (unlikely(h##j + sha256_init_state[7] == 0)) {		\
+		uint32_t v[8] = { d##j, e##j, f##j, g##j,		\
+				  h##j, a##j, b##j, c##j };		\
+									\
+		finish(hash32, v, W2, j);				\
+		*nonce = n + j + 1;					\
+		if (fulltest(hash, target)) {				\
+			*hashes_done = n + SHA256_STREAMS;		\
+			return true;					\
+		}							\
+	}
+
+static void finish(uint32_t *hash32, uint32_t *v,
+		   uint32_t W[64][SHA256_STREAMS], int j)
+{
+	uint32_t t1, t2;
+	int i;
+
+	for (i = 61; i < 64; i++) {
+		t1 = v[7] + e1(v[4]) + Ch(v[4], v[5], v[6]) + K[i] + W[i][j];
+		t2 = e0(v[0]) + Maj(v[0], v[1], v[2]);
+		memmove(v + 1, v, 7 * sizeof(*v));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		hash32[i] = v[i] + sha256_init_state[i];
+}
+
+static inline __attribute__((always_inline))
+bool scan_ilp(int thr_id, const unsigned char *midstate,
+	      unsigned char *data, unsigned char *hash,
+	      const unsigned char *target,
+	      uint32_t max_nonce, unsigned long *hashes_done)
+{
+	const uint32_t *data32 = (const uint32_t *) data;
+	const uint32_t *mid32 = (const uint32_t *) midstate;
+	uint32_t *hash32 = (uint32_t *) hash;
+	uint32_t *nonce = (uint32_t *)(data + 12);
+	uint32_t W1[64][SHA256_STREAMS], W2[64][SHA256_STREAMS];
+	uint32_t pre[8], pre_t1, pre_t2, pre_w18, pre_w19;
+	uint32_t t1, t2, n = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_C_ILP);
+	uint32_t poll_at = poll;
+	FOR_S(DECL_J, x)
+	int i, j;
+
+	work_restart[thr_id].restart = 0;
+
+	/* the first hash up to the nonce, which is word 3 */
+	memcpy(pre, mid32, sizeof(pre));
+	for (i = 0; i < 3; i++) {
+		t1 = pre[7] + e1(pre[4]) + Ch(pre[4], pre[5], pre[6]) +
+		     K[i] + data32[i];
+		t2 = e0(pre[0]) + Maj(pre[0], pre[1], pre[2]);
+		memmove(pre + 1, pre, 7 * sizeof(*pre));
+		pre[4] += t1;
+		pre[0] = t1 + t2;
+	}
+	pre_t1 = pre[7] + e1(pre[4]) + Ch(pre[4], pre[5], pre[6]) + K[3];
+	pre_t2 = e0(pre[0]) + Maj(pre[0], pre[1], pre[2]);
+
+	for (j = 0; j < SHA256_STREAMS; j++) {
+		for (i = 0; i < 16; i++)
+			W1[i][j] = data32[i];
+		for (i = 16; i < 18; i++)
+			EXPAND_J(j, W1, i)
+		for (i = 8; i < 16; i++)
+			W2[i][j] = i == 8 ? 0x80000000 :
+				   i == 15 ? 0x00000100 : 0;
+	}
+	pre_w18 = s1(W1[16][0]) + W1[11][0] + W1[2][0];
+	pre_w19 = s1(W1[17][0]) + W1[12][0] + s0(W1[4][0]);
+
+	while (1) {
+		FOR_S(FIRST_J, x)
+		for (i = 20; i < 64; i++) {
+			FOR_S(EXPAND_J, W1, i)
+		}
+		RND8(W1, 4)
+		RND8(W1, 12)
+		RND8(W1, 20)
+		RND8(W1, 28)
+		RND8(W1, 36)
+		RND8(W1, 44)
+		RND8(W1, 52)
+		RND(a, b, c, d, e, f, g, h, W1, 60)
+		RND(h, a, b, c, d, e, f, g, W1, 61)
+		RND(g, h, a, b, c, d, e, f, W1, 62)
+		RND(f, g, h, a, b, c, d, e, W1, 63)
+
+		FOR_S(SECOND_J, x)
+		for (i = 16; i < 64; i++) {
+			FOR_S(EXPAND_J, W2, i)
+		}
+		RND8(W2, 0)
+		RND8(W2, 8)
+		RND8(W2, 16)
+		RND8(W2, 24)
+		RND8(W2, 32)
+		RND8(W2, 40)
+		RND8(W2, 48)
+		RND(a, b, c, d, e, f, g, h, W2, 56)
+		RND(h, a, b, c, d, e, f, g, W2, 57)
+		RND(g, h, a, b, c, d, e, f, W2, 58)
+		RND(f, g, h, a, b, c, d, e, W2, 59)
+		RND(e, f, g, h, a, b, c, d, W2, 60)
+
+		FOR_S(CHECK_J, x)
+
+		n += SHA256_STREAMS;
+		if ((uint64_t) n + SHA256_STREAMS > max_nonce ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
+			*hashes_done = n;
+			return false;
+		}
+	}
+}
+
+#ifdef ILP_BMI2
+static __attribute__((target("bmi2")))
+bool scan_ilp_bmi2(int thr_id, const unsigned char *midstate,
+		   unsigned char *data, unsigned char *hash,
+		   const unsigned char *target,
+		   uint32_t max_nonce, unsigned long *hashes_done)
+{
+	return scan_ilp(thr_id, midstate, data, hash, target, max_nonce,
+			hashes_done);
+}
+#endif
+
+bool scanhash_c_ilp(int thr_id, const unsigned char *midstate,
+		    unsigned char *data, unsigned char *hash,
+		    const unsigned char *target,
+		    uint32_t max_nonce, unsigned long *hashes_done)
+{
+#ifdef ILP_BMI2
+	if (__builtin_cpu_supports("bmi2"))
+		return scan_ilp_bmi2(thr_id, midstate, data, hash, target,
+				     max_nonce, hashes_done);
+#endif
+	return scan_ilp(thr_id, midstate, data, hash, target, max_nonce,
+			hashes_done);
+}
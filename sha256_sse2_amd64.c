@@ -9,6 +9,18 @@
  *
  */
 
+/*
+ * Four nonces at a time, one per SSE2 lane, in intrinsics.  Both hashes
+ * run back to back in one function over a rolling 16-word message
+ * schedule: the working state stays in registers and the schedule in
+ * 256 bytes of L1, where the rounds read it as memory operands, instead
+ * of the 192 vectors the assembler version kept on the stack.  (All 24
+ * do not fit in 16 registers; forcing them in makes the compiler spill
+ * far more.)  The first three rounds of the first hash do not depend on
+ * the nonce and are done once per scan; the second hash runs its last
+ * three rounds only for candidates.
+ */
+
 #include "cpuminer-config.h"
 
 #include "miner.h"
@@ -16,38 +28,95 @@
 #ifdef WANT_X8664_SSE2
 
 #include <string.h>
-#include <assert.h>
-
-#include <xmmintrin.h>
 #include <stdint.h>
-#include <stdio.h>
-
-extern void CalcSha256_x64(__m128i *res, __m128i *data, uint32_t init[8]);
-
-uint32_t g_sha256_k[] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
-    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
-    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
-    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
-    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
-    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
-    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
-    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
-    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+#include <emmintrin.h>
+
+#define K4(x)	{ x, x, x, x }
+
+/* round constants, broadcast to all lanes; read only */
+static const uint32_t sha256_4k[64][4] __attribute__((aligned(16))) = {
+	K4(0x428a2f98), K4(0x71374491), K4(0xb5c0fbcf), K4(0xe9b5dba5),
+	K4(0x3956c25b), K4(0x59f111f1), K4(0x923f82a4), K4(0xab1c5ed5),
+	K4(0xd807aa98), K4(0x12835b01), K4(0x243185be), K4(0x550c7dc3),
+	K4(0x72be5d74), K4(0x80deb1fe), K4(0x9bdc06a7), K4(0xc19bf174),
+	K4(0xe49b69c1), K4(0xefbe4786), K4(0x0fc19dc6), K4(0x240ca1cc),
+	K4(0x2de92c6f), K4(0x4a7484aa), K4(0x5cb0a9dc), K4(0x76f988da),
+	K4(0x983e5152), K4(0xa831c66d), K4(0xb00327c8), K4(0xbf597fc7),
+	K4(0xc6e00bf3), K4(0xd5a79147), K4(0x06ca6351), K4(0x14292967),
+	K4(0x27b70a85), K4(0x2e1b2138), K4(0x4d2c6dfc), K4(0x53380d13),
+	K4(0x650a7354), K4(0x766a0abb), K4(0x81c2c92e), K4(0x92722c85),
+	K4(0xa2bfe8a1), K4(0xa81a664b), K4(0xc24b8b70), K4(0xc76c51a3),
+	K4(0xd192e819), K4(0xd6990624), K4(0xf40e3585), K4(0x106aa070),
+	K4(0x19a4c116), K4(0x1e376c08), K4(0x2748774c), K4(0x34b0bcb5),
+	K4(0x391c0cb3), K4(0x4ed8aa4a), K4(0x5b9cca4f), K4(0x682e6ff3),
+	K4(0x748f82ee), K4(0x78a5636f), K4(0x84c87814), K4(0x8cc70208),
+	K4(0x90befffa), K4(0xa4506ceb), K4(0xbef9a3f7), K4(0xc67178f2)
 };
 
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
 
-uint32_t g_sha256_hinit[8] =
-{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+#define ADD(x, y)	_mm_add_epi32(x, y)
+#define XOR(x, y)	_mm_xor_si128(x, y)
+#define AND(x, y)	_mm_and_si128(x, y)
+#define OR(x, y)	_mm_or_si128(x, y)
+#define ROR(x, n)	OR(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#define SHR(x, n)	_mm_srli_epi32(x, n)
+
+#define Ch(x, y, z)	XOR(z, AND(x, XOR(y, z)))
+#define Maj(x, y, z)	OR(AND(x, y), AND(z, OR(x, y)))
+#define S0(x)		XOR(ROR(x, 2), XOR(ROR(x, 13), ROR(x, 22)))
+#define S1(x)		XOR(ROR(x, 6), XOR(ROR(x, 11), ROR(x, 25)))
+#define s0(x)		XOR(ROR(x, 7), XOR(ROR(x, 18), SHR(x, 3)))
+#define s1(x)		XOR(ROR(x, 17), XOR(ROR(x, 19), SHR(x, 10)))
+
+/* scalar versions, for the rounds done once per scan */
+#define Ch32(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define Maj32(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+#define S0_32(x)	(ror32(x, 2) ^ ror32(x, 13) ^ ror32(x, 22))
+#define S1_32(x)	(ror32(x, 6) ^ ror32(x, 11) ^ ror32(x, 25))
+
+/* Round i = base + j, if lo <= i < hi; W[j] holds W[i] */
+#define STEP(a, b, c, d, e, f, g, h, base, lo, hi, j)			\
+	if ((base) + (j) >= (lo) && (base) + (j) < (hi)) {		\
+		t1 = ADD(ADD(ADD(h, S1(e)), Ch(e, f, g)),		\
+			 ADD(_mm_load_si128((const __m128i *)		\
+					    sha256_4k[(base) + (j)]), W[j])); \
+		t2 = ADD(S0(a), Maj(a, b, c));				\
+		d = ADD(d, t1);						\
+		h = ADD(t1, t2);					\
+	}
 
-__m128i g_4sha256_k[64];
+/* Rounds base..base+15, clipped to [lo, hi).  Entering a block past the
+ * first, the schedule rolls on by 16 words, in place: W[i-2] and W[i-7]
+ * are new by then, W[i-15] and W[i-16] not yet.
+ */
+#define ROUNDS(base, lo, hi)						\
+	do {								\
+		if ((base) >= 16 && (lo) <= (base))			\
+			for (i = 0; i < 16; i++)			\
+				W[i] = ADD(ADD(s1(W[(i + 14) & 15]),	\
+					       W[(i + 9) & 15]),	\
+					   ADD(s0(W[(i + 1) & 15]), W[i])); \
+		STEP(a, b, c, d, e, f, g, h, base, lo, hi, 0)		\
+		STEP(h, a, b, c, d, e, f, g, base, lo, hi, 1)		\
+		STEP(g, h, a, b, c, d, e, f, base, lo, hi, 2)		\
+		STEP(f, g, h, a, b, c, d, e, base, lo, hi, 3)		\
+		STEP(e, f, g, h, a, b, c, d, base, lo, hi, 4)		\
+		STEP(d, e, f, g, h, a, b, c, base, lo, hi, 5)		\
+		STEP(c, d, e, f, g, h, a, b, base, lo, hi, 6)		\
+		STEP(b, c, d, e, f, g, h, a, base, lo, hi, 7)		\
+		STEP(a, b, c, d, e, f, g, h, base, lo, hi, 8)		\
+		STEP(h, a, b, c, d, e, f, g, base, lo, hi, 9)		\
+		STEP(g, h, a, b, c, d, e, f, base, lo, hi, 10)		\
+		STEP(f, g, h, a, b, c, d, e, base, lo, hi, 11)		\
+		STEP(e, f, g, h, a, b, c, d, base, lo, hi, 12)		\
+		STEP(d, e, f, g, h, a, b, c, base, lo, hi, 13)		\
+		STEP(c, d, e, f, g, h, a, b, base, lo, hi, 14)		\
+		STEP(b, c, d, e, f, g, h, a, base, lo, hi, 15)		\
+	} while (0)
 
 int scanhash_sse2_64(int thr_id, const unsigned char *pmidstate,
 	unsigned char *pdata,
@@ -55,79 +124,128 @@ int scanhash_sse2_64(int thr_id, const unsigned char *pmidstate,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *nHashesDone)
 {
-    uint32_t *nNonce_p = (uint32_t *)(pdata + 12);
-    uint32_t nonce = 0;
-    uint32_t m_midstate[8], m_w[16], m_w1[16];
-    __m128i m_4w[64], m_4hash[64], m_4hash1[64];
-    __m128i offset;
-    int i;
-
-    work_restart[thr_id].restart = 0;
-
-    /* For debugging */
-    union {
-        __m128i m;
-        uint32_t i[4];
-    } mi;
-
-    /* Message expansion */
-    memcpy(m_midstate, pmidstate, sizeof(m_midstate));
-    memcpy(m_w, pdata, sizeof(m_w)); /* The 2nd half of the data */
-    memcpy(m_w1, phash1, sizeof(m_w1));
-    memset(m_4hash, 0, sizeof(m_4hash));
-
-    /* Transmongrify */
-    for (i = 0; i < 16; i++)
-        m_4w[i] = _mm_set1_epi32(m_w[i]);
-
-    for (i = 0; i < 16; i++)
-        m_4hash1[i] = _mm_set1_epi32(m_w1[i]);
-
-    for (i = 0; i < 64; i++)
-	g_4sha256_k[i] = _mm_set1_epi32(g_sha256_k[i]);
-
-    offset = _mm_set_epi32(0x3, 0x2, 0x1, 0x0);
-
-    for (;;)
-    {
-	int j;
-
-	m_4w[3] = _mm_add_epi32(offset, _mm_set1_epi32(nonce));
-
-	/* Some optimization can be done here W.R.T. precalculating some hash */
-        CalcSha256_x64(m_4hash1, m_4w, m_midstate);
-	CalcSha256_x64(m_4hash, m_4hash1, g_sha256_hinit);
-
-	for (j = 0; j < 4; j++) {
-	    mi.m = m_4hash[7];
-	    if (unlikely(mi.i[j] == 0))
-		break;
-        }
-
-	/* If j = true, we found a hit...so check it */
-	/* Use the C version for a check... */
-	if (unlikely(j != 4)) {
-		for (i = 0; i < 8; i++) {
-		    mi.m = m_4hash[i];
-		    *(uint32_t *)&(phash)[i*4] = mi.i[j];
-		}
-
-		if (fulltest(phash, ptarget)) {
-		     *nHashesDone = nonce;
-		     *nNonce_p = nonce + j;
-		     return nonce + j;
-		}
+	const uint32_t *data32 = (const uint32_t *) pdata;
+	uint32_t *nNonce_p = (uint32_t *)(pdata + 12);
+	uint32_t mid[8], pre[8], pre_t1, pre_t2, t1s, t2s;
+	uint32_t nonce = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_SSE2_64);
+	uint32_t poll_at = poll;
+	__m128i a, b, c, d, e, f, g, h, t1, t2;
+	__m128i W[16];
+	__m128i offset;
+	union {
+		__m128i m[8];
+		uint32_t i[8][4];
+	} out;
+	int i, j, hits;
+
+	work_restart[thr_id].restart = 0;
+
+	/* the first three rounds of the first hash, and what of round
+	 * four does not involve the nonce
+	 */
+	memcpy(mid, pmidstate, sizeof(mid));
+	memcpy(pre, mid, sizeof(pre));
+	for (i = 0; i < 3; i++) {
+		t1s = pre[7] + S1_32(pre[4]) + Ch32(pre[4], pre[5], pre[6]) +
+		      sha256_4k[i][0] + data32[i];
+		t2s = S0_32(pre[0]) + Maj32(pre[0], pre[1], pre[2]);
+		memmove(pre + 1, pre, 7 * sizeof(*pre));
+		pre[4] += t1s;
+		pre[0] = t1s + t2s;
 	}
+	pre_t1 = pre[7] + S1_32(pre[4]) + Ch32(pre[4], pre[5], pre[6]) +
+		 sha256_4k[3][0];
+	pre_t2 = S0_32(pre[0]) + Maj32(pre[0], pre[1], pre[2]);
+
+	offset = _mm_set_epi32(0x3, 0x2, 0x1, 0x0);
+
+	for (;;) {
+		/* first hash, from round 3: the header tail, nonces in W[3] */
+		for (i = 0; i < 16; i++)
+			W[i] = _mm_set1_epi32(data32[i]);
+		W[3] = ADD(offset, _mm_set1_epi32(nonce));
+
+		/* round 3; round 4 finds a..h in e..d */
+		t1 = ADD(_mm_set1_epi32(pre_t1), W[3]);
+		e = ADD(t1, _mm_set1_epi32(pre_t2));
+		f = _mm_set1_epi32(pre[0]);
+		g = _mm_set1_epi32(pre[1]);
+		h = _mm_set1_epi32(pre[2]);
+		a = ADD(_mm_set1_epi32(pre[3]), t1);
+		b = _mm_set1_epi32(pre[4]);
+		c = _mm_set1_epi32(pre[5]);
+		d = _mm_set1_epi32(pre[6]);
+
+		ROUNDS(0, 4, 64);
+		ROUNDS(16, 4, 64);
+		ROUNDS(32, 4, 64);
+		ROUNDS(48, 4, 64);
+
+		/* second hash, of the first, padded */
+		W[0] = ADD(a, _mm_set1_epi32(mid[0]));
+		W[1] = ADD(b, _mm_set1_epi32(mid[1]));
+		W[2] = ADD(c, _mm_set1_epi32(mid[2]));
+		W[3] = ADD(d, _mm_set1_epi32(mid[3]));
+		W[4] = ADD(e, _mm_set1_epi32(mid[4]));
+		W[5] = ADD(f, _mm_set1_epi32(mid[5]));
+		W[6] = ADD(g, _mm_set1_epi32(mid[6]));
+		W[7] = ADD(h, _mm_set1_epi32(mid[7]));
+		W[8] = _mm_set1_epi32(0x80000000);
+		for (i = 9; i < 15; i++)
+			W[i] = _mm_setzero_si128();
+		W[15] = _mm_set1_epi32(0x00000100);
+
+		a = _mm_set1_epi32(sha256_init_state[0]);
+		b = _mm_set1_epi32(sha256_init_state[1]);
+		c = _mm_set1_epi32(sha256_init_state[2]);
+		d = _mm_set1_epi32(sha256_init_state[3]);
+		e = _mm_set1_epi32(sha256_init_state[4]);
+		f = _mm_set1_epi32(sha256_init_state[5]);
+		g = _mm_set1_epi32(sha256_init_state[6]);
+		h = _mm_set1_epi32(sha256_init_state[7]);
+
+		/* after round 60 the last word is final: the e of round
+		 * 61, in h
+		 */
+		ROUNDS(0, 0, 61);
+		ROUNDS(16, 0, 61);
+		ROUNDS(32, 0, 61);
+		ROUNDS(48, 0, 61);
+
+		hits = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			ADD(h, _mm_set1_epi32(sha256_init_state[7])),
+			_mm_setzero_si128()));
+		if (unlikely(hits)) {
+			ROUNDS(48, 61, 64);
+
+			out.m[0] = a;  out.m[1] = b;
+			out.m[2] = c;  out.m[3] = d;
+			out.m[4] = e;  out.m[5] = f;
+			out.m[6] = g;  out.m[7] = h;
+
+			for (j = 0; j < 4; j++) {
+				if (!(hits & (1 << (4 * j))))
+					continue;
+				for (i = 0; i < 8; i++)
+					((uint32_t *) phash)[i] = out.i[i][j] +
+						sha256_init_state[i];
+				if (fulltest(phash, ptarget)) {
+					*nHashesDone = nonce;
+					*nNonce_p = nonce + j;
+					return nonce + j;
+				}
+			}
+		}
 
-	nonce += 4;
+		nonce += 4;
 
-        if (unlikely((nonce >= max_nonce) || work_restart[thr_id].restart))
-        {
-            *nHashesDone = nonce;
-            return -1;
+		if (unlikely((nonce >= max_nonce) ||
+			     scan_restart(thr_id, nonce, &poll_at, poll))) {
+			*nHashesDone = nonce;
+			return -1;
+		}
 	}
-   }
 }
 
 #endif /* WANT_X8664_SSE2 */
-
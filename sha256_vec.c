@@ -0,0 +1,70 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Portable SIMD scan kernels: double SHA-256 over 4, 8 or 16 nonces at
+ * once, from a single source written with GCC vector extensions.  There
+ * is no instruction set here: the same code becomes SSE2, AVX2, AVX-512
+ * or NEON depending on what the build targets (e.g. -march=native), so
+ * builds without yasm get a vectorized kernel too.  Every hash is
+ * SHA-256d of its header.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "miner.h"
+
+#ifdef WANT_SHA256_VEC
+
+#define CONCAT_(a, b)	a ## b
+#define CONCAT(a, b)	CONCAT_(a, b)
+
+/* all of these work on vectors as well as on scalars */
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define Ch(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define Maj(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+#define e0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define e1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define LANES 4
+#include "sha256_vec.h"
+#undef LANES
+
+#define LANES 8
+#include "sha256_vec.h"
+#undef LANES
+
+#define LANES 16
+#include "sha256_vec.h"
+#undef LANES
+
+#endif /* WANT_SHA256_VEC */
@@ -0,0 +1,110 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Body of the vector scan kernel, included by sha256_vec.c once per lane
+ * count: define LANES first.  Only generic vector operations are used,
+ * so the compiler maps the vectors onto whatever the build targets,
+ * splitting them over several registers where they are wider.
+ */
+
+#define VEC_T		CONCAT(vec, LANES)
+#define VEC_TRANSFORM	CONCAT(vec_transform, LANES)
+#define VEC_SCANHASH	CONCAT(scanhash_vec, LANES)
+
+typedef uint32_t VEC_T __attribute__((vector_size(LANES * 4)));
+
+/* One SHA-256 block per lane; W[0..15] holds the block, and is clobbered */
+static inline __attribute__((always_inline))
+void VEC_TRANSFORM(VEC_T *state, VEC_T *W)
+{
+	VEC_T a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 16; i < 64; i++)
+		W[i] = s1(W[i-2]) + W[i-7] + s0(W[i-15]) + W[i-16];
+
+	a = state[0];  b = state[1];  c = state[2];  d = state[3];
+	e = state[4];  f = state[5];  g = state[6];  h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + e1(e) + Ch(e, f, g) + sha256_k[i] + W[i];
+		t2 = e0(a) + Maj(a, b, c);
+		h = g;  g = f;  f = e;  e = d + t1;
+		d = c;  c = b;  b = a;  a = t1 + t2;
+	}
+
+	state[0] += a;  state[1] += b;  state[2] += c;  state[3] += d;
+	state[4] += e;  state[5] += f;  state[6] += g;  state[7] += h;
+}
+
+bool VEC_SCANHASH(int thr_id, const unsigned char *midstate,
+		  unsigned char *data, unsigned char *hash,
+		  const unsigned char *target,
+		  uint32_t max_nonce, unsigned long *hashes_done)
+{
+	const uint32_t *data32 = (const uint32_t *) data;
+	const uint32_t *mid32 = (const uint32_t *) midstate;
+	uint32_t *hash32 = (uint32_t *) hash;
+	uint32_t *nonce = (uint32_t *)(data + 12);
+	VEC_T W[64], state[8], lane;
+	uint32_t n = 0;
+	const unsigned int poll = scan_poll(thr_id, CONCAT(ALGO_VEC, LANES));
+	uint32_t poll_at = poll;
+	int i, j;
+
+	work_restart[thr_id].restart = 0;
+
+	for (j = 0; j < LANES; j++)
+		lane[j] = j + 1;
+
+	while (1) {
+		/* first hash: the second half of the header, nonces n+1.. */
+		for (i = 0; i < 16; i++)
+			W[i] = lane * 0 + data32[i];
+		W[3] = lane + n;
+		for (i = 0; i < 8; i++)
+			state[i] = lane * 0 + mid32[i];
+		VEC_TRANSFORM(state, W);
+
+		/* second hash: of the first, padded */
+		for (i = 0; i < 8; i++) {
+			W[i] = state[i];
+			state[i] = lane * 0 + sha256_init_state[i];
+		}
+		W[8] = lane * 0 + 0x80000000;
+		for (i = 9; i < 15; i++)
+			W[i] = lane * 0;
+		W[15] = lane * 0 + 256;
+		VEC_TRANSFORM(state, W);
+
+		for (j = 0; j < LANES; j++) {
+			if (likely(state[7][j] != 0))
+				continue;
+
+			for (i = 0; i < 8; i++)
+				hash32[i] = state[i][j];
+			*nonce = n + j + 1;
+			if (fulltest(hash, target)) {
+				*hashes_done = n + LANES;
+				return true;
+			}
+		}
+
+		n += LANES;
+		if ((uint64_t) n + LANES > max_nonce ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
+			*hashes_done = n;
+			return false;
+		}
+	}
+}
+
+#undef VEC_T
+#undef VEC_TRANSFORM
+#undef VEC_SCANHASH
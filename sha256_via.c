@@ -38,6 +38,8 @@ bool scanhash_via(int thr_id, unsigned char *data_inout,
 	uint32_t *nonce = (uint32_t *)(data + 64 + 12);
 	uint32_t n = 0;
 	unsigned long stat_ctr = 0;
+	const unsigned int poll = scan_poll(thr_id, ALGO_VIA);
+	uint32_t poll_at = poll;
 	int i;
 
 	work_restart[thr_id].restart = 0;
@@ -81,7 +83,8 @@ bool scanhash_via(int thr_id, unsigned char *data_inout,
 			return true;
 		}
 
-		if ((n >= max_nonce) || work_restart[thr_id].restart) {
+		if ((n >= max_nonce) ||
+		    scan_restart(thr_id, n, &poll_at, poll)) {
 			*hashes_done = stat_ctr;
 			return false;
 		}
@@ -0,0 +1,255 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Hashrate and share statistics.
+ *
+ * Each miner thread owns one cache-line padded slot of counters and is
+ * its only writer, so updating them needs no lock.  A reporter thread
+ * samples every slot periodically, folds the deltas into 1, 5 and 15
+ * minute exponentially weighted moving averages (the same smoothing the
+ * kernel uses for loadavg), and logs the totals.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+#define STATS_SAMPLE	5	/* seconds between EWMA updates */
+
+static const double ewma_period[STATS_WINDOWS] = { 60.0, 300.0, 900.0 };
+
+struct thr_ewma {
+	uint64_t	hashes;		/* counters at last sample */
+	uint64_t	scan_usecs;
+	uint64_t	wait_usecs;
+	double		rate[STATS_WINDOWS];	/* hash/sec */
+	double		duty;		/* hashing share of last interval */
+	double		elapsed;	/* seconds sampled before first hash */
+};
+
+struct thr_stats *thr_stats;
+struct share_stats share_stats;
+struct histogram rpc_latency[RPC_KINDS];
+struct histogram restart_latency;
+
+/* upper bounds, in seconds; longpoll calls can legitimately take hours */
+const double hist_bounds[HIST_BUCKETS] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+	1, 2.5, 5, 10, 30, 60, 300, 900, 3600,
+};
+
+static int st_threads;
+static int st_interval;
+static struct thr_ewma *ewma;
+static double total_rate[STATS_WINDOWS];
+static pthread_mutex_t ewma_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool stats_init(int n_threads)
+{
+	st_threads = n_threads;
+	thr_stats = calloc(n_threads, sizeof(*thr_stats));
+	ewma = calloc(n_threads, sizeof(*ewma));
+
+	return thr_stats && ewma;
+}
+
+static void ewma_update(double *avg, double rate, double dt, double period)
+{
+	double decay = exp(-dt / period);
+
+	*avg = *avg * decay + rate * (1.0 - decay);
+}
+
+static void stats_sample(double dt)
+{
+	double total[STATS_WINDOWS] = { };
+	int i, w;
+
+	pthread_mutex_lock(&ewma_lock);
+	for (i = 0; i < st_threads; i++) {
+		struct thr_stats *ts = &thr_stats[i];
+		struct thr_ewma *e = &ewma[i];
+		uint64_t hashes = stats_read(&ts->hashes);
+		uint64_t scan = stats_read(&ts->scan_usecs);
+		uint64_t wait = stats_read(&ts->wait_usecs);
+		double rate = (hashes - e->hashes) / dt;
+
+		/* seed the averages with the first report, rather than
+		 * ramping up from zero over fifteen minutes
+		 */
+		e->elapsed += dt;
+		if (!e->hashes && hashes)
+			for (w = 0; w < STATS_WINDOWS; w++)
+				e->rate[w] = hashes / e->elapsed;
+		else
+			for (w = 0; w < STATS_WINDOWS; w++)
+				ewma_update(&e->rate[w], rate, dt,
+					    ewma_period[w]);
+		for (w = 0; w < STATS_WINDOWS; w++)
+			total[w] += e->rate[w];
+
+		if (scan - e->scan_usecs + wait - e->wait_usecs)
+			e->duty = (double)(scan - e->scan_usecs) /
+				  (scan - e->scan_usecs + wait - e->wait_usecs);
+
+		e->hashes = hashes;
+		e->scan_usecs = scan;
+		e->wait_usecs = wait;
+	}
+	memcpy(total_rate, total, sizeof(total_rate));
+	pthread_mutex_unlock(&ewma_lock);
+}
+
+/* Smoothed rate of one thread (thr_id >= 0) or all threads, hash/sec */
+double stats_rate(int thr_id, enum stats_windows window)
+{
+	double rate;
+
+	pthread_mutex_lock(&ewma_lock);
+	rate = thr_id < 0 ? total_rate[window] : ewma[thr_id].rate[window];
+	pthread_mutex_unlock(&ewma_lock);
+
+	return rate;
+}
+
+/* Fraction of time spent hashing, rather than waiting for work; for
+ * all threads, the average over those not parked, whose last figure is
+ * stale
+ */
+double stats_duty(int thr_id)
+{
+	double duty = 0.0;
+	int i, running = 0;
+
+	pthread_mutex_lock(&ewma_lock);
+	if (thr_id >= 0)
+		duty = ewma[thr_id].duty;
+	else {
+		for (i = 0; i < st_threads; i++) {
+			if (thr_info[i].park_mask)
+				continue;
+			duty += ewma[i].duty;
+			running++;
+		}
+		if (running)
+			duty /= running;
+	}
+	pthread_mutex_unlock(&ewma_lock);
+
+	return duty;
+}
+
+void stats_share(enum share_results result)
+{
+	switch (result) {
+	case SHARE_ACCEPTED:
+		stats_add(&share_stats.accepted, 1);
+		break;
+	case SHARE_REJECTED:
+		stats_add(&share_stats.rejected, 1);
+		break;
+	case SHARE_STALE:
+		stats_add(&share_stats.stale, 1);
+		break;
+	}
+}
+
+void hist_observe(struct histogram *h, uint64_t usecs)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (usecs <= hist_bounds[i] * 1e6)
+			break;
+	stats_add(&h->bucket[i], 1);
+	stats_add(&h->sum_usecs, usecs);
+	stats_add(&h->count, 1);
+}
+
+static void stats_log(void)
+{
+	int i;
+
+	applog(LOG_INFO, "total: %.2f/%.2f/%.2f khash/sec (1m/5m/15m), "
+	       "shares %llu accepted, %llu rejected, %llu stale, "
+	       "duty cycle %.1f%%",
+	       stats_rate(-1, STATS_1M) / 1000.0,
+	       stats_rate(-1, STATS_5M) / 1000.0,
+	       stats_rate(-1, STATS_15M) / 1000.0,
+	       (unsigned long long) stats_read(&share_stats.accepted),
+	       (unsigned long long) stats_read(&share_stats.rejected),
+	       (unsigned long long) stats_read(&share_stats.stale),
+	       100.0 * stats_duty(-1));
+
+	if (n_pools > 1)
+		pool_log();
+
+	for (i = 0; i < st_threads && !opt_quiet; i++)
+		applog(LOG_INFO, "thread %d: %.2f/%.2f/%.2f khash/sec, "
+		       "duty cycle %.1f%%", i,
+		       stats_rate(i, STATS_1M) / 1000.0,
+		       stats_rate(i, STATS_5M) / 1000.0,
+		       stats_rate(i, STATS_15M) / 1000.0,
+		       100.0 * stats_duty(i));
+
+	perf_log();
+}
+
+static void *stats_thread(void *userdata)
+{
+	struct timeval tv_last, tv_now, diff;
+	int since_log = 0;
+
+	gettimeofday(&tv_last, NULL);
+
+	while (1) {
+		double dt;
+
+		sleep(STATS_SAMPLE);
+
+		gettimeofday(&tv_now, NULL);
+		timeval_subtract(&diff, &tv_now, &tv_last);
+		tv_last = tv_now;
+		dt = diff.tv_sec + diff.tv_usec / 1e6;
+		if (dt <= 0.0)
+			continue;
+
+		stats_sample(dt);
+
+		since_log += STATS_SAMPLE;
+		if (st_interval && since_log >= st_interval) {
+			since_log = 0;
+			stats_log();
+		}
+	}
+
+	return NULL;
+}
+
+bool stats_start(int interval)
+{
+	pthread_t pth;
+
+	st_interval = interval;
+	if (pthread_create(&pth, NULL, stats_thread, NULL)) {
+		applog(LOG_ERR, "stats thread create failed");
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,706 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * CPU topology discovery and miner thread placement.
+ *
+ * On Linux, the set of usable cpus comes from sched_getaffinity() (which
+ * already honours cgroup cpusets and taskset), minus the kernel's isolated
+ * cpus.  Package, core and SMT sibling information is read from sysfs, and
+ * NUMA node membership from /sys/devices/system/node.  Everything degrades
+ * to a flat, unpinned layout when sysfs is unavailable.
+ *
+ * Hybrid parts mix fast and slow cores.  cpus are grouped into core
+ * classes by speed, fastest first: cpu_capacity where the kernel
+ * exports it, else the E-cores Intel's hybrid PMU lists under cpu_atom,
+ * else cpufreq's maximum.  Speeds within 10% of a class's fastest join
+ * it, so that turbo-favoured cores of one type stay together.
+ * Placement fills the faster classes first.
+ */
+
+#define _GNU_SOURCE
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#ifdef __linux
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+#include "compat.h"
+#include "miner.h"
+
+#define SYSFS_CPU	"/sys/devices/system/cpu"
+#define SYSFS_NODE	"/sys/devices/system/node"
+#define SYSFS_ATOM	"/sys/devices/cpu_atom/cpus"
+
+struct cpu_topo {
+	int	cpu;		/* logical cpu number */
+	int	package;	/* physical package (socket) */
+	int	core;		/* physical core, unique across packages */
+	int	node;		/* NUMA node */
+	int	smt;		/* sibling index within the core */
+	int	rank;		/* core index within its NUMA node */
+	int	speed;		/* capacity, or max kHz; 0 unknown */
+	int	class;		/* core class, 0 the fastest */
+};
+
+static const char *policy_names[] = {
+	[CPU_POLICY_AUTO]	= "auto",
+	[CPU_POLICY_NONE]	= "none",
+	[CPU_POLICY_COMPACT]	= "compact",
+	[CPU_POLICY_SPREAD]	= "spread",
+	[CPU_POLICY_CORE]	= "core",
+	[CPU_POLICY_LIST]	= "list",
+};
+
+static struct cpu_topo *topo;
+static int topo_ncpus;
+static int topo_ncores;
+static int topo_npackages;
+static int topo_nnodes;
+static int topo_nsmt;
+static int topo_nclasses = 1;
+static int topo_nisolated;
+static enum cpu_policies topo_policy;
+
+/* placement order: thread N runs on placement[N % n_placement] */
+static int *placement;
+static int n_placement;
+
+int cpu_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(policy_names); i++)
+		if (policy_names[i] && !strcmp(name, policy_names[i]))
+			return i;
+
+	return -1;
+}
+
+const char *cpu_policy_name(enum cpu_policies policy)
+{
+	return policy_names[policy];
+}
+
+/* Parse a kernel-style cpu list ("0-3,8,10-11") into cpus[].  Returns
+ * the number of entries stored, or -1 on a syntax error.
+ */
+int cpulist_parse(const char *s, int *cpus, int max)
+{
+	int n = 0;
+
+	while (*s) {
+		char *end;
+		long lo, hi;
+
+		while (*s == ' ' || *s == '\t' || *s == '\n')
+			s++;
+		if (!*s)
+			break;
+
+		lo = strtol(s, &end, 10);
+		if (end == s || lo < 0)
+			return -1;
+		hi = lo;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				return -1;
+			s = end;
+		}
+
+		for (; lo <= hi; lo++) {
+			if (n >= max)
+				return -1;
+			cpus[n++] = lo;
+		}
+
+		while (*s == ' ' || *s == '\t' || *s == '\n')
+			s++;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+
+	return n;
+}
+
+/* Format cpus[] back into a compact list, for logging */
+static void cpulist_format(char *buf, size_t buflen, const int *cpus, int n)
+{
+	size_t len = 0;
+	int i = 0;
+
+	buf[0] = 0;
+	while (i < n && len + 24 < buflen) {
+		int j = i;
+
+		while (j + 1 < n && cpus[j + 1] == cpus[j] + 1)
+			j++;
+		if (j > i + 1)
+			len += sprintf(buf + len, "%s%d-%d", i ? "," : "",
+				       cpus[i], cpus[j]);
+		else {
+			len += sprintf(buf + len, "%s%d", i ? "," : "",
+				       cpus[i]);
+			j = i;
+		}
+		i = j + 1;
+	}
+	if (i < n)
+		strcpy(buf + len, ",...");
+}
+
+#ifdef __linux
+
+static int read_int_file(const char *path, int def)
+{
+	FILE *f;
+	int v;
+
+	f = fopen(path, "r");
+	if (!f)
+		return def;
+	if (fscanf(f, "%d", &v) != 1)
+		v = def;
+	fclose(f);
+
+	return v;
+}
+
+/* Read a sysfs cpu list file; returns entries stored, 0 if absent */
+static int read_cpulist_file(const char *path, int *cpus, int max)
+{
+	char buf[4096];
+	FILE *f;
+	int n;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = 0;
+	fclose(f);
+
+	n = cpulist_parse(buf, cpus, max);
+	return n < 0 ? 0 : n;
+}
+
+static int topo_index(int cpu)
+{
+	int i;
+
+	for (i = 0; i < topo_ncpus; i++)
+		if (topo[i].cpu == cpu)
+			return i;
+	return -1;
+}
+
+static void topo_read_nodes(void)
+{
+	int cpus[MAX_CPUS];
+	char path[256];
+	struct dirent *de;
+	DIR *dir;
+	int node, n, i, idx;
+
+	dir = opendir(SYSFS_NODE);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "node%d", &node) != 1)
+			continue;
+
+		snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+		n = read_cpulist_file(path, cpus, MAX_CPUS);
+		for (i = 0; i < n; i++) {
+			idx = topo_index(cpus[i]);
+			if (idx >= 0)
+				topo[idx].node = node;
+		}
+	}
+
+	closedir(dir);
+}
+
+/* Relative speed of each cpu, by the best source every cpu has */
+static void topo_read_speeds(void)
+{
+	int atoms[MAX_CPUS];
+	int capacity[MAX_CPUS], max_freq[MAX_CPUS];
+	bool all_capacity = true, all_freq = true;
+	char path[256];
+	int n_atoms, i, j;
+
+	for (i = 0; i < topo_ncpus && i < MAX_CPUS; i++) {
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cpu_capacity",
+			 topo[i].cpu);
+		capacity[i] = read_int_file(path, 0);
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/cpufreq/cpuinfo_max_freq",
+			 topo[i].cpu);
+		max_freq[i] = read_int_file(path, 0);
+		all_capacity &= capacity[i] > 0;
+		all_freq &= max_freq[i] > 0;
+	}
+	n_atoms = read_cpulist_file(SYSFS_ATOM, atoms, MAX_CPUS);
+
+	for (i = 0; i < topo_ncpus && i < MAX_CPUS; i++) {
+		if (all_capacity)
+			topo[i].speed = capacity[i];
+		else if (n_atoms) {
+			topo[i].speed = 2;
+			for (j = 0; j < n_atoms; j++)
+				if (atoms[j] == topo[i].cpu)
+					topo[i].speed = 1;
+		} else if (all_freq)
+			topo[i].speed = max_freq[i];
+	}
+}
+
+static void topo_classify(void)
+{
+	int i, done, top;
+
+	for (i = 0; i < topo_ncpus; i++)
+		topo[i].class = -1;
+
+	topo_nclasses = 0;
+	for (done = 0; done < topo_ncpus; topo_nclasses++) {
+		top = -1;
+		for (i = 0; i < topo_ncpus; i++)
+			if (topo[i].class < 0 && topo[i].speed > top)
+				top = topo[i].speed;
+		for (i = 0; i < topo_ncpus; i++) {
+			if (topo[i].class >= 0 ||
+			    (int64_t) topo[i].speed * 10 < (int64_t) top * 9)
+				continue;
+			topo[i].class = topo_nclasses;
+			done++;
+		}
+	}
+}
+
+static bool topo_discover(void)
+{
+	int isolated[MAX_CPUS];
+	cpu_set_t set;
+	int n_isolated, cpu, i, j;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return false;
+
+	n_isolated = read_cpulist_file(SYSFS_CPU "/isolated", isolated,
+				       MAX_CPUS);
+	for (i = 0; i < n_isolated; i++) {
+		if (isolated[i] < CPU_SETSIZE && CPU_ISSET(isolated[i], &set)) {
+			CPU_CLR(isolated[i], &set);
+			topo_nisolated++;
+		}
+	}
+
+	topo = calloc(CPU_COUNT(&set) + 1, sizeof(*topo));
+	if (!topo)
+		return false;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct cpu_topo *t;
+		char path[256];
+
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+
+		t = &topo[topo_ncpus++];
+		t->cpu = cpu;
+
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+		t->package = read_int_file(path, 0);
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+		t->core = read_int_file(path, cpu);
+	}
+
+	topo_read_nodes();
+	topo_read_speeds();
+	topo_classify();
+
+	/* core_id is only unique within a package; densely renumber
+	 * (package, core_id) pairs and count siblings as we go.
+	 */
+	for (i = 0; i < topo_ncpus; i++) {
+		topo[i].smt = 0;
+		for (j = 0; j < i; j++) {
+			if (topo[j].package == topo[i].package &&
+			    topo[j].core == topo[i].core)
+				topo[i].smt++;
+		}
+	}
+	for (i = 0; i < topo_ncpus; i++) {
+		int core = -1;
+
+		for (j = 0; j < i; j++)
+			if (topo[j].package == topo[i].package &&
+			    topo[j].smt == 0 && topo[j].core == topo[i].core) {
+				core = topo[j].rank;
+				break;
+			}
+		if (core < 0)
+			core = topo_ncores++;
+		topo[i].rank = core;	/* temporarily: dense core number */
+	}
+	for (i = 0; i < topo_ncpus; i++) {
+		topo[i].core = topo[i].rank;
+		if (topo[i].smt + 1 > topo_nsmt)
+			topo_nsmt = topo[i].smt + 1;
+		if (topo[i].package + 1 > topo_npackages)
+			topo_npackages = topo[i].package + 1;
+		if (topo[i].node + 1 > topo_nnodes)
+			topo_nnodes = topo[i].node + 1;
+	}
+
+	/* rank of each core within its node, used to interleave nodes */
+	for (i = 0; i < topo_ncpus; i++) {
+		int rank = 0;
+
+		for (j = 0; j < topo_ncpus; j++)
+			if (topo[j].smt == 0 && topo[j].node == topo[i].node &&
+			    topo[j].core < topo[i].core)
+				rank++;
+		topo[i].rank = rank;
+	}
+
+	return topo_ncpus > 0;
+}
+
+#else /* !__linux */
+
+static bool topo_discover(void)
+{
+	return false;
+}
+
+#endif /* __linux */
+
+static void topo_flat(void)
+{
+	int i, n = 1;
+
+#ifndef WIN32
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+#endif
+	free(topo);
+	topo = calloc(n, sizeof(*topo));
+	topo_ncpus = n;
+	topo_ncores = n;
+	topo_npackages = topo_nnodes = topo_nsmt = 1;
+	for (i = 0; topo && i < n; i++) {
+		topo[i].cpu = i;
+		topo[i].core = i;
+		topo[i].rank = i;
+	}
+}
+
+static int cmp_compact(const void *a_, const void *b_)
+{
+	const struct cpu_topo *a = a_, *b = b_;
+
+	if (a->class != b->class)
+		return a->class - b->class;
+	if (a->node != b->node)
+		return a->node - b->node;
+	if (a->package != b->package)
+		return a->package - b->package;
+	if (a->core != b->core)
+		return a->core - b->core;
+	return a->smt - b->smt;
+}
+
+static int cmp_spread(const void *a_, const void *b_)
+{
+	const struct cpu_topo *a = a_, *b = b_;
+
+	/* an E-core is worth more than a P-core's second thread */
+	if (a->smt != b->smt)
+		return a->smt - b->smt;
+	if (a->class != b->class)
+		return a->class - b->class;
+	if (a->rank != b->rank)
+		return a->rank - b->rank;
+	if (a->node != b->node)
+		return a->node - b->node;
+	return a->cpu - b->cpu;
+}
+
+/* May we run on 'cpu'?  An isolated cpu may still be named explicitly */
+static bool cpu_allowed(int cpu)
+{
+#ifdef __linux
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	if (!sched_getaffinity(0, sizeof(set), &set))
+		return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+#endif
+	return cpu < topo_ncpus;
+}
+
+static bool build_placement(enum cpu_policies policy, const char *cpu_list)
+{
+	struct cpu_topo *sorted;
+	int i;
+
+	placement = calloc(topo_ncpus > MAX_CPUS ? topo_ncpus : MAX_CPUS,
+			   sizeof(*placement));
+	if (!placement)
+		return false;
+
+	if (policy == CPU_POLICY_LIST) {
+		n_placement = cpulist_parse(cpu_list, placement, MAX_CPUS);
+		if (n_placement <= 0) {
+			applog(LOG_ERR, "Invalid cpu list '%s'", cpu_list);
+			return false;
+		}
+		for (i = 0; i < n_placement; i++) {
+			if (cpu_allowed(placement[i]))
+				continue;
+			applog(LOG_ERR, "--cpu-affinity: cpu %d is not one we "
+			       "may run on (affinity mask or cpuset)",
+			       placement[i]);
+			return false;
+		}
+		return true;
+	}
+
+	if (policy == CPU_POLICY_NONE)
+		return true;
+
+	sorted = malloc(topo_ncpus * sizeof(*sorted));
+	if (!sorted)
+		return false;
+	memcpy(sorted, topo, topo_ncpus * sizeof(*sorted));
+
+	if (policy == CPU_POLICY_SPREAD)
+		qsort(sorted, topo_ncpus, sizeof(*sorted), cmp_spread);
+	else if (policy != CPU_POLICY_AUTO)
+		qsort(sorted, topo_ncpus, sizeof(*sorted), cmp_compact);
+
+	for (i = 0; i < topo_ncpus; i++) {
+		if (policy == CPU_POLICY_CORE && sorted[i].smt)
+			continue;
+		placement[n_placement++] = sorted[i].cpu;
+	}
+
+	free(sorted);
+	return true;
+}
+
+bool topo_init(enum cpu_policies policy, const char *cpu_list)
+{
+	if (!topo_discover())
+		topo_flat();
+	if (!topo)
+		return false;
+
+	topo_policy = policy;
+	return build_placement(policy, cpu_list);
+}
+
+int topo_num_cpus(void)
+{
+	return topo_ncpus;
+}
+
+int topo_num_cores(void)
+{
+	return topo_ncores;
+}
+
+int topo_default_threads(void)
+{
+	switch (topo_policy) {
+	case CPU_POLICY_CORE:
+	case CPU_POLICY_LIST:
+		return n_placement;
+	default:
+		return topo_ncpus;
+	}
+}
+
+/* cpu that miner thread 'thr_id' should be bound to, or -1 for none */
+int topo_thread_cpu(int thr_id, int n_threads)
+{
+	if (!n_placement)
+		return -1;
+
+	/* historical behaviour: only pin when threads divide evenly */
+	if (topo_policy == CPU_POLICY_AUTO && (n_threads % n_placement))
+		return -1;
+
+	return placement[thr_id % n_placement];
+}
+
+void topo_log(int n_threads)
+{
+	char buf[256];
+	int *cpus;
+	int i;
+
+	applog(LOG_INFO, "CPU topology: %d usable cpus (%d isolated skipped), "
+	       "%d cores, %d packages, %d NUMA nodes, %d-way SMT",
+	       topo_ncpus, topo_nisolated, topo_ncores, topo_npackages,
+	       topo_nnodes, topo_nsmt);
+
+	for (i = 0; topo_nclasses > 1 && i < topo_nclasses; i++) {
+		int cpus[MAX_CPUS], n = 0, j, speed = 0;
+
+		for (j = 0; j < topo_ncpus && n < MAX_CPUS; j++) {
+			if (topo[j].class != i)
+				continue;
+			cpus[n++] = topo[j].cpu;
+			if (topo[j].speed > speed)
+				speed = topo[j].speed;
+		}
+		cpulist_format(buf, sizeof(buf), cpus, n);
+		applog(LOG_INFO, "CPU class %d: cpus %s (speed %d)", i, buf,
+		       speed);
+	}
+
+	if (topo_thread_cpu(0, n_threads) < 0) {
+		applog(LOG_INFO, "CPU placement: policy %s, threads not bound",
+		       cpu_policy_name(topo_policy));
+		return;
+	}
+
+	cpus = malloc(n_threads * sizeof(*cpus));
+	if (!cpus)
+		return;
+	for (i = 0; i < n_threads; i++)
+		cpus[i] = topo_thread_cpu(i, n_threads);
+	cpulist_format(buf, sizeof(buf), cpus, n_threads);
+	free(cpus);
+
+	applog(LOG_INFO, "CPU placement: policy %s, threads 0-%d on cpus %s",
+	       cpu_policy_name(topo_policy), n_threads - 1, buf);
+	if (n_threads > n_placement)
+		applog(LOG_WARNING, "CPU placement: %d threads share %d cpus",
+		       n_threads, n_placement);
+}
+
+int topo_num_classes(void)
+{
+	return topo_nclasses;
+}
+
+/* Core class of a usable cpu, 0 the fastest; 0 if unknown */
+int topo_cpu_class(int cpu)
+{
+	int i;
+
+	for (i = 0; i < topo_ncpus; i++)
+		if (topo[i].cpu == cpu)
+			return topo[i].class;
+	return 0;
+}
+
+/* Physical core of a usable cpu, or -1 */
+int topo_cpu_core(int cpu)
+{
+	int i;
+
+	for (i = 0; i < topo_ncpus; i++)
+		if (topo[i].cpu == cpu)
+			return topo[i].core;
+	return -1;
+}
+
+/* Allocate zeroed memory local to the calling thread's NUMA node.  Linux
+ * places anonymous pages on the node of the first thread to touch them,
+ * so callers must bind themselves before calling this.
+ */
+void *topo_alloc_local(size_t len)
+{
+#ifdef __linux
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	memset(p, 0, len);	/* first touch */
+	return p;
+#else
+	return calloc(1, len);
+#endif
+}
+
+void topo_free_local(void *p, size_t len)
+{
+	if (!p)
+		return;
+#ifdef __linux
+	munmap(p, len);
+#else
+	free(p);
+#endif
+}
+
+#define HUGE_PAGE	(2UL << 20)
+#define HUGE_LEN(len)	(((len) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1))
+
+/* As topo_alloc_local(), for big buffers scanned at random, where TLB
+ * misses add up: backed by huge pages from the reserved pool if there
+ * are any, else marked for transparent huge pages.
+ */
+void *topo_alloc_huge(size_t len)
+{
+#ifdef __linux
+	void *p = MAP_FAILED;
+
+	len = HUGE_LEN(len);
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+	}
+	memset(p, 0, len);	/* first touch */
+	return p;
+#else
+	return calloc(1, len);
+#endif
+}
+
+void topo_free_huge(void *p, size_t len)
+{
+#ifdef __linux
+	topo_free_local(p, HUGE_LEN(len));
+#else
+	topo_free_local(p, len);
+#endif
+}
@@ -0,0 +1,267 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Latency tracing: where the time goes between a new block and useful
+ * hashing, and between a share found and its verdict.
+ *
+ * Each stage (the phases of a JSON-RPC call, time in a thread_q, a
+ * miner thread blocked in get_work, a scan, a share's life) is timed on
+ * the monotonic clock into an HDR-style histogram: for every power of
+ * two, HDR_SUB linear buckets, so that any percentile is within 1 in
+ * HDR_SUB of the truth from a microsecond to days, at a fixed size and
+ * a lock-free add.
+ *
+ * With --trace FILE, every timed stage is also written out as Chrome
+ * trace events (a JSON array; chrome://tracing or ui.perfetto.dev):
+ * complete events on the thread they ran on, and each share as an
+ * async event from when it was found to its verdict.  The closing
+ * bracket is written at exit, but the viewers do not need it.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "compat.h"
+#include "miner.h"
+
+struct hdr_histogram trace_hist[TRACE_STAGES];
+
+const char *trace_stage_names[TRACE_STAGES] = {
+	[TRACE_RPC_CONNECT]	= "rpc_connect",
+	[TRACE_RPC_SEND]	= "rpc_send",
+	[TRACE_RPC_WAIT]	= "rpc_first_byte",
+	[TRACE_RPC_RECV]	= "rpc_receive",
+	[TRACE_RPC_PARSE]	= "rpc_parse",
+	[TRACE_QUEUE]		= "queue_wait",
+	[TRACE_GET_WORK]	= "get_work",
+	[TRACE_SCAN]		= "scan",
+	[TRACE_RESTART]		= "restart",
+	[TRACE_SHARE_QUEUE]	= "share_queue",
+	[TRACE_SHARE_SUBMIT]	= "share_submit",
+	[TRACE_SHARE_TOTAL]	= "share_total",
+};
+
+bool trace_active;
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int trace_tids;
+static __thread int trace_tid;
+
+uint64_t trace_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+}
+
+static int hdr_index(uint64_t v)
+{
+	int msb;
+
+	if (v < HDR_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= HDR_MAX_BITS)
+		return HDR_BUCKETS - 1;
+	return (msb - HDR_SUB_BITS + 1) * HDR_SUB +
+	       ((v >> (msb - HDR_SUB_BITS)) & (HDR_SUB - 1));
+}
+
+/* Highest value counted in bucket 'idx' */
+static uint64_t hdr_value(int idx)
+{
+	int shift;
+
+	if (idx < HDR_SUB)
+		return idx;
+	shift = idx / HDR_SUB - 1;
+	return ((uint64_t) (HDR_SUB + idx % HDR_SUB) << shift) +
+	       (1ULL << shift) - 1;
+}
+
+static void hdr_observe(struct hdr_histogram *h, uint64_t usecs)
+{
+	uint64_t max;
+
+	stats_add(&h->bucket[hdr_index(usecs)], 1);
+	stats_add(&h->sum_usecs, usecs);
+	stats_add(&h->count, 1);
+	while ((max = stats_read(&h->max_usecs)) < usecs &&
+	       !__sync_bool_compare_and_swap(&h->max_usecs, max, usecs))
+		;
+}
+
+/* The 'q' quantile (0..1) of 'h', in usecs; 0 when empty */
+uint64_t hdr_percentile(struct hdr_histogram *h, double q)
+{
+	uint64_t count = stats_read(&h->count), want, seen = 0;
+	uint64_t max = stats_read(&h->max_usecs);
+	int i;
+
+	if (!count)
+		return 0;
+	want = q * count + 0.5;
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < HDR_BUCKETS; i++) {
+		seen += stats_read(&h->bucket[i]);
+		if (seen >= want)
+			break;
+	}
+	if (i == HDR_BUCKETS || hdr_value(i) > max)
+		return max;
+	return hdr_value(i);
+}
+
+static int trace_thread_id(void)
+{
+	if (!trace_tid)
+		trace_tid = __sync_add_and_fetch(&trace_tids, 1);
+	return trace_tid;
+}
+
+static void trace_emit(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fputs(",\n", trace_file);
+		va_start(ap, fmt);
+		vfprintf(trace_file, fmt, ap);
+		va_end(ap);
+		fflush(trace_file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* Count a stage that took 'usecs', without a trace event */
+void trace_observe(enum trace_stages stage, uint64_t usecs)
+{
+	hdr_observe(&trace_hist[stage], usecs);
+}
+
+/* A stage run by the calling thread from 'start' to 'end'; 'args', if
+ * not NULL, is a JSON object for the trace event
+ */
+void trace_span(enum trace_stages stage, uint64_t start, uint64_t end,
+		const char *args)
+{
+	if (end < start)
+		end = start;
+	hdr_observe(&trace_hist[stage], end - start);
+	if (!trace_active)
+		return;
+
+	trace_emit("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		   "\"ts\":%llu,\"dur\":%llu%s%s}",
+		   trace_stage_names[stage], trace_thread_id(),
+		   (unsigned long long) start,
+		   (unsigned long long) (end - start),
+		   args ? ",\"args\":" : "", args ? args : "");
+}
+
+/* A share's life, from 'found' until its verdict, now */
+void trace_share(uint64_t found, enum share_results result)
+{
+	static const char *result_names[] = {
+		[SHARE_ACCEPTED]	= "accepted",
+		[SHARE_REJECTED]	= "rejected",
+		[SHARE_STALE]		= "stale",
+	};
+	static volatile uint64_t share_ids;
+	uint64_t now = trace_now(), id;
+
+	if (found > now)
+		found = now;
+	hdr_observe(&trace_hist[TRACE_SHARE_TOTAL], now - found);
+	if (!trace_active)
+		return;
+
+	id = __sync_add_and_fetch(&share_ids, 1);
+	trace_emit("{\"name\":\"share\",\"cat\":\"share\",\"ph\":\"b\","
+		   "\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%llu}",
+		   (unsigned long long) id, trace_thread_id(),
+		   (unsigned long long) found);
+	trace_emit("{\"name\":\"share\",\"cat\":\"share\",\"ph\":\"e\","
+		   "\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%llu,"
+		   "\"args\":{\"result\":\"%s\"}}",
+		   (unsigned long long) id, trace_thread_id(),
+		   (unsigned long long) now, result_names[result]);
+}
+
+/* A moment worth marking across all threads, such as a new block */
+void trace_instant(const char *name)
+{
+	if (!trace_active)
+		return;
+
+	trace_emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,"
+		   "\"tid\":%d,\"ts\":%llu}", name, trace_thread_id(),
+		   (unsigned long long) trace_now());
+}
+
+/* Name the calling thread in the trace */
+void trace_thread(const char *name)
+{
+	if (!trace_active)
+		return;
+
+	trace_emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		   "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		   trace_thread_id(), name);
+}
+
+static void trace_close(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fputs("\n]\n", trace_file);
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	trace_active = false;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+bool trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		applog(LOG_ERR, "trace file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":1,\"args\":{\"name\":\"minerd\"}}");
+	fflush(trace_file);
+	trace_active = true;
+	atexit(trace_close);
+
+	applog(LOG_INFO, "tracing to %s", path);
+	return true;
+}
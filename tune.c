@@ -0,0 +1,390 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Scan kernel tuning.
+ *
+ * A kernel reads its thread's restart flag only every thr_info[].poll
+ * nonces.  Checking every pass costs a little on the fast kernels;
+ * checking too seldom leaves a thread on a stale block.  Each miner
+ * thread re-derives its poll from each scan's hash rate, as the nonces
+ * scanned in --restart-budget microseconds, so a restart is noticed
+ * within the budget whatever the kernel, machine and core class.
+ *
+ * Kernels that can vary their batch, the nonces hashed per pass, read
+ * it from scan_tune[].batch.  A bigger batch amortizes more loop
+ * overhead but keeps more state in flight, so the best size depends on
+ * the cache; --tune times each candidate on dummy work at startup.
+ *
+ * Two SMT siblings running the same vector kernel contend for the same
+ * vector ports while the scalar ALUs idle, so --smt-algo gives the
+ * second miner thread on each physical core a different kernel.  It is
+ * kept only on cores where it wins: every bound miner thread's cpu
+ * scans at once, with and without the mix, and each core's combined
+ * rate decides.
+ *
+ * Every thread sizes its scans to --scantime from its own rate, but
+ * before its first scan it has none, and a slow core would take several
+ * times as long over the default.  Where the cpus fall into several core
+ * classes, each class's kernel is timed on one of its cpus first, and
+ * the threads of that class start from its rate.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef __linux
+#include <sched.h>
+#endif
+#include "compat.h"
+#include "miner.h"
+
+#define TUNE_POLL_MAX	(1U << 24)	/* nonces */
+#define TUNE_USECS	200000		/* per timing run */
+#define TUNE_CHUNK	0x4000		/* nonces per scan of a timing run */
+#define TUNE_ROUNDS	3		/* best of, against noise */
+#define TUNE_BATCHES	4
+
+struct scan_tune scan_tune[ALGO_MAX] = {
+	[ALGO_4WAY]	= { 32 },
+};
+
+int restart_budget = 1000;		/* usecs */
+
+/* Batch sizes to try, per kernel that has one */
+static const struct {
+	int		algo;
+	unsigned int	batch[TUNE_BATCHES];
+} tune_batches[] = {
+	{ ALGO_4WAY,	{ 8, 16, 32, 64 } },
+};
+
+/* After thread 'thr_id' scanned 'hashes' nonces in 'usecs' with kernel
+ * 'algo'; only that thread calls it
+ */
+void tune_observe(int thr_id, int algo, unsigned long hashes, uint64_t usecs)
+{
+	struct thr_info *t = &thr_info[thr_id];
+	unsigned int old, poll = 1;
+	uint64_t want;
+
+	if (algo < 0 || algo >= ALGO_MAX || !hashes || !usecs)
+		return;
+
+	want = (uint64_t) hashes * restart_budget / usecs;
+	while (poll < TUNE_POLL_MAX && (uint64_t) poll * 2 <= want)
+		poll *= 2;
+
+	/* come down at once, to keep within budget, but go up only on a
+	 * clear gain, lest rate jitter at a power of two flip it each scan
+	 */
+	old = scan_poll(thr_id, algo);
+	if (poll == old || (old && poll > old && poll < 4 * old))
+		return;
+	t->poll = poll;
+	t->poll_algo = algo;
+	if ((old || thr_id) && !opt_debug)
+		return;
+
+	applog(old || thr_id ? LOG_DEBUG : LOG_INFO,
+	       "thread %d: %s: checking for restarts every %u nonces "
+	       "(%d us budget at %.2f khash/sec)", thr_id, algo_name(algo),
+	       poll, restart_budget, hashes * 1000.0 / usecs);
+}
+
+/* hash/sec of kernel 'algo' on dummy work, scanning as thread 'thr_id'
+ * for about 'usecs'
+ */
+static double tune_rate(int algo, int thr_id, uint64_t usecs)
+{
+	struct work work;
+	struct timeval tv_start;
+	unsigned long hashes, total = 0;
+	uint32_t chunk = TUNE_CHUNK;
+	void *scratchbuf = NULL;
+	uint64_t elapsed;
+
+#ifdef WANT_SCRYPT
+	if (algo_is_scrypt(algo)) {
+		scratchbuf = malloc(scrypt_scratch_size());
+		if (!scratchbuf)
+			return 0.0;
+		chunk = TUNE_CHUNK >> 8;
+	}
+#endif
+
+	benchmark_work(&work);
+	gettimeofday(&tv_start, NULL);
+	do {
+		hashes = 0;
+		scan_work(algo, thr_id, &work, scratchbuf, chunk, &hashes);
+		total += hashes;
+		elapsed = usecs_since(&tv_start);
+	} while (elapsed < usecs);
+
+	free(scratchbuf);
+	return total * 1e6 / elapsed;
+}
+
+/* Pick the fastest batch size of kernel 'algo', before the miner
+ * threads start; it scans as thread 0
+ */
+bool tune_batch(int algo)
+{
+	const unsigned int *sizes = NULL;
+	double rate, best[TUNE_BATCHES];
+	int i, k, pick;
+
+	for (i = 0; i < ARRAY_SIZE(tune_batches); i++)
+		if (tune_batches[i].algo == algo)
+			sizes = tune_batches[i].batch;
+	if (!sizes) {
+		applog(LOG_INFO, "%s: no batch size to tune",
+		       algo_name(algo));
+		return true;
+	}
+
+	/* rounds go over every size in turn, so that a change of clock
+	 * speed does not favour whichever ran first
+	 */
+	memset(best, 0, sizeof(best));
+	for (k = 0; k < TUNE_ROUNDS; k++) {
+		for (i = 0; i < TUNE_BATCHES; i++) {
+			scan_tune[algo].batch = sizes[i];
+			rate = tune_rate(algo, 0, TUNE_USECS);
+			if (rate > best[i])
+				best[i] = rate;
+		}
+	}
+
+	pick = 0;
+	for (i = 0; i < TUNE_BATCHES; i++) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "%s: batch %u: %.2f khash/sec",
+			       algo_name(algo), sizes[i], best[i] / 1000.0);
+		if (best[i] > best[pick])
+			pick = i;
+	}
+	scan_tune[algo].batch = sizes[pick];
+	applog(LOG_INFO, "%s: tuned batch size %u nonces, %.2f khash/sec",
+	       algo_name(algo), sizes[pick], best[pick] / 1000.0);
+
+	return true;
+}
+
+/* A timing run bound to one cpu */
+struct cpu_trial {
+	pthread_t	pth;
+	int		thr_id;
+	int		cpu;
+	int		algo;
+	double		rate;
+};
+
+static void *trial_thread(void *userdata)
+{
+	struct cpu_trial *t = userdata;
+#ifdef __linux
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+#endif
+	t->rate = tune_rate(t->algo, t->thr_id, TUNE_USECS);
+	return NULL;
+}
+
+/* Time every thread's cpu at once, thread i scanning with kernel
+ * algos[i]; rates[i] gets the rate of the core that thread i leads
+ */
+static bool smt_round(int n_threads, const int *algos, const int *leader,
+		      double *rates)
+{
+	struct cpu_trial *trials;
+	int i, started;
+
+	trials = calloc(n_threads, sizeof(*trials));
+	if (!trials)
+		return false;
+
+	for (started = 0; started < n_threads; started++) {
+		struct cpu_trial *t = &trials[started];
+
+		t->thr_id = started;
+		t->cpu = thr_info[started].cpu;
+		t->algo = algos[started];
+		if (pthread_create(&t->pth, NULL, trial_thread, t))
+			break;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(trials[i].pth, NULL);
+
+	for (i = 0; i < n_threads; i++)
+		rates[i] = 0.0;
+	for (i = 0; i < started; i++)
+		rates[leader[i]] += trials[i].rate;
+
+	free(trials);
+	return started == n_threads;
+}
+
+/* Before the miner threads start, with their cpus and kernels assigned:
+ * give the later threads on each core kernel 'smt_algo' where that mix
+ * beats the threads' own.  The number of threads switched, or -1.
+ */
+int tune_smt(int n_threads, int smt_algo)
+{
+	int *leader, *algos[2];
+	double *best[2], *rates;
+	int i, j, k, mix, pairs = 0, switched = -1;
+
+	if (n_threads < 2 || thr_info[0].cpu < 0) {
+		applog(LOG_INFO, "SMT pairing: miner threads not bound, "
+		       "%s not used", algo_name(smt_algo));
+		return 0;
+	}
+
+	leader = calloc(n_threads, sizeof(*leader));
+	algos[0] = calloc(n_threads, sizeof(*algos[0]));
+	algos[1] = calloc(n_threads, sizeof(*algos[1]));
+	best[0] = calloc(n_threads, sizeof(*best[0]));
+	best[1] = calloc(n_threads, sizeof(*best[1]));
+	rates = calloc(n_threads, sizeof(*rates));
+	if (!leader || !algos[0] || !algos[1] || !best[0] || !best[1] ||
+	    !rates)
+		goto out;
+
+	/* a core's first thread leads it; the others, on other cpus of
+	 * the same core, are its SMT siblings
+	 */
+	for (i = 0; i < n_threads; i++) {
+		int core = topo_cpu_core(thr_info[i].cpu);
+
+		leader[i] = i;
+		algos[0][i] = algos[1][i] = thr_info[i].algo;
+		for (j = 0; j < i; j++) {
+			if (leader[j] != j || core < 0 ||
+			    topo_cpu_core(thr_info[j].cpu) != core)
+				continue;
+			leader[i] = j;
+			if (thr_info[j].cpu != thr_info[i].cpu) {
+				algos[1][i] = smt_algo;
+				pairs++;
+			}
+			break;
+		}
+	}
+	if (!pairs) {
+		applog(LOG_INFO, "SMT pairing: no miner threads share a core, "
+		       "%s not used", algo_name(smt_algo));
+		switched = 0;
+		goto out;
+	}
+
+	for (k = 0; k < TUNE_ROUNDS; k++) {
+		for (mix = 0; mix < 2; mix++) {
+			if (!smt_round(n_threads, algos[mix], leader, rates))
+				goto out;
+			for (i = 0; i < n_threads; i++)
+				if (rates[i] > best[mix][i])
+					best[mix][i] = rates[i];
+		}
+	}
+
+	switched = 0;
+	for (i = 0; i < n_threads; i++) {
+		bool keep;
+
+		if (leader[i] != i)
+			continue;
+		keep = best[1][i] > best[0][i];
+		for (j = i + 1; j < n_threads; j++) {
+			if (leader[j] != i || algos[1][j] == algos[0][j])
+				continue;
+			if (keep) {
+				thr_info[j].algo = smt_algo;
+				switched++;
+			}
+		}
+		if (opt_debug)
+			applog(LOG_DEBUG, "SMT pairing: core of cpu %d: "
+			       "%.2f khash/sec all %s, %.2f with %s%s",
+			       thr_info[i].cpu, best[0][i] / 1000.0,
+			       algo_name(thr_info[i].algo),
+			       best[1][i] / 1000.0, algo_name(smt_algo),
+			       keep ? " (kept)" : "");
+	}
+	applog(LOG_INFO, "SMT pairing: %s on %d of %d sibling threads",
+	       algo_name(smt_algo), switched, pairs);
+
+out:
+	if (switched < 0)
+		applog(LOG_ERR, "SMT pairing benchmark failed");
+	free(rates);
+	free(best[1]);
+	free(best[0]);
+	free(algos[1]);
+	free(algos[0]);
+	free(leader);
+	return switched;
+}
+
+/* Before the miner threads start, with their cpus, classes and kernels
+ * assigned: size each thread's first scan from its class's rate
+ */
+bool tune_classes(int n_threads, int scantime)
+{
+	int cls, i;
+
+	if (topo_num_classes() < 2)
+		return true;
+
+	for (cls = 0; cls < topo_num_classes(); cls++) {
+		struct cpu_trial t;
+		uint64_t nonces;
+
+		for (i = 0; i < n_threads; i++)
+			if (thr_info[i].cpu >= 0 && thr_info[i].cls == cls)
+				break;
+		if (i == n_threads)
+			continue;
+
+		memset(&t, 0, sizeof(t));
+		t.thr_id = i;
+		t.cpu = thr_info[i].cpu;
+		t.algo = thr_info[i].algo;
+		if (pthread_create(&t.pth, NULL, trial_thread, &t)) {
+			applog(LOG_ERR, "CPU class benchmark failed");
+			return false;
+		}
+		pthread_join(t.pth, NULL);
+
+		nonces = t.rate * scantime;
+		if (nonces < 0x100)
+			nonces = 0x100;
+		if (nonces > 0xfffffffaULL)
+			nonces = 0xfffffffaULL;
+		for (i = 0; i < n_threads; i++)
+			if (thr_info[i].cls == cls)
+				thr_info[i].max_nonce = nonces;
+
+		applog(LOG_INFO, "CPU class %d: %s at %.2f khash/sec per "
+		       "thread, first scans of %u nonces", cls,
+		       algo_name(t.algo), t.rate / 1000.0,
+		       (unsigned int) nonces);
+	}
+
+	return true;
+}
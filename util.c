@@ -22,12 +22,6 @@
 #include "miner.h"
 #include "elist.h"
 
-#if JANSSON_MAJOR_VERSION >= 2
-#define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
-#else
-#define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
-#endif
-
 struct data_buffer {
 	void		*buf;
 	size_t		len;
@@ -36,67 +30,30 @@ struct data_buffer {
 struct upload_buffer {
 	const void	*buf;
 	size_t		len;
+	uint64_t	sent;		/* trace_now() when fully handed over */
 };
 
 struct header_info {
 	char		*lp_path;
+	char		*switch_to;
 };
 
 struct tq_ent {
 	void			*data;
 	struct list_head	q_node;
+	uint64_t		pushed;		/* trace_now() */
 };
 
 struct thread_q {
 	struct list_head	q;
 
 	bool frozen;
+	int depth;
 
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
 };
 
-void applog(int prio, const char *fmt, ...)
-{
-	va_list ap;
-
-	va_start(ap, fmt);
-
-#ifdef HAVE_SYSLOG_H
-	if (use_syslog) {
-		vsyslog(prio, fmt, ap);
-	}
-#else
-	if (0) {}
-#endif
-	else {
-		char *f;
-		int len;
-		struct timeval tv = { };
-		struct tm tm, *tm_p;
-
-		gettimeofday(&tv, NULL);
-
-		pthread_mutex_lock(&time_lock);
-		tm_p = localtime(&tv.tv_sec);
-		memcpy(&tm, tm_p, sizeof(tm));
-		pthread_mutex_unlock(&time_lock);
-
-		len = 40 + strlen(fmt) + 2;
-		f = alloca(len);
-		sprintf(f, "[%d-%02d-%02d %02d:%02d:%02d] %s\n",
-			tm.tm_year + 1900,
-			tm.tm_mon + 1,
-			tm.tm_mday,
-			tm.tm_hour,
-			tm.tm_min,
-			tm.tm_sec,
-			fmt);
-		vfprintf(stderr, f, ap);	/* atomic write to stderr */
-	}
-	va_end(ap);
-}
-
 static void databuf_free(struct data_buffer *db)
 {
 	if (!db)
@@ -144,6 +101,8 @@ static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb,
 		memcpy(ptr, ub->buf, len);
 		ub->buf += len;
 		ub->len -= len;
+		if (!ub->len)
+			ub->sent = trace_now();
 	}
 
 	return len;
@@ -193,15 +152,43 @@ static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 		val = NULL;
 	}
 
+	if (!strcasecmp("X-Switch-To", key)) {
+		hi->switch_to = val;	/* steal memory reference */
+		val = NULL;
+	}
+
 out:
 	free(key);
 	free(val);
 	return ptrlen;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool longpoll_scan, bool longpoll)
+/* Split a finished request, started at 'start', into its phases */
+static void trace_rpc(CURL *curl, uint64_t start, uint64_t sent)
+{
+	double connect = 0, starttransfer = 0, total = 0;
+	uint64_t connected, first_byte, done;
+
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+
+	connected = start + connect * 1e6;
+	first_byte = start + starttransfer * 1e6;
+	done = start + total * 1e6;
+	if (sent < connected || sent > first_byte)
+		sent = connected;
+
+	trace_span(TRACE_RPC_CONNECT, start, connected, NULL);
+	trace_span(TRACE_RPC_SEND, connected, sent, NULL);
+	trace_span(TRACE_RPC_WAIT, sent, first_byte, NULL);
+	trace_span(TRACE_RPC_RECV, first_byte, done, NULL);
+}
+
+static json_t *rpc_call(CURL *curl, const char *url,
+			const char *userpass, const char *rpc_req,
+			bool longpoll_scan, bool longpoll, char **switch_to,
+			bool null_ok)
 {
 	json_t *val, *err_val, *res_val;
 	int rc;
@@ -211,9 +198,11 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	struct curl_slist *headers = NULL;
 	char len_hdr[64], user_agent_hdr[128];
 	char curl_err_str[CURL_ERROR_SIZE];
-	long timeout = longpoll ? (60 * 60) : (60 * 10);
+	long timeout = longpoll ? (60 * 60) : opt_timeout;
 	struct header_info hi = { };
 	bool lp_scanning = false;
+	struct timeval start;
+	uint64_t trace_start, parsed;
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
@@ -233,7 +222,9 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-	if (lp_scanning) {
+	if (switch_to)
+		*switch_to = NULL;
+	if (lp_scanning || switch_to || record_enabled()) {
 		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
 		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
 	}
@@ -248,6 +239,9 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 
 	upload_data.buf = rpc_req;
 	upload_data.len = strlen(rpc_req);
+	upload_data.sent = 0;
+	/* without a known size, newer libcurl sends the body chunked */
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) upload_data.len);
 	sprintf(len_hdr, "Content-Length: %lu",
 		(unsigned long) upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
@@ -260,14 +254,29 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
+	gettimeofday(&start, NULL);
+	trace_start = trace_now();
 	rc = curl_easy_perform(curl);
+	if (record_enabled())
+		record_rpc(&start, longpoll, rpc_req,
+			   rc ? NULL : (all_data.buf ? all_data.buf : ""),
+			   hi.lp_path);
 	if (rc) {
 		applog(LOG_ERR, "HTTP request failed: %s", curl_err_str);
 		goto err_out;
 	}
+	/* a long poll's wait is the pool's, not ours */
+	if (!longpoll)
+		trace_rpc(curl, trace_start, upload_data.sent);
+
+	if (switch_to)
+		*switch_to = hi.switch_to;
+	else
+		free(hi.switch_to);
+	hi.switch_to = NULL;
 
 	/* If X-Long-Polling was found, activate long polling */
-	if (hi.lp_path) {
+	if (hi.lp_path && lp_scanning) {
 		have_longpoll = true;
 		opt_scantime = 60;
 		tq_push(thr_info[longpoll_thr_id].q, hi.lp_path);
@@ -275,7 +284,9 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		free(hi.lp_path);
 	hi.lp_path = NULL;
 
+	parsed = trace_now();
 	val = JSON_LOADS(all_data.buf, &err);
+	trace_span(TRACE_RPC_PARSE, parsed, trace_now(), NULL);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto err_out;
@@ -293,7 +304,7 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
-	if (!res_val || json_is_null(res_val) ||
+	if (!res_val || (json_is_null(res_val) && !null_ok) ||
 	    (err_val && !json_is_null(err_val))) {
 		char *s;
 
@@ -315,12 +326,33 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	return val;
 
 err_out:
+	free(hi.lp_path);
+	free(hi.switch_to);
 	databuf_free(&all_data);
 	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
 	return NULL;
 }
 
+/* If 'switch_to' is given, it receives the X-Switch-To header of the
+ * reply, or NULL; the caller frees it.
+ */
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool longpoll_scan, bool longpoll, char **switch_to)
+{
+	return rpc_call(curl, url, userpass, rpc_req, longpoll_scan,
+			longpoll, switch_to, false);
+}
+
+/* For methods that answer success with a null result (submitblock) */
+json_t *json_rpc_call_null(CURL *curl, const char *url,
+			   const char *userpass, const char *rpc_req)
+{
+	return rpc_call(curl, url, userpass, rpc_req, false, false, NULL,
+			true);
+}
+
 char *bin2hex(const unsigned char *p, size_t len)
 {
 	int i;
@@ -393,6 +425,18 @@ timeval_subtract (
   return x->tv_sec < y->tv_sec;
 }
 
+/* microseconds elapsed since 'start' */
+uint64_t usecs_since(const struct timeval *start)
+{
+	struct timeval now, diff, from = *start;
+
+	/* timeval_subtract normalizes its last argument in place */
+	gettimeofday(&now, NULL);
+	if (timeval_subtract(&diff, &now, &from))
+		return 0;
+	return diff.tv_sec * 1000000ULL + diff.tv_usec;
+}
+
 bool fulltest(const unsigned char *hash, const unsigned char *target)
 {
 	unsigned char hash_swap[32], target_swap[32];
@@ -400,7 +444,6 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	uint32_t *target32 = (uint32_t *) target_swap;
 	int i;
 	bool rc = true;
-	char *hash_str, *target_str;
 
 	swap256(hash_swap, hash);
 	swap256(target_swap, target);
@@ -421,18 +464,20 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 		}
 	}
 
+	/* on the stack: this runs on a miner thread */
 	if (opt_debug) {
-		hash_str = bin2hex(hash_swap, 32);
-		target_str = bin2hex(target_swap, 32);
+		char hash_str[65], target_str[65];
+
+		for (i = 0; i < 32; i++) {
+			sprintf(hash_str + 2 * i, "%02x", hash_swap[i]);
+			sprintf(target_str + 2 * i, "%02x", target_swap[i]);
+		}
 
 		applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
 			hash_str,
 			target_str,
 			rc ? "YES (hash < target)" :
 			     "no (false positive; hash > target)");
-
-		free(hash_str);
-		free(target_str);
 	}
 
 	return true;	/* FIXME: return rc; */
@@ -492,6 +537,12 @@ void tq_thaw(struct thread_q *tq)
 	tq_freezethaw(tq, false);
 }
 
+/* number of queued entries; a racy snapshot, for reporting only */
+int tq_depth(struct thread_q *tq)
+{
+	return tq->depth;
+}
+
 bool tq_push(struct thread_q *tq, void *data)
 {
 	struct tq_ent *ent;
@@ -502,12 +553,14 @@ bool tq_push(struct thread_q *tq, void *data)
 		return false;
 
 	ent->data = data;
+	ent->pushed = trace_now();
 	INIT_LIST_HEAD(&ent->q_node);
 
 	pthread_mutex_lock(&tq->mutex);
 
 	if (!tq->frozen) {
 		list_add_tail(&ent->q_node, &tq->q);
+		tq->depth++;
 	} else {
 		free(ent);
 		rc = false;
@@ -542,9 +595,11 @@ void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 pop:
 	ent = list_entry(tq->q.next, struct tq_ent, q_node);
 	rval = ent->data;
+	trace_observe(TRACE_QUEUE, trace_now() - ent->pushed);
 
 	list_del(&ent->q_node);
 	free(ent);
+	tq->depth--;
 
 out:
 	pthread_mutex_unlock(&tq->mutex);
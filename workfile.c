@@ -0,0 +1,332 @@
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Work file: scan headers read from a file or pipe instead of a pool.
+ *
+ * The input is text, one header per line in hex -- 80 bytes in block
+ * chain byte order, or 128 bytes of getwork data -- optionally followed
+ * by a 32 byte little-endian target (default: difficulty 1).  Or it is a
+ * binary batch: a struct batch_hdr, then fixed-size records holding the
+ * same two fields; a batch in a regular file is mmap'ed.
+ *
+ * Each header goes to the next miner thread asking for work, and is
+ * scanned over the whole nonce range.  The kernels cannot resume a range
+ * part way, so a header yields its first solution, and a thread being
+ * parked finishes its header first.  Solutions are checked
+ * against the full target and written one per line: record number,
+ * solved header in chain byte order, nonce, and hash.
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "compat.h"
+#include "miner.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#define BATCH_MAGIC	"MINERBAT"
+#define BATCH_VERSION	1
+
+/* binary batch header; fields little-endian */
+struct batch_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	rec_len;	/* 80 + 32 or 128 + 32 */
+};
+
+static FILE *wf_in, *wf_out;
+static const unsigned char *wf_map;	/* mmap'ed batch, or NULL */
+static size_t wf_map_len, wf_map_pos;
+static unsigned int wf_rec_len;		/* binary records; 0: text */
+static unsigned long wf_line;
+
+/* guarded by wf_lock */
+static pthread_mutex_t wf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wf_cond = PTHREAD_COND_INITIALIZER;
+static bool wf_eof;
+static uint32_t wf_records;		/* handed out */
+static int wf_scanning;			/* of which being scanned */
+static bool *wf_busy;			/* per thread */
+
+static pthread_mutex_t wf_out_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t wf_solutions, wf_false;
+
+static const unsigned char diff1_target[32] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+};
+
+static uint32_t le32dec(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t be32dec(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Build work from a header of 80 (chain order) or 128 (getwork) bytes */
+static void header_work(struct work *work, const unsigned char *header,
+			size_t len, const unsigned char *target)
+{
+	uint32_t *data32 = (uint32_t *) work->data;
+	uint32_t *hash1_32 = (uint32_t *) work->hash1;
+	int i;
+
+	memset(work, 0, sizeof(*work));
+	if (len == 80) {
+		for (i = 0; i < 20; i++)
+			data32[i] = be32dec(header + 4 * i);
+		data32[20] = 0x80000000;
+		data32[31] = 0x00000280;
+	} else
+		memcpy(work->data, header, sizeof(work->data));
+	memcpy(work->target, target, sizeof(work->target));
+	sha256_midstate(work->midstate, work->data);
+	hash1_32[8] = 0x80000000;
+	hash1_32[15] = 0x00000100;
+}
+
+/* Next text record; caller holds wf_lock */
+static bool read_line(struct work *work)
+{
+	unsigned char header[128], target[32];
+	char buf[1024], *tok, *save;
+	size_t len;
+
+	while (fgets(buf, sizeof(buf), wf_in)) {
+		wf_line++;
+		tok = strtok_r(buf, " \t\r\n", &save);
+		if (!tok || *tok == '#')
+			continue;
+
+		len = strlen(tok) / 2;
+		if ((len != 80 && len != 128) || strlen(tok) != len * 2 ||
+		    !hex2bin(header, tok, len)) {
+			applog(LOG_ERR, "work file line %lu: header is not 80 "
+			       "or 128 bytes of hex", wf_line);
+			continue;
+		}
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (!tok)
+			memcpy(target, diff1_target, sizeof(target));
+		else if (strlen(tok) != 64 || !hex2bin(target, tok, 32)) {
+			applog(LOG_ERR, "work file line %lu: target is not 32 "
+			       "bytes of hex", wf_line);
+			continue;
+		}
+
+		header_work(work, header, len, target);
+		return true;
+	}
+
+	if (ferror(wf_in))
+		applog(LOG_ERR, "work file: %s", strerror(errno));
+	return false;
+}
+
+/* Next binary record; caller holds wf_lock */
+static bool read_record(struct work *work)
+{
+	unsigned char rec[160];
+	const unsigned char *p;
+
+	if (wf_map) {
+		if (wf_map_len - wf_map_pos < wf_rec_len)
+			return false;
+		p = wf_map + wf_map_pos;
+		wf_map_pos += wf_rec_len;
+	} else {
+		if (fread(rec, wf_rec_len, 1, wf_in) != 1)
+			return false;
+		p = rec;
+	}
+
+	header_work(work, p, wf_rec_len - 32, p + wf_rec_len - 32);
+	return true;
+}
+
+/* The next header for miner thread 'thr_id'; false once all are out */
+bool workfile_get_work(int thr_id, struct work *work)
+{
+	bool got = false;
+
+	pthread_mutex_lock(&wf_lock);
+
+	/* asking again means its last header is done */
+	if (wf_busy[thr_id]) {
+		wf_busy[thr_id] = false;
+		wf_scanning--;
+	}
+
+	if (!wf_eof) {
+		got = wf_rec_len ? read_record(work) : read_line(work);
+		wf_eof = !got;
+	}
+	if (got) {
+		work->record = wf_records++;
+		wf_busy[thr_id] = true;
+		wf_scanning++;
+	}
+
+	if (wf_eof && !wf_scanning)
+		pthread_cond_broadcast(&wf_cond);
+	pthread_mutex_unlock(&wf_lock);
+
+	return got;
+}
+
+/* A solution from a miner thread; false positives are dropped here */
+bool workfile_submit(const struct work *work)
+{
+	const uint32_t *data32 = (const uint32_t *) work->data;
+	unsigned char hash[32], header[80];
+	uint32_t *hash32 = (uint32_t *) hash;
+	char *header_hex;
+	int i;
+
+	/* a kernel stops at any hash with a zero top word */
+	if (!opt_scrypt)
+		sha256d_data(hash, work->data);
+#ifdef WANT_SCRYPT
+	else if (!scrypt_data(hash, work->data))
+		return false;
+#endif
+	for (i = 7; i >= 0; i--)
+		if (swab32(hash32[i]) != le32dec(work->target + 4 * i))
+			break;
+	if (i >= 0 && swab32(hash32[i]) > le32dec(work->target + 4 * i)) {
+		pthread_mutex_lock(&wf_out_lock);
+		wf_false++;
+		pthread_mutex_unlock(&wf_out_lock);
+		return true;
+	}
+
+	for (i = 0; i < 20; i++) {
+		header[4 * i] = data32[i] >> 24;
+		header[4 * i + 1] = data32[i] >> 16;
+		header[4 * i + 2] = data32[i] >> 8;
+		header[4 * i + 3] = data32[i];
+	}
+	header_hex = bin2hex(header, sizeof(header));
+	if (!header_hex)
+		return false;
+
+	pthread_mutex_lock(&wf_out_lock);
+	fprintf(wf_out, "%u %s %u ", work->record, header_hex,
+		le32dec(header + 76));
+	for (i = 7; i >= 0; i--)
+		fprintf(wf_out, "%08x", swab32(hash32[i]));
+	fputc('\n', wf_out);
+	fflush(wf_out);
+	wf_solutions++;
+	pthread_mutex_unlock(&wf_out_lock);
+
+	free(header_hex);
+	return true;
+}
+
+/* Block until every header has been handed out and scanned */
+void workfile_wait(void)
+{
+	pthread_mutex_lock(&wf_lock);
+	while (!wf_eof || wf_scanning)
+		pthread_cond_wait(&wf_cond, &wf_lock);
+	pthread_mutex_unlock(&wf_lock);
+
+	applog(LOG_INFO, "work file: %u headers scanned, %llu solutions "
+	       "(%llu false positives dropped)", wf_records,
+	       (unsigned long long) wf_solutions,
+	       (unsigned long long) wf_false);
+}
+
+static bool batch_open(const char *in)
+{
+	struct batch_hdr hdr;
+	struct stat st;
+
+	if (fread(&hdr, sizeof(hdr), 1, wf_in) != 1 ||
+	    memcmp(hdr.magic, BATCH_MAGIC, sizeof(hdr.magic)) ||
+	    le32dec((unsigned char *) &hdr.version) != BATCH_VERSION) {
+		applog(LOG_ERR, "work file %s: not a header batch", in);
+		return false;
+	}
+	wf_rec_len = le32dec((unsigned char *) &hdr.rec_len);
+	if (wf_rec_len != 80 + 32 && wf_rec_len != 128 + 32) {
+		applog(LOG_ERR, "work file %s: bad record length %u", in,
+		       wf_rec_len);
+		return false;
+	}
+
+#ifndef WIN32
+	if (!fstat(fileno(wf_in), &st) && S_ISREG(st.st_mode) &&
+	    st.st_size > sizeof(hdr)) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				 fileno(wf_in), 0);
+
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			wf_map = map;
+			wf_map_len = st.st_size;
+			wf_map_pos = sizeof(hdr);
+		}
+	}
+#endif
+
+	applog(LOG_INFO, "work file %s: batch of %u byte headers%s", in,
+	       wf_rec_len - 32, wf_map ? ", mapped" : "");
+	return true;
+}
+
+/* Read headers from 'in' and write solutions to 'out'; "-" is stdin or
+ * stdout
+ */
+bool workfile_open(const char *in, const char *out, int n_threads)
+{
+	int c;
+
+	wf_busy = calloc(n_threads, sizeof(*wf_busy));
+	if (!wf_busy)
+		return false;
+
+	wf_in = strcmp(in, "-") ? fopen(in, "rb") : stdin;
+	if (!wf_in) {
+		applog(LOG_ERR, "work file %s: %s", in, strerror(errno));
+		return false;
+	}
+	wf_out = !out || !strcmp(out, "-") ? stdout : fopen(out, "w");
+	if (!wf_out) {
+		applog(LOG_ERR, "work output %s: %s", out, strerror(errno));
+		return false;
+	}
+
+	/* a batch starts with its magic; text with hex, '#' or space */
+	c = getc(wf_in);
+	if (c != EOF)
+		ungetc(c, wf_in);
+	if (c == BATCH_MAGIC[0])
+		return batch_open(in);
+
+	applog(LOG_INFO, "work file %s: text headers", in);
+	return true;
+}